@@ -13,6 +13,7 @@
 """Tests for kvVariable training ops."""
 from __future__ import absolute_import, division, print_function
 
+import os
 import tempfile
 
 import numpy as np
@@ -434,6 +435,327 @@ class KvVariableTrainingOpsTest(tf.test.TestCase):
     self.assertEqual(True, result_for_tf)
     self.assertEqual(True, result)
 
+  def test_adagrad_optimizer_with_segment_apply(self):
+    """Test adagrad with the keys of a batch updated segment by segment"""
+    # The variables are created when the session runs, keep the flag on
+    # until then. Enough keys that every segment gets many of them.
+    os.environ["TFPLUS_KV_SEGMENT_APPLY"] = "1"
+    try:
+      kv_var, tf_var, resource_var, sparse_y = self.init_test_data(h=4096)
+      sparse_opt = AdagradOptimizer(0.5)
+      resource_sparse_opt = AdagradOptimizer(0.5)
+      kv_sparse_opt = AdagradOptimizer(0.5)
+      result, result_for_tf = self.check_optimizer_v3(
+          kv_var,
+          tf_var,
+          resource_var,
+          sparse_y,
+          sparse_opt,
+          resource_sparse_opt,
+          kv_sparse_opt,
+      )
+    finally:
+      del os.environ["TFPLUS_KV_SEGMENT_APPLY"]
+    self.assertEqual(True, result_for_tf)
+    self.assertEqual(True, result)
+
+  def test_adagrad_optimizer_with_admission_sketch(self):
+    """Test adagrad on a variable whose keys enter through the sketch"""
+    h, w = 10, 8
+    kv_options = KvOptions(
+        combination=StorageCombination.MEM,
+        configs={
+            StorageType.MEM_STORAGE: KvStorageConfig(),
+        },
+        admission_sketch_width=1024,
+    )
+    with tf.device("/cpu:0"):
+      kv_var = get_kv_variable(
+          "kv_table_sketch",
+          embedding_dim=w,
+          initializer=tf.compat.v1.ones_initializer,
+          key_dtype=tf.int64,
+          value_dtype=tf.float32,
+          enter_threshold=2,
+          kv_options=kv_options,
+      )
+      sparse_y = tf.IndexedSlices(
+          tf.constant(np.random.rand(h, w).astype(np.float32)),
+          tf.constant(list(range(h)), dtype=tf.int64))
+      train_op = AdagradOptimizer(0.5).apply_gradients([[sparse_y, kv_var]])
+      kv_val = kv_var._read_variable_op()  # pylint: disable=protected-access
+      init_op = tf.compat.v1.global_variables_initializer()
+      with self.session() as sess:
+        sess.run(init_op)
+        # The keys were never gathered, the step skips them instead of
+        # inserting them.
+        sess.run(train_op)
+        keys, _ = sess.run(kv_val)
+    self.assertEqual(len(keys), 0)
+
+  def test_adagrad_with_handles_of_other_indices(self):
+    """Test that handles which do not belong to the indices are not used"""
+    h, w = 10, 8
+    grad_value = np.random.rand(h, w).astype(np.float32)
+    kv_options = KvOptions(
+        combination=StorageCombination.MEM,
+        configs={
+            StorageType.MEM_STORAGE: KvStorageConfig(),
+        },
+    )
+    results = []
+    for case in ("none", "other_gather", "reordered", "forged"):
+      with tf.Graph().as_default() as graph, tf.device("/cpu:0"):
+        kv_vars = [
+            get_kv_variable(
+                "kv_table_handles_%s_%s" % (case, name),
+                embedding_dim=w,
+                initializer=tf.compat.v1.ones_initializer,
+                key_dtype=tf.int64,
+                value_dtype=tf.float32,
+                kv_options=kv_options,
+            ) for name in ("var", "accum")
+        ]
+        var, accum = kv_vars
+        indices = tf.constant(list(range(h)), dtype=tf.int64)
+        if case == "none":
+          handles = []
+        elif case == "other_gather":
+          # A gather of the same variable with as many keys in the same step.
+          _, other = var.sparse_read_with_handles(indices + h)
+          handles = [other]
+        elif case == "reordered":
+          _, own = var.sparse_read_with_handles(indices)
+          handles = [tf.reverse(own, axis=[0])]
+        else:
+          handles = [tf.constant(np.arange(3 * h).reshape(h, 3), tf.int64)]
+        train_op = gen_kv_var_ops.kv_variable_sparse_apply_adagrad(
+            var.handle,
+            accum.handle,
+            tf.constant(0.5),
+            tf.constant(grad_value),
+            indices,
+            handles=handles,
+            use_locking=True,
+        )
+        kv_val = var._read_variable_op()  # pylint: disable=protected-access
+        init_op = tf.compat.v1.global_variables_initializer()
+        with self.session(graph=graph) as sess:
+          sess.run(init_op)
+          sess.run(train_op)
+          keys, values = sess.run(kv_val)
+      results.append(dict(zip(keys.tolist(), values)))
+    for k in range(h):
+      for result in results[1:]:
+        self.assertAllClose(results[0][k], result[k])
+
+  def test_batch_sparse_apply_adagrad(self):
+    """Test that the batch op matches one adagrad op per variable"""
+    h, w = 10, 8
+    # The first variable is listed twice, with disjoint keys.
+    grad_values = [np.random.rand(h, w).astype(np.float32) for _ in range(3)]
+    key_values = [list(range(h)), list(range(h)), list(range(h, 2 * h))]
+    kv_options = KvOptions(
+        combination=StorageCombination.MEM,
+        configs={
+            StorageType.MEM_STORAGE: KvStorageConfig(),
+        },
+    )
+    results = []
+    for batch in (False, True):
+      with tf.Graph().as_default() as graph, tf.device("/cpu:0"):
+        kv_vars = [
+            get_kv_variable(
+                "kv_table_batch_%d_%s" % (batch, name),
+                embedding_dim=w,
+                initializer=tf.compat.v1.ones_initializer,
+                key_dtype=tf.int64,
+                value_dtype=tf.float32,
+                kv_options=kv_options,
+            ) for name in ("var_0", "accum_0", "var_1", "accum_1")
+        ]
+        var_list = [kv_vars[0], kv_vars[2], kv_vars[0]]
+        accum_list = [kv_vars[1], kv_vars[3], kv_vars[1]]
+        grads = [tf.constant(value) for value in grad_values]
+        indices = [tf.constant(keys, dtype=tf.int64) for keys in key_values]
+        lr = tf.constant(0.5)
+        if batch:
+          train_ops = [
+              gen_kv_var_ops.batch_kv_variable_sparse_apply_adagrad(
+                  [var.handle for var in var_list],
+                  [accum.handle for accum in accum_list],
+                  lr,
+                  grads,
+                  indices,
+                  use_locking=True,
+              )
+          ]
+        else:
+          train_ops = [
+              gen_kv_var_ops.kv_variable_sparse_apply_adagrad(
+                  var.handle,
+                  accum.handle,
+                  lr,
+                  grad,
+                  index,
+                  handles=[],
+                  use_locking=True,
+              ) for var, accum, grad, index in zip(var_list, accum_list,
+                                                   grads, indices)
+          ]
+        kv_vals = [
+            var._read_variable_op()  # pylint: disable=protected-access
+            for var in kv_vars
+        ]
+        init_op = tf.compat.v1.global_variables_initializer()
+        with self.session(graph=graph) as sess:
+          sess.run(init_op)
+          for train_op in train_ops:
+            sess.run(train_op)
+          results.append([
+              dict(zip(keys.tolist(), values))
+              for keys, values in sess.run(kv_vals)
+          ])
+    for expected, actual in zip(results[0], results[1]):
+      self.assertEqual(sorted(expected), sorted(actual))
+      for k, v in expected.items():
+        self.assertAllClose(v, actual[k])
+    self.assertEqual(len(results[1][0]), 2 * h)
+
+  def check_batch_apply_optimizer(self, make_optimizer, batch_op_type):
+    """Check that batch_apply changes the ops but not the values"""
+    h, w = 10, 8
+    grad_values = [np.random.rand(h, w).astype(np.float32) for _ in range(2)]
+    kv_options = KvOptions(
+        combination=StorageCombination.MEM,
+        configs={
+            StorageType.MEM_STORAGE: KvStorageConfig(),
+        },
+    )
+    results = []
+    for batch_apply in (False, True):
+      with tf.Graph().as_default() as graph, tf.device("/cpu:0"):
+        kv_vars = [
+            get_kv_variable(
+                "kv_table_batch_apply_%d_%d" % (batch_apply, i),
+                embedding_dim=w,
+                initializer=tf.compat.v1.ones_initializer,
+                key_dtype=tf.int64,
+                value_dtype=tf.float32,
+                kv_options=kv_options,
+            ) for i in range(len(grad_values))
+        ]
+        grads_and_vars = [[
+            tf.IndexedSlices(tf.constant(value),
+                             tf.constant(list(range(h)), dtype=tf.int64)),
+            var,
+        ] for value, var in zip(grad_values, kv_vars)]
+        train_op = make_optimizer(batch_apply).apply_gradients(grads_and_vars)
+        op_types = [op.type for op in graph.get_operations()]
+        self.assertEqual(op_types.count(batch_op_type),
+                         1 if batch_apply else 0)
+        kv_vals = [
+            var._read_variable_op()  # pylint: disable=protected-access
+            for var in kv_vars
+        ]
+        init_op = tf.compat.v1.global_variables_initializer()
+        with self.session(graph=graph) as sess:
+          sess.run(init_op)
+          # The second step uses the beta powers updated by the first one.
+          sess.run(train_op)
+          sess.run(train_op)
+          results.append([
+              dict(zip(keys.tolist(), values))
+              for keys, values in sess.run(kv_vals)
+          ])
+    for expected, actual in zip(results[0], results[1]):
+      self.assertEqual(len(expected), h)
+      for k, v in expected.items():
+        self.assertAllClose(v, actual[k])
+
+  def test_adagrad_optimizer_with_batch_apply(self):
+    """Test adagrad with the KvVariables updated by one batch op"""
+    self.check_batch_apply_optimizer(
+        lambda batch_apply: AdagradOptimizer(0.5, batch_apply=batch_apply),
+        "BatchKvVariableSparseApplyAdagrad",
+    )
+
+  def test_group_adam_optimizer_with_batch_apply(self):
+    """Test group adam with the KvVariables updated by one batch op"""
+    self.check_batch_apply_optimizer(
+        lambda batch_apply: GroupAdamOptimizer(
+            0.5,
+            l1_regularization_strength=0.01,
+            l2_regularization_strength=0.05,
+            l21_regularization_strength=0.05,
+            version=3,
+            batch_apply=batch_apply,
+        ),
+        "BatchKvVariableGroupSparseApplyAdamV3",
+    )
+    with self.assertRaises(ValueError):
+      GroupAdamOptimizer(0.5, version=4, batch_apply=True)
+
+  def test_group_adam_optimizer_with_lazy_decay(self):
+    """Test that a key skipped for k steps gets the moments of dense Adam
+    given zero gradients for it on those steps"""
+    h, w, k = 4, 8, 5
+    grad_values = [
+        np.random.rand(h, w).astype(np.float32) for _ in range(k + 2)
+    ]
+    moments = []
+    for lazy in (True, False):
+      if lazy:
+        os.environ["TFPLUS_KV_LAZY_DECAY"] = "1"
+      try:
+        with tf.Graph().as_default() as graph, tf.device("/cpu:0"):
+          kv_var = get_kv_variable(
+              "kv_table_lazy_decay_%d" % lazy,
+              embedding_dim=w,
+              initializer=tf.compat.v1.ones_initializer,
+              key_dtype=tf.int64,
+              value_dtype=tf.float32,
+              kv_options=KvOptions(
+                  combination=StorageCombination.MEM,
+                  configs={
+                      StorageType.MEM_STORAGE: KvStorageConfig(),
+                  },
+              ),
+          )
+          global_step = tf.compat.v1.train.get_or_create_global_step()
+          grad = tf.compat.v1.placeholder(tf.float32, [None, w])
+          indices = tf.compat.v1.placeholder(tf.int64, [None])
+          opt = GroupAdamOptimizer(0.5, version=3)
+          train_op = opt.apply_gradients(
+              [[tf.IndexedSlices(grad, indices), kv_var]],
+              global_step=global_step)
+          slot = opt.get_slot(kv_var, "m_v_linear")
+          # pylint: disable=protected-access
+          slot_val = slot._read_variable_op()
+          init_op = tf.compat.v1.global_variables_initializer()
+          with self.session(graph=graph) as sess:
+            sess.run(init_op)
+            for step, value in enumerate(grad_values):
+              if 0 < step <= k:
+                # Key 0 is left out of the batch, or given a zero gradient.
+                value = value.copy()
+                value[0] = 0
+                if lazy:
+                  value = value[1:]
+              keys = list(range(h - len(value), h))
+              sess.run(train_op, {grad: value, indices: keys})
+            keys, values = sess.run(slot_val)
+      finally:
+        if lazy:
+          del os.environ["TFPLUS_KV_LAZY_DECAY"]
+      # m and v, the linear accumulator is not replayed.
+      moments.append({
+          key: value[:2 * w]
+          for key, value in zip(keys.tolist(), values)
+      })
+    for key in range(h):
+      self.assertAllClose(moments[0][key], moments[1][key], rtol=1e-5)
+
   def test_group_adam_v4_optimizer(self):
     """Test gradient adam for both kv variable and tf variable"""
     kv_var, tf_var, resource_var, sparse_y = self.init_test_data(h=10)
@@ -472,6 +794,48 @@ class KvVariableTrainingOpsTest(tf.test.TestCase):
     self.assertEqual(True, result)
     self.assertEqual(True, result_for_tf)
 
+  def test_group_adam_optimizer_with_colocated_slots(self):
+    """Test group adam whose slots are moved into the rows of the variable"""
+    h, w = 100, 8
+    grad_value = np.random.rand(h, w).astype(np.float32)
+    results = []
+    for colocated_slots in (0, 4):
+      kv_options = KvOptions(
+          combination=StorageCombination.MEM,
+          configs={
+              StorageType.MEM_STORAGE: KvStorageConfig(),
+          },
+          colocated_slots=colocated_slots,
+      )
+      with tf.Graph().as_default() as graph, tf.device("/cpu:0"):
+        kv_var = get_kv_variable(
+            "kv_table_colocated_%d" % colocated_slots,
+            embedding_dim=w,
+            initializer=tf.compat.v1.ones_initializer,
+            key_dtype=tf.int64,
+            value_dtype=tf.float32,
+            kv_options=kv_options,
+        )
+        sparse_y = tf.IndexedSlices(
+            tf.constant(grad_value), tf.constant(list(range(h)),
+                                                 dtype=tf.int64))
+        # Version 1 updates var, accum, linear, m and v with
+        # KvVariableGroupSparseApplyAdamV2.
+        kv_sparse_opt = GroupAdamOptimizer(0.5, version=1)
+        train_op = kv_sparse_opt.apply_gradients([[sparse_y, kv_var]])
+        kv_val = kv_var._read_variable_op()  # pylint: disable=protected-access
+        init_op = tf.compat.v1.global_variables_initializer()
+        with self.session(graph=graph) as sess:
+          sess.run(init_op)
+          # The first step attaches the slots, the second one uses them.
+          sess.run(train_op)
+          sess.run(train_op)
+          keys, values = sess.run(kv_val)
+      results.append(dict(zip(keys.tolist(), values)))
+    self.assertEqual(len(results[0]), h)
+    for k, v in results[0].items():
+      self.assertAllClose(v, results[1][k])
+
   def test_sparse_group_ftrl_optimizer(self):
     """Test sparse group ftrl for both kv variable and tf variable"""
     kv_var, tf_var, resource_var, sparse_y = self.init_test_data(h=10)
@@ -543,5 +907,94 @@ class KvVariableTrainingOpsTest(tf.test.TestCase):
     self.assertEqual(True, result_for_tf)
 
 
+class KvVariableTrainingOpsBenchmark(tf.test.Benchmark):
+  """Benchmarks of the kvVariable training ops, run with --benchmarks=."""
+
+  def benchmark_batch_sparse_apply_adagrad(self):
+    """One optimizer step of a wide model with skewed tables, applied by one
+    KvVariableSparseApplyAdagrad per table and by one
+    BatchKvVariableSparseApplyAdagrad."""
+    num_tables, w = 400, 16
+    kv_options = KvOptions(
+        combination=StorageCombination.MEM,
+        configs={
+            StorageType.MEM_STORAGE: KvStorageConfig(),
+        },
+    )
+    gen = np.random.RandomState(12)
+    # The first tables take most of the keys, like the features of a
+    # recommendation model.
+    key_values = [
+        gen.choice(1 << 16, max(1, 16384 // (t + 1)), replace=False)
+        for t in range(num_tables)
+    ]
+    grad_values = [
+        gen.rand(len(keys), w).astype(np.float32) for keys in key_values
+    ]
+    for batch in (False, True):
+      with tf.Graph().as_default(), tf.device("/cpu:0"):
+        var_list, accum_list = [], []
+        for t in range(num_tables):
+          var_list.append(
+              get_kv_variable(
+                  "kv_table_bench_%d_var_%d" % (batch, t),
+                  embedding_dim=w,
+                  initializer=tf.compat.v1.ones_initializer,
+                  key_dtype=tf.int64,
+                  value_dtype=tf.float32,
+                  kv_options=kv_options,
+              ))
+          accum_list.append(
+              get_kv_variable(
+                  "kv_table_bench_%d_accum_%d" % (batch, t),
+                  embedding_dim=w,
+                  initializer=tf.compat.v1.ones_initializer,
+                  key_dtype=tf.int64,
+                  value_dtype=tf.float32,
+                  kv_options=kv_options,
+              ))
+        grads = [tf.constant(value) for value in grad_values]
+        indices = [tf.constant(keys, dtype=tf.int64) for keys in key_values]
+        lr = tf.constant(0.01)
+        if batch:
+          train_op = gen_kv_var_ops.batch_kv_variable_sparse_apply_adagrad(
+              [var.handle for var in var_list],
+              [accum.handle for accum in accum_list],
+              lr,
+              grads,
+              indices,
+              use_locking=True,
+          )
+        else:
+          train_op = tf.group(*[
+              gen_kv_var_ops.kv_variable_sparse_apply_adagrad(
+                  var.handle,
+                  accum.handle,
+                  lr,
+                  grad,
+                  index,
+                  handles=[],
+                  use_locking=True,
+              ) for var, accum, grad, index in zip(var_list, accum_list,
+                                                   grads, indices)
+          ])
+        init_op = tf.compat.v1.global_variables_initializer()
+        with tf.compat.v1.Session() as sess:
+          sess.run(init_op)
+          # The first steps insert the keys, the measured ones update them.
+          self.run_op_benchmark(
+              sess,
+              train_op,
+              burn_iters=5,
+              min_iters=50,
+              name="batch_sparse_apply_adagrad_%s" %
+              ("batch" if batch else "per_table"),
+              extras={
+                  "tables": num_tables,
+                  "keys": sum(len(keys) for keys in key_values),
+              },
+          )
+
+
 if __name__ == "__main__":
   test.main()
@@ -0,0 +1,123 @@
+// Copyright 2023 The TFPlus Authors. All rights reserved.
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TFPLUS_KV_VARIABLE_KERNELS_ADMISSION_SKETCH_H_
+#define TFPLUS_KV_VARIABLE_KERNELS_ADMISSION_SKETCH_H_
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory>
+
+namespace tfplus {
+
+// Count-min sketch counting the keys that are not admitted to a KvVariable
+// yet. A key hashes to one counter in each of kDepth rows and its estimate
+// is the smallest of them, which may overcount but never undercounts.
+// Counts are added with conservative update, only the counters below the
+// new estimate are raised, which keeps the overcount of rare keys low.
+// Counters saturate at 65535, like the frequency of EmbeddingValue.
+class CountMinSketch {
+ public:
+  static constexpr int kDepth = 4;
+
+  explicit CountMinSketch(int64_t width)
+      : width_(std::max<int64_t>(width, 1)),
+        counters_(new std::atomic<uint16_t>[kDepth * width_]) {
+    Clear();
+  }
+
+  CountMinSketch(const CountMinSketch&) = delete;
+  CountMinSketch& operator=(const CountMinSketch&) = delete;
+
+  int64_t width() const { return width_; }
+
+  int64_t num_counters() const { return kDepth * width_; }
+
+  size_t MemoryUsed() const {
+    return sizeof(CountMinSketch) + num_counters() * sizeof(uint16_t);
+  }
+
+  // Adds count to key and returns its new estimate.
+  uint16_t Add(uint64_t key, uint16_t count) {
+    int64_t slots[kDepth];
+    Slots(key, slots);
+    uint32_t estimate = EstimateSlots(slots) + count;
+    const uint16_t target = static_cast<uint16_t>(
+        std::min<uint32_t>(estimate, std::numeric_limits<uint16_t>::max()));
+    for (int64_t slot : slots) {
+      uint16_t current = counters_[slot].load(std::memory_order_relaxed);
+      while (current < target &&
+             !counters_[slot].compare_exchange_weak(
+                 current, target, std::memory_order_relaxed)) {
+      }
+    }
+    return target;
+  }
+
+  uint16_t Estimate(uint64_t key) const {
+    int64_t slots[kDepth];
+    Slots(key, slots);
+    return EstimateSlots(slots);
+  }
+
+  void Clear() {
+    for (int64_t i = 0; i < num_counters(); ++i) {
+      counters_[i].store(0, std::memory_order_relaxed);
+    }
+  }
+
+  // Copies the num_counters() counters row by row into counters.
+  void Export(uint16_t* counters) const {
+    for (int64_t i = 0; i < num_counters(); ++i) {
+      counters[i] = counters_[i].load(std::memory_order_relaxed);
+    }
+  }
+
+  void Import(const uint16_t* counters) {
+    for (int64_t i = 0; i < num_counters(); ++i) {
+      counters_[i].store(counters[i], std::memory_order_relaxed);
+    }
+  }
+
+ private:
+  // Derives the kDepth slots of key from two halves of one mixed hash.
+  void Slots(uint64_t key, int64_t* slots) const {
+    uint64_t h = key + 0x9e3779b97f4a7c15ULL;
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    const uint64_t h1 = h & 0xffffffffULL;
+    const uint64_t h2 = (h >> 32) | 1;
+    for (int i = 0; i < kDepth; ++i) {
+      slots[i] = i * width_ + static_cast<int64_t>((h1 + i * h2) % width_);
+    }
+  }
+
+  uint16_t EstimateSlots(const int64_t* slots) const {
+    uint16_t estimate = std::numeric_limits<uint16_t>::max();
+    for (int i = 0; i < kDepth; ++i) {
+      estimate = std::min(
+          estimate, counters_[slots[i]].load(std::memory_order_relaxed));
+    }
+    return estimate;
+  }
+
+  const int64_t width_;
+  std::unique_ptr<std::atomic<uint16_t>[]> counters_;
+};
+
+}  // namespace tfplus
+#endif  // TFPLUS_KV_VARIABLE_KERNELS_ADMISSION_SKETCH_H_
@@ -0,0 +1,151 @@
+// Copyright 2023 The TFPlus Authors. All rights reserved.
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TFPLUS_KV_VARIABLE_KERNELS_COMPACT_ROW_H_
+#define TFPLUS_KV_VARIABLE_KERNELS_COMPACT_ROW_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include "tfplus/kv_variable/kernels/hybrid_embedding/storage_config.pb.h"
+
+namespace tfplus {
+
+inline uint32_t FloatBits(float f) {
+  uint32_t bits;
+  std::memcpy(&bits, &f, sizeof(bits));
+  return bits;
+}
+
+inline float FloatFromBits(uint32_t bits) {
+  float f;
+  std::memcpy(&f, &bits, sizeof(f));
+  return f;
+}
+
+// Rounds f to the nearest bfloat16, ties to even. noise, when not 0, is
+// added below the kept bits instead, which rounds up with a probability
+// proportional to the dropped fraction (stochastic rounding).
+inline uint16_t FloatToBfloat16(float f, uint32_t noise = 0) {
+  uint32_t bits = FloatBits(f);
+  if ((bits & 0x7fffffffu) > 0x7f800000u) {
+    // Keeps NaN a quiet NaN instead of rounding it to infinity.
+    return static_cast<uint16_t>((bits >> 16) | 0x40u);
+  }
+  bits += noise != 0 ? (noise & 0xffffu) : 0x7fffu + ((bits >> 16) & 1u);
+  return static_cast<uint16_t>(bits >> 16);
+}
+
+inline float Bfloat16ToFloat(uint16_t h) {
+  return FloatFromBits(static_cast<uint32_t>(h) << 16);
+}
+
+// IEEE half precision conversions without branches on the value, so that
+// the row loops below vectorize. Values beyond the half range become
+// infinity and values below it round to subnormals or zero.
+inline uint16_t FloatToHalf(float f) {
+  const uint32_t w = FloatBits(f);
+  const uint32_t shl1_w = w + w;
+  const uint32_t sign = w & 0x80000000u;
+  float base = (f < 0 ? -f : f) * 0x1.0p+112f * 0x1.0p-110f;
+  uint32_t bias = shl1_w & 0xff000000u;
+  bias = bias < 0x71000000u ? 0x71000000u : bias;
+  base = FloatFromBits((bias >> 1) + 0x07800000u) + base;
+  const uint32_t bits = FloatBits(base);
+  const uint32_t nonsign = ((bits >> 13) & 0x00007c00u) + (bits & 0x00000fffu);
+  return static_cast<uint16_t>((sign >> 16) |
+                               (shl1_w > 0xff000000u ? 0x7e00u : nonsign));
+}
+
+inline float HalfToFloat(uint16_t h) {
+  const uint32_t w = static_cast<uint32_t>(h) << 16;
+  const uint32_t sign = w & 0x80000000u;
+  const uint32_t two_w = w + w;
+  const float normalized =
+      FloatFromBits((two_w >> 4) + (0xe0u << 23)) * 0x1.0p-112f;
+  const float denormalized =
+      FloatFromBits((two_w >> 17) | (126u << 23)) - 0.5f;
+  return FloatFromBits(sign | (two_w < (1u << 27) ? FloatBits(denormalized)
+                                                  : FloatBits(normalized)));
+}
+
+// Converts rows between the float values a KvVariable computes with and the
+// 16 bit elements of a table that stores its rows as bfloat16 or half, see
+// StorageOption.row_dtype. A ROW_FLOAT codec stores nothing compactly and
+// must not be used to convert.
+class RowCodec {
+ public:
+  RowCodec() = default;
+
+  RowCodec(RowDtype dtype, bool stochastic_rounding)
+      : dtype_(dtype),
+        stochastic_rounding_(stochastic_rounding && dtype == ROW_BFLOAT16) {}
+
+  bool compact() const { return dtype_ != ROW_FLOAT; }
+
+  RowDtype dtype() const { return dtype_; }
+
+  // Bytes of a stored row of dim elements.
+  size_t RowBytes(size_t dim) const {
+    return dim * (compact() ? sizeof(uint16_t) : sizeof(float));
+  }
+
+  template <typename T>
+  void Decode(const void* row, T* out, int64_t dim) const {
+    const uint16_t* src = static_cast<const uint16_t*>(row);
+    if (dtype_ == ROW_BFLOAT16) {
+      for (int64_t i = 0; i < dim; ++i) {
+        out[i] = static_cast<T>(Bfloat16ToFloat(src[i]));
+      }
+    } else {
+      for (int64_t i = 0; i < dim; ++i) {
+        out[i] = static_cast<T>(HalfToFloat(src[i]));
+      }
+    }
+  }
+
+  template <typename T>
+  void Encode(const T* in, void* row, int64_t dim) const {
+    uint16_t* dst = static_cast<uint16_t*>(row);
+    if (stochastic_rounding_) {
+      for (int64_t i = 0; i < dim; ++i) {
+        dst[i] = FloatToBfloat16(static_cast<float>(in[i]), NextNoise());
+      }
+    } else if (dtype_ == ROW_BFLOAT16) {
+      for (int64_t i = 0; i < dim; ++i) {
+        dst[i] = FloatToBfloat16(static_cast<float>(in[i]));
+      }
+    } else {
+      for (int64_t i = 0; i < dim; ++i) {
+        dst[i] = FloatToHalf(static_cast<float>(in[i]));
+      }
+    }
+  }
+
+ private:
+  // xorshift32, one stream per thread is enough for rounding noise.
+  static uint32_t NextNoise() {
+    static thread_local uint32_t state = 0x9e3779b9u;
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state | 1u;
+  }
+
+  RowDtype dtype_ = ROW_FLOAT;
+  bool stochastic_rounding_ = false;
+};
+
+}  // namespace tfplus
+#endif  // TFPLUS_KV_VARIABLE_KERNELS_COMPACT_ROW_H_
@@ -50,14 +50,27 @@ Status KvVariable<K, V>::DeltaImport(OpKernelContext* ctx, int first_n,
         ") do not match");
   }
 
-  mutex_write_lock l(*mu());
+  mutex_write_lock l = LockDetached<mutex_write_lock>();
   // DeltaImport must been initialized
   // If FullImport finished, all variable must been initialized
   // TF_RETURN_IF_ERROR(CheckInitializedInternal());
 
+  // Readers of a shared table keep none of the rows, they map the table
+  // the loader published from the rows of the same checkpoint.
+  if (shared_table_role_ == SharedTableRole::kReader) {
+    if (others.size() <= 6 || others[6].template flat<bool>()(0)) {
+      TF_RETURN_IF_ERROR(AttachSharedTableUnsafe(true));
+      random_init_table_set_ = true;
+    }
+    return ::tensorflow::OkStatus();
+  }
+
   // Stage 1: insert keys and values.
   const auto& keys_flat = keys.template flat<K>();
   const auto& values_flat = values.flat_outer_dims<V>();
+  for (int64 i = 0; i < keys_flat.size(); ++i) {
+    ForgetStep(keys_flat(i));
+  }
   if (HasMemTable()) {
     for (int64 i = 0; i < keys_flat.size(); ++i) {
       auto& key = keys_flat(i);
@@ -67,7 +80,7 @@ Status KvVariable<K, V>::DeltaImport(OpKernelContext* ctx, int first_n,
             reinterpret_cast<const V*>(values.tensor_data().data()) +
             i * embedding_dim_;
         // insert: allocate and memcpy, update: memcpy
-        context->UpdateValue(embedding_val, false, value_bytes_);
+        CopyToRow(key, context, embedding_val);
         context->Meta()->RemoveBlacklist();
         UpdateUnderThreshold(context);
       };
@@ -148,6 +161,9 @@ Status KvVariable<K, V>::DeltaImport(OpKernelContext* ctx, int first_n,
                 << "restore is complete";
     }
     random_init_table_set_ = true;
+    if (InferenceMode()) {
+      FreezeTableUnsafe();
+    }
   }
   return ::tensorflow::OkStatus();
 }
@@ -171,11 +187,31 @@ Status KvVariable<K, V>::ImportValues(OpKernelContext* ctx, const Tensor& keys,
 
   // Check if the 1st dimension matches between keys and values.
   TensorShape value_shape = values.shape();
-  mutex_write_lock l(*mu());
+  // Colocated slots are restored in their own tables and merged again by the
+  // next optimizer step.
+  if (num_colocated_slots_ > 0) {
+    SplitColocatedSlots();
+  }
+  mutex_write_lock l = LockDetached<mutex_write_lock>();
+
+  // Readers of a shared table keep none of the rows, they map the table
+  // the loader published from the rows of the same checkpoint.
+  if (shared_table_role_ == SharedTableRole::kReader) {
+    if (others.size() <= 6 || others[6].template flat<bool>()(0)) {
+      TF_RETURN_IF_ERROR(AttachSharedTableUnsafe(true));
+      random_init_table_set_ = true;
+    }
+    return ::tensorflow::OkStatus();
+  }
 
   // Stage 1: import keys and values.
   table_->clear();
+  if (update_steps_ != nullptr) {
+    update_steps_->clear();
+  }
   const auto& keys_flat = keys.template flat<K>();
+  // Inserting the keys one by one would rehash every segment several times.
+  table_->Reserve(keys_flat.size());
 
   // Cache values for hash table reference
   p_values_ = values;
@@ -183,12 +219,17 @@ Status KvVariable<K, V>::ImportValues(OpKernelContext* ctx, const Tensor& keys,
   // if (values_found) {
   for (int64 i = 0; i < keys_flat.size(); ++i) {
     // TODO(jianmu.scj): multi thread optimize
-    auto insert_func = [this, i, &values](EVContext<V>* context) {
+    auto insert_func = [this, i, &values, &keys_flat](EVContext<V>* context) {
       V* value_ptr = const_cast<V*>(
           reinterpret_cast<const V*>(values.tensor_data().data()) +
           i * embedding_dim_);
-      context->InitValue(value_ptr,
-                         false);  // no need to allocate or copy here
+      if (num_colocated_slots_ > 0) {
+        // Rows are wider than the imported values, they can not be shared.
+        CopyToRow(keys_flat(i), context, value_ptr);
+      } else {
+        context->InitValue(value_ptr,
+                           false);  // no need to allocate or copy here
+      }
     };
     table_->InsertWithFn(keys_flat(i), insert_func);
   }
@@ -254,6 +295,9 @@ Status KvVariable<K, V>::ImportValues(OpKernelContext* ctx, const Tensor& keys,
                 << "restore is complete";
     }
     random_init_table_set_ = true;
+    if (InferenceMode()) {
+      FreezeTableUnsafe();
+    }
   }
   train_deltalist_.clear();  // not thread safe here
   prediction_deltalist_.clear();
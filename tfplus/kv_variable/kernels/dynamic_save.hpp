@@ -50,11 +50,17 @@ Status KvVariable<K, V>::ExportValues(OpKernelContext* ctx, int first_n,
                                       void* table_handler) {
   CHECK(ctx != nullptr);
 
+  // A colocated slot exports its part of the rows of the primary, which is
+  // locked before the slot.
+  const bool slot_view = table_handler == nullptr && RowTable() != table_;
+  mutex_read_lock primary_lock(*RowTable()->mu(), slot_view);
+  const int64_t offset = slot_view ? RowOffset() : 0;
+
   // The order of locks: mu_ -> train_deltalist_mu_ -> table_.locks
   mutex_write_lock l(*mu());
   TableManager<K, V>* handler =
       table_handler ? reinterpret_cast<TableManager<K, V>*>(table_handler)
-                    : table_;
+                    : RowTable();
   TF_RETURN_IF_ERROR(CheckInitializedInternal());
   // Calcuate the number of valid key-value pairs, blacklist, frequency.
   int64_t num_rows = 0;
@@ -64,19 +70,24 @@ Status KvVariable<K, V>::ExportValues(OpKernelContext* ctx, int first_n,
   int64_t blacklist_row = 0;
   int64_t freq_row = 0;
   size_t value_rows = 0;
-  {
+  if (!slot_view) {
     typename TableManager<K, V>::ScopedLock table_scoped_lock(handler);
     RefreshAllUnderThresholds(enable_cutoff, cutoff_value, handler);
   }
+  // Thresholds and blacklist are kept for the value of the primary, a slot
+  // exports every row that holds it.
+  auto exported = [slot_view](const EmbeddingValue<V>* v) {
+    return slot_view ? v->Value() != nullptr : !v->IsUnderThreshold();
+  };
   auto counting_iter = [this, &blacklist_nums, &num_rows, &enable_cutoff,
-                        &cutoff_value,
-                        &first_n](const K& key, const EVContext<V>* context) {
+                        &cutoff_value, &first_n, slot_view,
+                        &exported](const K& key, const EVContext<V>* context) {
     auto v = context->Meta();
-    if (v->InBlacklist()) {
+    if (!slot_view && v->InBlacklist()) {
       blacklist_nums++;
     } else if ((first_n <= FIRST_N_EXPORT_BLACK_LIST ||
                 !HasLowFrequency(v->GetFrequency())) &&
-               !v->IsUnderThreshold()) {
+               exported(v)) {
       num_rows++;
     }
   };
@@ -142,20 +153,21 @@ Status KvVariable<K, V>::ExportValues(OpKernelContext* ctx, int first_n,
   auto do_export = [this, &key_row, &num_rows, &keys_flat, &values_flat,
                     &blacklist, &blacklist_nums, &blacklist_row,
                     &freq_use_uint32, &freq_nums, &freq_row, &freq_keys,
-                    &freq_values, &enable_cutoff, &first_n,
-                    &cutoff_value](const K& key, const EVContext<V>* context) {
+                    &freq_values, &enable_cutoff, &first_n, &cutoff_value,
+                    slot_view, offset,
+                    &exported](const K& key, const EVContext<V>* context) {
     auto v = context->Meta();
-    if (v->InBlacklist() && blacklist_nums > 0 &&
+    if (!slot_view && v->InBlacklist() && blacklist_nums > 0 &&
         blacklist_row < blacklist_nums && blacklist != nullptr) {
       // Output blacklist if needed
       blacklist->template flat<K>()(blacklist_row++) = key;
     } else if ((first_n <= FIRST_N_EXPORT_BLACK_LIST ||
                 !HasLowFrequency(v->GetFrequency())) &&
-               !v->IsUnderThreshold() && key_row < num_rows) {
+               exported(v) && key_row < num_rows) {
       // Output keys and values
       keys_flat(key_row) = key;
       context->OutputEmbeddingData(values_flat.template chip<0>(key_row),
-                                   embedding_dim_);
+                                   embedding_dim_, offset);
       key_row++;
     }
 
@@ -172,7 +184,7 @@ Status KvVariable<K, V>::ExportValues(OpKernelContext* ctx, int first_n,
       freq_row++;
     }
   };
-  handler->ForEach(do_export);
+  handler->ForEachWithValue(do_export);
 
   VLOG(0) << "Export " << variable_name_ << " with num of ids=" << num_rows
           << " blacklists=" << blacklist_nums << " freqs=" << freq_nums
@@ -202,9 +214,13 @@ Status KvVariable<K, V>::DeltaExport(OpKernelContext* ctx, int first_n,
   CHECK(ctx != nullptr);
   VLOG(0) << "Start DeltaExport " << variable_name_;
 
+  TableManager<K, V>* row_table = RowTable();
+  const bool slot_view = row_table != table_;
+  const int64_t offset = RowOffset();
+  mutex_read_lock primary_lock(*row_table->mu(), slot_view);
   mutex_write_lock lock(*mu());
   typename TableManager<K, V>::ScopedDisableRecordRequest
-      table_disable_record_request(table_);
+      table_disable_record_request(row_table);
   TF_RETURN_IF_ERROR(CheckInitializedInternal());
   // Stage 1: ouput key-value pairs.
   // Calcuate the number of valid key-value pairs.
@@ -227,23 +243,30 @@ Status KvVariable<K, V>::DeltaExport(OpKernelContext* ctx, int first_n,
     }
   }
 
-  for (auto iter = all_delta.begin(); iter != all_delta.end(); ++iter) {
-    const auto v = table_->FindOrNull(*iter);
-
-    if (v == nullptr) {
-      delete_list.push_back(*iter);
-      continue;
+  auto classify_key = [this, slot_view, &update_list, &black_list,
+                       &delete_list](const K& key,
+                                     const EmbeddingValue<V>* v) {
+    if (v == nullptr || (slot_view && v->Value() == nullptr)) {
+      delete_list.push_back(key);
+      return;
     }
     // Just ignore low frequency here
     if (HasLowFrequency(v->GetFrequency())) {
-      continue;
+      return;
     }
 
-    if (v->InBlacklist()) {
-      black_list.push_back(*iter);
-      continue;
+    if (!slot_view && v->InBlacklist()) {
+      black_list.push_back(key);
+      return;
     }
-    update_list.push_back(*iter);
+    update_list.push_back(key);
+  };
+  for (auto iter = all_delta.begin(); iter != all_delta.end(); ++iter) {
+    const K& key = *iter;
+    row_table->FindMetaWithFn(key, [&classify_key, &key](
+                                       const EmbeddingValue<V>* v) {
+      classify_key(key, v);
+    });
   }
 
   // Allocate output tensors for key-value pairs.
@@ -276,22 +299,21 @@ Status KvVariable<K, V>::DeltaExport(OpKernelContext* ctx, int first_n,
   int64_t num_rows = 0;
   auto&& keys_flat = keys->template flat<K>();
   auto&& values_flat = values->flat_outer_dims<V>();
-  auto DoOutputKVPairs = [this, &keys_flat, &values_flat, &update_list](
-                             int64_t start, int64_t end) {
+  auto DoOutputKVPairs = [this, &keys_flat, &values_flat, &update_list,
+                          row_table, offset](int64_t start, int64_t end) {
     std::unique_ptr<V, void (*)(V*)> buf(
         static_cast<V*>(AllocateRaw(value_bytes_)), DeallocateRaw<V>);
     for (int64_t row = start; row < end; ++row) {
       EVContext<V> context(buf.get(), false);
       auto key = update_list[row];
       keys_flat(row) = key;
-      auto out_keys_values = [this, &values_flat, row,
-                              &key](EVContext<V>* context) {
+      auto out_keys_values = [this, &values_flat, row, &key,
+                              offset](EVContext<V>* context) {
         if (!HasLowFrequency(context->Meta()->GetFrequency())) {
-          context->OutputEmbeddingData(values_flat.template chip<0>(row),
-                                       embedding_dim_);
+          OutputValue(key, context, values_flat.template chip<0>(row), offset);
         }
       };
-      table_->FindWithFn(key, out_keys_values, &context);
+      row_table->FindWithFn(key, out_keys_values, &context);
     }
   };
   if (ctx != nullptr) {
@@ -34,6 +34,7 @@
 #include "tensorflow/core/util/work_sharder.h"
 #include "tfplus/kv_variable/kernels/hybrid_embedding/storage_config.pb.h"
 #include "tfplus/kv_variable/kernels/kv_variable_cwise_op.h"
+#include "tfplus/kv_variable/kernels/slab_allocator.h"
 #include "tfplus/kv_variable/kernels/utility.h"
 #include "tfplus/kv_variable/utils/utils.h"
 
@@ -105,8 +106,7 @@ class EmbeddingValue {
   EmbeddingValue& operator=(EmbeddingValue&& other) {
     if (this != &other || embedding_val_ != other.embedding_val_) {
       if (buf_owner_.load() && (embedding_val_ != nullptr)) {
-        ::tensorflow::cpu_allocator()->DeallocateRaw(
-            reinterpret_cast<void*>(embedding_val_));
+        DeallocateEmbedding(embedding_val_);
       }
       embedding_val_ = other.embedding_val_;
       in_black_ = other.in_black_.load();
@@ -125,8 +125,7 @@ class EmbeddingValue {
 
   ~EmbeddingValue() {
     if (CASBufferOwner(true, false) && (embedding_val_ != nullptr)) {
-      ::tensorflow::cpu_allocator()->DeallocateRaw(
-          reinterpret_cast<void*>(embedding_val_));
+      DeallocateEmbedding(embedding_val_);
       embedding_val_ = nullptr;
     }
   }
@@ -153,8 +152,7 @@ class EmbeddingValue {
 
   void UpdateEmbedding(V* val_ptr) {
     if (embedding_val_ && embedding_val_ != val_ptr && buf_owner_.load()) {
-      ::tensorflow::cpu_allocator()->DeallocateRaw(
-          reinterpret_cast<void*>(embedding_val_));
+      DeallocateEmbedding(embedding_val_);
     }
     embedding_val_ = val_ptr;
   }
@@ -206,8 +204,7 @@ class EmbeddingValue {
 
   void DeleteValue() {
     if (CASBufferOwner(true, false) && embedding_val_) {
-      ::tensorflow::cpu_allocator()->DeallocateRaw(
-          reinterpret_cast<void*>(embedding_val_));
+      DeallocateEmbedding(embedding_val_);
     }
     embedding_val_ = nullptr;
   }
@@ -216,7 +213,7 @@ class EmbeddingValue {
     storage_type_ = static_cast<uint8_t>(storage_type);
   }
 
-  StorageType GetStorageType() { return StorageType(storage_type_); }
+  StorageType GetStorageType() const { return StorageType(storage_type_); }
 
  private:
   bool CASBufferOwner(bool expected, bool desired) {
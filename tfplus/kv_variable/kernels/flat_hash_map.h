@@ -0,0 +1,459 @@
+// Copyright 2023 The TFPlus Authors. All rights reserved.
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TFPLUS_KV_VARIABLE_KERNELS_FLAT_HASH_MAP_H_
+#define TFPLUS_KV_VARIABLE_KERNELS_FLAT_HASH_MAP_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <new>
+#include <utility>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace tfplus {
+namespace flat_hash_internal {
+
+// Control byte of a slot: kEmpty and kDeleted have the sign bit set, a full
+// slot stores the low 7 bits of the key hash (H2).
+typedef int8_t ctrl_t;
+constexpr ctrl_t kEmpty = -128;
+constexpr ctrl_t kDeleted = -2;
+constexpr size_t kGroupWidth = 16;
+
+inline size_t MixHash(size_t h) {
+  // std::hash of integers is the identity, fold a multiplicative mix so that
+  // both the probe position and the 7-bit tag see high entropy bits.
+  uint64_t x = static_cast<uint64_t>(h) * 0x9E3779B97F4A7C15ULL;
+  return static_cast<size_t>(x ^ (x >> 32));
+}
+
+inline size_t H1(size_t hash) { return hash >> 7; }
+inline ctrl_t H2(size_t hash) { return static_cast<ctrl_t>(hash & 0x7f); }
+
+inline int TrailingZeros(uint32_t x) { return __builtin_ctz(x); }
+
+// A group is kGroupWidth consecutive control bytes, the match functions
+// return a bitmask with bit i set if control byte i satisfies the predicate.
+struct Group {
+#if defined(__SSE2__)
+  explicit Group(const ctrl_t* pos)
+      : ctrl(_mm_load_si128(reinterpret_cast<const __m128i*>(pos))) {}
+
+  uint32_t Match(ctrl_t h2) const {
+    return static_cast<uint32_t>(
+        _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(h2), ctrl)));
+  }
+
+  uint32_t MatchEmpty() const {
+    return static_cast<uint32_t>(
+        _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(kEmpty), ctrl)));
+  }
+
+  uint32_t MatchEmptyOrDeleted() const {
+    return static_cast<uint32_t>(_mm_movemask_epi8(ctrl));
+  }
+
+  __m128i ctrl;
+#else
+  explicit Group(const ctrl_t* pos) : ctrl(pos) {}
+
+  uint32_t Match(ctrl_t h2) const {
+    uint32_t mask = 0;
+    for (size_t i = 0; i < kGroupWidth; ++i) {
+      mask |= static_cast<uint32_t>(ctrl[i] == h2) << i;
+    }
+    return mask;
+  }
+
+  uint32_t MatchEmpty() const { return Match(kEmpty); }
+
+  uint32_t MatchEmptyOrDeleted() const {
+    uint32_t mask = 0;
+    for (size_t i = 0; i < kGroupWidth; ++i) {
+      mask |= static_cast<uint32_t>(ctrl[i] < 0) << i;
+    }
+    return mask;
+  }
+
+  const ctrl_t* ctrl;
+#endif
+};
+
+}  // namespace flat_hash_internal
+
+// Open addressing hash map with Swiss-table style metadata. Slots are grouped
+// by 16, each slot owns one control byte, and a probe compares the whole
+// group against the 7-bit hash tag with one SSE2 compare, so a lookup
+// usually touches one control line and one slot. Keys and values live inline
+// in the slot array; there is no per-entry node allocation.
+//
+// Growing does not rehash the whole table at once: the old arrays are kept
+// and every later insertion moves kMigrateSlots of their slots to the new
+// ones, so the cost of doubling is spread over the insertions that fill the
+// new table and no single insertion stalls on it. Lookups probe the new
+// arrays and then, while a migration runs, the old ones. reserve() and the
+// rehash that drops tombstones still run synchronously.
+//
+// The map itself is not thread safe, ConcurrentFlatSimdMap guards each
+// segment with a spin_rw_mutex. Value pointers are invalidated by clear(),
+// reserve() and by any insertion or erase.
+template <class K, class V, class Hash = std::hash<K>,
+          class Eq = std::equal_to<K>>
+class FlatHashMap {
+ public:
+  typedef std::pair<K, V> value_type;
+
+  FlatHashMap() = default;
+  FlatHashMap(const FlatHashMap&) = delete;
+  FlatHashMap& operator=(const FlatHashMap&) = delete;
+  ~FlatHashMap() { DestroyAndFree(); }
+
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  size_t capacity() const { return capacity_; }
+
+  // Whether the slots of a previous, smaller table are still being moved.
+  bool migrating() const { return old_ctrl_ != nullptr; }
+
+  // Bytes held by the control and slot arrays.
+  size_t MemoryUsed() const {
+    return AllocSize(capacity_) + AllocSize(old_capacity_);
+  }
+
+  value_type* find(const K& key) {
+    if (size_ == 0) return nullptr;
+    return FindSlot(key, HashOf(key));
+  }
+
+  // Prefetches the control group and the first slots that a lookup of key
+  // probes.
+  void prefetch(const K& key) const {
+    if (capacity_ == 0) return;
+    const size_t group_mask = capacity_ / flat_hash_internal::kGroupWidth - 1;
+    size_t base = (flat_hash_internal::H1(HashOf(key)) & group_mask) *
+                  flat_hash_internal::kGroupWidth;
+    __builtin_prefetch(ctrl_ + base);
+    __builtin_prefetch(slots_ + base);
+  }
+
+  // Returns the existing entry of key, or a new entry whose value is built
+  // by make_value(). The bool is true if the entry was inserted.
+  template <class MakeValue>
+  std::pair<value_type*, bool> find_or_insert(const K& key,
+                                              MakeValue&& make_value) {
+    size_t hash = HashOf(key);
+    if (size_ != 0) {
+      value_type* kv = FindSlot(key, hash);
+      if (kv != nullptr) return {kv, false};
+    }
+    size_t index = PrepareInsert(hash);
+    new (&slots_[index]) value_type(key, make_value());
+    return {&slots_[index], true};
+  }
+
+  std::pair<value_type*, bool> insert_or_assign(const K& key, V&& val) {
+    size_t hash = HashOf(key);
+    if (size_ != 0) {
+      value_type* kv = FindSlot(key, hash);
+      if (kv != nullptr) {
+        kv->second = std::move(val);
+        return {kv, false};
+      }
+    }
+    size_t index = PrepareInsert(hash);
+    new (&slots_[index]) value_type(key, std::move(val));
+    return {&slots_[index], true};
+  }
+
+  bool erase(const K& key) {
+    if (size_ == 0) return false;
+    size_t hash = HashOf(key);
+    size_t index = capacity_ == 0 ? npos
+                                  : FindIndex(ctrl_, slots_, capacity_, key,
+                                              hash);
+    if (index == npos) {
+      if (!migrating()) return false;
+      index = FindIndex(old_ctrl_, old_slots_, old_capacity_, key, hash);
+      if (index == npos) return false;
+      // The old arrays only shrink, a tombstone keeps their probe chains
+      // intact until they are freed.
+      old_slots_[index].~value_type();
+      old_ctrl_[index] = flat_hash_internal::kDeleted;
+      --size_;
+      return true;
+    }
+    slots_[index].~value_type();
+    --size_;
+    // A probe stops at the first group that has an empty slot, so if this
+    // group already has one the slot can go back to empty instead of
+    // becoming a tombstone.
+    size_t group_start = index & ~(flat_hash_internal::kGroupWidth - 1);
+    if (flat_hash_internal::Group(ctrl_ + group_start).MatchEmpty()) {
+      ctrl_[index] = flat_hash_internal::kEmpty;
+      ++growth_left_;
+    } else {
+      ctrl_[index] = flat_hash_internal::kDeleted;
+    }
+    return true;
+  }
+
+  void clear() { DestroyAndFree(); }
+
+  // Grows the table so that n elements fit without rehashing.
+  void reserve(size_t n) {
+    size_t cap = CapacityFor(n);
+    if (cap > capacity_) {
+      FinishMigration();
+      Resize(cap);
+    }
+  }
+
+  template <class Fn>
+  void for_each(Fn&& fn) {
+    for (size_t i = 0; i < capacity_; ++i) {
+      if (ctrl_[i] >= 0) fn(slots_[i]);
+    }
+    for (size_t i = migrate_pos_; i < old_capacity_; ++i) {
+      if (old_ctrl_[i] >= 0) fn(old_slots_[i]);
+    }
+  }
+
+  template <class Fn>
+  void for_each(Fn&& fn) const {
+    for (size_t i = 0; i < capacity_; ++i) {
+      if (ctrl_[i] >= 0) fn(static_cast<const value_type&>(slots_[i]));
+    }
+    for (size_t i = migrate_pos_; i < old_capacity_; ++i) {
+      if (old_ctrl_[i] >= 0) fn(static_cast<const value_type&>(old_slots_[i]));
+    }
+  }
+
+ private:
+  static constexpr size_t npos = static_cast<size_t>(-1);
+  static constexpr size_t kMinCapacity = flat_hash_internal::kGroupWidth;
+  // Old slots moved per insertion while growing. A doubling leaves about
+  // 7/8 of the old capacity free in the new table, so the migration ends
+  // long before the free slots run out.
+  static constexpr size_t kMigrateSlots = 4 * flat_hash_internal::kGroupWidth;
+
+  static size_t HashOf(const K& key) {
+    return flat_hash_internal::MixHash(Hash()(key));
+  }
+
+  // Max load factor is 7/8.
+  static size_t MaxLoad(size_t cap) { return cap - cap / 8; }
+
+  static size_t CapacityFor(size_t n) {
+    size_t cap = kMinCapacity;
+    while (MaxLoad(cap) < n) cap <<= 1;
+    return cap;
+  }
+
+  static size_t SlotOffset(size_t cap) {
+    return (cap + alignof(value_type) - 1) & ~(alignof(value_type) - 1);
+  }
+
+  static size_t AllocSize(size_t cap) {
+    return cap == 0 ? 0 : SlotOffset(cap) + cap * sizeof(value_type);
+  }
+
+  static constexpr size_t Alignment() {
+    return alignof(value_type) > flat_hash_internal::kGroupWidth
+               ? alignof(value_type)
+               : flat_hash_internal::kGroupWidth;
+  }
+
+  static size_t FindIndex(const flat_hash_internal::ctrl_t* ctrl,
+                          const value_type* slots, size_t capacity,
+                          const K& key, size_t hash) {
+    using flat_hash_internal::Group;
+    using flat_hash_internal::kGroupWidth;
+    const size_t group_mask = capacity / kGroupWidth - 1;
+    const flat_hash_internal::ctrl_t h2 = flat_hash_internal::H2(hash);
+    size_t group = flat_hash_internal::H1(hash) & group_mask;
+    // Triangular probing visits every group when the group count is a power
+    // of two.
+    for (size_t step = 1;; ++step) {
+      const size_t base = group * kGroupWidth;
+      Group g(ctrl + base);
+      for (uint32_t m = g.Match(h2); m != 0; m &= m - 1) {
+        size_t index = base + flat_hash_internal::TrailingZeros(m);
+        if (Eq()(slots[index].first, key)) return index;
+      }
+      if (g.MatchEmpty() != 0) return npos;
+      group = (group + step) & group_mask;
+    }
+  }
+
+  // The entry of key in the current or, while migrating, the old arrays.
+  value_type* FindSlot(const K& key, size_t hash) const {
+    if (capacity_ != 0) {
+      size_t index = FindIndex(ctrl_, slots_, capacity_, key, hash);
+      if (index != npos) return &slots_[index];
+    }
+    if (migrating()) {
+      size_t index =
+          FindIndex(old_ctrl_, old_slots_, old_capacity_, key, hash);
+      if (index != npos) return &old_slots_[index];
+    }
+    return nullptr;
+  }
+
+  // First empty or deleted slot on the probe sequence of hash.
+  size_t FindFirstNonFull(size_t hash) const {
+    using flat_hash_internal::Group;
+    using flat_hash_internal::kGroupWidth;
+    const size_t group_mask = capacity_ / kGroupWidth - 1;
+    size_t group = flat_hash_internal::H1(hash) & group_mask;
+    for (size_t step = 1;; ++step) {
+      const size_t base = group * kGroupWidth;
+      uint32_t m = Group(ctrl_ + base).MatchEmptyOrDeleted();
+      if (m != 0) return base + flat_hash_internal::TrailingZeros(m);
+      group = (group + step) & group_mask;
+    }
+  }
+
+  // Claims a slot for a key known to be absent, growing the table first if
+  // needed. The returned slot is marked full but not yet constructed.
+  size_t PrepareInsert(size_t hash) {
+    if (capacity_ == 0) Resize(kMinCapacity);
+    if (migrating()) MigrateSome(kMigrateSlots);
+    size_t index = FindFirstNonFull(hash);
+    if (growth_left_ == 0 && ctrl_[index] == flat_hash_internal::kEmpty) {
+      // Only erases during a migration can use up the new table early.
+      FinishMigration();
+      // Double when the table is more than half full of live entries,
+      // otherwise rehash in place to drop the tombstones.
+      if (size_ * 2 >= MaxLoad(capacity_)) {
+        Grow();
+      } else {
+        Resize(capacity_);
+      }
+      index = FindFirstNonFull(hash);
+    }
+    if (ctrl_[index] == flat_hash_internal::kEmpty) --growth_left_;
+    ctrl_[index] = flat_hash_internal::H2(hash);
+    ++size_;
+    return index;
+  }
+
+  // Replaces the arrays by empty ones of new_cap slots, growth_left_ counts
+  // every live entry as already placed.
+  void Allocate(size_t new_cap) {
+    char* mem = static_cast<char*>(
+        ::operator new(AllocSize(new_cap), std::align_val_t(Alignment())));
+    ctrl_ = reinterpret_cast<flat_hash_internal::ctrl_t*>(mem);
+    slots_ = reinterpret_cast<value_type*>(mem + SlotOffset(new_cap));
+    capacity_ = new_cap;
+    std::memset(ctrl_, flat_hash_internal::kEmpty, new_cap);
+    growth_left_ = MaxLoad(new_cap) - size_;
+  }
+
+  // Moves the full slots in [begin, end) of ctrl/slots into the current
+  // arrays, leaving tombstones behind so that lookups in the rest of the old
+  // arrays still probe past them.
+  void MoveSlots(flat_hash_internal::ctrl_t* ctrl, value_type* slots,
+                 size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      if (ctrl[i] < 0) continue;
+      size_t hash = HashOf(slots[i].first);
+      size_t index = FindFirstNonFull(hash);
+      ctrl_[index] = flat_hash_internal::H2(hash);
+      new (&slots_[index]) value_type(std::move(slots[i]));
+      slots[i].~value_type();
+      ctrl[i] = flat_hash_internal::kDeleted;
+    }
+  }
+
+  void Resize(size_t new_cap) {
+    flat_hash_internal::ctrl_t* old_ctrl = ctrl_;
+    value_type* old_slots = slots_;
+    size_t old_cap = capacity_;
+    Allocate(new_cap);
+    MoveSlots(old_ctrl, old_slots, 0, old_cap);
+    if (old_ctrl != nullptr) {
+      ::operator delete(old_ctrl, std::align_val_t(Alignment()));
+    }
+  }
+
+  // Doubles the table, the current slots become the old arrays that the
+  // following insertions migrate.
+  void Grow() {
+    old_ctrl_ = ctrl_;
+    old_slots_ = slots_;
+    old_capacity_ = capacity_;
+    migrate_pos_ = 0;
+    Allocate(capacity_ * 2);
+  }
+
+  void MigrateSome(size_t num_slots) {
+    size_t end = std::min(old_capacity_, migrate_pos_ + num_slots);
+    MoveSlots(old_ctrl_, old_slots_, migrate_pos_, end);
+    migrate_pos_ = end;
+    if (migrate_pos_ == old_capacity_) FreeOld();
+  }
+
+  void FinishMigration() {
+    if (migrating()) MigrateSome(old_capacity_);
+  }
+
+  void FreeOld() {
+    ::operator delete(old_ctrl_, std::align_val_t(Alignment()));
+    old_ctrl_ = nullptr;
+    old_slots_ = nullptr;
+    old_capacity_ = 0;
+    migrate_pos_ = 0;
+  }
+
+  void DestroyAndFree() {
+    if (migrating()) {
+      for (size_t i = migrate_pos_; i < old_capacity_; ++i) {
+        if (old_ctrl_[i] >= 0) old_slots_[i].~value_type();
+      }
+      FreeOld();
+    }
+    if (ctrl_ == nullptr) return;
+    for (size_t i = 0; i < capacity_; ++i) {
+      if (ctrl_[i] >= 0) slots_[i].~value_type();
+    }
+    ::operator delete(ctrl_, std::align_val_t(Alignment()));
+    ctrl_ = nullptr;
+    slots_ = nullptr;
+    capacity_ = 0;
+    size_ = 0;
+    growth_left_ = 0;
+  }
+
+  flat_hash_internal::ctrl_t* ctrl_ = nullptr;
+  value_type* slots_ = nullptr;
+  size_t capacity_ = 0;
+  // Number of entries in both the current and the old arrays.
+  size_t size_ = 0;
+  size_t growth_left_ = 0;
+  // Arrays of the table before the last doubling, the slots from
+  // migrate_pos_ on have not been moved yet.
+  flat_hash_internal::ctrl_t* old_ctrl_ = nullptr;
+  value_type* old_slots_ = nullptr;
+  size_t old_capacity_ = 0;
+  size_t migrate_pos_ = 0;
+};
+
+}  // namespace tfplus
+
+#endif  // TFPLUS_KV_VARIABLE_KERNELS_FLAT_HASH_MAP_H_
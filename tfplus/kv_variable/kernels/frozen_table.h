@@ -0,0 +1,271 @@
+// Copyright 2023 The TFPlus Authors. All rights reserved.
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TFPLUS_KV_VARIABLE_KERNELS_FROZEN_TABLE_H_
+#define TFPLUS_KV_VARIABLE_KERNELS_FROZEN_TABLE_H_
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>  // NOLINT(build/c++11)
+#include <utility>
+#include <vector>
+
+#include "tensorflow/core/lib/core/errors.h"
+#include "tfplus/kv_variable/kernels/shared_memory.h"
+
+namespace tfplus {
+
+// Immutable copy of the rows of a KvVariable that inference lookups read
+// without any lock, see KvVariable::FreezeTable(). It is never changed once
+// built, a new model version builds a new table which replaces it as a
+// whole. Keys live in an open addressing array with linear probing, at most
+// half full, and rows in one contiguous buffer.
+//
+// The arrays are either owned by the table or live in a shared memory
+// segment, which other processes of the host map with Attach(). The segment
+// only holds offsets, so it reads the same at any address.
+template <typename K, typename V>
+class FrozenTable {
+ public:
+  // rows holds the embedding_dim values of keys[i] at i * embedding_dim.
+  FrozenTable(std::vector<K> keys, std::vector<V> rows, int64_t embedding_dim)
+      : embedding_dim_(embedding_dim),
+        owned_keys_(std::move(keys)),
+        owned_rows_(std::move(rows)) {
+    size_ = owned_keys_.size();
+    SetCapacity(Capacity(size_));
+    owned_slots_.resize(mask_ + 1);
+    BuildSlots(owned_keys_.data(), owned_slots_.data());
+    keys_ = owned_keys_.data();
+    rows_ = owned_rows_.data();
+    slots_ = owned_slots_.data();
+  }
+
+  // Writes the table of keys and rows to the new shared memory segment
+  // name.
+  static ::tensorflow::Status Share(const std::string& name,
+                                    const std::vector<K>& keys,
+                                    const std::vector<V>& rows,
+                                    int64_t embedding_dim,
+                                    std::unique_ptr<FrozenTable>* table) {
+    SharedLayout layout;
+    layout.magic = kSharedMagic;
+    layout.key_bytes = sizeof(K);
+    layout.value_bytes = sizeof(V);
+    layout.embedding_dim = embedding_dim;
+    layout.num_keys = keys.size();
+    layout.capacity = Capacity(keys.size());
+    layout.keys_offset = Align(sizeof(SharedLayout));
+    layout.rows_offset =
+        Align(layout.keys_offset + layout.num_keys * sizeof(K));
+    layout.slots_offset =
+        Align(layout.rows_offset + rows.size() * sizeof(V));
+    const size_t bytes =
+        layout.slots_offset + layout.capacity * sizeof(int64_t);
+    std::unique_ptr<SharedMemory> memory;
+    TF_RETURN_IF_ERROR(SharedMemory::Create(name, bytes, &memory));
+    char* base = static_cast<char*>(memory->data());
+    std::copy(keys.begin(), keys.end(),
+              reinterpret_cast<K*>(base + layout.keys_offset));
+    std::copy(rows.begin(), rows.end(),
+              reinterpret_cast<V*>(base + layout.rows_offset));
+    std::memcpy(base, &layout, sizeof(layout));
+    table->reset(new FrozenTable(std::move(memory), embedding_dim));
+    (*table)->BuildSlots((*table)->keys_, reinterpret_cast<int64_t*>(
+                                               base + layout.slots_offset));
+    return ::tensorflow::OkStatus();
+  }
+
+  // Maps the segment name written by Share(), read-only.
+  static ::tensorflow::Status Attach(const std::string& name,
+                                     int64_t embedding_dim,
+                                     std::unique_ptr<FrozenTable>* table) {
+    std::unique_ptr<SharedMemory> memory;
+    TF_RETURN_IF_ERROR(SharedMemory::Open(name, false, &memory));
+    SharedLayout layout;
+    if (memory->size() < sizeof(layout)) {
+      return ::tensorflow::errors::DataLoss("Shared table ", name,
+                                            " is truncated");
+    }
+    std::memcpy(&layout, memory->data(), sizeof(layout));
+    if (layout.magic != kSharedMagic || layout.key_bytes != sizeof(K) ||
+        layout.value_bytes != sizeof(V)) {
+      return ::tensorflow::errors::InvalidArgument(
+          "Shared table ", name, " holds other key or value types");
+    }
+    if (layout.embedding_dim != embedding_dim) {
+      return ::tensorflow::errors::InvalidArgument(
+          "Shared table ", name, " has embedding dim ", layout.embedding_dim,
+          " instead of ", embedding_dim);
+    }
+    if (layout.slots_offset + layout.capacity * sizeof(int64_t) >
+        memory->size()) {
+      return ::tensorflow::errors::DataLoss("Shared table ", name,
+                                            " is truncated");
+    }
+    table->reset(new FrozenTable(std::move(memory), embedding_dim));
+    return ::tensorflow::OkStatus();
+  }
+
+  FrozenTable(const FrozenTable&) = delete;
+  FrozenTable& operator=(const FrozenTable&) = delete;
+
+  size_t size() const { return size_; }
+
+  bool shared() const { return memory_ != nullptr; }
+
+  // The row of key or nullptr.
+  const V* Find(const K& key) const {
+    for (size_t slot = Home(key);; slot = (slot + 1) & mask_) {
+      const int64_t index = slots_[slot];
+      if (index == kEmpty) {
+        return nullptr;
+      }
+      if (keys_[index] == key) {
+        return rows_ + index * embedding_dim_;
+      }
+    }
+  }
+
+  void Prefetch(const K& key) const { __builtin_prefetch(&slots_[Home(key)]); }
+
+  // The memory of this process, a shared segment is counted by its loader
+  // only.
+  size_t MemoryUsed() const {
+    return sizeof(FrozenTable) + owned_keys_.capacity() * sizeof(K) +
+           owned_rows_.capacity() * sizeof(V) +
+           owned_slots_.capacity() * sizeof(int64_t);
+  }
+
+ private:
+  static constexpr int64_t kEmpty = -1;
+  static constexpr uint64_t kSharedMagic = 0x7466706c75736674ULL;
+
+  // Header of a shared segment, the arrays follow at the offsets.
+  struct SharedLayout {
+    uint64_t magic;
+    uint32_t key_bytes;
+    uint32_t value_bytes;
+    int64_t embedding_dim;
+    uint64_t num_keys;
+    uint64_t capacity;
+    uint64_t keys_offset;
+    uint64_t rows_offset;
+    uint64_t slots_offset;
+  };
+
+  FrozenTable(std::unique_ptr<SharedMemory> memory, int64_t embedding_dim)
+      : embedding_dim_(embedding_dim), memory_(std::move(memory)) {
+    const char* base = static_cast<const char*>(memory_->data());
+    SharedLayout layout;
+    std::memcpy(&layout, base, sizeof(layout));
+    size_ = layout.num_keys;
+    SetCapacity(layout.capacity);
+    keys_ = reinterpret_cast<const K*>(base + layout.keys_offset);
+    rows_ = reinterpret_cast<const V*>(base + layout.rows_offset);
+    slots_ = reinterpret_cast<const int64_t*>(base + layout.slots_offset);
+  }
+
+  static size_t Capacity(size_t num_keys) {
+    size_t capacity = 16;
+    while (capacity < 2 * num_keys) {
+      capacity <<= 1;
+    }
+    return capacity;
+  }
+
+  static size_t Align(size_t offset) { return (offset + 63) & ~size_t{63}; }
+
+  void SetCapacity(size_t capacity) {
+    mask_ = capacity - 1;
+    shift_ = 64 - __builtin_ctzll(capacity);
+  }
+
+  void BuildSlots(const K* keys, int64_t* slots) const {
+    std::fill(slots, slots + mask_ + 1, kEmpty);
+    for (size_t i = 0; i < size_; ++i) {
+      size_t slot = Home(keys[i]);
+      while (slots[slot] != kEmpty && keys[slots[slot]] != keys[i]) {
+        slot = (slot + 1) & mask_;
+      }
+      slots[slot] = static_cast<int64_t>(i);
+    }
+  }
+
+  // Fibonacci hashing, the high bits of the product depend on every bit of
+  // the key.
+  size_t Home(const K& key) const {
+    return ((static_cast<uint64_t>(key) * 0x9e3779b97f4a7c15ULL) >> shift_) &
+           mask_;
+  }
+
+  const int64_t embedding_dim_;
+  std::vector<K> owned_keys_;
+  std::vector<V> owned_rows_;
+  std::vector<int64_t> owned_slots_;
+  std::unique_ptr<SharedMemory> memory_;
+  const K* keys_;
+  const V* rows_;
+  const int64_t* slots_;
+  size_t size_;
+  size_t mask_;
+  int shift_;
+};
+
+// Counts the lookups reading a published FrozenTable, so that the table a
+// new one replaces is only freed, and a shared one unmapped, once no lookup
+// reads it. A lookup registers in the counter of the current epoch before it
+// loads the table. Synchronize() is called after the new table is
+// published, it moves the epoch to the other counter and waits for the
+// one it left, twice, lookups that start meanwhile do not delay it.
+class FrozenTableReaders {
+ public:
+  class Scope {
+   public:
+    explicit Scope(FrozenTableReaders* readers)
+        : counter_(&readers->counters_[readers->epoch_.load()]) {
+      counter_->fetch_add(1);
+    }
+    ~Scope() { counter_->fetch_sub(1); }
+
+    Scope(const Scope&) = delete;
+    Scope& operator=(const Scope&) = delete;
+
+   private:
+    std::atomic<int64_t>* counter_;
+  };
+
+  // Returns once every lookup that may have loaded the previous table is
+  // done. Callers are serialized, e.g. by the write lock of the variable.
+  void Synchronize() {
+    for (int i = 0; i < 2; ++i) {
+      const int left = epoch_.load();
+      epoch_.store(1 - left);
+      while (counters_[left].load() != 0) {
+        std::this_thread::yield();
+      }
+    }
+  }
+
+ private:
+  std::atomic<int> epoch_{0};
+  std::atomic<int64_t> counters_[2] = {{0}, {0}};
+};
+
+}  // namespace tfplus
+#endif  // TFPLUS_KV_VARIABLE_KERNELS_FROZEN_TABLE_H_
@@ -14,8 +14,12 @@
 #ifndef TFPLUS_KV_VARIABLE_KERNELS_HASHMAP_H_
 #define TFPLUS_KV_VARIABLE_KERNELS_HASHMAP_H_
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
 #include <cstdlib>
 #include <functional>
+#include <memory>
 #include <string>
 #include <type_traits>
 #include <unordered_map>
@@ -30,6 +34,7 @@
 #include "tensorflow/core/platform/stacktrace.h"
 
 #include "tensorflow/core/platform/types.h"
+#include "tfplus/kv_variable/kernels/flat_hash_map.h"
 #include "tfplus/kv_variable/kernels/mutex.h"
 #include "tfplus/kv_variable/kernels/utility.h"
 
@@ -40,14 +45,18 @@ enum MapType {
   CUCKOO_HASH,
   CONCURRENT_UNORDERED_MAP,
   CONCURRENT_DENSE_HASH_MAP,
-  MULTI_LEVEL_MAP
+  MULTI_LEVEL_MAP,
+  FLAT_SIMD_MAP
 };
 
 enum LockType { WRITE_LOCK, READ_LOCK };
 
 using ::tensorflow::int64;
 
-constexpr size_t HASH_SIZE_DEFAULT = 1031;
+// Segments of the concurrent maps, each has its own map and lock. Counts
+// are rounded up to a power of two and clamped to HASH_SIZE_MAX.
+constexpr size_t HASH_SIZE_DEFAULT = 1024;
+constexpr size_t HASH_SIZE_MAX = 1 << 16;
 constexpr uint64_t MAGIC_SEED = 0x5446534d;
 
 template <class T>
@@ -84,6 +93,43 @@ struct murmurhash_b<std::string> {
   }
 };
 
+// Picks the segment of a hash from the high bits of its Fibonacci hash,
+// which depend on every bit of the hash, so that keys spread evenly even
+// when the hash function is the identity.
+class SegmentSelector {
+ public:
+  explicit SegmentSelector(size_t num_segments) {
+    num_segments = std::min(std::max<size_t>(num_segments, 1), HASH_SIZE_MAX);
+    size_t bits = 0;
+    while ((size_t(1) << bits) < num_segments) {
+      ++bits;
+    }
+    num_segments_ = size_t(1) << bits;
+    mask_ = num_segments_ - 1;
+    shift_ = 64 - std::max<size_t>(bits, 1);
+  }
+
+  size_t num_segments() const { return num_segments_; }
+
+  // Keys to reserve per segment so that n keys spread over the segments
+  // rarely overflow one: the mean plus four standard deviations of the
+  // binomial count of a segment.
+  size_t KeysPerSegment(size_t n) const {
+    double mean = static_cast<double>(n) / num_segments_;
+    return static_cast<size_t>(mean + 4 * std::sqrt(mean)) + 1;
+  }
+
+  size_t operator()(size_t hash) const {
+    return ((static_cast<uint64_t>(hash) * 0x9e3779b97f4a7c15ULL) >> shift_) &
+           mask_;
+  }
+
+ private:
+  size_t num_segments_;
+  size_t mask_;
+  size_t shift_;
+};
+
 template <class K, class V>
 class IMap {
  public:
@@ -109,6 +155,31 @@ class IMap {
       const K& key, std::function<void(V* val)> find_func,
       std::function<V(const K& key)> insert_func) = 0;
 
+  /*
+   Hints that key is going to be looked up soon. Maps prefetch what they can
+   locate without blocking, it never changes the map.
+   */
+  virtual void Prefetch(const K& key) {}
+
+  /*
+   Sizes the map for n keys in total, so that growing to n keys does not
+   rehash while a segment lock is held. Maps that cannot be sized ignore it.
+   */
+  virtual void Reserve(size_t n) {}
+
+  /*
+   Segments the keys are spread over, each guarded by its own lock, and the
+   segment of key. Maps without segments are a single one.
+   */
+  virtual size_t NumSegments() const { return 1; }
+  virtual size_t SegmentOf(const K& key) const { return 0; }
+
+  /*
+   Whether the address of a value stays the same until its key is erased,
+   whatever else is inserted or erased meanwhile.
+   */
+  virtual bool StableValues() const { return false; }
+
   /*
    Insert the given key-value pair into the map. Returns true if and
    only if the key from the given pair doesn't previously exist. Otherwise, the
@@ -150,6 +221,14 @@ class IMap {
     return ScopedSpinLock();
   }
 
+  // GetScopedKeyLock() that never waits, *locked tells whether the key is
+  // guarded by the returned lock. For hints, which skip the key otherwise.
+  virtual ScopedSpinLock TryGetScopedKeyLock(const K& key, LockType lock_type,
+                                             bool* locked) {
+    *locked = true;
+    return ScopedSpinLock();
+  }
+
   class ScopedLock {
    public:
     ScopedLock() = delete;
@@ -211,6 +290,8 @@ class UnorderedMap : public IMap<K, V> {
 
   void clear() override { table_.clear(); }
 
+  void Reserve(size_t n) override { table_.reserve(n); }
+
   bool erase(const K& key) override { return table_.erase(key) != 0; }
 
   void ForEach(std::function<void(const K& key, const V* val)> func) override {
@@ -294,6 +375,8 @@ class CuckooHashMap : public IMap<K, V> {
 
   void clear() override { table_.clear(); }
 
+  void Reserve(size_t n) override { table_.reserve(n); }
+
   bool erase(const K& key) override { return table_.erase(key); }
 
   void ForEach(std::function<void(const K& key, const V* val)> func) override {
@@ -338,6 +421,10 @@ class ConcurrentUnorderedMap : public IMap<K, V> {
   /*hash table*/
   typedef typename std::unordered_map<K, V, murmurhash_a<K>> hash_segment;
 
+  explicit ConcurrentUnorderedMap(size_t num_segments = HASH_SIZE_DEFAULT)
+      : segments_(num_segments),
+        table_(new concurrent_hash_map[segments_.num_segments()]) {}
+
   V* FindOrNull(const K& key) override {
     size_t segment_id = hash_id(key);
     tfplus_shared_spin_lock r_lock(table_[segment_id].mu);
@@ -364,8 +451,9 @@ class ConcurrentUnorderedMap : public IMap<K, V> {
     auto it = table_[segment_id].map.find(key);
     if (it == table_[segment_id].map.end()) {
       V new_val = func(key);
-      table_[segment_id].map[key] = std::move(new_val);
-      V* val = &table_[segment_id].map.find(key)->second;
+      auto res = table_[segment_id].map.emplace(key, std::move(new_val));
+      V* val = &res.first->second;
+      size_.fetch_add(1, std::memory_order_relaxed);
       return val;
     }
 
@@ -380,7 +468,8 @@ class ConcurrentUnorderedMap : public IMap<K, V> {
 
     auto it = table_[segment_id].map.find(key);
     if (it == table_[segment_id].map.end()) {
-      table_[segment_id].map[key] = std::move(insert_func(key));
+      table_[segment_id].map.emplace(key, insert_func(key));
+      size_.fetch_add(1, std::memory_order_relaxed);
       return false;
     }
 
@@ -388,6 +477,18 @@ class ConcurrentUnorderedMap : public IMap<K, V> {
     return true;
   }
 
+  void Prefetch(const K& key) override {
+    __builtin_prefetch(&table_[hash_id(key)]);
+  }
+
+  void Reserve(size_t n) override {
+    size_t keys = segments_.KeysPerSegment(n);
+    for (size_t segment_id = 0; segment_id < num_segments(); segment_id++) {
+      tfplus_spin_lock w_lock(table_[segment_id].mu);
+      table_[segment_id].map.reserve(keys);
+    }
+  }
+
   bool FindWithFn(const K& key, std::function<void(V* val)> func) override {
     V* val = nullptr;
     size_t segment_id = hash_id(key);
@@ -417,7 +518,9 @@ class ConcurrentUnorderedMap : public IMap<K, V> {
   bool InsertOrAssign(const K& key, V&& val) override {
     size_t segment_id = hash_id(key);
     tfplus_spin_lock w_lock(table_[segment_id].mu);
-    table_[segment_id].map[key] = std::move(val);
+    if (table_[segment_id].map.insert_or_assign(key, std::move(val)).second) {
+      size_.fetch_add(1, std::memory_order_relaxed);
+    }
     return true;
   }
 
@@ -425,8 +528,10 @@ class ConcurrentUnorderedMap : public IMap<K, V> {
                                                    V&& val) override {
     size_t segment_id = hash_id(key);
     auto it = table_[segment_id].map.insert_or_assign(key, std::move(val));
+    if (it.second) {
+      size_.fetch_add(1, std::memory_order_relaxed);
+    }
     return {&it.first->second, it.second};
-    // return {nullptr, false};
   }
 
   bool UpdateWithFn(const K& key, std::function<void(V* val)> func) override {
@@ -442,27 +547,17 @@ class ConcurrentUnorderedMap : public IMap<K, V> {
     return false;
   }
 
-  size_t size() const override {
-    size_t total_size = 0;
-    for (size_t segment_id = 0; segment_id < HASH_SIZE_DEFAULT; segment_id++) {
-      tfplus_shared_spin_lock r_lock(table_[segment_id].mu);
-      total_size += table_[segment_id].map.size();
-    }
-    return total_size;
-  }
+  size_t size() const override { return size_.load(std::memory_order_relaxed); }
 
   size_t size_unsafe() const override {
-    size_t total_size = 0;
-    for (size_t segment_id = 0; segment_id < HASH_SIZE_DEFAULT; segment_id++) {
-      total_size += table_[segment_id].map.size();
-    }
-    return total_size;
+    return size_.load(std::memory_order_relaxed);
   }
 
   void clear() override {
-    for (size_t segment_id = 0; segment_id < HASH_SIZE_DEFAULT; segment_id++) {
+    for (size_t segment_id = 0; segment_id < num_segments(); segment_id++) {
       auto& mu = table_[segment_id].mu;
       mu.lock();
+      size_.fetch_sub(table_[segment_id].map.size(), std::memory_order_relaxed);
       table_[segment_id].map.clear();
       mu.unlock();
     }
@@ -471,16 +566,15 @@ class ConcurrentUnorderedMap : public IMap<K, V> {
   bool erase(const K& key) override {
     size_t segment_id = hash_id(key);
     tfplus_spin_lock w_lock(table_[segment_id].mu);
-    return table_[segment_id].map.erase(key) != 0;
+    return EraseFromSegment(segment_id, key);
   }
 
   bool erase_unsafe(const K& key) override {
-    size_t segment_id = hash_id(key);
-    return table_[segment_id].map.erase(key) != 0;
+    return EraseFromSegment(hash_id(key), key);
   }
 
   void ForEach(std::function<void(const K& key, const V* val)> func) override {
-    for (size_t segment_id = 0; segment_id < HASH_SIZE_DEFAULT; segment_id++) {
+    for (size_t segment_id = 0; segment_id < num_segments(); segment_id++) {
       auto& seg = table_[segment_id];
       tfplus_spin_lock w_lock(seg.mu);
       for (auto it = seg.map.begin(); it != seg.map.end(); ++it) {
@@ -491,7 +585,7 @@ class ConcurrentUnorderedMap : public IMap<K, V> {
 
   void ForEachUnsafe(
       std::function<void(const K& key, const V* val)> func) override {
-    for (size_t segment_id = 0; segment_id < HASH_SIZE_DEFAULT; segment_id++) {
+    for (size_t segment_id = 0; segment_id < num_segments(); segment_id++) {
       auto& seg = table_[segment_id];
       for (auto it = seg.map.begin(); it != seg.map.end(); ++it) {
         func(it->first, &it->second);
@@ -499,16 +593,25 @@ class ConcurrentUnorderedMap : public IMap<K, V> {
     }
   }
 
+  size_t num_segments() const { return segments_.num_segments(); }
+
+  size_t NumSegments() const override { return num_segments(); }
+
+  size_t SegmentOf(const K& key) const override { return hash_id(key); }
+
+  // Nodes of std::unordered_map do not move on rehash.
+  bool StableValues() const override { return true; }
+
   bool NeedExplicitLock() override { return false; }
 
   void LockAll() {
-    for (size_t segment_id = 0; segment_id < HASH_SIZE_DEFAULT; segment_id++) {
+    for (size_t segment_id = 0; segment_id < num_segments(); segment_id++) {
       table_[segment_id].mu.lock();
     }
   }
 
   void ReleaseAll() {
-    for (size_t segment_id = 0; segment_id < HASH_SIZE_DEFAULT; segment_id++) {
+    for (size_t segment_id = 0; segment_id < num_segments(); segment_id++) {
       table_[segment_id].mu.unlock();
     }
   }
@@ -530,15 +633,34 @@ class ConcurrentUnorderedMap : public IMap<K, V> {
                           lock_type == LockType::WRITE_LOCK);
   }
 
+  ScopedSpinLock TryGetScopedKeyLock(const K& key, LockType lock_type,
+                                     bool* locked) override {
+    ScopedSpinLock lock;
+    *locked = lock.try_acquire(table_[hash_id(key)].mu,
+                               lock_type == LockType::WRITE_LOCK);
+    return lock;
+  }
+
  private:
-  size_t hash_id(const K& key) { return hash_fn_(key) % HASH_SIZE_DEFAULT; }
+  size_t hash_id(const K& key) const { return segments_(hash_fn_(key)); }
+
+  bool EraseFromSegment(size_t segment_id, const K& key) {
+    if (table_[segment_id].map.erase(key) == 0) {
+      return false;
+    }
+    size_.fetch_sub(1, std::memory_order_relaxed);
+    return true;
+  }
 
   struct concurrent_hash_map {
     hash_segment map;
     mutable spin_rw_mutex mu;
   };
 
-  concurrent_hash_map table_[HASH_SIZE_DEFAULT];
+  SegmentSelector segments_;
+  std::unique_ptr<concurrent_hash_map[]> table_;
+  // Number of keys in all segments, so that size() does not visit them.
+  std::atomic<size_t> size_{0};
   F hash_fn_;
 };
 
@@ -559,8 +681,10 @@ struct dense_hash_sepecial_key<std::basic_string<char>> {
 template <class K, class V, class F = murmurhash_b<K>>
 class ConcurrentDenseHashMap : public IMap<K, V> {
  public:
-  ConcurrentDenseHashMap() {
-    for (size_t i = 0; i < HASH_SIZE_DEFAULT; i++) {
+  explicit ConcurrentDenseHashMap(size_t num_segments = HASH_SIZE_DEFAULT)
+      : segments_(num_segments),
+        table_(new concurrent_dense_hash_map[segments_.num_segments()]) {
+    for (size_t i = 0; i < segments_.num_segments(); i++) {
       table_[i].map.max_load_factor(0.8);
       dense_hash_sepecial_key<K> keys;
       table_[i].map.set_empty_key(keys.empty_key());
@@ -595,6 +719,7 @@ class ConcurrentDenseHashMap : public IMap<K, V> {
     if (it == table_[segment_id].map.end()) {
       V new_val = func(key);
       table_[segment_id].map[key] = std::move(new_val);
+      size_.fetch_add(1, std::memory_order_relaxed);
       V* val = &table_[segment_id].map.find(key)->second;
       return val;
     }
@@ -610,7 +735,8 @@ class ConcurrentDenseHashMap : public IMap<K, V> {
 
     auto it = table_[segment_id].map.find(key);
     if (it == table_[segment_id].map.end()) {
-      table_[segment_id].map[key] = std::move(insert_func(key));
+      table_[segment_id].map[key] = insert_func(key);
+      size_.fetch_add(1, std::memory_order_relaxed);
       return false;
     }
 
@@ -618,6 +744,18 @@ class ConcurrentDenseHashMap : public IMap<K, V> {
     return true;
   }
 
+  void Prefetch(const K& key) override {
+    __builtin_prefetch(&table_[hash_id(key)]);
+  }
+
+  void Reserve(size_t n) override {
+    size_t keys = segments_.KeysPerSegment(n);
+    for (size_t segment_id = 0; segment_id < num_segments(); segment_id++) {
+      tfplus_spin_lock w_lock(table_[segment_id].mu);
+      table_[segment_id].map.resize(keys);
+    }
+  }
+
   bool FindWithFn(const K& key, std::function<void(V* val)> func) override {
     V* val = nullptr;
     size_t segment_id = hash_id(key);
@@ -647,16 +785,15 @@ class ConcurrentDenseHashMap : public IMap<K, V> {
   bool InsertOrAssign(const K& key, V&& val) override {
     size_t segment_id = hash_id(key);
     tfplus_spin_lock w_lock(table_[segment_id].mu);
-    table_[segment_id].map[key] = std::move(val);
+    AssignInSegment(segment_id, key, std::move(val));
     return true;
   }
 
   std::pair<V*, bool> InsertOrAssignUnsafe(const K& key,
                                                    V&& val) override {
     size_t segment_id = hash_id(key);
-    table_[segment_id].map[key] = std::move(val);
-    V* v = FindOrNull(key);
-    return {v, true};
+    bool inserted = AssignInSegment(segment_id, key, std::move(val));
+    return {&table_[segment_id].map.find(key)->second, inserted};
   }
 
   bool UpdateWithFn(const K& key, std::function<void(V* val)> func) override {
@@ -672,27 +809,17 @@ class ConcurrentDenseHashMap : public IMap<K, V> {
     return false;
   }
 
-  size_t size() const override {
-    size_t total_size = 0;
-    for (size_t segment_id = 0; segment_id < HASH_SIZE_DEFAULT; segment_id++) {
-      tfplus_shared_spin_lock r_lock(table_[segment_id].mu);
-      total_size += table_[segment_id].map.size();
-    }
-    return total_size;
-  }
+  size_t size() const override { return size_.load(std::memory_order_relaxed); }
 
   size_t size_unsafe() const override {
-    size_t total_size = 0;
-    for (size_t segment_id = 0; segment_id < HASH_SIZE_DEFAULT; segment_id++) {
-      total_size += table_[segment_id].map.size();
-    }
-    return total_size;
+    return size_.load(std::memory_order_relaxed);
   }
 
   void clear() override {
-    for (size_t segment_id = 0; segment_id < HASH_SIZE_DEFAULT; segment_id++) {
+    for (size_t segment_id = 0; segment_id < num_segments(); segment_id++) {
       auto& mu = table_[segment_id].mu;
       mu.lock();
+      size_.fetch_sub(table_[segment_id].map.size(), std::memory_order_relaxed);
       table_[segment_id].map.clear();
       mu.unlock();
     }
@@ -701,16 +828,15 @@ class ConcurrentDenseHashMap : public IMap<K, V> {
   bool erase(const K& key) override {
     size_t segment_id = hash_id(key);
     tfplus_spin_lock w_lock(table_[segment_id].mu);
-    return table_[segment_id].map.erase(key) != 0;
+    return EraseFromSegment(segment_id, key);
   }
 
   bool erase_unsafe(const K& key) override {
-    size_t segment_id = hash_id(key);
-    return table_[segment_id].map.erase(key) != 0;
+    return EraseFromSegment(hash_id(key), key);
   }
 
   void ForEach(std::function<void(const K& key, const V* val)> func) override {
-    for (size_t segment_id = 0; segment_id < HASH_SIZE_DEFAULT; segment_id++) {
+    for (size_t segment_id = 0; segment_id < num_segments(); segment_id++) {
       auto& seg = table_[segment_id];
       tfplus_spin_lock w_lock(seg.mu);
       for (auto it = seg.map.begin(); it != seg.map.end(); ++it) {
@@ -721,7 +847,7 @@ class ConcurrentDenseHashMap : public IMap<K, V> {
 
   void ForEachUnsafe(
       std::function<void(const K& key, const V* val)> func) override {
-    for (size_t segment_id = 0; segment_id < HASH_SIZE_DEFAULT; segment_id++) {
+    for (size_t segment_id = 0; segment_id < num_segments(); segment_id++) {
       auto& seg = table_[segment_id];
       for (auto it = seg.map.begin(); it != seg.map.end(); ++it) {
         func(it->first, &it->second);
@@ -730,13 +856,13 @@ class ConcurrentDenseHashMap : public IMap<K, V> {
   }
 
   void LockAll() {
-    for (size_t segment_id = 0; segment_id < HASH_SIZE_DEFAULT; segment_id++) {
+    for (size_t segment_id = 0; segment_id < num_segments(); segment_id++) {
       table_[segment_id].mu.lock();
     }
   }
 
   void ReleaseAll() {
-    for (size_t segment_id = 0; segment_id < HASH_SIZE_DEFAULT; segment_id++) {
+    for (size_t segment_id = 0; segment_id < num_segments(); segment_id++) {
       table_[segment_id].mu.unlock();
     }
   }
@@ -758,17 +884,288 @@ class ConcurrentDenseHashMap : public IMap<K, V> {
                           lock_type == LockType::WRITE_LOCK);
   }
 
+  ScopedSpinLock TryGetScopedKeyLock(const K& key, LockType lock_type,
+                                     bool* locked) override {
+    ScopedSpinLock lock;
+    *locked = lock.try_acquire(table_[hash_id(key)].mu,
+                               lock_type == LockType::WRITE_LOCK);
+    return lock;
+  }
+
+  size_t num_segments() const { return segments_.num_segments(); }
+
+  size_t NumSegments() const override { return num_segments(); }
+
+  size_t SegmentOf(const K& key) const override { return hash_id(key); }
+
   bool NeedExplicitLock() override { return false; }
 
  private:
-  size_t hash_id(const K& key) { return hash_fn_(key) % HASH_SIZE_DEFAULT; }
+  size_t hash_id(const K& key) const { return segments_(hash_fn_(key)); }
+
+  // Returns whether key was inserted rather than assigned.
+  bool AssignInSegment(size_t segment_id, const K& key, V&& val) {
+    auto& map = table_[segment_id].map;
+    size_t old_size = map.size();
+    map[key] = std::move(val);
+    bool inserted = map.size() != old_size;
+    if (inserted) {
+      size_.fetch_add(1, std::memory_order_relaxed);
+    }
+    return inserted;
+  }
+
+  bool EraseFromSegment(size_t segment_id, const K& key) {
+    if (table_[segment_id].map.erase(key) == 0) {
+      return false;
+    }
+    size_.fetch_sub(1, std::memory_order_relaxed);
+    return true;
+  }
 
   struct concurrent_dense_hash_map {
     google::dense_hash_map<K, V, murmurhash_a<K>> map;
     mutable spin_rw_mutex mu;
   };
 
-  concurrent_dense_hash_map table_[HASH_SIZE_DEFAULT];
+  SegmentSelector segments_;
+  std::unique_ptr<concurrent_dense_hash_map[]> table_;
+  // Number of keys in all segments, so that size() does not visit them.
+  std::atomic<size_t> size_{0};
+  F hash_fn_;
+};
+
+template <class K, class V, class F = murmurhash_b<K>>
+class ConcurrentFlatSimdMap : public IMap<K, V> {
+ public:
+  /*open addressing table, values are stored inline in the slots*/
+  typedef FlatHashMap<K, V, murmurhash_a<K>> hash_segment;
+
+  explicit ConcurrentFlatSimdMap(size_t num_segments = HASH_SIZE_DEFAULT)
+      : segments_(num_segments),
+        table_(new concurrent_flat_map[segments_.num_segments()]) {}
+
+  V* FindOrNull(const K& key) override {
+    size_t segment_id = hash_id(key);
+    tfplus_shared_spin_lock r_lock(table_[segment_id].mu);
+    auto* kv = table_[segment_id].map.find(key);
+    return kv == nullptr ? nullptr : &kv->second;
+  }
+
+  V* FindOrNullUnsafe(const K& key) override {
+    size_t segment_id = hash_id(key);
+    auto* kv = table_[segment_id].map.find(key);
+    return kv == nullptr ? nullptr : &kv->second;
+  }
+
+  V* FindOrInsertWithFn(const K& key, std::function<V(const K& key)> func) {
+    size_t segment_id = hash_id(key);
+    tfplus_spin_lock w_lock(table_[segment_id].mu);
+    auto res =
+        table_[segment_id].map.find_or_insert(key, [&]() { return func(key); });
+    if (res.second) {
+      size_.fetch_add(1, std::memory_order_relaxed);
+    }
+    return &res.first->second;
+  }
+
+  bool FindOrInsertWithDifferentFn(const K& key,
+                                   std::function<void(V* val)> find_func,
+                                   std::function<V(const K& key)> insert_func) {
+    size_t segment_id = hash_id(key);
+    tfplus_spin_lock w_lock(table_[segment_id].mu);
+    auto res = table_[segment_id].map.find_or_insert(
+        key, [&]() { return insert_func(key); });
+    if (res.second) {
+      size_.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    find_func(&res.first->second);
+    return true;
+  }
+
+  // Also prefetches the control group of key unless the segment is being
+  // written.
+  void Prefetch(const K& key) override {
+    size_t segment_id = hash_id(key);
+    tfplus_shared_spin_lock r_lock(table_[segment_id].mu, true,
+                                   std::try_to_lock);
+    if (r_lock) {
+      table_[segment_id].map.prefetch(key);
+    }
+  }
+
+  void Reserve(size_t n) override {
+    size_t keys = segments_.KeysPerSegment(n);
+    for (size_t segment_id = 0; segment_id < num_segments(); segment_id++) {
+      tfplus_spin_lock w_lock(table_[segment_id].mu);
+      table_[segment_id].map.reserve(keys);
+    }
+  }
+
+  bool FindWithFn(const K& key, std::function<void(V* val)> func) override {
+    size_t segment_id = hash_id(key);
+    tfplus_shared_spin_lock r_lock(table_[segment_id].mu);
+    auto* kv = table_[segment_id].map.find(key);
+    if (kv != nullptr) {
+      func(&kv->second);
+      return true;
+    }
+    return false;
+  }
+
+  bool FindWithFnUnsafe(const K& key,
+                        std::function<void(V* val)> func) override {
+    size_t segment_id = hash_id(key);
+    auto* kv = table_[segment_id].map.find(key);
+    if (kv != nullptr) {
+      func(&kv->second);
+      return true;
+    }
+    return false;
+  }
+
+  bool InsertOrAssign(const K& key, V&& val) override {
+    size_t segment_id = hash_id(key);
+    tfplus_spin_lock w_lock(table_[segment_id].mu);
+    if (table_[segment_id].map.insert_or_assign(key, std::move(val)).second) {
+      size_.fetch_add(1, std::memory_order_relaxed);
+    }
+    return true;
+  }
+
+  std::pair<V*, bool> InsertOrAssignUnsafe(const K& key, V&& val) override {
+    size_t segment_id = hash_id(key);
+    auto res = table_[segment_id].map.insert_or_assign(key, std::move(val));
+    if (res.second) {
+      size_.fetch_add(1, std::memory_order_relaxed);
+    }
+    return {&res.first->second, res.second};
+  }
+
+  bool UpdateWithFn(const K& key, std::function<void(V* val)> func) override {
+    size_t segment_id = hash_id(key);
+    tfplus_spin_lock w_lock(table_[segment_id].mu);
+    auto* kv = table_[segment_id].map.find(key);
+    if (kv != nullptr) {
+      func(&kv->second);
+      return true;
+    }
+    return false;
+  }
+
+  size_t size() const override { return size_.load(std::memory_order_relaxed); }
+
+  size_t size_unsafe() const override {
+    return size_.load(std::memory_order_relaxed);
+  }
+
+  void clear() override {
+    for (size_t segment_id = 0; segment_id < num_segments(); segment_id++) {
+      auto& mu = table_[segment_id].mu;
+      mu.lock();
+      size_.fetch_sub(table_[segment_id].map.size(), std::memory_order_relaxed);
+      table_[segment_id].map.clear();
+      mu.unlock();
+    }
+  }
+
+  bool erase(const K& key) override {
+    size_t segment_id = hash_id(key);
+    tfplus_spin_lock w_lock(table_[segment_id].mu);
+    return EraseFromSegment(segment_id, key);
+  }
+
+  bool erase_unsafe(const K& key) override {
+    return EraseFromSegment(hash_id(key), key);
+  }
+
+  void ForEach(std::function<void(const K& key, const V* val)> func) override {
+    for (size_t segment_id = 0; segment_id < num_segments(); segment_id++) {
+      auto& seg = table_[segment_id];
+      tfplus_spin_lock w_lock(seg.mu);
+      seg.map.for_each([&](const std::pair<K, V>& kv) {
+        func(kv.first, &kv.second);
+      });
+    }
+  }
+
+  void ForEachUnsafe(
+      std::function<void(const K& key, const V* val)> func) override {
+    for (size_t segment_id = 0; segment_id < num_segments(); segment_id++) {
+      table_[segment_id].map.for_each([&](const std::pair<K, V>& kv) {
+        func(kv.first, &kv.second);
+      });
+    }
+  }
+
+  size_t num_segments() const { return segments_.num_segments(); }
+
+  size_t NumSegments() const override { return num_segments(); }
+
+  size_t SegmentOf(const K& key) const override { return hash_id(key); }
+
+  bool NeedExplicitLock() override { return false; }
+
+  void LockAll() {
+    for (size_t segment_id = 0; segment_id < num_segments(); segment_id++) {
+      table_[segment_id].mu.lock();
+    }
+  }
+
+  void ReleaseAll() {
+    for (size_t segment_id = 0; segment_id < num_segments(); segment_id++) {
+      table_[segment_id].mu.unlock();
+    }
+  }
+
+  spin_rw_mutex* LockKey(const K& key, LockType lock_type) override {
+    size_t segment_id = hash_id(key);
+    auto& mu = table_[segment_id].mu;
+    if (lock_type == LockType::READ_LOCK) {
+      mu.lock_read();
+    } else {
+      mu.lock();
+    }
+    return &mu;
+  }
+
+  ScopedSpinLock GetScopedKeyLock(const K& key, LockType lock_type) override {
+    size_t segment_id = hash_id(key);
+    return ScopedSpinLock(table_[segment_id].mu,
+                          lock_type == LockType::WRITE_LOCK);
+  }
+
+  ScopedSpinLock TryGetScopedKeyLock(const K& key, LockType lock_type,
+                                     bool* locked) override {
+    ScopedSpinLock lock;
+    *locked = lock.try_acquire(table_[hash_id(key)].mu,
+                               lock_type == LockType::WRITE_LOCK);
+    return lock;
+  }
+
+ private:
+  size_t hash_id(const K& key) const { return segments_(hash_fn_(key)); }
+
+  bool EraseFromSegment(size_t segment_id, const K& key) {
+    if (!table_[segment_id].map.erase(key)) {
+      return false;
+    }
+    size_.fetch_sub(1, std::memory_order_relaxed);
+    return true;
+  }
+
+  // Segments are cache line aligned so that neighbouring spin locks do not
+  // share a line.
+  struct alignas(64) concurrent_flat_map {
+    hash_segment map;
+    mutable spin_rw_mutex mu;
+  };
+
+  SegmentSelector segments_;
+  std::unique_ptr<concurrent_flat_map[]> table_;
+  // Number of keys in all segments, so that size() does not visit them.
+  std::atomic<size_t> size_{0};
   F hash_fn_;
 };
 
@@ -780,7 +1177,7 @@ class MultiLevelHashMap : public IMap<K, V> {
     tables_.clear();
     table_names_.clear();
   }
-  MultiLevelHashMap() {
+  explicit MultiLevelHashMap(size_t num_segments = HASH_SIZE_DEFAULT) {
     MapType map_type = MapType(GetEnvVar<int>(
         "INNER_MULTI_LEVEL_MAP", MapType::CONCURRENT_UNORDERED_MAP));
     switch (map_type) {
@@ -789,17 +1186,17 @@ class MultiLevelHashMap : public IMap<K, V> {
       case CUCKOO_HASH:
         hashtable_creator_ = []() { return new CuckooHashMap<K, V>(); };
       case CONCURRENT_UNORDERED_MAP:
-        hashtable_creator_ = []() {
+        hashtable_creator_ = [num_segments]() {
           VLOG(0) << "new ConcurrentUnorderedMap";
-          return new ConcurrentUnorderedMap<K, V>();
+          return new ConcurrentUnorderedMap<K, V>(num_segments);
         };
       case CONCURRENT_DENSE_HASH_MAP:
-        hashtable_creator_ = []() {
-          return new ConcurrentDenseHashMap<K, V>();
+        hashtable_creator_ = [num_segments]() {
+          return new ConcurrentDenseHashMap<K, V>(num_segments);
         };
       default:
-        hashtable_creator_ = []() {
-          return new ConcurrentUnorderedMap<K, V>();
+        hashtable_creator_ = [num_segments]() {
+          return new ConcurrentUnorderedMap<K, V>(num_segments);
         };
     }
     map_type_ = map_type;
@@ -908,6 +1305,8 @@ class MultiLevelHashMap : public IMap<K, V> {
         return false;
       case CONCURRENT_DENSE_HASH_MAP:
         return false;
+      case FLAT_SIMD_MAP:
+        return false;
       default:
         return true;
     }
@@ -1008,20 +1407,24 @@ class MapFactory {
  public:
   MapFactory() = delete;
   ~MapFactory() {}
-  static IMap<K, V>* CreateMap(const MapType& map_type) {
+  // num_segments only applies to the segmented concurrent maps.
+  static IMap<K, V>* CreateMap(const MapType& map_type,
+                               size_t num_segments = HASH_SIZE_DEFAULT) {
     switch (map_type) {
       case UNORDERED_MAP:
         return new UnorderedMap<K, V>();
       case CUCKOO_HASH:
         return new CuckooHashMap<K, V>();
       case CONCURRENT_UNORDERED_MAP:
-        return new ConcurrentUnorderedMap<K, V>();
+        return new ConcurrentUnorderedMap<K, V>(num_segments);
       case CONCURRENT_DENSE_HASH_MAP:
-        return new ConcurrentDenseHashMap<K, V>();
+        return new ConcurrentDenseHashMap<K, V>(num_segments);
       case MULTI_LEVEL_MAP:
-        return new MultiLevelHashMap<K, V>();
+        return new MultiLevelHashMap<K, V>(num_segments);
+      case FLAT_SIMD_MAP:
+        return new ConcurrentFlatSimdMap<K, V>(num_segments);
       default:
-        return new ConcurrentUnorderedMap<K, V>();
+        return new ConcurrentUnorderedMap<K, V>(num_segments);
     }
   }
 };
@@ -0,0 +1,542 @@
+// Copyright 2023 The TFPlus Authors. All rights reserved.
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TFPLUS_KV_VARIABLE_KERNELS_HOT_KEY_MAP_H_
+#define TFPLUS_KV_VARIABLE_KERNELS_HOT_KEY_MAP_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <thread>  // NOLINT(build/c++11)
+#include <utility>
+#include <vector>
+
+#include "tfplus/kv_variable/kernels/hashmap.h"
+#include "tfplus/kv_variable/kernels/mutex.h"
+
+namespace tfplus {
+
+// Map in front of a map with stable values, see IMap::StableValues(), that
+// gives a few pinned keys, the heavy hitters, a lock of their own instead of
+// the lock of their segment.
+//
+// Pin() takes a new set of keys, their values are found once and the keys
+// live in a small array of cache line sized slots. A pinned key is locked
+// through its slot by GetScopedKeyLock() and the other methods, the Unsafe
+// methods use the value of the slot, never the segment the key is in. The
+// writers of a slot make its sequence odd while they hold it, so that
+// ReadLockFree() can read a pinned value without any lock and retry when a
+// writer got in the way.
+//
+// A slot is retired, and its key goes back to the segment lock, when the key
+// is erased or the next Pin() replaces the set. Pin() holds every segment
+// lock and every slot of the old set, so a key is always guarded by exactly
+// one lock: GetScopedKeyLock() checks the set again once it holds a lock.
+// The lock order is segment then slot, holders of a slot never take a
+// segment lock. Lookups outside of any lock count themselves in a
+// ReadSection, a replaced set is freed and an unpinned key is erased once
+// the readers that may still see them are gone.
+template <class K, class V>
+class HotKeyMap : public IMap<K, V> {
+ public:
+  struct alignas(64) Slot {
+    spin_rw_mutex mu;
+    std::atomic<uint32_t> seq{0};
+    // nullptr once the slot is retired.
+    std::atomic<V*> value{nullptr};
+    K key;
+  };
+
+  explicit HotKeyMap(IMap<K, V>* map)
+      : map_(map), stripes_(new ReaderStripe[kReaderStripes]) {}
+
+  ~HotKeyMap() override { delete map_; }
+
+  // Replaces the pinned keys by keys, those missing from the map are
+  // skipped. Returns the number of keys pinned.
+  size_t Pin(const std::vector<K>& keys) {
+    tfplus_mutex_lock l(pin_mu_);
+    std::unique_ptr<HotSet> old;
+    size_t num_pinned = 0;
+    {
+      typename IMap<K, V>::ScopedLock lock_all(map_);
+      std::vector<std::pair<K, V*>> entries;
+      entries.reserve(keys.size());
+      for (const K& key : keys) {
+        V* value = map_->FindOrNullUnsafe(key);
+        if (value != nullptr) {
+          entries.emplace_back(key, value);
+        }
+      }
+      if (owner_ != nullptr) {
+        for (size_t i = 0; i < owner_->size(); ++i) {
+          RetireSlot(owner_->slot(i));
+        }
+      }
+      old = std::move(owner_);
+      if (!entries.empty()) {
+        owner_.reset(new HotSet(entries));
+      }
+      hot_.store(owner_.get(), std::memory_order_seq_cst);
+      num_pinned = entries.size();
+    }
+    WaitForReaders();
+    return num_pinned;
+  }
+
+  // Returns key to its segment lock until the next Pin(). Lock free readers
+  // are done with its value on return.
+  void Unpin(const K& key) {
+    tfplus_mutex_lock l(pin_mu_);
+    {
+      ReadSection section(this);
+      Slot* slot = FindSlot(key);
+      if (slot == nullptr) {
+        return;
+      }
+      RetireSlot(slot);
+    }
+    WaitForReaders();
+  }
+
+  bool IsPinned(const K& key) const {
+    ReadSection section(this);
+    return FindSlot(key) != nullptr;
+  }
+
+  size_t NumPinned() const {
+    ReadSection section(this);
+    HotSet* hot = hot_.load(std::memory_order_seq_cst);
+    return hot == nullptr ? 0 : hot->size();
+  }
+
+  // Calls fn(value) for a pinned key without taking any lock and returns
+  // true, or returns false for keys that are not pinned. fn may see a value
+  // that a writer is changing, or one that was just erased, it is called
+  // again until it ran without a writer in between, so it must only read the
+  // value and write its own output. Memory the value points to may be freed
+  // by a writer meanwhile, it must stay readable, rows of a SlabAllocator
+  // do.
+  template <typename Fn>
+  bool ReadLockFree(const K& key, Fn&& fn) const {
+    ReadSection section(this);
+    while (true) {
+      HotSet* hot = hot_.load(std::memory_order_seq_cst);
+      Slot* slot = hot == nullptr ? nullptr : hot->Find(key);
+      if (slot == nullptr) {
+        return false;
+      }
+      uint32_t seq = slot->seq.load(std::memory_order_acquire);
+      if (seq & 1) {
+        section.stripe()->retries.fetch_add(1, std::memory_order_relaxed);
+        std::this_thread::yield();
+        continue;
+      }
+      V* value = slot->value.load(std::memory_order_acquire);
+      if (value == nullptr) {
+        return false;
+      }
+      fn(value);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (slot->seq.load(std::memory_order_relaxed) == seq) {
+        section.stripe()->reads.fetch_add(1, std::memory_order_relaxed);
+        return true;
+      }
+      section.stripe()->retries.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  // Reads served by ReadLockFree() and the reads it had to retry because a
+  // writer held the slot.
+  uint64_t lock_free_reads() const {
+    uint64_t reads = 0;
+    for (int i = 0; i < kReaderStripes; ++i) {
+      reads += stripes_[i].reads.load(std::memory_order_relaxed);
+    }
+    return reads;
+  }
+  uint64_t read_retries() const {
+    uint64_t retries = 0;
+    for (int i = 0; i < kReaderStripes; ++i) {
+      retries += stripes_[i].retries.load(std::memory_order_relaxed);
+    }
+    return retries;
+  }
+
+  V* FindOrNull(const K& key) override {
+    {
+      ReadSection section(this);
+      Slot* slot = FindSlot(key);
+      if (slot != nullptr) {
+        return slot->value.load(std::memory_order_acquire);
+      }
+    }
+    return map_->FindOrNull(key);
+  }
+
+  V* FindOrNullUnsafe(const K& key) override {
+    Slot* slot = FindSlot(key);
+    return slot != nullptr ? slot->value.load(std::memory_order_acquire)
+                           : map_->FindOrNullUnsafe(key);
+  }
+
+  bool FindWithFn(const K& key, std::function<void(V* val)> func) override {
+    return WithPinned(key, LockType::READ_LOCK, func) ||
+           map_->FindWithFn(key, func);
+  }
+
+  bool FindWithFnUnsafe(const K& key,
+                        std::function<void(V* val)> func) override {
+    V* value = PinnedValue(key);
+    if (value != nullptr) {
+      func(value);
+      return true;
+    }
+    return map_->FindWithFnUnsafe(key, func);
+  }
+
+  V* FindOrInsertWithFn(const K& key,
+                        std::function<V(const K& key)> func) override {
+    V* value = nullptr;
+    {
+      ReadSection section(this);
+      value = PinnedValue(key);
+    }
+    return value != nullptr ? value : map_->FindOrInsertWithFn(key, func);
+  }
+
+  bool FindOrInsertWithDifferentFn(
+      const K& key, std::function<void(V* val)> find_func,
+      std::function<V(const K& key)> insert_func) override {
+    return WithPinned(key, LockType::WRITE_LOCK, find_func) ||
+           map_->FindOrInsertWithDifferentFn(key, find_func, insert_func);
+  }
+
+  void Prefetch(const K& key) override { map_->Prefetch(key); }
+
+  void Reserve(size_t n) override { map_->Reserve(n); }
+
+  size_t NumSegments() const override { return map_->NumSegments(); }
+
+  size_t SegmentOf(const K& key) const override {
+    return map_->SegmentOf(key);
+  }
+
+  bool StableValues() const override { return true; }
+
+  bool InsertOrAssign(const K& key, V&& val) override {
+    auto assign = [&val](V* value) { *value = std::move(val); };
+    return WithPinned(key, LockType::WRITE_LOCK, assign) ||
+           map_->InsertOrAssign(key, std::move(val));
+  }
+
+  std::pair<V*, bool> InsertOrAssignUnsafe(const K& key, V&& val) override {
+    V* value = PinnedValue(key);
+    if (value != nullptr) {
+      *value = std::move(val);
+      return {value, false};
+    }
+    return map_->InsertOrAssignUnsafe(key, std::move(val));
+  }
+
+  bool UpdateWithFn(const K& key, std::function<void(V* val)> func) override {
+    return WithPinned(key, LockType::WRITE_LOCK, func) ||
+           map_->UpdateWithFn(key, func);
+  }
+
+  size_t size() const override { return map_->size(); }
+
+  size_t size_unsafe() const override { return map_->size_unsafe(); }
+
+  void clear() override {
+    Pin({});
+    map_->clear();
+  }
+
+  bool erase(const K& key) override {
+    while (true) {
+      Unpin(key);
+      auto lock = map_->GetScopedKeyLock(key, LockType::WRITE_LOCK);
+      // Pin() may have pinned key again, it can not while the segment lock
+      // is held.
+      if (!IsPinned(key)) {
+        return map_->erase_unsafe(key);
+      }
+    }
+  }
+
+  // The key must not be pinned, see Unpin().
+  bool erase_unsafe(const K& key) override { return map_->erase_unsafe(key); }
+
+  void ForEach(std::function<void(const K& key, const V* val)> func) override {
+    map_->ForEach(WithPinnedLock(func));
+  }
+
+  void ForEachUnsafe(
+      std::function<void(const K& key, const V* val)> func) override {
+    map_->ForEachUnsafe(func);
+  }
+
+  bool NeedExplicitLock() override { return map_->NeedExplicitLock(); }
+
+  // Every segment, then every slot, so that holders of all locks exclude
+  // the writers of pinned keys too.
+  void LockAll() override {
+    map_->LockAll();
+    locked_ = owner_.get();
+    for (size_t i = 0; locked_ != nullptr && i < locked_->size(); ++i) {
+      locked_->slot(i)->mu.lock();
+      locked_->slot(i)->seq.fetch_add(1, std::memory_order_acq_rel);
+    }
+  }
+
+  void ReleaseAll() override {
+    for (size_t i = 0; locked_ != nullptr && i < locked_->size(); ++i) {
+      locked_->slot(i)->seq.fetch_add(1, std::memory_order_acq_rel);
+      locked_->slot(i)->mu.unlock();
+    }
+    locked_ = nullptr;
+    map_->ReleaseAll();
+  }
+
+  // Lock free readers do not see writers locked this way, use
+  // GetScopedKeyLock() for pinned keys.
+  spin_rw_mutex* LockKey(const K& key, LockType lock_type) override {
+    return map_->LockKey(key, lock_type);
+  }
+
+  ScopedSpinLock GetScopedKeyLock(const K& key, LockType lock_type) override {
+    const bool write = lock_type == LockType::WRITE_LOCK;
+    ReadSection section(this);
+    while (true) {
+      HotSet* hot = hot_.load(std::memory_order_seq_cst);
+      Slot* slot = hot == nullptr ? nullptr : hot->Find(key);
+      if (slot != nullptr) {
+        ScopedSpinLock lock(slot->mu, write, &slot->seq);
+        if (slot->value.load(std::memory_order_acquire) != nullptr) {
+          return lock;
+        }
+      }
+      ScopedSpinLock lock = map_->GetScopedKeyLock(key, lock_type);
+      // Pin() holds every segment lock, the set can not change from here on,
+      // and retired slots stay retired.
+      if (hot_.load(std::memory_order_seq_cst) == hot &&
+          (slot == nullptr ||
+           slot->value.load(std::memory_order_acquire) == nullptr)) {
+        return lock;
+      }
+    }
+  }
+
+  // Pinned keys are hot, they are skipped rather than waited for.
+  ScopedSpinLock TryGetScopedKeyLock(const K& key, LockType lock_type,
+                                     bool* locked) override {
+    ReadSection section(this);
+    HotSet* hot = hot_.load(std::memory_order_seq_cst);
+    Slot* slot = hot == nullptr ? nullptr : hot->Find(key);
+    if (slot != nullptr &&
+        slot->value.load(std::memory_order_acquire) != nullptr) {
+      *locked = false;
+      return ScopedSpinLock();
+    }
+    ScopedSpinLock lock = map_->TryGetScopedKeyLock(key, lock_type, locked);
+    if (*locked && hot_.load(std::memory_order_seq_cst) != hot) {
+      lock.release();
+      *locked = false;
+    }
+    return lock;
+  }
+
+ private:
+  static constexpr int kReaderStripes = 32;
+
+  // Counters of the threads that share a stripe. readers[e] counts the
+  // ReadSections that started in epoch e.
+  struct alignas(64) ReaderStripe {
+    std::atomic<int64_t> readers[2] = {{0}, {0}};
+    std::atomic<uint64_t> reads{0};
+    std::atomic<uint64_t> retries{0};
+  };
+
+  // Lookup of the set outside of any lock. Readers only touch the counter of
+  // their thread, WaitForReaders() sums them.
+  class ReadSection {
+   public:
+    explicit ReadSection(const HotKeyMap* map)
+        : stripe_(&map->stripes_[ThreadStripe()]),
+          epoch_(map->epoch_.load(std::memory_order_seq_cst)) {
+      stripe_->readers[epoch_].fetch_add(1, std::memory_order_seq_cst);
+    }
+
+    ~ReadSection() {
+      stripe_->readers[epoch_].fetch_sub(1, std::memory_order_release);
+    }
+
+    ReaderStripe* stripe() const { return stripe_; }
+
+   private:
+    static int ThreadStripe() {
+      static std::atomic<int> next_thread{0};
+      thread_local int index =
+          next_thread.fetch_add(1, std::memory_order_relaxed) % kReaderStripes;
+      return index;
+    }
+
+    ReaderStripe* stripe_;
+    int epoch_;
+  };
+
+  // Immutable set of pinned keys indexed like FrozenTable, the slots change.
+  class HotSet {
+   public:
+    explicit HotSet(const std::vector<std::pair<K, V*>>& entries)
+        : size_(entries.size()), slots_(new Slot[entries.size()]) {
+      size_t capacity = 16;
+      shift_ = 60;
+      while (capacity < 2 * size_) {
+        capacity <<= 1;
+        --shift_;
+      }
+      mask_ = capacity - 1;
+      index_.assign(capacity, -1);
+      for (size_t i = 0; i < size_; ++i) {
+        slots_[i].key = entries[i].first;
+        slots_[i].value.store(entries[i].second, std::memory_order_relaxed);
+        size_t pos = Home(entries[i].first);
+        while (index_[pos] >= 0) {
+          pos = (pos + 1) & mask_;
+        }
+        index_[pos] = static_cast<int32_t>(i);
+      }
+    }
+
+    size_t size() const { return size_; }
+
+    Slot* slot(size_t i) const { return &slots_[i]; }
+
+    Slot* Find(const K& key) const {
+      for (size_t pos = Home(key);; pos = (pos + 1) & mask_) {
+        const int32_t i = index_[pos];
+        if (i < 0) {
+          return nullptr;
+        }
+        if (slots_[i].key == key) {
+          return &slots_[i];
+        }
+      }
+    }
+
+    bool Contains(const K& key) const { return Find(key) != nullptr; }
+
+   private:
+    size_t Home(const K& key) const {
+      return ((static_cast<uint64_t>(key) * 0x9e3779b97f4a7c15ULL) >>
+              shift_) &
+             mask_;
+    }
+
+    const size_t size_;
+    std::unique_ptr<Slot[]> slots_;
+    std::vector<int32_t> index_;
+    size_t mask_;
+    int shift_;
+  };
+
+  // Waits until the ReadSections that may have seen what the caller just
+  // replaced or retired are gone, new ones see the change. Requires
+  // pin_mu_.
+  void WaitForReaders() {
+    const int epoch = epoch_.load(std::memory_order_relaxed);
+    epoch_.store(1 - epoch, std::memory_order_seq_cst);
+    for (int i = 0; i < kReaderStripes; ++i) {
+      while (stripes_[i].readers[epoch].load(std::memory_order_seq_cst) > 0) {
+        std::this_thread::yield();
+      }
+    }
+  }
+
+  // Live slot of key, or nullptr. Requires a ReadSection or a key lock.
+  Slot* FindSlot(const K& key) const {
+    HotSet* hot = hot_.load(std::memory_order_seq_cst);
+    if (hot == nullptr) {
+      return nullptr;
+    }
+    Slot* slot = hot->Find(key);
+    return slot != nullptr &&
+                   slot->value.load(std::memory_order_acquire) != nullptr
+               ? slot
+               : nullptr;
+  }
+
+  V* PinnedValue(const K& key) const {
+    Slot* slot = FindSlot(key);
+    return slot == nullptr ? nullptr
+                           : slot->value.load(std::memory_order_acquire);
+  }
+
+  // Runs func on the value of a pinned key under its slot lock and returns
+  // true, false if key is not pinned.
+  template <typename Fn>
+  bool WithPinned(const K& key, LockType lock_type, Fn&& func) {
+    if (!IsPinned(key)) {
+      return false;
+    }
+    auto lock = GetScopedKeyLock(key, lock_type);
+    V* value = PinnedValue(key);
+    if (value == nullptr) {
+      // Unpinned meanwhile, lock holds the segment.
+      return false;
+    }
+    func(value);
+    return true;
+  }
+
+  // func for the segment walk of ForEach(), pinned keys are visited under
+  // their slot lock too, callers may change the values.
+  std::function<void(const K&, const V*)> WithPinnedLock(
+      const std::function<void(const K&, const V*)>& func) {
+    if (hot_.load(std::memory_order_seq_cst) == nullptr) {
+      return func;
+    }
+    return [this, &func](const K& key, const V* value) {
+      Slot* slot = FindSlot(key);
+      if (slot == nullptr) {
+        func(key, value);
+        return;
+      }
+      ScopedSpinLock lock(slot->mu, true, &slot->seq);
+      func(key, value);
+    };
+  }
+
+  static void RetireSlot(Slot* slot) {
+    ScopedSpinLock lock(slot->mu, true, &slot->seq);
+    slot->value.store(nullptr, std::memory_order_release);
+  }
+
+  IMap<K, V>* map_;
+  // The set of owner_, replaced under every segment lock.
+  std::atomic<HotSet*> hot_{nullptr};
+  std::unique_ptr<HotSet> owner_;
+  // Set whose slots LockAll() holds.
+  HotSet* locked_ = nullptr;
+  // Serializes Pin() and Unpin(), which flip epoch_.
+  tf_mutex pin_mu_;
+  std::atomic<int> epoch_{0};
+  std::unique_ptr<ReaderStripe[]> stripes_;
+};
+
+}  // namespace tfplus
+#endif  // TFPLUS_KV_VARIABLE_KERNELS_HOT_KEY_MAP_H_
@@ -62,8 +62,7 @@ class EVContext {
   ~EVContext() {
     meta_ = nullptr;
     if (CASBufferOwner(true, false) && val_) {
-      ::tensorflow::cpu_allocator()->DeallocateRaw(
-          reinterpret_cast<void*>(val_));
+      DeallocateEmbedding(val_);
       val_ = nullptr;
     }
   }
@@ -78,8 +77,7 @@ class EVContext {
 
   void InitValue(const V* new_val, bool buffer_owner) {
     if (CASBufferOwner(true, false) && val_) {
-      ::tensorflow::cpu_allocator()->DeallocateRaw(
-          reinterpret_cast<void*>(val_));
+      DeallocateEmbedding(val_);
       val_ = nullptr;
     }
     val_ = const_cast<V*>(new_val);
@@ -98,9 +96,9 @@ class EVContext {
       } else {
         if (!val_) {
           // false(nullptr), false -> true
-          val_ =
-              reinterpret_cast<V*>(::tensorflow::cpu_allocator()->AllocateRaw(
-                  ::tensorflow::Allocator::kAllocatorAlignment, value_bytes));
+          val_ = row_allocator_ != nullptr
+                     ? static_cast<V*>(row_allocator_->Allocate())
+                     : static_cast<V*>(AllocateRaw(value_bytes));
           buf_owner_ = true;
         }
         // false, false -> false / true
@@ -110,8 +108,7 @@ class EVContext {
       if (input_buf_owner) {
         // true, true -> true
         if (val_) {
-          ::tensorflow::cpu_allocator()->DeallocateRaw(
-              reinterpret_cast<void*>(val_));
+          DeallocateEmbedding(val_);
         }
         val_ = const_cast<V*>(new_val);
       } else {
@@ -123,13 +120,15 @@ class EVContext {
 
   EmbeddingValue<V>* Meta() const { return meta_; }
 
-  void OutputEmbeddingData(MatrixChip out, int64_t num_elements) const {
+  void OutputEmbeddingData(MatrixChip out, int64_t num_elements,
+                           int64_t offset = 0) const {
     if (val_) {
-      typename ::tensorflow::TTypes<V>::ConstTensor src(val_, num_elements);
+      typename ::tensorflow::TTypes<V>::ConstTensor src(val_ + offset,
+                                                        num_elements);
       out = src;
     } else if (meta_ && meta_->Value()) {
-      typename ::tensorflow::TTypes<V>::ConstTensor src(meta_->Value(),
-                                                        num_elements);
+      typename ::tensorflow::TTypes<V>::ConstTensor src(
+          meta_->Value() + offset, num_elements);
       out = src;
     }
   }
@@ -142,10 +141,12 @@ class EVContext {
 
   void SetBufOwner(bool val) { buf_owner_ = val; }
 
+  // Allocator used when UpdateValue needs a buffer of its own.
+  void SetRowAllocator(SlabAllocator* allocator) { row_allocator_ = allocator; }
+
   void DeleteValue() {
     if (CASBufferOwner(true, false) && val_) {
-      ::tensorflow::cpu_allocator()->DeallocateRaw(
-          reinterpret_cast<void*>(val_));
+      DeallocateEmbedding(val_);
       val_ = nullptr;
     } else {
       meta_->DeleteValue();
@@ -171,6 +172,7 @@ class EVContext {
   V* val_{nullptr};
   EmbeddingValue<V>* meta_;
   ::tensorflow::Status* status_{nullptr};
+  SlabAllocator* row_allocator_{nullptr};
 };
 
 }  // namespace tfplus
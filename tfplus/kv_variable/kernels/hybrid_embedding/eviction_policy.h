@@ -0,0 +1,68 @@
+// Copyright 2023 The TFPlus Authors. All rights reserved.
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TFPLUS_KV_VARIABLE_KERNELS_HYBRID_EMBEDDING_EVICTION_POLICY_H_
+#define TFPLUS_KV_VARIABLE_KERNELS_HYBRID_EMBEDDING_EVICTION_POLICY_H_
+
+#include <cstdint>
+#include <string>
+
+namespace tfplus {
+
+// Orders rows for eviction and demotion, rows with lower scores go first.
+// Policies only look at the frequency word of EmbeddingValue, its low 16
+// bits count the updates of the row and its high 16 bits hold the day of
+// the last update.
+class EvictionPolicy {
+ public:
+  virtual ~EvictionPolicy() = default;
+
+  virtual uint32_t Score(uint32_t freq_val) const = 0;
+
+  virtual const char* Name() const = 0;
+
+  // Returns the policy called name, "lru" or "lfu", or nullptr if there is
+  // no such policy.
+  static EvictionPolicy* Create(const std::string& name);
+};
+
+// Least recently updated rows first, ties broken by frequency.
+class LruEvictionPolicy : public EvictionPolicy {
+ public:
+  uint32_t Score(uint32_t freq_val) const override { return freq_val; }
+
+  const char* Name() const override { return "lru"; }
+};
+
+// Least frequently updated rows first, ties broken by the last update day.
+class LfuEvictionPolicy : public EvictionPolicy {
+ public:
+  uint32_t Score(uint32_t freq_val) const override {
+    return (freq_val << 16) | (freq_val >> 16);
+  }
+
+  const char* Name() const override { return "lfu"; }
+};
+
+inline EvictionPolicy* EvictionPolicy::Create(const std::string& name) {
+  if (name == "lru") {
+    return new LruEvictionPolicy();
+  }
+  if (name == "lfu") {
+    return new LfuEvictionPolicy();
+  }
+  return nullptr;
+}
+
+}  // namespace tfplus
+#endif  // TFPLUS_KV_VARIABLE_KERNELS_HYBRID_EMBEDDING_EVICTION_POLICY_H_
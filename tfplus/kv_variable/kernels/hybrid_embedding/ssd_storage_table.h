@@ -0,0 +1,389 @@
+// Copyright 2023 The TFPlus Authors. All rights reserved.
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TFPLUS_KV_VARIABLE_KERNELS_HYBRID_EMBEDDING_SSD_STORAGE_TABLE_H_
+#define TFPLUS_KV_VARIABLE_KERNELS_HYBRID_EMBEDDING_SSD_STORAGE_TABLE_H_
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "tensorflow/core/lib/io/path.h"
+#include "tensorflow/core/platform/env.h"
+#include "tfplus/kv_variable/kernels/hybrid_embedding/storage_table.h"
+#include "tfplus/kv_variable/kernels/mutex.h"
+
+namespace tfplus {
+
+// Rows read by a single pread when BatchGet coalesces adjacent slots.
+constexpr int64_t SSD_MAX_COALESCED_ROWS = 256;
+// Retired slots a writer lets pile up while reads keep io_mu_ busy, past
+// that it waits for the reads in flight and recycles them.
+constexpr size_t SSD_MAX_RETIRED_SLOTS = 4096;
+
+// Storage table keeping rows in a single file under storage_path. The file is
+// split into fixed size slots of one row each, a key owns at most one slot.
+//
+// Put always writes to a fresh slot and then publishes it, so a reader never
+// sees a half written row. Replaced and evicted slots are retired first and
+// only recycled once no read is in flight, readers hold io_mu_ shared from
+// the index lookup to the end of the read.
+//
+// The file is a cache of the rows that do not fit in memory, checkpoints are
+// still written by the export ops. It is removed with the table.
+template <typename K, typename V>
+class SsdStorageTable : public StorageTableInterface<K, V> {
+ public:
+  SsdStorageTable(int64_t storage_size, size_t row_dim,
+                  const std::string& storage_path,
+                  const std::string& table_name)
+      : row_dim_(row_dim),
+        buffer_size_(row_dim * sizeof(V)),
+        table_name_(table_name) {
+    storage_capacity_ = storage_size < 0 ? 0 : storage_size;
+    auto_size_ = storage_size < 0;
+    std::string file_name = table_name;
+    std::replace(file_name.begin(), file_name.end(), '/', '_');
+    file_path_ = ::tensorflow::io::JoinPath(
+        storage_path, file_name + "-" + std::to_string(::getpid()) + "-" +
+                          std::to_string(reinterpret_cast<uintptr_t>(this)) +
+                          ".ssd");
+    Status s = ::tensorflow::Env::Default()->RecursivelyCreateDir(storage_path);
+    if (!s.ok()) {
+      LOG(ERROR) << "Failed to create ssd storage dir " << storage_path << ": "
+                 << s;
+    }
+    fd_ = ::open(file_path_.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd_ < 0) {
+      LOG(ERROR) << "Failed to open ssd storage file " << file_path_ << ": "
+                 << std::strerror(errno);
+    }
+  }
+
+  ~SsdStorageTable() {
+    if (fd_ >= 0) {
+      ::close(fd_);
+      ::unlink(file_path_.c_str());
+    }
+  }
+
+  StorageType GetStorageType() override { return StorageType::SSD_STORAGE; }
+
+  bool StoageReady() override { return fd_ >= 0; }
+
+  // Reads the row of key into context, a buffer owned by the context is
+  // allocated if it has none. Rows missing from the file read as zeros.
+  void Get(const K& key, EVContext<V>* context) override {
+    if (context->Value() == nullptr) {
+      context->InitValue(static_cast<V*>(AllocateRaw(buffer_size_)), true);
+    }
+    if (record_request_) {
+      request_count_++;
+    }
+    tfplus_shared_lock io_lock(io_mu_);
+    Location loc;
+    if (!Lookup(key, &loc) || !ReadRows(loc.slot, 1, context->Value())) {
+      std::fill_n(context->Value(), row_dim_, V(0));
+    }
+  }
+
+  void Put(const K& key, EVContext<V>* context,
+           bool is_insert = false) override {
+    if (context->Value() == nullptr) {
+      return;
+    }
+    Write(key, context->Value());
+  }
+
+  // Writes row as the value of key and returns the sequence number of the
+  // write, which EvictIfSequence() uses to detect a later update.
+  uint64_t Write(const K& key, const V* row) {
+    int64_t slot = AllocateSlot();
+    WriteRow(slot, row);
+    Location old{-1, 0};
+    bool replaced = false;
+    uint64_t seq = next_seq_.fetch_add(1, std::memory_order_relaxed);
+    {
+      auto& shard = ShardOf(key);
+      tfplus_spin_lock l(shard.mu);
+      auto it = shard.index.find(key);
+      if (it != shard.index.end()) {
+        old = it->second;
+        replaced = true;
+        it->second = {slot, seq};
+      } else {
+        shard.index.emplace(key, Location{slot, seq});
+      }
+    }
+    if (replaced) {
+      RetireSlot(old.slot);
+    } else {
+      storage_size_++;
+    }
+    return seq;
+  }
+
+  void Evict(const K& key) override { EvictIfSequence(key, 0, false); }
+
+  // Removes key if it was last written with sequence number seq. Returns
+  // false if the key is gone or was rewritten since.
+  bool EvictIfSequence(const K& key, uint64_t seq, bool check_seq = true) {
+    int64_t slot = -1;
+    {
+      auto& shard = ShardOf(key);
+      tfplus_spin_lock l(shard.mu);
+      auto it = shard.index.find(key);
+      if (it == shard.index.end() || (check_seq && it->second.seq != seq)) {
+        return false;
+      }
+      slot = it->second.slot;
+      shard.index.erase(it);
+    }
+    RetireSlot(slot);
+    storage_size_--;
+    return true;
+  }
+
+  // Reads the rows of keys into out, row i at out + i * row_dim. Slots are
+  // read in file order and adjacent ones with a single pread. found[i] tells
+  // whether keys[i] was present, seqs receives the write sequence numbers
+  // if not null.
+  void BatchGet(const std::vector<K>& keys, V* out, std::vector<bool>* found,
+                std::vector<uint64_t>* seqs = nullptr) {
+    found->assign(keys.size(), false);
+    if (seqs != nullptr) {
+      seqs->assign(keys.size(), 0);
+    }
+    if (record_request_) {
+      request_count_ += keys.size();
+    }
+    tfplus_shared_lock io_lock(io_mu_);
+    std::vector<std::pair<int64_t, size_t>> slots;
+    slots.reserve(keys.size());
+    for (size_t i = 0; i < keys.size(); ++i) {
+      Location loc;
+      if (Lookup(keys[i], &loc)) {
+        slots.emplace_back(loc.slot, i);
+        if (seqs != nullptr) {
+          (*seqs)[i] = loc.seq;
+        }
+      }
+    }
+    std::sort(slots.begin(), slots.end());
+    std::vector<V> run_buf;
+    size_t begin = 0;
+    while (begin < slots.size()) {
+      size_t end = begin + 1;
+      while (end < slots.size() &&
+             end - begin < SSD_MAX_COALESCED_ROWS &&
+             slots[end].first == slots[end - 1].first + 1) {
+        ++end;
+      }
+      size_t num_rows = end - begin;
+      V* dst = out + slots[begin].second * row_dim_;
+      if (num_rows > 1) {
+        run_buf.resize(num_rows * row_dim_);
+        dst = run_buf.data();
+      }
+      if (ReadRows(slots[begin].first, num_rows, dst)) {
+        for (size_t i = begin; i < end; ++i) {
+          size_t index = slots[i].second;
+          if (num_rows > 1) {
+            std::copy_n(run_buf.data() + (i - begin) * row_dim_, row_dim_,
+                        out + index * row_dim_);
+          }
+          (*found)[index] = true;
+        }
+      }
+      begin = end;
+    }
+  }
+
+  void Clear() override {
+    tfplus_mutex_lock io_lock(io_mu_);
+    for (auto& shard : shards_) {
+      tfplus_spin_lock l(shard.mu);
+      shard.index.clear();
+    }
+    {
+      tfplus_spin_lock l(slot_mu_);
+      free_slots_.clear();
+      retired_slots_.clear();
+      next_slot_ = 0;
+    }
+    storage_size_ = 0;
+    if (fd_ >= 0 && ::ftruncate(fd_, 0) != 0) {
+      LOG(WARNING) << "Failed to truncate " << file_path_ << ": "
+                   << std::strerror(errno);
+    }
+  }
+
+  int64_t RequestCount() override { return request_count_; }
+
+  void ResetRequestCount() override { request_count_ = 0; }
+
+  void StartRecordRequest() override { record_request_ = true; }
+
+  void StopRecordRequest() override { record_request_ = false; }
+
+  void SetCapacity(size_t size) override { storage_capacity_ = size; }
+
+  int64_t Capacity() override { return storage_capacity_; }
+
+  int64_t Size() override { return storage_size_; }
+
+  bool AutoSize() override { return auto_size_; }
+
+  // Whether another row fits in the file.
+  bool HasRoom() {
+    return auto_size_ || Size() < static_cast<int64_t>(storage_capacity_);
+  }
+
+  const std::string& FilePath() const { return file_path_; }
+
+ private:
+  static constexpr int kNumShards = 64;
+
+  struct Location {
+    int64_t slot;
+    uint64_t seq;
+  };
+
+  struct alignas(64) IndexShard {
+    spin_rw_mutex mu;
+    std::unordered_map<K, Location> index;
+  };
+
+  IndexShard& ShardOf(const K& key) {
+    return shards_[std::hash<K>()(key) % kNumShards];
+  }
+
+  bool Lookup(const K& key, Location* loc) {
+    auto& shard = ShardOf(key);
+    tfplus_shared_spin_lock l(shard.mu);
+    auto it = shard.index.find(key);
+    if (it == shard.index.end()) {
+      return false;
+    }
+    *loc = it->second;
+    return true;
+  }
+
+  int64_t AllocateSlot() {
+    bool must_recycle = false;
+    {
+      tfplus_spin_lock l(slot_mu_);
+      if (!free_slots_.empty()) {
+        int64_t slot = free_slots_.back();
+        free_slots_.pop_back();
+        return slot;
+      }
+      must_recycle = retired_slots_.size() >= SSD_MAX_RETIRED_SLOTS;
+    }
+    // Retired slots become free once no reader can still hold them, try
+    // that before growing the file. Under a steady stream of reads the try
+    // keeps failing, so past SSD_MAX_RETIRED_SLOTS the writer waits for the
+    // reads in flight rather than grow the file without bound.
+    {
+      tfplus_mutex_lock io_lock =
+          must_recycle ? tfplus_mutex_lock(io_mu_)
+                       : tfplus_mutex_lock(io_mu_, true, std::try_to_lock);
+      if (io_lock) {
+        tfplus_spin_lock l(slot_mu_);
+        free_slots_.insert(free_slots_.end(), retired_slots_.begin(),
+                           retired_slots_.end());
+        retired_slots_.clear();
+        if (!free_slots_.empty()) {
+          int64_t slot = free_slots_.back();
+          free_slots_.pop_back();
+          return slot;
+        }
+      }
+    }
+    tfplus_spin_lock l(slot_mu_);
+    return next_slot_++;
+  }
+
+  void RetireSlot(int64_t slot) {
+    tfplus_spin_lock l(slot_mu_);
+    retired_slots_.push_back(slot);
+  }
+
+  bool ReadRows(int64_t slot, size_t num_rows, V* dst) {
+    return Transfer(slot, num_rows * buffer_size_,
+                    reinterpret_cast<char*>(dst), false);
+  }
+
+  void WriteRow(int64_t slot, const V* src) {
+    if (!Transfer(slot, buffer_size_,
+                  reinterpret_cast<char*>(const_cast<V*>(src)), true)) {
+      LOG(FATAL) << "Failed to write " << file_path_ << " of "
+                 << table_name_ << ": " << std::strerror(errno);
+    }
+  }
+
+  bool Transfer(int64_t slot, size_t bytes, char* buf, bool is_write) {
+    if (fd_ < 0) {
+      return false;
+    }
+    off_t offset = static_cast<off_t>(slot) * buffer_size_;
+    size_t done = 0;
+    while (done < bytes) {
+      ssize_t n = is_write ? ::pwrite(fd_, buf + done, bytes - done,
+                                      offset + done)
+                           : ::pread(fd_, buf + done, bytes - done,
+                                     offset + done);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        return false;
+      }
+      done += n;
+    }
+    return true;
+  }
+
+  const size_t row_dim_;
+  const size_t buffer_size_;
+  std::string table_name_;
+  std::string file_path_;
+  int fd_ = -1;
+  size_t storage_capacity_;
+  bool auto_size_;
+  std::atomic<int64_t> storage_size_{0};
+  std::atomic<uint64_t> next_seq_{1};
+
+  IndexShard shards_[kNumShards];
+  // Held shared by readers and exclusively to recycle retired slots.
+  tf_mutex io_mu_;
+  spin_rw_mutex slot_mu_;
+  std::vector<int64_t> free_slots_;
+  std::vector<int64_t> retired_slots_;
+  int64_t next_slot_ = 0;
+
+  bool record_request_{true};
+  std::atomic<size_t> request_count_{0};
+};
+
+}  // namespace tfplus
+#endif  // TFPLUS_KV_VARIABLE_KERNELS_HYBRID_EMBEDDING_SSD_STORAGE_TABLE_H_
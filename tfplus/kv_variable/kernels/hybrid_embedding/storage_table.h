@@ -26,9 +26,11 @@
 #include "tensorflow/core/framework/allocator.h"
 #include "tensorflow/core/lib/core/status.h"
 #include "tensorflow/core/platform/mem.h"
+#include "tfplus/kv_variable/kernels/compact_row.h"
 #include "tfplus/kv_variable/kernels/embedding_value.h"
 #include "tfplus/kv_variable/kernels/hashmap.h"
 #include "tfplus/kv_variable/kernels/hybrid_embedding/embedding_context.h"
+#include "tfplus/kv_variable/kernels/slab_allocator.h"
 #include "tfplus/kv_variable/kernels/utility.h"
 
 namespace tfplus {
@@ -41,7 +43,7 @@ template <typename K, typename V>
 class StorageTableInterface {
  public:
   using KvMap = IMap<K, EmbeddingValue<V>>;
-  // virtual ~StorageTableInterface() = default;
+  virtual ~StorageTableInterface() = default;
   virtual void Get(const K& key, EVContext<V>* context) = 0;
   virtual void Put(const K& key, EVContext<V>* context,
                    bool is_insert = false) = 0;
@@ -66,7 +68,7 @@ class StorageTableInterface {
   virtual void StopRecordRequest() {}
   virtual void SetCapacity(size_t size) {}
   virtual bool StoageReady() { return true; }
-  void Clear() { return; }
+  virtual void Clear() {}
   virtual bool AutoSize() { return false; }
 };
 
@@ -91,7 +93,7 @@ class MemStorageTable : public StorageTableInterface<K, V> {
 
   ~MemStorageTable() {}
 
-  void Clear() {
+  void Clear() override {
     ev_table_->clear();
     storage_size_ = 0;
   }
@@ -104,10 +106,10 @@ class MemStorageTable : public StorageTableInterface<K, V> {
 
   void Evict(const K& key) {
     auto ev = ev_table_->FindOrNullUnsafe(key);
-    if (ev) {
+    if (ev && ev->Value()) {
       ev->DeleteValue();
+      storage_size_--;
     }
-    storage_size_--;
   }
   /*
     1. get from ev_table_
@@ -118,8 +120,15 @@ class MemStorageTable : public StorageTableInterface<K, V> {
       ev = ev_table_->FindOrNullUnsafe(key);
       context->UpdateMeta(ev);
     }
-    context->InitValue(ev->Value(),
-                       false);  // no need to allocate or copy here
+    if (codec_ != nullptr && ev->Value() != nullptr) {
+      // The context gets its own float copy of a compact row.
+      V* view = AllocateView();
+      codec_->Decode(ev->Value(), view, embedding_dim_);
+      context->InitValue(view, true);
+    } else {
+      context->InitValue(ev->Value(),
+                         false);  // no need to allocate or copy here
+    }
     if (record_request_) {
       request_count_++;
     }
@@ -133,6 +142,17 @@ class MemStorageTable : public StorageTableInterface<K, V> {
     if (is_insert && context->Meta()->Value() == nullptr) {
       storage_size_++;
     }
+    if (codec_ != nullptr) {
+      // The values of the context are rounded into the compact row, the
+      // context keeps its buffer.
+      EmbeddingValue<V>* ev = context->Meta();
+      if (ev->Value() == nullptr) {
+        ev->UpdateEmbedding(AllocateCompactRow());
+        ev->SetBufOwner(true);
+      }
+      codec_->Encode(context->Value(), ev->Value(), embedding_dim_);
+      return;
+    }
     context->Meta()->UpdateEmbedding(context->Value());
     // 如果是buffer owner，则直接赋值给ev table
     if (context->GetBufOwner()) {
@@ -165,6 +185,17 @@ class MemStorageTable : public StorageTableInterface<K, V> {
 
   void StartRecordRequest() override { record_request_ = true; }
 
+  // Stores the rows as 16 bit elements, see RowCodec. Get then hands out a
+  // float copy of the row and Put rounds the values of the context into
+  // it. Float copies come from view_allocator and rows from row_allocator,
+  // either may be null to use AllocateRaw.
+  void SetRowCodec(const RowCodec* codec, SlabAllocator* view_allocator,
+                   SlabAllocator* row_allocator) {
+    codec_ = codec;
+    view_allocator_ = view_allocator;
+    row_allocator_ = row_allocator;
+  }
+
   void StopRecordRequest() override { record_request_ = false; }
 
   // Status ExportSnapshot(BundleWriter* writer, TensorShape& value_shape,
@@ -183,6 +214,20 @@ class MemStorageTable : public StorageTableInterface<K, V> {
   // }
 
  private:
+  V* AllocateView() {
+    if (view_allocator_ != nullptr) {
+      return static_cast<V*>(view_allocator_->Allocate());
+    }
+    return static_cast<V*>(AllocateRaw(embedding_dim_ * sizeof(V)));
+  }
+
+  V* AllocateCompactRow() {
+    if (row_allocator_ != nullptr) {
+      return static_cast<V*>(row_allocator_->Allocate());
+    }
+    return static_cast<V*>(AllocateRaw(codec_->RowBytes(embedding_dim_)));
+  }
+
   int64_t storage_capacity_;
   std::atomic<size_t> storage_size_{0};
 
@@ -193,6 +238,9 @@ class MemStorageTable : public StorageTableInterface<K, V> {
   bool auto_size_;
   bool record_request_{true};
   std::atomic<size_t> request_count_{0};
+  const RowCodec* codec_{nullptr};
+  SlabAllocator* view_allocator_{nullptr};
+  SlabAllocator* row_allocator_{nullptr};
 };
 
 }  // namespace tfplus
@@ -15,10 +15,15 @@
 #define TFPLUS_KV_VARIABLE_KERNELS_HYBRID_EMBEDDING_TABLE_MANAGER_H_
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>  // NOLINT(build/c++11)
+#include <functional>
 #include <map>
 #include <memory>
 #include <queue>
 #include <string>
+#include <thread>  // NOLINT(build/c++11)
+#include <type_traits>
 #include <utility>
 #include <vector>
 
@@ -26,13 +31,22 @@
 #include "tbb/concurrent_unordered_set.h"
 #include "tensorflow/core/lib/core/threadpool.h"
 #include "tensorflow/core/platform/env.h"
+#include "tfplus/kv_variable/kernels/compact_row.h"
 #include "tfplus/kv_variable/kernels/embedding_value.h"
 #include "tfplus/kv_variable/kernels/hashmap.h"
+#include "tfplus/kv_variable/kernels/hot_key_map.h"
 #include "tfplus/kv_variable/kernels/hybrid_embedding/embedding_context.h"
+#include "tfplus/kv_variable/kernels/hybrid_embedding/eviction_policy.h"
+#include "tfplus/kv_variable/kernels/hybrid_embedding/ssd_storage_table.h"
 #include "tfplus/kv_variable/kernels/hybrid_embedding/storage_config.pb.h"
 #include "tfplus/kv_variable/kernels/hybrid_embedding/storage_table.h"
+#include "tfplus/kv_variable/kernels/numa.h"
+#include "tfplus/kv_variable/kernels/slab_allocator.h"
 namespace tfplus {
 extern GlobalConfigs gConf;
+// Memory rows are evicted or demoted to SSD until this fraction of the
+// memory capacity is used, so that a few inserts do not start another round.
+constexpr double EVICTION_WATERMARK = 0.9;
 using ::tensorflow::DataType;
 using ::tensorflow::mutex;
 using tensorflow::mutex_lock;
@@ -56,44 +70,207 @@ class TableManager {
       : variable_name_(variable_name),
         embedding_dim_(embedding_dim),
         buffer_size_(embedding_dim * sizeof(V)),
-        storage_option_(storage_option) {
-    ev_table_ =
-        MapFactory<K, EmbeddingValue<V>>::CreateMap(MapType(gConf.map_type));
+        storage_option_(storage_option),
+        auto_evict_(auto_evict) {
+    size_t num_segments = storage_option_.num_segments() > 0
+                              ? storage_option_.num_segments()
+                              : HASH_SIZE_DEFAULT;
+    ev_table_ = MapFactory<K, EmbeddingValue<V>>::CreateMap(
+        MapType(gConf.map_type), num_segments);
+    if (storage_option_.expected_size() > 0) {
+      ev_table_->Reserve(storage_option_.expected_size());
+    }
     train_delta_list_ptr_ = train_delta_list_ptr;
+    if (GetEnvVar<bool>("TFPLUS_KV_SLAB_ALLOCATOR", true)) {
+      row_allocator_.reset(new SlabAllocator(buffer_size_));
+      if (NumaWorkers::Get() != nullptr) {
+        num_numa_nodes_ = NumaWorkers::Get()->num_nodes();
+        for (int node = 0; node < num_numa_nodes_; ++node) {
+          node_row_allocators_.emplace_back(
+              new SlabAllocator(buffer_size_, node));
+        }
+      }
+    }
+    int64 num_hot_keys = GetEnvVar<int64>("TFPLUS_KV_HOT_KEYS", 0);
+    if (num_hot_keys > 0) {
+      InitHotKeys(num_hot_keys);
+    }
     // init zero value
     zero_val_ = reinterpret_cast<V*>(::tensorflow::cpu_allocator()->AllocateRaw(
         ::tensorflow::Allocator::kAllocatorAlignment, buffer_size_));
     typename ::tensorflow::TTypes<V>::Tensor src(zero_val_, embedding_dim_);
     src.setZero();
-    auto table = new MemStorageTable<K, V>(-1, embedding_dim_,
+    const auto& configs = storage_option_.configs();
+    auto mem_config = configs.find(StorageType::MEM_STORAGE);
+    // A size of 0 is an unset proto field and means no limit, like -1.
+    int64_t mem_size = mem_config == configs.end() ||
+                               mem_config->second.training_storage_size() <= 0
+                           ? -1
+                           : mem_config->second.training_storage_size();
+    auto table = new MemStorageTable<K, V>(mem_size, embedding_dim_,
                                       ev_table_, variable_name);
     writeable_storage_table_ = table;
     storage_tables_.push_back(table);
+    stored_row_bytes_ = buffer_size_;
+    InitRowCodec(table);
+    std::string policy = GetEnvVar<std::string>("TFPLUS_KV_EVICTION_POLICY",
+                                                "lru");
+    eviction_policy_.reset(EvictionPolicy::Create(policy));
+    if (eviction_policy_ == nullptr) {
+      LOG(ERROR) << "Unknown TFPLUS_KV_EVICTION_POLICY " << policy
+                 << ", using lru";
+      eviction_policy_.reset(new LruEvictionPolicy());
+    }
+    eviction_slice_ =
+        std::max<int64>(1, GetEnvVar<int64>("TFPLUS_KV_EVICTION_SLICE", 256));
+    prefetch_distance_ =
+        std::max<int64>(0, GetEnvVar<int64>("TFPLUS_KV_PREFETCH_DISTANCE", 8));
+    if (storage_option_.combination() == StorageCombination::MEM_SSD) {
+      InitSsdStorage();
+    } else if (auto_evict_ && !table->AutoSize()) {
+      StartCapacityThread(
+          GetEnvVar<int64>("TFPLUS_KV_EVICTION_INTERVAL_MS", 1000));
+    }
+    if (hot_map_ != nullptr) {
+      StartHotKeyThread(
+          GetEnvVar<int64>("TFPLUS_KV_HOT_KEYS_INTERVAL_MS", 10000));
+    }
   }
 
   ~TableManager() {
+    {
+      mutex_lock l(eviction_mu_);
+      shutdown_ = true;
+    }
+    shutdown_cv_.notify_all();
+    delete eviction_thread_;
+    delete hot_key_thread_;
     delete ev_table_;
+    for (auto storage : storage_tables_) delete storage;
   }
   KvMap* GetKVMap() { return ev_table_; }
 
-  bool HasMemTable() { return with_ev_table_; }
+  // Pinned keys in front of ev_table_, nullptr unless TFPLUS_KV_HOT_KEYS
+  // is set, see InitHotKeys().
+  HotKeyMap<K, EmbeddingValue<V>>* hot_map() const { return hot_map_; }
 
-  inline bool SSDStorageEneabled() {
-    return false;
+  // Pins the most frequent memory rows, the background thread calls it
+  // every TFPLUS_KV_HOT_KEYS_INTERVAL_MS. Returns the number of keys
+  // pinned.
+  size_t RefreshHotKeys() {
+    if (hot_map_ == nullptr) {
+      return 0;
+    }
+    std::vector<std::pair<uint32_t, K>> candidates;
+    candidates.reserve(writeable_storage_table_->Size());
+    ev_table_->ForEach(
+        [&candidates](const K& key, const EmbeddingValue<V>* v) {
+          if (v->GetStorageType() == StorageType::MEM_STORAGE &&
+              v->Value() != nullptr && !v->InBlacklist()) {
+            candidates.emplace_back(
+                GetUint16FromUint32(v->GetFrequency(), true), key);
+          }
+        });
+    size_t num = std::min<size_t>(num_hot_keys_, candidates.size());
+    std::nth_element(candidates.begin(), candidates.begin() + num,
+                     candidates.end(), std::greater<std::pair<uint32_t, K>>());
+    std::vector<K> keys;
+    keys.reserve(num);
+    for (size_t i = 0; i < num; ++i) {
+      keys.push_back(candidates[i].second);
+    }
+    return hot_map_->Pin(keys);
   }
 
+  // Allocates a row buffer owned by the table, it is released through
+  // DeallocateEmbedding when the EmbeddingValue drops it.
+  V* AllocateRow() {
+    if (SlabAllocator* allocator = RowAllocator()) {
+      return static_cast<V*>(allocator->Allocate());
+    }
+    return static_cast<V*>(AllocateRaw(buffer_size_));
+  }
+
+  // Allocator of the rows the calling thread inserts. In NUMA mode, see
+  // NumaWorkers, it is the one of the node the thread runs on.
+  SlabAllocator* RowAllocator() const {
+    if (num_numa_nodes_ > 0) {
+      return node_row_allocators_[CurrentNumaNode()].get();
+    }
+    return row_allocator_.get();
+  }
+
+  // NUMA nodes the rows are spread over, 0 unless NUMA mode is on.
+  int num_numa_nodes() const { return num_numa_nodes_; }
+
+  // Node whose threads handle key: the segments of the map are split in
+  // num_numa_nodes() contiguous ranges. Maps with fewer segments than nodes
+  // spread the keys by hash.
+  int NumaNodeOf(const K& key) const {
+    const size_t num_segments = ev_table_->NumSegments();
+    if (num_segments < static_cast<size_t>(num_numa_nodes_)) {
+      return static_cast<int>(std::hash<K>()(key) % num_numa_nodes_);
+    }
+    return static_cast<int>(ev_table_->SegmentOf(key) * num_numa_nodes_ /
+                            num_segments);
+  }
+
+  // Bytes of the row slabs of every NUMA node.
+  std::vector<size_t> NumaRowBytes() const {
+    std::vector<size_t> bytes;
+    for (const auto& allocator : node_row_allocators_) {
+      bytes.push_back(allocator->AllocatedBytes());
+    }
+    return bytes;
+  }
+
+  // Bytes reserved by the row allocators.
+  size_t RowMemoryUsed() const {
+    size_t bytes = row_allocator_ ? row_allocator_->AllocatedBytes() : 0;
+    for (const auto& allocator : node_row_allocators_) {
+      bytes += allocator->AllocatedBytes();
+    }
+    if (compact_row_allocator_) {
+      bytes += compact_row_allocator_->AllocatedBytes();
+    }
+    return bytes;
+  }
+
+  // Whether rows are stored as 16 bit elements, see RowCodec. Contexts then
+  // hold a float copy of the row and changes made to it in place only reach
+  // the table through StoreRowUnsafe().
+  bool CompactRows() const { return row_codec_.compact(); }
+
+  // Writes the value of context back to the row of key. Requires the key
+  // write lock.
+  void StoreRowUnsafe(const K& key, EVContext<V>* context) {
+    GetStorageWithType(context->Meta()->GetStorageType())
+        ->Put(key, context, true);
+  }
+
+  // Keeps the row of a blacklisted key and only zeroes its first value_dim
+  // elements, the rest of the row holds state that must survive blacklisting.
+  void RetainBlacklistedRows(size_t value_dim) {
+    retained_value_dim_ = value_dim;
+  }
+
+  bool HasMemTable() { return with_ev_table_; }
+
+  inline bool SSDStorageEneabled() { return ssd_table_ != nullptr; }
+
   inline bool MayNeedDeltaInfo() { return need_delta_info_; }
 
   inline StorageType GetLowestWriteableStorageType() {
     return writeable_storage_table_->GetStorageType();
   }
 
-  void InsertWithFnUnsafe(
-      const K& key, std::function<void(EVContext<V>* context)> insert_func,
-      EVContext<V>* context) {
+  template <typename InsertFn>
+  void InsertWithFnUnsafe(const K& key, InsertFn&& insert_func,
+                          EVContext<V>* context) {
     EmbeddingValue<V> ev(nullptr, false, 1, false,
                          GetLowestWriteableStorageType());
     context->UpdateMeta(&ev);
+    context->SetRowAllocator(RowAllocator());
     insert_func(context);
     if (context->Value()) {
       writeable_storage_table_->Put(key, context, true);
@@ -102,19 +279,18 @@ class TableManager {
     context->UpdateMeta(it.first);
   }
 
-  void InsertWithFn(const K& key,
-                    std::function<void(EVContext<V>* context)> insert_func) {
+  template <typename InsertFn>
+  void InsertWithFn(const K& key, InsertFn&& insert_func) {
     auto lock = GetScopedKeyLock(key, LockType::WRITE_LOCK);
     EVContext<V> context;
     InsertWithFnUnsafe(key, insert_func, &context);
   }
 
-  Status BatchGetWithFn(
-      OpKernelContext* ctx, const Tensor& keys,
-      std::function<void(const K& key, EVContext<V>* context, size_t row)>
-          find_func,
-      std::function<void(const K& key, EVContext<V>* context, size_t row)>
-          not_find_func) {
+  // find_func(key, context, row) runs for the keys that are found and
+  // not_find_func(key, context, row) for the others.
+  template <typename FindFn, typename NotFindFn>
+  Status BatchGetWithFn(OpKernelContext* ctx, const Tensor& keys,
+                        FindFn&& find_func, NotFindFn&& not_find_func) {
     // std::vector<ph::client::SparseTableGetResult> resultVec;
     std::promise<bool> barrier;
     std::future<bool> stat_future = barrier.get_future();
@@ -128,18 +304,7 @@ class TableManager {
 
     auto DoWork = [this, &local_keys, &find_func, &not_find_func](int64 start,
                                                                   int64 end) {
-      for (int64 index = start; index < end; ++index) {
-        auto& key_row = local_keys[index];
-        auto& key = key_row.first;
-        EVContext<V> context;
-        auto lock = GetScopedKeyLock(key, LockType::READ_LOCK);
-        GetMetaAndValue(key, &context, true);
-        if (context.IsValid()) {
-          find_func(key, &context, key_row.second);
-        } else {
-          not_find_func(key, &context, key_row.second);
-        }
-      }
+      GetLocalKeys(local_keys, start, end, find_func, not_find_func);
     };
 
     if (ctx != nullptr) {
@@ -153,6 +318,62 @@ class TableManager {
     return status;
   }
 
+  // Reads local_keys[start, end), calling find_func or not_find_func with
+  // the row of each key.
+  template <typename FindFn, typename NotFindFn>
+  void GetLocalKeys(const std::vector<std::pair<K, size_t>>& local_keys,
+                    int64 start, int64 end, FindFn& find_func,
+                    NotFindFn& not_find_func) {
+    // Rows on SSD are read after the memory pass with one batched read.
+    std::vector<std::pair<K, size_t>> ssd_keys;
+    auto key_at = [&local_keys](int64 index) {
+      return local_keys[index].first;
+    };
+    for (int64 index = start; index < end; ++index) {
+      PrefetchLookup(key_at, start, index, end);
+      auto& key_row = local_keys[index];
+      auto& key = key_row.first;
+      if (hot_map_ != nullptr &&
+          hot_map_->ReadLockFree(key, [&](EmbeddingValue<V>* ev) {
+            EVContext<V> context(ev);
+            GetMetaAndValue(key, &context, true);
+            find_func(key, &context, key_row.second);
+          })) {
+        continue;
+      }
+      EVContext<V> context;
+      auto lock = GetScopedKeyLock(key, LockType::READ_LOCK);
+      if (OnSsdUnsafe(key)) {
+        ssd_keys.push_back(key_row);
+        continue;
+      }
+      GetMetaAndValue(key, &context, true);
+      if (context.IsValid()) {
+        find_func(key, &context, key_row.second);
+      } else {
+        not_find_func(key, &context, key_row.second);
+      }
+    }
+    if (!ssd_keys.empty()) {
+      BatchGetFromSsd(ssd_keys, find_func, not_find_func);
+    }
+  }
+
+  // BatchGetWithFn() of keys[begin, end) on the calling thread, for ops that
+  // shard the keys of several tables together.
+  template <typename FindFn, typename NotFindFn>
+  Status BatchGetRangeWithFn(const Tensor& keys, int64 begin, int64 end,
+                             FindFn&& find_func, NotFindFn&& not_find_func) {
+    const auto& keys_flat = keys.flat<K>();
+    std::vector<std::pair<K, size_t>> local_keys;
+    local_keys.reserve(end - begin);
+    for (int64 index = begin; index < end; ++index) {
+      local_keys.push_back({keys_flat(index), index});
+    }
+    GetLocalKeys(local_keys, 0, local_keys.size(), find_func, not_find_func);
+    return tensorflow::OkStatus();
+  }
+
   void ClassifyLocalOrRemoteKey(
       const Tensor& keys,
       std::vector<std::pair<K, size_t>>* local_keys,
@@ -164,10 +385,10 @@ class TableManager {
     }
   }
 
-  void FindOrInsertWithDifferentFn(
-      const K& key, std::function<void(EVContext<V>* context)> find_func,
-      std::function<void(EVContext<V>* context)> insert_func,
-      EVContext<V>* context) {
+  template <typename FindFn, typename InsertFn>
+  void FindOrInsertWithDifferentFn(const K& key, FindFn&& find_func,
+                                   InsertFn&& insert_func,
+                                   EVContext<V>* context) {
     // locks
     auto lock = GetScopedKeyLock(key, LockType::READ_LOCK);
     GetMetaAndValue(key, context);
@@ -189,13 +410,14 @@ class TableManager {
     }
   }
 
-  bool FindOrInsertWithFnUnsafe(
-      const K& key, std::function<void(EVContext<V>* context)> insert_func,
-      EVContext<V>* context) {
+  template <typename InsertFn>
+  bool FindOrInsertWithFnUnsafe(const K& key, InsertFn&& insert_func,
+                                EVContext<V>* context) {
     // TODO(jianmu.scj): Consider optimizing to upgrade from read locks to write
     // locks
     GetMetaAndValue(key, context);
     if (context->IsValid()) {
+      PromoteUnsafe(key, context);
       return true;
     } else {
       InsertWithFnUnsafe(key, insert_func, context);
@@ -203,10 +425,93 @@ class TableManager {
     }
   }
 
+  // Moves the SSD rows among keys back to memory, their rows are read with
+  // one batched read. Keys updated on SSD during the read are left there.
+  void PromoteBatch(const std::vector<K>& keys) {
+    if (ssd_table_ == nullptr) {
+      return;
+    }
+    std::vector<K> ssd_keys;
+    for (const auto& key : keys) {
+      auto lock = GetScopedKeyLock(key, LockType::READ_LOCK);
+      if (OnSsdUnsafe(key)) {
+        ssd_keys.push_back(key);
+      }
+    }
+    if (ssd_keys.empty()) {
+      return;
+    }
+    std::vector<V> rows(ssd_keys.size() * embedding_dim_);
+    std::vector<bool> found;
+    std::vector<uint64_t> seqs;
+    ssd_table_->BatchGet(ssd_keys, rows.data(), &found, &seqs);
+    for (size_t i = 0; i < ssd_keys.size(); ++i) {
+      if (!found[i]) {
+        continue;
+      }
+      auto lock = GetScopedKeyLock(ssd_keys[i], LockType::WRITE_LOCK);
+      if (OnSsdUnsafe(ssd_keys[i]) &&
+          ssd_table_->EvictIfSequence(ssd_keys[i], seqs[i])) {
+        InstallRowUnsafe(ev_table_->FindOrNullUnsafe(ssd_keys[i]),
+                         rows.data() + i * embedding_dim_);
+      }
+    }
+  }
+
+  // Makes row, allocated by AllocateRow(), the memory row of ev, which must
+  // not have one yet. Requires the key write lock.
+  void AttachRowUnsafe(EmbeddingValue<V>* ev, V* row) {
+    ev->UpdateEmbedding(row);
+    ev->SetBufOwner(true);
+    ev->SetStorage(StorageType::MEM_STORAGE);
+    writeable_storage_table_->AddStorageSize();
+  }
+
+  // The returned EmbeddingValue may be moved or freed by an insert or erase
+  // of another key, callers that do not hold the key lock use
+  // FindMetaWithFn().
   EmbeddingValue<V>* FindOrNull(const K& key) {
     return ev_table_->FindOrNull(key);
   }
 
+  // Calls func with the EmbeddingValue of key, or nullptr, under the key
+  // read lock.
+  template <typename Fn>
+  void FindMetaWithFn(const K& key, Fn&& func) {
+    auto lock = GetScopedKeyLock(key, LockType::READ_LOCK);
+    func(static_cast<const EmbeddingValue<V>*>(
+        ev_table_->FindOrNullUnsafe(key)));
+  }
+
+  // Software prefetching for a loop that looks up keys(begin) to
+  // keys(end - 1) in order. Called at the top of iteration i, it prefetches
+  // the map slot of the key 2 * prefetch_distance_ positions ahead and the
+  // memory row of the key prefetch_distance_ positions ahead, whose slot is
+  // in cache by then, so that the cache misses of later keys overlap with
+  // the work on key i. keys(j) returns the j-th key. It never waits for a
+  // lock, callers may hold the lock of any key.
+  template <typename Keys>
+  void PrefetchLookup(const Keys& keys, int64 begin, int64 i, int64 end) {
+    const int64 distance = prefetch_distance_;
+    if (distance == 0 || !with_ev_table_) {
+      return;
+    }
+    if (i == begin) {
+      for (int64 j = begin; j < std::min(end, begin + 2 * distance); ++j) {
+        ev_table_->Prefetch(keys(j));
+      }
+      for (int64 j = begin; j < std::min(end, begin + distance); ++j) {
+        PrefetchRow(keys(j));
+      }
+    }
+    if (i + 2 * distance < end) {
+      ev_table_->Prefetch(keys(i + 2 * distance));
+    }
+    if (i + distance < end) {
+      PrefetchRow(keys(i + distance));
+    }
+  }
+
   void GetMetaAndValue(const K& key, EVContext<V>* context,
                        bool local_only = false) {
     if (record_enabled_) {
@@ -221,7 +526,7 @@ class TableManager {
       }
       if (ev) {
         auto storage_type = ev->GetStorageType();
-        if (ev->InBlacklist()) {
+        if (ev->InBlacklist() && !HasRetainedRow(ev)) {
           // assign a temporary zero embedding
           context->InitValue(zero_val_, false);
         } else {
@@ -236,8 +541,8 @@ class TableManager {
     }
   }
 
-  bool FindWithFn(const K& key, std::function<void(EVContext<V>* context)> func,
-                  EVContext<V>* context) {
+  template <typename Fn>
+  bool FindWithFn(const K& key, Fn&& func, EVContext<V>* context) {
     {
       auto lock = GetScopedKeyLock(key, LockType::READ_LOCK);
       GetMetaAndValue(key, context);
@@ -251,9 +556,8 @@ class TableManager {
     return true;
   }
 
-  void FindWithFnUnsafe(const K& key,
-                        std::function<void(EVContext<V>* context)> func,
-                        EVContext<V>* context) {
+  template <typename Fn>
+  void FindWithFnUnsafe(const K& key, Fn&& func, EVContext<V>* context) {
     GetMetaAndValue(key, context);
     if (context->IsValid()) {
       func(context);
@@ -264,43 +568,52 @@ class TableManager {
     return storage_tables_[static_cast<uint8_t>(type)];
   }
 
-  bool UpdateWithFn(const K& key,
-                    std::function<void(EVContext<V>* context)> func) {
+  template <typename Fn>
+  bool UpdateWithFn(const K& key, Fn&& func) {
     auto lock = GetScopedKeyLock(key, LockType::WRITE_LOCK);
     return UpdateWithFnUnsafe(key, func);
   }
 
-  bool UpdateWithFnUnsafe(const K& key,
-                          std::function<void(EVContext<V>* context)> func) {
+  template <typename Fn>
+  bool UpdateWithFnUnsafe(const K& key, Fn&& func) {
     auto ev = ev_table_->FindOrNullUnsafe(key);
     if (!ev) {
       return false;
     }
+    if (OnSsdUnsafe(key)) {
+      EVContext<V> ssd_context(ev, nullptr);
+      ssd_table_->Get(key, &ssd_context);
+      PromoteUnsafe(key, &ssd_context);
+    }
     EVContext<V> context(ev);
+    context.SetRowAllocator(RowAllocator());
+    if (CompactRows()) {
+      // func updates a float copy of the row.
+      writeable_storage_table_->Get(key, &context);
+    }
     return UpdateWithFnUnsafe(key, func, &context);
   }
 
-  bool UpdateWithFn(const K& key,
-                    std::function<void(EVContext<V>* context)> func,
-                    EVContext<V>* context) {
+  template <typename Fn>
+  bool UpdateWithFn(const K& key, Fn&& func, EVContext<V>* context) {
     auto lock = GetScopedKeyLock(key, LockType::WRITE_LOCK);
     return UpdateWithFnUnsafe(key, func, context);
   }
 
-  bool UpdateWithFnUnsafe(const K& key,
-                          std::function<void(EVContext<V>* context)> func,
-                          EVContext<V>* context) {
+  template <typename Fn>
+  bool UpdateWithFnUnsafe(const K& key, Fn&& func, EVContext<V>* context) {
     func(context);
     if (context->Value()) {
       auto storage_type = context->Meta()->GetStorageType();
       auto storage = GetStorageWithType(storage_type);
-      storage->Put(key, context);
+      // A row without a value, see KvVariable::lazy_rows_, gets one here.
+      storage->Put(key, context, true);
     }
     return true;
   }
 
-  bool FetchAndUpdateWithFn(const K& key,
-                            std::function<void(EVContext<V>* context)> func) {
+  template <typename Fn>
+  bool FetchAndUpdateWithFn(const K& key, Fn&& func) {
     auto lock = GetScopedKeyLock(key, LockType::WRITE_LOCK);
     // EmbeddingValue<V> ev(nullptr, false, 1, false);
     EVContext<V> context;
@@ -308,6 +621,7 @@ class TableManager {
     if (!context.IsValid()) {
       return false;
     }
+    PromoteUnsafe(key, &context);
     func(&context);
     auto storage_type = context.Meta()->GetStorageType();
     auto key_storage = GetStorageWithType(storage_type);
@@ -315,9 +629,10 @@ class TableManager {
     return true;
   }
 
-  void InsertToGivenStorageIndexWithFn(
-      const K& key, int storage_index, int64 storage_size,
-      std::function<void(EVContext<V>* context)> insert_func) {
+  template <typename InsertFn>
+  void InsertToGivenStorageIndexWithFn(const K& key, int storage_index,
+                                       int64 storage_size,
+                                       InsertFn&& insert_func) {
     if (storage_index > storage_tables_.size() || storage_index < 0) {
       LOG(FATAL) << "Invalid storage size while insert table " << variable_name_
                  << " with storage index: " << storage_index;
@@ -326,6 +641,7 @@ class TableManager {
     EmbeddingValue<V> ev(nullptr, false, 1, false,
                          storage_tables_[storage_index]->GetStorageType());
     EVContext<V> context(&ev);
+    context.SetRowAllocator(RowAllocator());
     insert_func(&context);
     storage_tables_[storage_index]->Put(key, &context, true);
     auto it = ev_table_->InsertOrAssignUnsafe(key, std::move(ev));
@@ -347,6 +663,10 @@ class TableManager {
     } else if (!ev->InBlacklist()) {
       ev->MarkBlacklist();
       ev->SetUnderThreshold(true);
+      if (HasRetainedRow(ev)) {
+        std::fill_n(ev->Value(), retained_value_dim_, V(0));
+        return;
+      }
       auto storage_type = ev->GetStorageType();
       auto key_storage = GetStorageWithType(storage_type);
       key_storage->Evict(key);
@@ -358,15 +678,20 @@ class TableManager {
 
   void RemoveBlacklistUnsafe(const K& key, EVContext<V>* context) {
     // It must be running in a write lock scope
+    if (HasRetainedRow(context->Meta())) {
+      // The value part was zeroed when the key was blacklisted.
+      context->Meta()->RemoveBlacklist();
+      context->Meta()->SetUnderThreshold(true);
+      return;
+    }
     // Only memory type needs reallocation to replace the temporary buffer
-    V* val = reinterpret_cast<V*>(::tensorflow::cpu_allocator()->AllocateRaw(
-        ::tensorflow::Allocator::kAllocatorAlignment, buffer_size_));
+    V* val = AllocateRow();
     typename ::tensorflow::TTypes<V>::Tensor src(val, embedding_dim_);
     src.setZero();
     context->UpdateValue(val, true, buffer_size_);
     auto storage_type = context->Meta()->GetStorageType();
     auto key_storage = GetStorageWithType(storage_type);
-    key_storage->Put(key, context);
+    key_storage->Put(key, context, true);
     context->Meta()->RemoveBlacklist();
     context->Meta()->SetUnderThreshold(true);
   }
@@ -376,11 +701,18 @@ class TableManager {
   size_t size_unsafe() const { return ev_table_->size_unsafe(); }
 
   void clear() {
+    NextRowEpoch();
     ev_table_->clear();
     for (auto storage : storage_tables_) storage->Clear();
   }
 
-  bool erase(const K& key) { return ev_table_->erase(key); }
+  bool erase(const K& key) {
+    NextRowEpoch();
+    return ev_table_->erase(key);
+  }
+
+  // Sizes the map for n keys, see IMap::Reserve().
+  void Reserve(size_t n) { ev_table_->Reserve(n); }
 
   std::string RemoteStorageTableName() const {
     return "";
@@ -403,35 +735,78 @@ class TableManager {
   }
 
   void DeleteKey(const K& key) {
-    auto lock = GetScopedKeyLock(key, LockType::WRITE_LOCK);
-    auto ev = ev_table_->FindOrNullUnsafe(key);
-    if (!ev) {
+    if (hot_map_ != nullptr) {
+      hot_map_->Unpin(key);
+    }
+    {
+      auto lock = GetScopedKeyLock(key, LockType::WRITE_LOCK);
+      // A key pinned again before the lock was taken is unpinned once more,
+      // erase_unsafe() needs the segment lock.
+      if (hot_map_ == nullptr || !hot_map_->IsPinned(key)) {
+        auto ev = ev_table_->FindOrNullUnsafe(key);
+        if (!ev) {
+          return;
+        }
+        EVContext<V> context(ev);
+        auto storage_type = ev->GetStorageType();
+        auto key_storage = GetStorageWithType(storage_type);
+        key_storage->Evict(key);
+        NextRowEpoch();
+        ev_table_->erase_unsafe(key);
+        return;
+      }
+    }
+    DeleteKey(key);
+  }
+
+  // Like ForEach, but rows on SSD are read into a buffer of the context
+  // first so that func can read every value.
+  void ForEachWithValue(
+      std::function<void(const K& key, const EVContext<V>* context)> func) {
+    if (ssd_table_ == nullptr) {
+      ForEach(func);
       return;
     }
-    EVContext<V> context(ev);
-    auto storage_type = ev->GetStorageType();
-    auto key_storage = GetStorageWithType(storage_type);
-    key_storage->Evict(key);
-    ev_table_->erase_unsafe(key);
+    std::unique_ptr<V, void (*)(V*)> buf(
+        static_cast<V*>(AllocateRaw(buffer_size_)), DeallocateRaw<V>);
+    auto for_each_func_with_value = [this, &func, &buf](
+                                        const K& key,
+                                        const EmbeddingValue<V>* v) {
+      auto ev = const_cast<EmbeddingValue<V>*>(v);
+      if (ev->GetStorageType() == StorageType::SSD_STORAGE &&
+          !ev->InBlacklist()) {
+        EVContext<V> context(ev, buf.get());
+        ssd_table_->Get(key, &context);
+        func(key, &context);
+      } else {
+        EVContext<V> context(ev);
+        func(key, &context);
+      }
+    };
+    ev_table_->ForEach(for_each_func_with_value);
   }
 
-  // If ForEach need ssd value, please use FetchAndForEachUnsafe
+  // If ForEach need ssd value, please use ForEachWithValue
   void ForEach(
       std::function<void(const K& key, const EVContext<V>* context)> func) {
-    auto for_each_func_with_context = [this, func](const K& key,
-                                                   const EmbeddingValue<V>* v) {
-      EVContext<V> context(const_cast<EmbeddingValue<V>*>(v));
-      func(key, &context);
+    std::vector<V> view(CompactRows() ? embedding_dim_ : 0);
+    auto for_each_func_with_context = [this, func, &view](
+                                          const K& key,
+                                          const EmbeddingValue<V>* v) {
+      CallWithReadableRow(key, const_cast<EmbeddingValue<V>*>(v), view.data(),
+                          func);
     };
     ev_table_->ForEach(for_each_func_with_context);
   }
 
   void ForEachUnsafe(
       std::function<void(const K& key, const EVContext<V>* context)> func) {
-    auto for_each_func_with_context = [this, func](const K& key,
-                                                   const EmbeddingValue<V>* v) {
-      EVContext<V> context(const_cast<EmbeddingValue<V>*>(v));
-      func(key, &context);
+    std::vector<V> view(CompactRows() ? embedding_dim_ : 0);
+    auto for_each_func_with_context = [this, func, &view](
+                                          const K& key,
+                                          const EmbeddingValue<V>* v) {
+      CallWithReadableRow(key, const_cast<EmbeddingValue<V>*>(v), view.data(),
+                          func);
     };
     ev_table_->ForEachUnsafe(for_each_func_with_context);
   }
@@ -448,10 +823,82 @@ class TableManager {
     return ::tensorflow::OkStatus();
   }
 
+  // Runs a demotion round now instead of waiting for the background thread.
   Status TriggerTransferSSD(bool with_lock) {
+    if (ssd_table_ == nullptr) {
+      return ::tensorflow::OkStatus();
+    }
+    if (!ssd_table_->StoageReady()) {
+      return ::tensorflow::errors::Unavailable(
+          "SSD storage of ", variable_name_, " is not ready");
+    }
+    EvictToCapacity(with_lock);
     return ::tensorflow::OkStatus();
   }
 
+  // Brings the memory table back under its watermark when it is over its
+  // capacity. The coldest rows under the eviction policy are demoted to SSD
+  // if the table has one and deleted otherwise. Rows are handled in slices
+  // of eviction_slice_ keys, each slice holds mu_ shared when with_lock is
+  // set, so exports and imports wait for at most one slice.
+  void EvictToCapacity(bool with_lock = true) {
+    if (evicted_along_.load(std::memory_order_acquire)) {
+      return;
+    }
+    // Rows holding colocated slots are never demoted to SSD.
+    if (ssd_table_ != nullptr && retained_value_dim_ > 0) {
+      return;
+    }
+    int64_t capacity = writeable_storage_table_->Capacity();
+    int64_t mem_rows = writeable_storage_table_->Size();
+    if (writeable_storage_table_->AutoSize() || mem_rows <= capacity) {
+      return;
+    }
+    uint32_t max_score = 0;
+    std::vector<K> keys = ColdestRows(
+        mem_rows - static_cast<int64_t>(capacity * EVICTION_WATERMARK),
+        &max_score);
+    for (size_t begin = 0; begin < keys.size(); begin += eviction_slice_) {
+      size_t end = std::min(keys.size(), begin + eviction_slice_);
+      {
+        tfplus_shared_lock l(mu_, with_lock);
+        for (size_t i = begin; i < end; ++i) {
+          auto lock = GetScopedKeyLock(keys[i], LockType::WRITE_LOCK);
+          if (ssd_table_ != nullptr) {
+            if (!DemoteRowUnsafe(keys[i], max_score)) {
+              return;
+            }
+          } else {
+            EvictRowUnsafe(keys[i], max_score);
+          }
+        }
+      }
+      std::this_thread::yield();
+    }
+  }
+
+  // Makes table, which holds state of the keys of this table such as an
+  // optimizer slot, lose the row of a key whenever this table evicts the key,
+  // under its lock here. table then stops evicting rows of its own.
+  void EvictAlong(TableManager<K, V>* table) {
+    table->evicted_along_.store(true, std::memory_order_release);
+    mutex_lock l(evict_along_mu_);
+    if (std::find(evict_along_.begin(), evict_along_.end(), table) ==
+        evict_along_.end()) {
+      evict_along_.push_back(table);
+    }
+  }
+
+  void StopEvictingAlong(TableManager<K, V>* table) {
+    {
+      mutex_lock l(evict_along_mu_);
+      evict_along_.erase(
+          std::remove(evict_along_.begin(), evict_along_.end(), table),
+          evict_along_.end());
+    }
+    table->evicted_along_.store(false, std::memory_order_release);
+  }
+
   Status InitRemoteTable(std::string remote_table_name) {
     return ::tensorflow::OkStatus();
   }
@@ -474,6 +921,9 @@ class TableManager {
     mutex_lock l(mu_);
     std::vector<size_t> storage_size;
     storage_size.push_back(ev_table_->size_unsafe());
+    if (ssd_table_ != nullptr) {
+      storage_size.push_back(ssd_table_->Size());
+    }
     return storage_size;
   }
 
@@ -483,6 +933,35 @@ class TableManager {
     return ev_table_->GetScopedKeyLock(key, lock_type);
   }
 
+  // Whether the lock of a key is the lock of its segment, so that holding it
+  // guards every key of the segment. Not with TFPLUS_KV_HOT_KEYS, pinned
+  // keys have locks of their own.
+  bool SegmentLocks() const {
+    return ev_table_->NumSegments() > 1 && hot_map_ == nullptr;
+  }
+
+  size_t NumSegments() const { return ev_table_->NumSegments(); }
+  size_t SegmentOf(const K& key) const { return ev_table_->SegmentOf(key); }
+
+  // Locks the segment of key until it is unlocked by the caller.
+  spin_rw_mutex* LockKey(const K& key, LockType lock_type) {
+    return ev_table_->LockKey(key, lock_type);
+  }
+
+  // Whether the EmbeddingValue of a key stays at the same address until the
+  // key is erased, so that a pointer to it can be kept across ops, see
+  // KvVariable::RowHandles. Not with TFPLUS_KV_HOT_KEYS, which erases
+  // unpinned keys later on.
+  bool CachesRows() const {
+    return with_ev_table_ && ev_table_->StableValues() && hot_map_ == nullptr;
+  }
+
+  // Changes before any key is erased. Epochs are drawn from one counter for
+  // all tables, so an epoch also names its table.
+  int64_t RowEpoch() const {
+    return row_epoch_.load(std::memory_order_acquire);
+  }
+
   class ScopedLock {
    public:
     ScopedLock() = delete;
@@ -523,7 +1002,304 @@ class TableManager {
   };
 
  private:
+  // Never waits for the lock of key, a key whose segment is taken, also by
+  // the calling thread, is not prefetched.
+  void PrefetchRow(const K& key) {
+    bool locked = false;
+    auto lock = ev_table_->TryGetScopedKeyLock(key, LockType::READ_LOCK,
+                                               &locked);
+    if (!locked) {
+      return;
+    }
+    EmbeddingValue<V>* ev = ev_table_->FindOrNullUnsafe(key);
+    const char* row =
+        ev == nullptr ? nullptr : reinterpret_cast<const char*>(ev->Value());
+    if (row == nullptr) {
+      return;
+    }
+    for (size_t offset = 0; offset < stored_row_bytes_; offset += 64) {
+      __builtin_prefetch(row + offset);
+    }
+  }
+
+  // Calls func with a context of ev whose value reads as V, a compact row is
+  // decoded into view first.
+  template <typename Fn>
+  void CallWithReadableRow(const K& key, EmbeddingValue<V>* ev, V* view,
+                           const Fn& func) {
+    if (CompactRows() && ev->Value() != nullptr) {
+      row_codec_.Decode(ev->Value(), view, embedding_dim_);
+      EVContext<V> context(ev, view);
+      func(key, &context);
+    } else {
+      EVContext<V> context(ev);
+      func(key, &context);
+    }
+  }
+
+  void InitRowCodec(MemStorageTable<K, V>* table) {
+    if (storage_option_.row_dtype() == ROW_FLOAT) {
+      return;
+    }
+    if (!std::is_same<V, float>::value ||
+        storage_option_.combination() != StorageCombination::MEM ||
+        storage_option_.colocated_slots() > 0) {
+      LOG(WARNING) << "Compact rows of " << variable_name_
+                   << " need float values in a MEM table without colocated"
+                   << " slots, keeping full precision rows";
+      return;
+    }
+    row_codec_ = RowCodec(storage_option_.row_dtype(),
+                          storage_option_.stochastic_rounding());
+    stored_row_bytes_ = row_codec_.RowBytes(embedding_dim_);
+    if (row_allocator_) {
+      compact_row_allocator_.reset(new SlabAllocator(stored_row_bytes_));
+    }
+    table->SetRowCodec(&row_codec_, row_allocator_.get(),
+                       compact_row_allocator_.get());
+  }
+
+  bool HasRetainedRow(const EmbeddingValue<V>* ev) const {
+    return retained_value_dim_ > 0 && ev->Value() != nullptr;
+  }
+
+  void InitSsdStorage() {
+    const auto& configs = storage_option_.configs();
+    auto ssd_config = configs.find(StorageType::SSD_STORAGE);
+    if (ssd_config == configs.end() ||
+        ssd_config->second.storage_path().empty()) {
+      LOG(ERROR) << "MEM_SSD storage of " << variable_name_
+                 << " has no storage_path, keeping all rows in memory";
+      return;
+    }
+    ssd_table_ = new SsdStorageTable<K, V>(
+        ssd_config->second.training_storage_size(), embedding_dim_,
+        ssd_config->second.storage_path(), variable_name_);
+    storage_tables_.push_back(ssd_table_);
+    if (!writeable_storage_table_->AutoSize()) {
+      StartCapacityThread(
+          GetEnvVar<int64>("TFPLUS_KV_SSD_DEMOTE_INTERVAL_MS", 1000));
+    }
+  }
+
+  // Optimizer slots are updated under the segment lock of their variable,
+  // which a pinned key does not take, KvVariable::TrackSlots refuses tables
+  // with hot keys.
+  void InitHotKeys(int64 num_hot_keys) {
+    // Lock free readers need values that stay put and rows whose memory is
+    // never unmapped, and rows that do not move to SSD.
+    if (!ev_table_->StableValues() || row_allocator_ == nullptr ||
+        storage_option_.combination() != StorageCombination::MEM) {
+      LOG(WARNING) << "Hot keys of " << variable_name_ << " need a MEM table"
+                   << " with map type CONCURRENT_UNORDERED_MAP and the slab"
+                   << " allocator, TFPLUS_KV_HOT_KEYS is ignored";
+      return;
+    }
+    num_hot_keys_ = num_hot_keys;
+    hot_map_ = new HotKeyMap<K, EmbeddingValue<V>>(ev_table_);
+    ev_table_ = hot_map_;
+  }
+
+  // Runs RefreshHotKeys every interval_ms on hot_key_thread_ until the table
+  // is destroyed.
+  void StartHotKeyThread(int64 interval_ms) {
+    hot_key_thread_ = ::tensorflow::Env::Default()->StartThread(
+        ::tensorflow::ThreadOptions(), "KvHotKeys", [this, interval_ms]() {
+          while (true) {
+            {
+              mutex_lock l(eviction_mu_);
+              if (!shutdown_) {
+                shutdown_cv_.wait_for(l,
+                                      std::chrono::milliseconds(interval_ms));
+              }
+              if (shutdown_) {
+                break;
+              }
+            }
+            size_t pinned = RefreshHotKeys();
+            VLOG(1) << "Pinned " << pinned << " hot keys of "
+                    << variable_name_ << ", " << hot_map_->lock_free_reads()
+                    << " lock free reads, " << hot_map_->read_retries()
+                    << " retries";
+          }
+        });
+  }
+
+  // Runs EvictToCapacity every interval_ms on eviction_thread_ until the
+  // table is destroyed.
+  void StartCapacityThread(int64 interval_ms) {
+    eviction_thread_ = ::tensorflow::Env::Default()->StartThread(
+        ::tensorflow::ThreadOptions(), "KvEviction", [this, interval_ms]() {
+          while (true) {
+            {
+              mutex_lock l(eviction_mu_);
+              if (!shutdown_) {
+                shutdown_cv_.wait_for(l,
+                                      std::chrono::milliseconds(interval_ms));
+              }
+              if (shutdown_) {
+                break;
+              }
+            }
+            EvictToCapacity();
+          }
+        });
+  }
+
+  // Whether the row of key lives on SSD. Requires the key lock.
+  bool OnSsdUnsafe(const K& key) {
+    if (ssd_table_ == nullptr) {
+      return false;
+    }
+    auto ev = ev_table_->FindOrNullUnsafe(key);
+    return ev != nullptr && !ev->InBlacklist() &&
+           ev->GetStorageType() == StorageType::SSD_STORAGE;
+  }
+
+  // Moves the SSD row held by context back to memory, the context then
+  // points to the new memory row. Requires the key write lock.
+  void PromoteUnsafe(const K& key, EVContext<V>* context) {
+    if (!OnSsdUnsafe(key) || context->Value() == nullptr) {
+      return;
+    }
+    ssd_table_->Evict(key);
+    V* row = InstallRowUnsafe(context->Meta(), context->Value());
+    context->InitValue(row, false);
+  }
+
+  V* InstallRowUnsafe(EmbeddingValue<V>* ev, const V* value) {
+    V* row = AllocateRow();
+    std::copy_n(value, embedding_dim_, row);
+    AttachRowUnsafe(ev, row);
+    return row;
+  }
+
+  template <typename FindFn, typename NotFindFn>
+  void BatchGetFromSsd(const std::vector<std::pair<K, size_t>>& key_rows,
+                       FindFn& find_func, NotFindFn& not_find_func) {
+    std::vector<K> keys;
+    keys.reserve(key_rows.size());
+    for (const auto& key_row : key_rows) keys.push_back(key_row.first);
+    std::vector<V> rows(keys.size() * embedding_dim_);
+    std::vector<bool> found;
+    ssd_table_->BatchGet(keys, rows.data(), &found);
+    for (size_t i = 0; i < keys.size(); ++i) {
+      EVContext<V> context(rows.data() + i * embedding_dim_, false);
+      if (found[i]) {
+        context.SetValid(true);
+        find_func(keys[i], &context, key_rows[i].second);
+      } else {
+        not_find_func(keys[i], &context, key_rows[i].second);
+      }
+    }
+  }
+
+  // Keys of the num coldest memory rows, max_score receives the highest
+  // score among them.
+  std::vector<K> ColdestRows(size_t num, uint32_t* max_score) {
+    std::vector<std::pair<uint32_t, K>> candidates;
+    candidates.reserve(writeable_storage_table_->Size());
+    auto policy = eviction_policy_.get();
+    ev_table_->ForEach(
+        [&candidates, policy](const K& key, const EmbeddingValue<V>* v) {
+          if (v->GetStorageType() == StorageType::MEM_STORAGE &&
+              v->Value() != nullptr && !v->InBlacklist()) {
+            candidates.emplace_back(policy->Score(v->GetFrequency()), key);
+          }
+        });
+    num = std::min(num, candidates.size());
+    std::nth_element(candidates.begin(), candidates.begin() + num,
+                     candidates.end());
+    std::vector<K> keys;
+    keys.reserve(num);
+    *max_score = 0;
+    for (size_t i = 0; i < num; ++i) {
+      keys.push_back(candidates[i].second);
+      *max_score = std::max(*max_score, candidates[i].first);
+    }
+    return keys;
+  }
+
+  // The memory row of key if it is still a candidate for eviction, rows
+  // that were used since they were picked are skipped.
+  EmbeddingValue<V>* ColdRowUnsafe(const K& key, uint32_t max_score) {
+    // The lock of a pinned key does not cover erase_unsafe(), and hot keys
+    // are not cold anyway.
+    if (hot_map_ != nullptr && hot_map_->IsPinned(key)) {
+      return nullptr;
+    }
+    auto ev = ev_table_->FindOrNullUnsafe(key);
+    if (ev == nullptr || ev->Value() == nullptr || ev->InBlacklist() ||
+        ev->GetStorageType() != StorageType::MEM_STORAGE ||
+        eviction_policy_->Score(ev->GetFrequency()) > max_score) {
+      return nullptr;
+    }
+    return ev;
+  }
+
+  // Returns false once the SSD table is full.
+  bool DemoteRowUnsafe(const K& key, uint32_t max_score) {
+    if (!ssd_table_->HasRoom()) {
+      LOG_EVERY_N(WARNING, 1000)
+          << "SSD storage of " << variable_name_ << " is full";
+      return false;
+    }
+    auto ev = ColdRowUnsafe(key, max_score);
+    if (ev != nullptr) {
+      ssd_table_->Write(key, ev->Value());
+      writeable_storage_table_->Evict(key);
+      ev->SetStorage(StorageType::SSD_STORAGE);
+    }
+    return true;
+  }
+
+  void EvictRowUnsafe(const K& key, uint32_t max_score) {
+    if (ColdRowUnsafe(key, max_score) == nullptr) {
+      return;
+    }
+    writeable_storage_table_->Evict(key);
+    NextRowEpoch();
+    ev_table_->erase_unsafe(key);
+    if (train_delta_list_ptr_ != nullptr) {
+      // Delta exports report the key as deleted.
+      train_delta_list_ptr_->insert(key);
+    }
+    tfplus_shared_lock l(evict_along_mu_);
+    for (auto table : evict_along_) {
+      table->EraseAlong(key);
+    }
+  }
+
+  // Erases the row of key for the table this table is evicted along with,
+  // which holds the lock of key there.
+  void EraseAlong(const K& key) {
+    auto lock = GetScopedKeyLock(key, LockType::WRITE_LOCK);
+    auto ev = ev_table_->FindOrNullUnsafe(key);
+    if (ev == nullptr) {
+      return;
+    }
+    GetStorageWithType(ev->GetStorageType())->Evict(key);
+    NextRowEpoch();
+    ev_table_->erase_unsafe(key);
+    if (train_delta_list_ptr_ != nullptr) {
+      train_delta_list_ptr_->insert(key);
+    }
+  }
+
+  static int64_t NewRowEpoch() {
+    static std::atomic<int64_t> next_epoch{1};
+    return next_epoch.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // Called before a key is erased, at the latest under its lock. A thread
+  // that holds the lock and read the previous epoch keeps the key until it
+  // lets go of the lock.
+  void NextRowEpoch() {
+    row_epoch_.store(NewRowEpoch(), std::memory_order_release);
+  }
+
   KvMap* ev_table_;
+  std::atomic<int64_t> row_epoch_{NewRowEpoch()};
   StorageOption storage_option_;
   std::vector<StorageTableInterface<K, V>*> storage_tables_;
   StorageTableInterface<K, V>* writeable_storage_table_;
@@ -536,11 +1312,38 @@ class TableManager {
   std::atomic<bool> record_enabled_;
   tbb::concurrent_unordered_set<K>* train_delta_list_ptr_ = nullptr;
 
+  size_t retained_value_dim_ = 0;
+  SsdStorageTable<K, V>* ssd_table_ = nullptr;
+  bool auto_evict_;
+  std::unique_ptr<EvictionPolicy> eviction_policy_;
+  int64 eviction_slice_ = 256;
+  // Keys a batched lookup prefetches ahead, see PrefetchLookup().
+  int64 prefetch_distance_ = 8;
   tensorflow::Thread* eviction_thread_ = nullptr;
+  // Tables evicted along with this one, see EvictAlong().
+  mutex evict_along_mu_;
+  std::vector<TableManager<K, V>*> evict_along_;
+  std::atomic<bool> evicted_along_{false};
+  // ev_table_ itself when hot keys are on.
+  HotKeyMap<K, EmbeddingValue<V>>* hot_map_ = nullptr;
+  int64 num_hot_keys_ = 0;
+  tensorflow::Thread* hot_key_thread_ = nullptr;
   tensorflow::condition_variable shutdown_cv_;
   mutex mu_;
-  bool shutdown_ TF_GUARDED_BY(mu_) = false;
+  mutex eviction_mu_;
+  bool shutdown_ TF_GUARDED_BY(eviction_mu_) = false;
   V* zero_val_;
+  // Outlives ev_table_, which is deleted in the destructor body.
+  std::unique_ptr<SlabAllocator> row_allocator_;
+  // One allocator per NUMA node, binding its slabs to the node, see
+  // RowAllocator().
+  std::vector<std::unique_ptr<SlabAllocator>> node_row_allocators_;
+  int num_numa_nodes_ = 0;
+  // Rows stored as 16 bit elements and the allocator of such rows, see
+  // InitRowCodec(). row_allocator_ then allocates the float copies.
+  RowCodec row_codec_;
+  std::unique_ptr<SlabAllocator> compact_row_allocator_;
+  size_t stored_row_bytes_;
 };
 
 }  // namespace tfplus
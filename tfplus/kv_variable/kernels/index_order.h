@@ -0,0 +1,155 @@
+// Copyright 2023 The TFPlus Authors. All rights reserved.
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TFPLUS_KV_VARIABLE_KERNELS_INDEX_ORDER_H_
+#define TFPLUS_KV_VARIABLE_KERNELS_INDEX_ORDER_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "tensorflow/core/framework/op_kernel.h"
+#include "tensorflow/core/util/work_sharder.h"
+#include "tfplus/kv_variable/kernels/numa.h"
+
+namespace tfplus {
+
+// Order in which a sparse op visits the positions of its indices. The
+// default order is the identity, GroupBy() puts the positions of each group
+// next to each other, e.g. the keys of one NUMA node, keeping their relative
+// order. Work loops over j and handles position order(j).
+class IndexOrder {
+ public:
+  IndexOrder() = default;
+
+  // Stable counting sort of the positions [0, n) by group(i), which must be
+  // in [0, num_groups).
+  template <typename GroupFn>
+  static IndexOrder GroupBy(int64_t n, int num_groups, GroupFn&& group) {
+    IndexOrder order;
+    std::vector<int> groups(n);
+    order.group_begin_.assign(num_groups + 1, 0);
+    for (int64_t i = 0; i < n; ++i) {
+      groups[i] = group(i);
+      ++order.group_begin_[groups[i] + 1];
+    }
+    for (int g = 0; g < num_groups; ++g) {
+      order.group_begin_[g + 1] += order.group_begin_[g];
+    }
+    std::vector<int64_t> next(order.group_begin_.begin(),
+                              order.group_begin_.end() - 1);
+    order.positions_.resize(n);
+    for (int64_t i = 0; i < n; ++i) {
+      order.positions_[next[groups[i]]++] = i;
+    }
+    return order;
+  }
+
+  // GroupBy() the segment of the key at each position. ShardIndexOrder()
+  // then hands whole segments to each worker, so that no two workers update
+  // keys of the same segment.
+  template <typename SegmentFn>
+  static IndexOrder BySegment(int64_t n, int num_segments,
+                              SegmentFn&& segment) {
+    IndexOrder order =
+        GroupBy(n, num_segments, std::forward<SegmentFn>(segment));
+    order.by_segment_ = true;
+    return order;
+  }
+
+  int64_t operator()(int64_t j) const {
+    return positions_.empty() ? j : positions_[j];
+  }
+
+  bool identity() const { return positions_.empty(); }
+  bool by_segment() const { return by_segment_; }
+
+  // Group g holds [group_begin()[g], group_begin()[g + 1]), empty for the
+  // identity.
+  const std::vector<int64_t>& group_begin() const { return group_begin_; }
+
+  // keys in this order, for PrefetchLookup() which walks j rather than i.
+  template <typename Keys>
+  auto Reorder(const Keys& keys) const {
+    return [this, &keys](int64_t j) { return keys((*this)(j)); };
+  }
+
+ private:
+  std::vector<int64_t> positions_;
+  std::vector<int64_t> group_begin_;
+  bool by_segment_ = false;
+};
+
+// Runs work(start, limit) over [0, n) like Shard() on the cpu workers of
+// ctx. An order grouped by NUMA node, see KvVariable::NumaOrder(), runs each
+// group on the NumaWorkers threads of that node instead. An order grouped by
+// segment is split at segment boundaries only.
+template <typename Work>
+void ShardIndexOrder(::tensorflow::OpKernelContext* ctx,
+                     const IndexOrder& order, int64_t n, int64_t cost,
+                     Work&& work) {
+  if (order.identity()) {
+    auto worker_threads = *(ctx->device()->tensorflow_cpu_worker_threads());
+    ::tensorflow::Shard(worker_threads.num_threads, worker_threads.workers, n,
+                        cost, std::forward<Work>(work));
+    return;
+  }
+  if (order.by_segment()) {
+    const std::vector<int64_t>& begin = order.group_begin();
+    const int64_t num_segments = begin.size() - 1;
+    auto worker_threads = *(ctx->device()->tensorflow_cpu_worker_threads());
+    ::tensorflow::Shard(worker_threads.num_threads, worker_threads.workers,
+                        num_segments, cost * (n / num_segments + 1),
+                        [&begin, &work](int64_t first, int64_t last) {
+                          if (begin[first] < begin[last]) {
+                            work(begin[first], begin[last]);
+                          }
+                        });
+    return;
+  }
+  NumaWorkers::Get()->ParallelFor(order.group_begin(), cost,
+                                  std::forward<Work>(work));
+}
+
+// Shards the keys of several tables as one range, work(t, begin, end)
+// handles keys [begin, end) of table t, which has sizes[t] keys. Small
+// tables are packed into one shard and a large one is split across
+// several, so a batch of skewed tables neither pays a Shard() per table nor
+// waits on its largest table running on one thread.
+template <typename Work>
+void ShardTables(int num_threads, ::tensorflow::thread::ThreadPool* workers,
+                 const std::vector<int64_t>& sizes, int64_t cost_per_key,
+                 Work&& work) {
+  // offsets[t] is the position of the first key of table t.
+  std::vector<int64_t> offsets(sizes.size() + 1, 0);
+  for (size_t t = 0; t < sizes.size(); ++t) {
+    offsets[t + 1] = offsets[t] + sizes[t];
+  }
+  auto DoWork = [&offsets, &work](int64_t begin, int64_t end) {
+    size_t t = std::upper_bound(offsets.begin(), offsets.end(), begin) -
+               offsets.begin() - 1;
+    for (; begin < end; ++t) {
+      const int64_t table_end = std::min(end, offsets[t + 1]);
+      if (table_end > begin) {
+        work(t, begin - offsets[t], table_end - offsets[t]);
+      }
+      begin = table_end;
+    }
+  };
+  ::tensorflow::Shard(num_threads, workers, offsets.back(), cost_per_key,
+                      DoWork);
+}
+
+}  // namespace tfplus
+#endif  // TFPLUS_KV_VARIABLE_KERNELS_INDEX_ORDER_H_
@@ -31,12 +31,16 @@
 #include "tensorflow/core/framework/allocator.h"
 #include "tensorflow/core/framework/op_kernel.h"
 #include "tensorflow/core/framework/register_types.h"
+#include "tensorflow/core/framework/resource_mgr.h"
 #include "tensorflow/core/framework/tensor_types.h"
 #include "tensorflow/core/framework/tensor_util.h"
 #include "tensorflow/core/framework/types.h"
 #include "tensorflow/core/lib/core/status.h"
 #include "tensorflow/core/lib/gtl/inlined_vector.h"
 #include "tensorflow/core/lib/gtl/map_util.h"
+#include "tensorflow/core/lib/hash/hash.h"
+#include "tensorflow/core/lib/random/philox_random.h"
+#include "tensorflow/core/lib/strings/strcat.h"
 // #include "tensorflow/core/platform/default/logging.h"
 #include "tensorflow/core/platform/logging.h"
 #include "tensorflow/core/util/tensor_bundle/tensor_bundle.h"
@@ -46,14 +50,19 @@
 #include "tensorflow/core/platform/types.h"
 #include "tensorflow/core/public/version.h"
 #include "tensorflow/core/util/work_sharder.h"
+#include "tfplus/kv_variable/kernels/admission_sketch.h"
 #include "tfplus/kv_variable/kernels/embedding_value.h"
+#include "tfplus/kv_variable/kernels/frozen_table.h"
 #include "tfplus/kv_variable/kernels/hashmap.h"
 #include "tfplus/kv_variable/kernels/hybrid_embedding/embedding_context.h"
 #include "tfplus/kv_variable/kernels/hybrid_embedding/storage_config.pb.h"
 #include "tfplus/kv_variable/kernels/hybrid_embedding/table_manager.h"
+#include "tfplus/kv_variable/kernels/index_order.h"
 #include "tfplus/kv_variable/kernels/kv_variable_cwise_op.h"
 #include "tfplus/kv_variable/kernels/kv_variable_interface.h"
 #include "tfplus/kv_variable/kernels/mutex.h"
+#include "tfplus/kv_variable/kernels/shared_memory.h"
+#include "tfplus/kv_variable/kernels/unique_keys.h"
 #include "tfplus/kv_variable/kernels/utility.h"
 #include "tfplus/kv_variable/utils/progress_bar.h"
 #include "tfplus/kv_variable/utils/utils.h"
@@ -97,23 +106,63 @@ class KvVariable : public KvVariableInterface {
         value_shape_(value_shape),
         embedding_dim_(value_shape.num_elements()),
         enter_threshold_(SaturateMaxFrequency(enter_threshold)),
-        value_bytes_(embedding_dim_ * sizeof(V)) {
+        value_bytes_(embedding_dim_ * sizeof(V)),
+        num_colocated_slots_(std::max(0, storage_option.colocated_slots())),
+        row_dim_(embedding_dim_ * (1 + num_colocated_slots_)) {
     support_prediction_delta_ =
         GetEnvVar<bool>("SUPPORT_PREDICTION_DELTA_EXPORT", false);
     support_delta_export_ = GetEnvVar<bool>("SUPPORT_DELTA_EXPORT", false);
+    // Colocated slots are initialized along with the row, so a row holding
+    // them is never lazy.
+    lazy_rows_ = num_colocated_slots_ == 0 &&
+                 GetEnvVar<bool>("TFPLUS_KV_LAZY_ROWS", false);
+    dedup_keys_ = GetEnvVar<bool>("TFPLUS_KV_DEDUP_KEYS", false);
+    segment_apply_ = GetEnvVar<bool>("TFPLUS_KV_SEGMENT_APPLY", false);
+    lazy_decay_ = GetEnvVar<bool>("TFPLUS_KV_LAZY_DECAY", false);
+    if (lazy_decay_) {
+      update_steps_.reset(new ConcurrentFlatSimdMap<K, uint32_t>());
+    }
+    if (storage_option.admission_sketch_width() > 0 && enter_threshold_ > 1) {
+      admission_sketch_.reset(
+          new CountMinSketch(storage_option.admission_sketch_width()));
+    }
+    // A lazy row or a key waiting for admission must read the same value
+    // before and after it is allocated.
+    deterministic_init_ =
+        lazy_rows_ || admission_sketch_ != nullptr ||
+        GetEnvVar<bool>("TFPLUS_KV_DETERMINISTIC_INIT", false);
+    init_seed_ = ::tensorflow::Hash64(variable_name_);
+    shared_table_role_ =
+        InferenceMode() ? GetSharedTableRole() : SharedTableRole::kNone;
     VLOG(1) << "new kv variable: " << variable_name_
             << " enter_threshold: " << enter_threshold_
             << " SUPPORT_DELTA_EXPORT: " << support_delta_export_
             << " SUPPORT_PREDICTION_DELTA_EXPORT: "
             << support_prediction_delta_;
     table_ = new TableManager<K, V>(
-        storage_option, variable_name, embedding_dim_,
+        storage_option, variable_name, row_dim_,
         support_delta_export_ ? &train_deltalist_ : nullptr);
     lockable_ = table_->NeedExplicitLock();
     has_mem_table_ = table_->HasMemTable();
+    if (num_colocated_slots_ > 0) {
+      // Blacklisting the variable must not drop the optimizer state.
+      table_->RetainBlacklistedRows(embedding_dim_);
+      colocated_slots_.resize(num_colocated_slots_, nullptr);
+    }
   }
 
-  virtual ~KvVariable() { delete table_; }
+  virtual ~KvVariable() {
+    KvVariable<K, V>* primary = colocated_primary_.load();
+    if (primary != nullptr) {
+      primary->ForgetColocatedSlot(this);
+      primary->Unref();
+    }
+    // Joins the eviction thread, which erases the rows of the tracked slots.
+    delete table_;
+    for (auto slot : tracked_slots_) {
+      slot->Unref();
+    }
+  }
 
   string DebugString() const override {
     return variable_name_;
@@ -128,6 +177,19 @@ class KvVariable : public KvVariableInterface {
       ret += random_init_table_.AllocatedBytes();
     }
 
+    // get the memory reserved for embedding rows.
+    ret += table_->RowMemoryUsed();
+
+    if (admission_sketch_ != nullptr) {
+      ret += admission_sketch_->MemoryUsed();
+    }
+
+    const FrozenTable<K, V>* frozen =
+        frozen_table_.load(std::memory_order_acquire);
+    if (frozen != nullptr) {
+      ret += frozen->MemoryUsed();
+    }
+
     return sizeof(KvVariable) + ret;
   }
 
@@ -146,12 +208,12 @@ class KvVariable : public KvVariableInterface {
     auto count_size = [this, &num_rows](const K& key,
                                         const EVContext<V>* context) {
       auto embedding_val = context->Meta();
-      if (!embedding_val->InBlacklist() &&
+      if (HasLiveRow(embedding_val) &&
           !HasLowFrequency(embedding_val->GetFrequency())) {
         num_rows++;
       }
     };
-    table_->ForEach(count_size);
+    RowTable()->ForEach(count_size);
     return num_rows;
   }
 
@@ -165,18 +227,18 @@ class KvVariable : public KvVariableInterface {
     auto count_freq = [this, &freq_count](const K& key,
                                           const EVContext<V>* context) {
       auto embedding_val = context->Meta();
-      if (!embedding_val->InBlacklist() &&
+      if (HasLiveRow(embedding_val) &&
           !HasLowFrequency(embedding_val->GetFrequency())) {
         freq_count += GetUint16FromUint32(embedding_val->GetFrequency(), true);
       }
     };
-    table_->ForEach(count_freq);
+    RowTable()->ForEach(count_freq);
     return freq_count;
   }
 
   TensorShape GetShape() const override {
     TensorShape shape = value_shape_;
-    shape.InsertDim(0, table_->size());
+    shape.InsertDim(0, RowTable()->size());
 
     return shape;
   }
@@ -240,17 +302,56 @@ class KvVariable : public KvVariableInterface {
                      Tensor* values) const override {
     CHECK(values != nullptr);
     TF_RETURN_IF_ERROR(CheckInitializedInternal());
+    MaybeRefreshSharedTable();
+    {
+      // Left before mu() is taken, a new table is published under it.
+      FrozenTableReaders::Scope frozen_reader(&frozen_readers_);
+      const FrozenTable<K, V>* frozen = frozen_table_.load();
+      if (frozen != nullptr) {
+        return FindOrZerosFrozen(ctx, *frozen, keys, values);
+      }
+    }
+    // A colocated slot is not merged or split while it is read.
+    mutex_read_lock l(*mu());
     auto values_flat = values->flat_outer_dims<V>();
-    auto find_fn = [this, &values_flat](const K& key, EVContext<V>* context,
-                                        size_t row) {
-      context->OutputEmbeddingData(values_flat.template chip<0>(row),
-                                   embedding_dim_);
+    const int64_t offset = RowOffset();
+    auto find_fn = [this, &values_flat, offset](
+                       const K& key, EVContext<V>* context, size_t row) {
+      OutputValue(key, context, values_flat.template chip<0>(row), offset);
+    };
+    auto set_zero = [this, &values_flat](const K& key, EVContext<V>* context,
+                                         size_t row) {
+      values_flat.chip(row, 0).setZero();
+    };
+    return RowTable()->BatchGetWithFn(ctx, keys, find_fn, set_zero);
+  }
+
+  Status FindOrZerosRange(const Tensor& keys, Tensor* values, int64 begin,
+                          int64 end) const override {
+    CHECK(values != nullptr);
+    TF_RETURN_IF_ERROR(CheckInitializedInternal());
+    MaybeRefreshSharedTable();
+    {
+      FrozenTableReaders::Scope frozen_reader(&frozen_readers_);
+      const FrozenTable<K, V>* frozen = frozen_table_.load();
+      if (frozen != nullptr) {
+        FindOrZerosFrozenRange(*frozen, keys, values, begin, end);
+        return ::tensorflow::OkStatus();
+      }
+    }
+    mutex_read_lock l(*mu());
+    auto values_flat = values->flat_outer_dims<V>();
+    const int64_t offset = RowOffset();
+    auto find_fn = [this, &values_flat, offset](
+                       const K& key, EVContext<V>* context, size_t row) {
+      OutputValue(key, context, values_flat.template chip<0>(row), offset);
     };
     auto set_zero = [this, &values_flat](const K& key, EVContext<V>* context,
                                          size_t row) {
       values_flat.chip(row, 0).setZero();
     };
-    return table_->BatchGetWithFn(ctx, keys, find_fn, set_zero);
+    return RowTable()->BatchGetRangeWithFn(keys, begin, end, find_fn,
+                                           set_zero);
   }
 
   //  FindOrInsert is typically used in KvVariableGather OP for model training.
@@ -264,137 +365,374 @@ class KvVariable : public KvVariableInterface {
                       const Tensor* counts, Tensor* filter_out,
                       bool apply_filter = true) override {
     CHECK(values != nullptr);
-    if (counts != nullptr) {
-      if (keys.shape() != counts->shape()) {
-        return ::tensorflow::errors::InvalidArgument(
-            "KvVariable ", variable_name_.c_str(),
-            ": increment count, indices shape ", keys.shape().DebugString(),
-            " does not match with counts shape ",
-            counts->shape().DebugString());
-      }
-
-      if (counts->dtype() != DataType::DT_INT32) {
-        return ::tensorflow::errors::InvalidArgument(
-            "KvVariable ", variable_name_.c_str(),
-            ": increment count, counts dtype must be int32");
-      }
+    TF_RETURN_IF_ERROR(CheckCounts(keys, counts));
+    // Counting or filtering keys writes their frequencies in this variable.
+    const bool reads_only = counts == nullptr && filter_out == nullptr;
+    mutex_read_lock l = reads_only ? mutex_read_lock(*mu())
+                                   : LockDetached<mutex_read_lock>();
+    if (colocated_primary_.load() != nullptr) {
+      return FindColocatedLocked(keys, values, 0, keys.NumElements());
     }
-    mutex_read_lock l(*mu());
     return FindOrInsertLocally(ctx, keys, values, counts, filter_out,
                                 apply_filter);
   }
 
+  // Rows a gather resolved, see FindOrInsertWithHandles(). Kept in the step
+  // container of the step, the handles tensor only names it, so that no
+  // pointer is read from a tensor.
+  class RowResolution : public ::tensorflow::ResourceBase {
+   public:
+    RowResolution(const TableManager<K, V>* table, int64 epoch, int64 n)
+        : table_(table), epoch_(epoch), keys_(n), rows_(n, nullptr) {}
+
+    std::string DebugString() const override {
+      return ::tensorflow::strings::StrCat("RowResolution of ", keys_.size(),
+                                           " keys");
+    }
+
+    static int64 NextId() {
+      static std::atomic<int64> next_id{1};
+      return next_id.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    static std::string Name(int64 id) {
+      return ::tensorflow::strings::StrCat("kv_variable_rows_", id);
+    }
+
+    const TableManager<K, V>* table() const { return table_; }
+    int64 epoch() const { return epoch_; }
+    int64 size() const { return static_cast<int64>(keys_.size()); }
+    K* keys() { return keys_.data(); }
+    const K& key(int64 i) const { return keys_[i]; }
+    EmbeddingValue<V>** rows() { return rows_.data(); }
+    EmbeddingValue<V>* row(int64 i) const { return rows_[i]; }
+
+   private:
+    const TableManager<K, V>* table_;
+    const int64 epoch_;
+    std::vector<K> keys_;
+    std::vector<EmbeddingValue<V>*> rows_;
+  };
+
+  Status FindOrInsertWithHandles(OpKernelContext* ctx, const Tensor& keys,
+                                 Tensor* values, Tensor* handles) override {
+    CHECK(values != nullptr && handles != nullptr);
+    mutex_read_lock l(*mu());
+    auto handles_matrix = handles->matrix<int64>();
+    handles_matrix.setZero();
+    if (colocated_primary_.load() != nullptr) {
+      return FindColocatedLocked(keys, values, 0, keys.NumElements());
+    }
+    if (!table_->CachesRows() || ctx == nullptr ||
+        ctx->step_container() == nullptr) {
+      return FindOrInsertLocally(ctx, keys, values, nullptr, nullptr);
+    }
+    auto resolution = NewRowResolution(keys.NumElements());
+    Status st = ResolveRowsLocked(ctx, keys, values, resolution);
+    if (!st.ok()) {
+      resolution->Unref();
+      return st;
+    }
+    const int64 id = RowResolution::NextId();
+    const auto& keys_flat = keys.flat<K>();
+    for (int64 i = 0; i < keys_flat.size(); ++i) {
+      handles_matrix(i, 0) = id;
+      handles_matrix(i, 1) = i;
+      handles_matrix(i, 2) = static_cast<int64>(keys_flat(i));
+    }
+    // Dropped with the step, the handles are never valid in another one.
+    return ctx->step_container()->Create(ctx->resource_manager(),
+                                         RowResolution::Name(id), resolution);
+  }
+
+  // An empty RowResolution of n keys of this table. The epoch is read before
+  // the lookups, a key erased during them changes it.
+  RowResolution* NewRowResolution(int64 n) const {
+    return new RowResolution(table_, table_->RowEpoch(), n);
+  }
+
+  // FindOrInsert() of keys that stores the row of each position in
+  // resolution, the caller holds mu() shared.
+  Status ResolveRowsLocked(OpKernelContext* ctx, const Tensor& keys,
+                           Tensor* values, RowResolution* resolution) {
+    TF_RETURN_IF_ERROR(FindOrInsertLocally(ctx, keys, values, nullptr,
+                                           nullptr, true, nullptr,
+                                           resolution->rows()));
+    const auto& keys_flat = keys.flat<K>();
+    std::copy_n(keys_flat.data(), keys_flat.size(), resolution->keys());
+    return ::tensorflow::OkStatus();
+  }
+
+  Status FindOrInsertRange(const Tensor& keys, Tensor* values,
+                           const Tensor* counts, Tensor* filter_out,
+                           bool apply_filter, int64 begin,
+                           int64 end) override {
+    CHECK(values != nullptr);
+    TF_RETURN_IF_ERROR(CheckCounts(keys, counts));
+    const bool reads_only = counts == nullptr && filter_out == nullptr;
+    // A map that needs an explicit lock can not insert from several threads,
+    // the ranges of its table run one at a time.
+    mutex_write_lock write_lock =
+        reads_only ? mutex_write_lock(*mu(), lockable_)
+                   : LockDetached<mutex_write_lock>(lockable_);
+    mutex_read_lock read_lock =
+        reads_only ? mutex_read_lock(*mu(), !lockable_)
+                   : LockDetached<mutex_read_lock>(!lockable_);
+    TF_RETURN_IF_ERROR(CheckInitializedInternal());
+    if (colocated_primary_.load() != nullptr) {
+      return FindColocatedLocked(keys, values, begin, end);
+    }
+    const auto& keys_flat = keys.flat<K>();
+    auto key_at = [&keys_flat](int64_t i) { return keys_flat(i); };
+    Status st = ::tensorflow::OkStatus();
+    FindOrInsertShard(IndexOrder(), key_at, keys_flat,
+                      values->flat_outer_dims<V>(), counts, filter_out,
+                      apply_filter, GetCurrentUnixTimeByDivisor(), nullptr,
+                      begin, end, &st);
+    return st;
+  }
+
+  // With rows, the rows of a RowResolution, the EmbeddingValue of each
+  // position is stored in rows.
   Status FindOrInsertLocally(
       OpKernelContext* ctx, const Tensor& keys, Tensor* values,
       const Tensor* counts, Tensor* filter_out, bool apply_filter = true,
-      std::vector<std::pair<K, size_t>>* key_and_index = nullptr) {
+      std::vector<std::pair<K, size_t>>* key_and_index = nullptr,
+      EmbeddingValue<V>** rows = nullptr) {
     const auto& keys_flat = keys.flat<K>();
     auto values_flat = values->flat_outer_dims<V>();
     uint16_t last_update_time_in_days = GetCurrentUnixTimeByDivisor();
 
     TF_RETURN_IF_ERROR(CheckInitializedInternal());
+    if (dedup_keys_ && key_and_index == nullptr && keys_flat.size() > 1) {
+      return FindOrInsertUnique(ctx, keys, values, counts, filter_out,
+                                apply_filter, rows);
+    }
     // thread can't be wait for mutex lock
     Status st = ::tensorflow::OkStatus();
-    auto DoWork = [this, &keys_flat, &values_flat, &filter_out, &apply_filter,
-                   &last_update_time_in_days, &counts, key_and_index,
-                   &st](int64_t start, int64_t end) {
-      std::unique_ptr<V, void (*)(V*)> buf(
-          static_cast<V*>(AllocateRaw(value_bytes_)), DeallocateRaw<V>);
-      for (int64_t i = start; i < end; ++i) {
-        // Check if key exists in filter_out.
-        size_t row = i;
-        K key = keys_flat(row);
-        if (key_and_index) {
-          row = (*key_and_index)[i].second;
-          key = (*key_and_index)[i].first;
+    size_t key_size =
+        key_and_index == nullptr ? keys_flat.size() : key_and_index->size();
+    auto key_at = [&keys_flat, key_and_index](int64_t i) {
+      return key_and_index ? (*key_and_index)[i].first : keys_flat(i);
+    };
+    const bool sharded = ctx != nullptr && !lockable_;
+    // Inserting threads allocate the rows, in NUMA mode the keys of a node
+    // go to the threads of that node.
+    IndexOrder order;
+    if (sharded && table_->num_numa_nodes() > 0) {
+      order = IndexOrder::GroupBy(
+          key_size, table_->num_numa_nodes(),
+          [this, &key_at](int64_t i) { return table_->NumaNodeOf(key_at(i)); });
+    }
+    auto DoWork = [this, &order, &key_at, &keys_flat, &values_flat,
+                   filter_out, apply_filter, last_update_time_in_days, counts,
+                   key_and_index, rows, &st](int64_t start, int64_t end) {
+      FindOrInsertShard(order, key_at, keys_flat, values_flat, counts,
+                        filter_out, apply_filter, last_update_time_in_days,
+                        key_and_index, start, end, &st, rows);
+    };
+    if (sharded) {
+      ShardIndexOrder(ctx, order, key_size, 5000, DoWork);
+    } else {
+      DoWork(0, key_size);
+    }
+    return st;
+  }
+
+  // Looks up or inserts the keys at positions order(j) for j in [start, end)
+  // of FindOrInsertLocally().
+  template <typename KeyAt>
+  void FindOrInsertShard(
+      const IndexOrder& order, const KeyAt& key_at,
+      typename ::tensorflow::TTypes<K>::ConstFlat keys_flat,
+      typename ::tensorflow::TTypes<V>::Matrix values_flat,
+      const Tensor* counts,
+      Tensor* filter_out, bool apply_filter, uint16_t last_update_time_in_days,
+      const std::vector<std::pair<K, size_t>>* key_and_index, int64_t start,
+      int64_t end, Status* st, EmbeddingValue<V>** rows = nullptr) {
+    std::unique_ptr<V, void (*)(V*)> buf(
+        static_cast<V*>(AllocateRaw(value_bytes_)), DeallocateRaw<V>);
+    if (table_->SSDStorageEneabled()) {
+      // Bring the rows of this shard back from SSD in one batched read.
+      std::vector<K> shard_keys;
+      shard_keys.reserve(end - start);
+      for (int64_t j = start; j < end; ++j) {
+        shard_keys.push_back(key_at(order(j)));
+      }
+      table_->PromoteBatch(shard_keys);
+    }
+    for (int64_t j = start; j < end; ++j) {
+      const int64_t i = order(j);
+      table_->PrefetchLookup(order.Reorder(key_at), start, j, end);
+      // Check if key exists in filter_out.
+      size_t row = i;
+      K key = keys_flat(row);
+      if (key_and_index) {
+        row = (*key_and_index)[i].second;
+        key = (*key_and_index)[i].first;
+      }
+      if (filter_out != nullptr && apply_filter &&
+          filter_out->flat<bool>()(row)) {
+        continue;
+      }
+
+      uint16_t admitted_frequency = 0;
+      if (admission_sketch_ != nullptr) {
+        uint16_t frequency = 1;
+        if (counts != nullptr) {
+          frequency =
+              SaturateMaxFrequency(counts->template flat<int32>()(row));
         }
-        if (filter_out != nullptr && apply_filter &&
-            filter_out->flat<bool>()(row)) {
+        if (!AdmitKey(key, frequency, &admitted_frequency)) {
+          if (filter_out != nullptr && !apply_filter) {
+            filter_out->template flat<bool>()(row) = true;
+          }
+          // The key reads the value it is going to be admitted with.
+          OutputInitialValue(key, values_flat.template chip<0>(row));
           continue;
         }
+      }
 
-        if (NeedDeltaInfo()) {
-          train_deltalist_.insert(key);
-        }
+      if (NeedDeltaInfo()) {
+        train_deltalist_.insert(key);
+      }
 
-        auto find_func = [this, &values_flat, &filter_out, &counts,
-                          &apply_filter, &last_update_time_in_days, &row,
-                          &key](EVContext<V>* context) {
-          uint16_t frequency = 1;
-          if (counts != nullptr) {
-            frequency =
-                SaturateMaxFrequency(counts->template flat<int32>()(row));
-          }
-          context->Meta()->AddFrequency(frequency, last_update_time_in_days);
-          UpdateUnderThreshold(context);
-          context->OutputEmbeddingData(values_flat.template chip<0>(row),
-                                        embedding_dim_);
-        };
+      auto find_func = [this, &values_flat, &filter_out, &counts,
+                        &apply_filter, &last_update_time_in_days, &row,
+                        &key](EVContext<V>* context) {
+        uint16_t frequency = 1;
+        if (counts != nullptr) {
+          frequency =
+              SaturateMaxFrequency(counts->template flat<int32>()(row));
+        }
+        context->Meta()->AddFrequency(frequency, last_update_time_in_days);
+        UpdateUnderThreshold(context);
+        OutputValue(key, context, values_flat.template chip<0>(row));
+      };
 
-        bool should_filter = false;
-        uint32_t freq = 1;
+      bool should_filter = false;
+      uint32_t freq = admitted_frequency > 0 ? admitted_frequency : 1;
+      if (filter_out != nullptr && !apply_filter) {
+        should_filter = HasLowFrequency(freq);
+      }
+      auto insert_func = [this, &values_flat, &freq, &apply_filter,
+                          &should_filter, &filter_out,
+                          &last_update_time_in_days, &counts, &key, &row,
+                          &admitted_frequency](EVContext<V>* context) {
+        auto stat = reinterpret_cast<uint16_t*>(&freq);
+        if (admitted_frequency > 0) {
+          stat[0] = admitted_frequency;
+        } else if (counts != nullptr) {
+          stat[0] = SaturateMaxFrequency(counts->template flat<int32>()(row));
+        } else {
+          stat[0] = static_cast<uint16_t>(1);
+        }
+        stat[1] = last_update_time_in_days + 0;
+        context->Meta()->UpdateFrequency(freq);
         if (filter_out != nullptr && !apply_filter) {
-          should_filter = HasLowFrequency(freq);
+          filter_out->template flat<bool>()(row) = should_filter;
         }
-        auto insert_func = [this, &values_flat, &freq, &apply_filter,
-                            &should_filter, &filter_out,
-                            &last_update_time_in_days, &counts, &key,
-                            &row](EVContext<V>* context) {
-          auto stat = reinterpret_cast<uint16_t*>(&freq);
-          if (counts != nullptr) {
-            stat[0] = SaturateMaxFrequency(counts->template flat<int32>()(row));
-          } else {
-            stat[0] = static_cast<uint16_t>(1);
-          }
-          stat[1] = last_update_time_in_days + 0;
-          context->Meta()->UpdateFrequency(freq);
-          if (filter_out != nullptr && !apply_filter) {
-            filter_out->template flat<bool>()(row) = should_filter;
-          }
-          if (context->Meta()->GetStorageType() == StorageType::MEM_STORAGE) {
-            // needs allocating new buffer for mem_storage
-            context->UpdateValue(static_cast<V*>(AllocateRaw(value_bytes_)),
-                                 true, value_bytes_);
-          }
-          GenerateRandomInitialValue(context->Value());
+        if (lazy_rows_) {
+          // Only the metadata is stored, the row is allocated by the first
+          // update of the key.
+          context->InitValue(nullptr, false);
           UpdateUnderThreshold(context);
-          context->OutputEmbeddingData(values_flat.template chip<0>(row),
-                                       embedding_dim_);
-        };
-        EVContext<V> context(buf.get(), false);
-        context.SetStatus(&st);
-        table_->FindOrInsertWithDifferentFn(key, find_func, insert_func,
-                                            &context);
+          OutputInitialValue(key, values_flat.template chip<0>(row));
+          return;
+        }
+        if (context->Meta()->GetStorageType() == StorageType::MEM_STORAGE) {
+          // needs allocating new buffer for mem_storage
+          context->UpdateValue(table_->AllocateRow(), true, value_bytes_);
+        }
+        GenerateRandomInitialRow(key, context->Value());
+        UpdateUnderThreshold(context);
+        context->OutputEmbeddingData(values_flat.template chip<0>(row),
+                                     embedding_dim_);
+      };
+      EVContext<V> context(buf.get(), false);
+      context.SetStatus(st);
+      table_->FindOrInsertWithDifferentFn(key, find_func, insert_func,
+                                          &context);
+      if (rows != nullptr) {
+        rows[row] = context.Meta();
       }
-    };
-    size_t key_size =
-        key_and_index == nullptr ? keys_flat.size() : key_and_index->size();
-    if (ctx != nullptr && !lockable_) {
-      auto worker_threads = *(ctx->device()->tensorflow_cpu_worker_threads());
-      ::tensorflow::Shard(worker_threads.num_threads, worker_threads.workers,
-                          key_size, 5000, DoWork);
-    } else {
-      DoWork(0, key_size);
     }
-    return st;
+  }
+
+  // FindOrInsertLocally() with TFPLUS_KV_DEDUP_KEYS, each distinct key is
+  // looked up once with the count of all its occurrences, then its row is
+  // copied to the other positions of the key.
+  Status FindOrInsertUnique(OpKernelContext* ctx, const Tensor& keys,
+                            Tensor* values, const Tensor* counts,
+                            Tensor* filter_out, bool apply_filter,
+                            EmbeddingValue<V>** rows) {
+    const auto& keys_flat = keys.flat<K>();
+    const int64_t n = keys_flat.size();
+    const bool skip_filtered = filter_out != nullptr && apply_filter;
+    UniqueKeys<K> unique(
+        ctx, n, [&keys_flat](int64_t i) { return keys_flat(i); },
+        [filter_out, skip_filtered](int64_t i) {
+          return skip_filtered && filter_out->flat<bool>()(i);
+        });
+    std::vector<std::pair<K, size_t>> key_and_index(unique.size());
+    for (int64_t u = 0; u < unique.size(); ++u) {
+      key_and_index[u] = {keys_flat(unique.first(u)), unique.first(u)};
+    }
+    Tensor summed_counts(DT_INT32, TensorShape({n}));
+    auto summed = summed_counts.flat<int32>();
+    summed.setZero();
+    unique.ForEachPosition(1, [&unique, &summed, counts](int64_t i,
+                                                         int64_t u) {
+      summed(unique.first(u)) +=
+          counts != nullptr ? counts->template flat<int32>()(i) : 1;
+    });
+    TF_RETURN_IF_ERROR(FindOrInsertLocally(ctx, keys, values, &summed_counts,
+                                           filter_out, apply_filter,
+                                           &key_and_index, rows));
+    if (!unique.has_duplicates()) {
+      return ::tensorflow::OkStatus();
+    }
+    V* values_data = values->flat<V>().data();
+    const bool copy_filter = filter_out != nullptr && !apply_filter;
+    unique.ForEachPosition(
+        embedding_dim_, [this, &unique, values_data, filter_out, copy_filter,
+                         rows](int64_t i, int64_t u) {
+          const int64_t first = unique.first(u);
+          if (i == first) return;
+          std::copy_n(values_data + first * embedding_dim_, embedding_dim_,
+                      values_data + i * embedding_dim_);
+          if (copy_filter) {
+            filter_out->flat<bool>()(i) = filter_out->flat<bool>()(first);
+          }
+          if (rows != nullptr) {
+            rows[i] = rows[first];
+          }
+        });
+    return ::tensorflow::OkStatus();
   }
 
   void FindOrInsertUnsafe(const K& key, EVContext<V>* context,
                           bool* filter_out) {
+    // The caller holds the lock of key, the lookup must not take it again.
+    if (filter_out != nullptr && admission_sketch_ != nullptr &&
+        context->Meta() == nullptr &&
+        kv_map()->FindOrNullUnsafe(key) == nullptr) {
+      // Keys only enter the table through the gather, see admission_sketch_.
+      *filter_out = true;
+      return;
+    }
     auto insert_func = [this, key](EVContext<V>* context) {
       if (context->Meta()->GetStorageType() == StorageType::MEM_STORAGE) {
         // needs allocating new buffer for mem_storage
-        context->UpdateValue(static_cast<V*>(AllocateRaw(value_bytes_)), true,
-                             value_bytes_);
+        context->UpdateValue(table_->AllocateRow(), true, value_bytes_);
       } else {
         // TODO(mochen.bmc): change training_ops.cc to removing the if
         // statement, add context_buf
         if (!context->Value()) {
-          context->UpdateValue(static_cast<V*>(AllocateRaw(value_bytes_)), true,
-                               value_bytes_);
+          context->UpdateValue(table_->AllocateRow(), true, value_bytes_);
         }
       }
-      GenerateRandomInitialValue(context->Value());
+      GenerateRandomInitialRow(key, context->Value());
       UpdateUnderThreshold(context);
     };
     bool succ = table_->FindOrInsertWithFnUnsafe(key, insert_func, context);
@@ -406,7 +744,11 @@ class KvVariable : public KvVariableInterface {
         if (context->Meta()->InBlacklist() && !should_filter) {
           table_->RemoveBlacklistUnsafe(key, context);
         }
+        if (!should_filter) {
+          MaterializeLazyRowUnsafe(key, context);
+        }
       } else {
+        MaterializeLazyRowUnsafe(key, context);
         // backward variables, evict needs the frequency information
         uint16_t last_update_time_in_days = GetCurrentUnixTimeByDivisor();
         uint16_t frequency = 1;
@@ -438,12 +780,14 @@ class KvVariable : public KvVariableInterface {
     const auto& values_inner_flat = values.template flat_inner_dims<V, 2>();
     auto values_flat = values.flat_outer_dims<V>();
 
-    mutex_read_lock l(*mu());
+    mutex_read_lock l = LockDetached<mutex_read_lock>();
     TF_RETURN_IF_ERROR(CheckInitializedInternal());
-    auto DoWork = [this, &keys_flat, &values_inner_flat, &values_flat,
+    const IndexOrder order = ctx != nullptr ? NumaOrder(keys) : IndexOrder();
+    auto DoWork = [this, &order, &keys_flat, &values_inner_flat, &values_flat,
                    &filterout, &blacklist](int64_t start, int64_t end) {
       // Apply filtering.
-      for (int64_t i = start; i < end; ++i) {
+      for (int64_t j = start; j < end; ++j) {
+        const int64_t i = order(j);
         const auto& key = keys_flat(i);
         bool mark_blacklist =
             blacklist == nullptr ? false : blacklist->flat<bool>()(i);
@@ -454,12 +798,11 @@ class KvVariable : public KvVariableInterface {
         if ((filterout != nullptr && filterout->flat<bool>()(i))) {
           continue;
         }
-        std::function<void(EVContext<V> * context)> update_fn;
         if (!mark_blacklist) {
           auto insert_or_update_fn = [this, &mark_blacklist, &values_flat, &i,
                                       &key](EVContext<V>* context) {
             const V* value_ptr = &values_flat(i, 0);
-            context->UpdateValue(value_ptr, false, value_bytes_);
+            CopyToRow(key, context, value_ptr);
             UpdateUnderThreshold(context);
           };
           // update: memcpy, insert: allocate and memcpy
@@ -475,9 +818,7 @@ class KvVariable : public KvVariableInterface {
     };
 
     if (ctx != nullptr) {
-      auto worker_threads = *(ctx->device()->tensorflow_cpu_worker_threads());
-      ::tensorflow::Shard(worker_threads.num_threads, worker_threads.workers,
-                          keys_flat.size(), 5000, DoWork);
+      ShardIndexOrder(ctx, order, keys_flat.size(), 5000, DoWork);
     } else {
       DoWork(0, keys_flat.size());
     }
@@ -489,8 +830,11 @@ class KvVariable : public KvVariableInterface {
     CoverUpdateUnsafe(key, context);
   }
 
+  // Called by the training ops once they updated the value of context in
+  // place, it writes the value back unless context points into the row.
   void CoverUpdateUnsafe(const K& key, EVContext<V>* context) const {
-    if (context->Meta()->GetStorageType() == StorageType::MEM_STORAGE) {
+    if (context->Meta()->GetStorageType() == StorageType::MEM_STORAGE &&
+        (!table_->CompactRows() || context->Meta()->InBlacklist())) {
       UpdateUnderThreshold(context);
     } else {
       auto update_fn = [this, &key](EVContext<V>* context) {
@@ -513,12 +857,11 @@ class KvVariable : public KvVariableInterface {
 
     for (int64_t i = 0; i < indices_values.size(); ++i) {
       const auto& key = indices_values(i);
-      const auto v = table_->FindOrNull(key);
-      if (v == nullptr) {
-        counts_values(i) = 0;
-      } else {
-        counts_values(i) = GetUint16FromUint32(v->GetFrequency(), true);
-      }
+      RowTable()->FindMetaWithFn(
+          key, [&counts_values, i](const EmbeddingValue<V>* v) {
+            counts_values(i) =
+                v == nullptr ? 0 : GetUint16FromUint32(v->GetFrequency(), true);
+          });
     }
     return ::tensorflow::OkStatus();
   }
@@ -550,18 +893,101 @@ class KvVariable : public KvVariableInterface {
 
     for (int64_t i = 0; i < indices_values.size(); ++i) {
       const auto& key = indices_values(i);
-      const auto v = table_->FindOrNull(key);
-      if (v == nullptr) {
-        timestamps_values(i) = GetCurrentUnixTimeByDivisor();
-      } else {
-        timestamps_values(i) = GetUint16FromUint32(v->GetFrequency(), false);
-      }
+      RowTable()->FindMetaWithFn(
+          key, [&timestamps_values, i](const EmbeddingValue<V>* v) {
+            timestamps_values(i) =
+                v == nullptr ? GetCurrentUnixTimeByDivisor()
+                             : GetUint16FromUint32(v->GetFrequency(), false);
+          });
     }
     return ::tensorflow::OkStatus();
   }
 
   bool IsInitialized() const override { return random_init_table_set_; }
 
+  // Copies the rows into a FrozenTable that FindOrZeros reads from then on
+  // without taking any lock, the previous frozen table, if any, is replaced.
+  // Imports call it in inference mode, where the rows only change when the
+  // next model version is loaded. Changes to the rows made afterwards are
+  // not seen by FindOrZeros until the next call. The rows are held twice,
+  // by the table and by its frozen copy, and three times while a new copy
+  // waits for the lookups that still read the previous one.
+  //
+  // With TFPLUS_KV_SHARED_TABLE=loader the frozen table is written to shared
+  // memory and published as the next version of the variable, processes
+  // with TFPLUS_KV_SHARED_TABLE=reader map it instead of importing the rows,
+  // see AttachSharedTableUnsafe().
+  void FreezeTable() {
+    mutex_write_lock lock(*mu());
+    FreezeTableUnsafe();
+  }
+
+  // FreezeTable() for callers holding the write lock of mu().
+  void FreezeTableUnsafe() {
+    if (shared_table_role_ == SharedTableRole::kReader) {
+      ::tensorflow::Status status = AttachSharedTableUnsafe(false);
+      if (!status.ok()) {
+        LOG(WARNING) << "KvVariable " << variable_name_
+                     << " keeps its frozen table: " << status;
+      }
+      return;
+    }
+    std::vector<K> keys;
+    std::vector<V> rows;
+    keys.reserve(table_->size());
+    rows.reserve(table_->size() * embedding_dim_);
+    table_->ForEachWithValue([this, &keys, &rows](
+                                 const K& key, const EVContext<V>* context) {
+      // Blacklisted keys read zeros just like missing ones.
+      const EmbeddingValue<V>* ev = context->Meta();
+      if (ev->InBlacklist() ||
+          (context->Value() == nullptr && !IsLazyRow(ev))) {
+        return;
+      }
+      keys.push_back(key);
+      rows.resize(rows.size() + embedding_dim_);
+      V* row = rows.data() + rows.size() - embedding_dim_;
+      if (context->Value() != nullptr) {
+        std::copy_n(context->Value(), embedding_dim_, row);
+      } else {
+        GenerateRandomInitialValue(key, row);
+      }
+    });
+    if (shared_table_role_ == SharedTableRole::kLoader) {
+      ::tensorflow::Status status = ShareFrozenTableUnsafe(keys, rows);
+      if (status.ok()) {
+        return;
+      }
+      LOG(WARNING) << "KvVariable " << variable_name_
+                   << " is only frozen in this process: " << status;
+    }
+    PublishFrozenTable(
+        new FrozenTable<K, V>(std::move(keys), std::move(rows),
+                              embedding_dim_));
+  }
+
+  // Maps the latest version of the table the loader process shares, for
+  // readers of a shared table. With wait it retries until the loader
+  // published one, for at most TFPLUS_KV_SHARED_TABLE_WAIT_MS. Requires the
+  // write lock of mu().
+  ::tensorflow::Status AttachSharedTableUnsafe(bool wait) {
+    auto* env = ::tensorflow::Env::Default();
+    const uint64_t deadline =
+        env->NowMicros() +
+        (wait ? GetEnvVar<int64_t>("TFPLUS_KV_SHARED_TABLE_WAIT_MS", 600000)
+              : 0) *
+            1000;
+    while (true) {
+      ::tensorflow::Status status = TryAttachSharedTableUnsafe();
+      if (status.ok() || env->NowMicros() >= deadline ||
+          !(::tensorflow::errors::IsUnavailable(status) ||
+            ::tensorflow::errors::IsNotFound(status))) {
+        return status;
+      }
+      env->SleepForMicroseconds(100000);
+    }
+  }
+
   Status ImportValues(OpKernelContext* ctx, const Tensor& keys,
                       const Tensor& values,
                       const std::vector<Tensor>& others) override;
@@ -584,6 +1010,37 @@ class KvVariable : public KvVariableInterface {
     return ::tensorflow::OkStatus();
   }
 
+  Status ExportAdmissionSketch(OpKernelContext* ctx) override {
+    TensorShape shape({0});
+    if (admission_sketch_ != nullptr) {
+      shape = TensorShape({CountMinSketch::kDepth, admission_sketch_->width()});
+    }
+    Tensor* sketch;
+    TF_RETURN_IF_ERROR(ctx->allocate_output("sketch", shape, &sketch));
+    if (admission_sketch_ != nullptr) {
+      admission_sketch_->Export(sketch->flat<uint16>().data());
+    }
+    return ::tensorflow::OkStatus();
+  }
+
+  Status ImportAdmissionSketch(const Tensor& sketch) override {
+    if (admission_sketch_ == nullptr) {
+      return ::tensorflow::OkStatus();
+    }
+    if (sketch.NumElements() == 0) {
+      admission_sketch_->Clear();
+      return ::tensorflow::OkStatus();
+    }
+    if (sketch.NumElements() != admission_sketch_->num_counters()) {
+      return ::tensorflow::errors::InvalidArgument(
+          "KvVariable ", variable_name_.c_str(), ": admission sketch has ",
+          sketch.NumElements(), " counters instead of ",
+          admission_sketch_->num_counters());
+    }
+    admission_sketch_->Import(sketch.flat<uint16>().data());
+    return ::tensorflow::OkStatus();
+  }
+
   Status ExportValues(OpKernelContext* ctx, int first_n,
                       bool enable_cutoff = false, float cutoff_value = 0.0,
                       void* table_handler = nullptr) override;
@@ -675,7 +1132,7 @@ class KvVariable : public KvVariableInterface {
     const auto& updates_flat = updates.flat_outer_dims<V>();
 
     // Run in parallel, kernel function per thread.
-    mutex_read_lock lock(*mu());
+    mutex_read_lock lock = LockDetached<mutex_read_lock>();
     auto DoWork = [this, &keys_flat, &updates_flat, op_obj, num_elements](
                       int64_t start_row, int64_t end_row) {
       // Iterate over the slice.
@@ -688,6 +1145,7 @@ class KvVariable : public KvVariableInterface {
         auto scatter_update_fn = [this, &row, &updates_flat, &num_elements,
                                   &op_obj, &key](EVContext<V>* context) {
           if (!context->Meta()->InBlacklist()) {
+            MaterializeLazyRowUnsafe(key, context);
             typename ::tensorflow::TTypes<V>::ConstTensor lhs(context->Value(),
                                                               num_elements);
             const auto& res = (*op_obj)(lhs, updates_flat.chip(row, 0));
@@ -699,11 +1157,8 @@ class KvVariable : public KvVariableInterface {
         if (!succeed) {
           auto insert_func = [this, &num_elements, &op_obj, &updates_flat, &row,
                               &key](EVContext<V>* context) {
-            V* init_vec =
-                reinterpret_cast<V*>(::tensorflow::cpu_allocator()->AllocateRaw(
-                    ::tensorflow::Allocator::kAllocatorAlignment,
-                    value_bytes_));
-            GenerateRandomInitialValue(init_vec);
+            V* init_vec = table_->AllocateRow();
+            GenerateRandomInitialRow(key, init_vec);
             context->UpdateValue(init_vec, true, value_bytes_);
             typename ::tensorflow::TTypes<V>::ConstTensor lhs(context->Value(),
                                                               num_elements);
@@ -739,11 +1194,12 @@ class KvVariable : public KvVariableInterface {
     TF_RETURN_IF_ERROR(CheckKvVariableKeyTypes(indices.dtype()));
 
     const auto& indices_values = indices.template flat<K>();
-    mutex_write_lock lock(*mu());
+    mutex_write_lock lock = LockDetached<mutex_write_lock>();
     TF_RETURN_IF_ERROR(CheckInitializedInternal());
     for (int64_t i = 0; i < indices_values.size(); ++i) {
       const auto& delete_key = indices_values(i);
       table_->DeleteKey(delete_key);
+      ForgetStep(delete_key);
       if (NeedDeltaInfo()) {
         train_deltalist_.insert(delete_key);
       }
@@ -755,8 +1211,7 @@ class KvVariable : public KvVariableInterface {
   // Delete keys with timestamp.
   Status DeleteWithTimestamp(OpKernelContext* ctx, int threshold) {
     CHECK(ctx != nullptr);
-
-    mutex_write_lock l(*mu());
+    mutex_write_lock l = LockDetached<mutex_write_lock>();
     TF_RETURN_IF_ERROR(CheckInitializedInternal());
 
     std::vector<K> delete_list;
@@ -777,6 +1232,7 @@ class KvVariable : public KvVariableInterface {
     table_->ForEach(delete_iter);
     for (auto iter = delete_list.begin(); iter != delete_list.end(); ++iter) {
       table_->DeleteKey(*iter);
+      ForgetStep(*iter);
     }
 
     Tensor* delete_keys;
@@ -812,6 +1268,7 @@ class KvVariable : public KvVariableInterface {
   int embedding_dim() const override { return embedding_dim_; }
   tf_mutex* mu() const override { return table_->mu(); }
   IMap<K, EmbeddingValue<V>>* kv_map() const { return table_->GetKVMap(); }
+  TableManager<K, V>* table_manager() const { return table_; }
 
   inline bool NeedDeltaInfo() const override {
     return support_delta_export_ || table_->MayNeedDeltaInfo();
@@ -864,6 +1321,332 @@ class KvVariable : public KvVariableInterface {
     return table_->GetScopedKeyLock(key, lock_type);
   }
 
+  // Write lock an optimizer holds on the key it updates. Over an
+  // ApplyOrder() grouped by segment it keeps the segment locked until the
+  // keys move on to the next one, rather than locking it again for every
+  // key.
+  class ApplyLock {
+   public:
+    ApplyLock(KvVariable* var, const IndexOrder& order)
+        : var_(var), by_segment_(order.by_segment()) {}
+    ApplyLock(ApplyLock&& other)
+        : var_(other.var_),
+          by_segment_(other.by_segment_),
+          locked_(other.locked_),
+          segment_(other.segment_) {
+      other.locked_ = nullptr;
+    }
+    ApplyLock(const ApplyLock&) = delete;
+    ApplyLock& operator=(const ApplyLock&) = delete;
+    ~ApplyLock() { Unlock(); }
+
+    // The lock of key, empty when the segment of key is held already.
+    ScopedSpinLock Lock(const K& key) {
+      if (!by_segment_) {
+        return var_->GetScopedKeyLock(key, LockType::WRITE_LOCK);
+      }
+      const size_t segment = var_->table_->SegmentOf(key);
+      if (locked_ == nullptr || segment != segment_) {
+        Unlock();
+        locked_ = var_->table_->LockKey(key, LockType::WRITE_LOCK);
+        segment_ = segment;
+      }
+      return ScopedSpinLock();
+    }
+
+   private:
+    void Unlock() {
+      if (locked_ != nullptr) {
+        locked_->unlock();
+        locked_ = nullptr;
+      }
+    }
+
+    KvVariable* var_;
+    bool by_segment_;
+    spin_rw_mutex* locked_ = nullptr;
+    size_t segment_ = 0;
+  };
+
+  ApplyLock GetApplyLock(const IndexOrder& order) {
+    return ApplyLock(this, order);
+  }
+
+  // Rows a gather resolved for an optimizer, so that it does not look its
+  // keys up again, see FindOrInsertWithHandles(). A handle is used only if
+  // it names a resolution of this table in the running step, its key is the
+  // key of the position and no key of the table was erased since the gather.
+  class RowHandles {
+   public:
+    RowHandles() = default;
+    RowHandles(const int64* handles, RowResolution* resolution)
+        : handles_(handles),
+          resolution_(resolution,
+                      [](RowResolution* r) { r->Unref(); }) {}
+
+    // Points context at the EmbeddingValue of key at position i, if its
+    // handle is still valid. Requires the key lock, that keeps the key from
+    // being erased while context is used.
+    void Seed(int64 i, const K& key, EVContext<V>* context) const {
+      if (resolution_ == nullptr) {
+        return;
+      }
+      const int64* handle = handles_ + 3 * i;
+      const int64 position = handle[1];
+      if (handle[0] != handles_[0] || position < 0 ||
+          position >= resolution_->size() ||
+          handle[2] != static_cast<int64>(key) ||
+          resolution_->key(position) != key ||
+          resolution_->row(position) == nullptr ||
+          resolution_->epoch() != resolution_->table()->RowEpoch()) {
+        return;
+      }
+      context->UpdateMeta(resolution_->row(position));
+    }
+
+   private:
+    const int64* handles_ = nullptr;
+    std::shared_ptr<const RowResolution> resolution_;
+  };
+
+  // The handles input of the optimizer op ctx, if it has one for indices.
+  // They are ignored when they do not match, e.g. when the gradients of
+  // duplicate keys were summed, or when they come from another step.
+  RowHandles GetRowHandles(OpKernelContext* ctx, const Tensor& indices) const {
+    ::tensorflow::OpInputList handles;
+    if (!table_->CachesRows() || ctx->step_container() == nullptr ||
+        !ctx->input_list("handles", &handles).ok() || handles.size() != 1 ||
+        handles[0].dims() != 2 ||
+        handles[0].dim_size(0) != indices.NumElements() ||
+        handles[0].dim_size(0) == 0 || handles[0].dim_size(1) != 3) {
+      return RowHandles();
+    }
+    const int64* handles_data = handles[0].flat<int64>().data();
+    RowResolution* resolution = nullptr;
+    if (!ctx->step_container()
+             ->Lookup(ctx->resource_manager(),
+                      RowResolution::Name(handles_data[0]), &resolution)
+             .ok()) {
+      return RowHandles();
+    }
+    if (resolution->table() != table_) {
+      resolution->Unref();
+      return RowHandles();
+    }
+    return RowHandles(handles_data, resolution);
+  }
+
+  // See TableManager::PrefetchLookup().
+  template <typename Keys>
+  void PrefetchLookup(const Keys& keys, int64 begin, int64 i, int64 end) {
+    table_->PrefetchLookup(keys, begin, i, end);
+  }
+
+  bool dedup_keys() const { return dedup_keys_; }
+
+  bool lazy_decay() const { return lazy_decay_; }
+
+  // Records that key, whose lock is held, is updated at step and returns
+  // the number of steps it missed since its previous update. A key not
+  // updated since it was inserted or restored missed none. Requires
+  // lazy_decay().
+  uint32_t TouchStepUnsafe(const K& key, uint32_t step) {
+    uint32_t last_step = 0;
+    update_steps_->FindOrInsertWithDifferentFn(
+        key,
+        [&last_step, step](uint32_t* value) {
+          last_step = *value;
+          *value = step;
+        },
+        [step](const K&) { return step; });
+    return last_step == 0 || step <= last_step + 1 ? 0 : step - last_step - 1;
+  }
+
+  // Order in which sparse ops visit indices, see ShardIndexOrder(). It groups
+  // the keys by NUMA node when TFPLUS_KV_NUMA is on, so that the rows of a
+  // node are touched by its own threads, and is the identity otherwise.
+  IndexOrder NumaOrder(const Tensor& indices) const {
+    if (table_->num_numa_nodes() == 0) {
+      return IndexOrder();
+    }
+    const auto indices_flat = indices.flat<K>();
+    return IndexOrder::GroupBy(
+        indices_flat.size(), table_->num_numa_nodes(),
+        [this, &indices_flat](int64_t i) {
+          return table_->NumaNodeOf(indices_flat(i));
+        });
+  }
+
+  // Order in which the optimizers update indices. With
+  // TFPLUS_KV_SEGMENT_APPLY the positions are grouped by the segment of their
+  // key and ShardIndexOrder() gives each segment to a single worker, so the
+  // workers never wait on each other and an ApplyLock takes each segment
+  // lock once for all of its keys. It is NumaOrder() in NUMA mode and when
+  // the key locks are not segment locks, see TableManager::SegmentLocks().
+  IndexOrder ApplyOrder(const Tensor& indices) const {
+    if (!segment_apply_ || table_->num_numa_nodes() > 0 ||
+        !table_->SegmentLocks()) {
+      return NumaOrder(indices);
+    }
+    const auto indices_flat = indices.flat<K>();
+    return IndexOrder::BySegment(
+        indices_flat.size(), static_cast<int>(table_->NumSegments()),
+        [this, &indices_flat](int64_t i) {
+          return static_cast<int>(table_->SegmentOf(indices_flat(i)));
+        });
+  }
+
+  // Colocated optimizer slots.
+  //
+  // A variable created with StorageOption.colocated_slots = n keeps n slot
+  // vectors next to its value, each row is laid out as
+  // [var | slot 1 | ... | slot n]. Slot variables are attached with
+  // ColocateSlots(), which moves their rows into this variable, after that an
+  // optimizer resolves a single EVContext per key and reaches the slots with
+  // SlotValue(). An attached slot still saves and restores its own tensors,
+  // reads are served from the rows of the primary and writes that do not
+  // come from the optimizer split the slots back into their own tables.
+  int NumColocatedSlots() const { return num_colocated_slots_; }
+
+  // Held shared by optimizers while they use the colocated layout.
+  tf_mutex* colocate_mu() const { return &colocate_mu_; }
+
+  V* SlotValue(V* row, int slot_index) const {
+    return row + slot_index * embedding_dim_;
+  }
+
+  // Attaches slots[i] as slot i + 1, nothing is done for slots which are
+  // attached already.
+  Status ColocateSlots(const std::vector<KvVariableInterface*>& slots) {
+    {
+      mutex_read_lock colocate_lock(colocate_mu_);
+      if (SlotsColocatedUnsafe(slots)) {
+        return ::tensorflow::OkStatus();
+      }
+    }
+    if (slots.size() > colocated_slots_.size()) {
+      return ::tensorflow::errors::InvalidArgument(
+          "KvVariable ", variable_name_, " has room for ",
+          num_colocated_slots_, " colocated slots, got ", slots.size());
+    }
+    for (auto slot : slots) {
+      if (slot->key_dtype() != key_dtype() ||
+          slot->value_dtype() != value_dtype() ||
+          slot->embedding_dim() != embedding_dim_) {
+        return ::tensorflow::errors::InvalidArgument(
+            "KvVariable ", slot->name(), " can not be colocated with ",
+            variable_name_, ": key type, value type or shape mismatch");
+      }
+      if (static_cast<KvVariable<K, V>*>(slot)->num_colocated_slots_ > 0) {
+        return ::tensorflow::errors::InvalidArgument(
+            "KvVariable ", slot->name(), " owns colocated slots itself");
+      }
+    }
+
+    mutex_write_lock colocate_lock(colocate_mu_);
+    mutex_write_lock lock(*mu());
+    for (size_t i = 0; i < slots.size(); ++i) {
+      auto slot = static_cast<KvVariable<K, V>*>(slots[i]);
+      if (colocated_slots_[i] == slot) {
+        continue;
+      }
+      KvVariable<K, V>* primary = slot->colocated_primary_.load();
+      if (primary != nullptr || colocated_slots_[i] != nullptr) {
+        return ::tensorflow::errors::FailedPrecondition(
+            "KvVariable ", slot->name(), " can not be colocated as slot ",
+            i + 1, " of ", variable_name_);
+      }
+      MergeSlotUnsafe(slot, i + 1);
+    }
+    return ::tensorflow::OkStatus();
+  }
+
+  // Whether slots[i] is attached as slot i + 1 for every i, the caller holds
+  // colocate_mu().
+  bool SlotsColocatedUnsafe(
+      const std::vector<KvVariableInterface*>& slots) const {
+    if (slots.size() > colocated_slots_.size()) {
+      return false;
+    }
+    for (size_t i = 0; i < slots.size(); ++i) {
+      if (colocated_slots_[i] != slots[i]) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Registers the optimizer slots of this variable, a key this variable
+  // evicts is erased from them under its key lock, and the slots no longer
+  // evict rows by themselves. Colocated slots live in the rows of this
+  // variable and are left out, this variable holds a reference on each
+  // tracked slot. The optimizers update the row of a slot under the key lock
+  // of this variable, so a slot must have as many segments. The lock of a
+  // pinned hot key does not cover the segments of a slot, hot keys are
+  // refused on a variable with tracked slots and on the slots themselves.
+  Status TrackSlots(const std::vector<KvVariableInterface*>& slots) {
+    auto untracked = [this](KvVariable<K, V>* slot) {
+      return slot != this && slot->colocated_primary_.load() != this &&
+             std::find(tracked_slots_.begin(), tracked_slots_.end(), slot) ==
+                 tracked_slots_.end();
+    };
+    {
+      mutex_read_lock lock(slots_mu_);
+      if (std::none_of(slots.begin(), slots.end(),
+                       [&untracked](KvVariableInterface* slot) {
+                         return untracked(
+                             static_cast<KvVariable<K, V>*>(slot));
+                       })) {
+        return ::tensorflow::OkStatus();
+      }
+    }
+    mutex_write_lock lock(slots_mu_);
+    for (auto slot_interface : slots) {
+      auto slot = static_cast<KvVariable<K, V>*>(slot_interface);
+      if (!untracked(slot)) {
+        continue;
+      }
+      if (slot->table_->NumSegments() != table_->NumSegments()) {
+        return ::tensorflow::errors::InvalidArgument(
+            "KvVariable ", slot->name(), " has ", slot->table_->NumSegments(),
+            " segments, its variable ", variable_name_, " has ",
+            table_->NumSegments());
+      }
+      if (table_->hot_map() != nullptr || slot->table_->hot_map() != nullptr) {
+        return ::tensorflow::errors::InvalidArgument(
+            "KvVariable ", variable_name_, " and its slot ", slot->name(),
+            " can not use TFPLUS_KV_HOT_KEYS, a pinned key is not locked in",
+            " the slot");
+      }
+      slot->Ref();
+      tracked_slots_.push_back(slot);
+      table_->EvictAlong(slot->table_);
+    }
+    return ::tensorflow::OkStatus();
+  }
+
+  // Moves the rows of all attached slots back into their own tables and
+  // detaches them.
+  void SplitColocatedSlots() {
+    int num_detached = 0;
+    {
+      mutex_write_lock colocate_lock(colocate_mu_);
+      mutex_write_lock lock(*mu());
+      for (auto& slot : colocated_slots_) {
+        if (slot == nullptr) {
+          continue;
+        }
+        SplitSlotUnsafe(slot);
+        slot = nullptr;
+        ++num_detached;
+      }
+    }
+    // Drop the references of the slots last, they may be the only ones.
+    for (int i = 0; i < num_detached; ++i) {
+      Unref();
+    }
+  }
+
  private:
   TableManager<K, V>* table_;
   bool has_mem_table_;
@@ -873,6 +1656,49 @@ class KvVariable : public KvVariableInterface {
   bool support_delta_export_;
   Tensor random_init_table_;
   std::atomic<bool> random_init_table_set_;
+  // With TFPLUS_KV_LAZY_ROWS a new key only stores its metadata when it is
+  // gathered, reads compute its initial value from the key until the first
+  // update allocates the row. Lazy rows count as under the threshold, so
+  // full exports skip them, a restored key reads the same initial value
+  // again.
+  bool lazy_rows_;
+  // With TFPLUS_KV_DEDUP_KEYS the gather looks up each distinct key of a
+  // batch once and the sparse apply ops sum the gradients of duplicate
+  // indices before the update, see UniqueKeys.
+  bool dedup_keys_;
+  // With TFPLUS_KV_SEGMENT_APPLY the optimizers update the keys segment by
+  // segment, see ApplyOrder().
+  bool segment_apply_;
+  // With TFPLUS_KV_LAZY_DECAY the sparse Adam ops keep the step of the last
+  // update of each key in update_steps_ and decay its moments by the steps
+  // it missed when it is next updated. Steps are the global steps given to
+  // the ops and are not saved, a restored key starts over.
+  bool lazy_decay_;
+  // The steps live apart from the EmbeddingValue so that only the variables
+  // with lazy_decay_ pay for them. Deleted and restored keys are dropped, a
+  // key evicted by capacity keeps its step, which only decays the zero
+  // moments it is inserted with again.
+  std::unique_ptr<ConcurrentFlatSimdMap<K, uint32_t>> update_steps_;
+  // Keys missing from the table are counted here until they are seen
+  // enter_threshold_ times, only then they are inserted. Set by the
+  // admission_sketch_width of the storage option.
+  std::unique_ptr<CountMinSketch> admission_sketch_;
+  // Lock free copy of the rows read by FindOrZeros in inference mode, see
+  // FreezeTable(). Lookups register in frozen_readers_ while they read it.
+  std::atomic<const FrozenTable<K, V>*> frozen_table_{nullptr};
+  std::unique_ptr<const FrozenTable<K, V>> frozen_table_owner_;
+  mutable FrozenTableReaders frozen_readers_;
+  // Role of this process for the frozen tables shared between processes,
+  // kNone outside of inference mode. shared_version_ is set once, before
+  // shared_table_checked_, the last version a reader tried to map, becomes
+  // non zero. shared_table_attached_ is the version it maps, guarded by
+  // mu().
+  SharedTableRole shared_table_role_;
+  std::unique_ptr<SharedTableVersion> shared_version_;
+  std::atomic<uint64_t> shared_table_checked_{0};
+  uint64_t shared_table_attached_ = 0;
+  bool deterministic_init_;
+  uint64_t init_seed_;
   const std::string variable_name_;
   const TensorShape value_shape_;
   const uint16 enter_threshold_;
@@ -884,17 +1710,438 @@ class KvVariable : public KvVariableInterface {
   bool lockable_;
   Tensor p_values_;
   MapType map_type_;
+  const int num_colocated_slots_;
+  const int row_dim_;
+  // Guards colocated_slots_ and the colocated_primary_ of the slots.
+  mutable tf_mutex colocate_mu_;
+  std::vector<KvVariable<K, V>*> colocated_slots_;
+  // Set while this variable is a slot stored in the rows of another one, the
+  // slot holds a reference on it.
+  std::atomic<KvVariable<K, V>*> colocated_primary_{nullptr};
+  int64_t colocated_offset_ = 0;
+  // Slots evicted along with this variable, see TrackSlots().
+  mutable tf_mutex slots_mu_;
+  std::vector<KvVariable<K, V>*> tracked_slots_;
+
+  // Randomly generates initial value, the average of two rows of the
+  // initialization table. The rows are drawn from a thread local generator,
+  // or with TFPLUS_KV_DETERMINISTIC_INIT from one keyed by the key and the
+  // variable name, so that every worker initializes a key the same way.
+  inline void GenerateRandomInitialValue(const K& key, V* value) const {
+    AssignInitialValue(
+        key, typename ::tensorflow::TTypes<V>::Tensor(value, embedding_dim_));
+  }
+
+  template <typename Out>
+  void AssignInitialValue(const K& key, Out out) const {
+    const uint64_t init_dim_size = random_init_table_.dim_size(0);
+    uint32_t r1, r2;
+    if (deterministic_init_) {
+      ::tensorflow::random::PhiloxRandom gen(static_cast<uint64_t>(key),
+                                             init_seed_);
+      auto sample = gen();
+      r1 = sample[0];
+      r2 = sample[1];
+    } else {
+      r1 = ThreadLocalRandom32();
+      r2 = ThreadLocalRandom32();
+    }
+    const V* base = random_init_table_.flat<V>().data();
+    typename ::tensorflow::TTypes<V>::ConstTensor t1(
+        base + (r1 % init_dim_size) * embedding_dim_, embedding_dim_);
+    typename ::tensorflow::TTypes<V>::ConstTensor t2(
+        base + (r2 % init_dim_size) * embedding_dim_, embedding_dim_);
+    out = (t1 + t2) * V(0.5f);
+  }
+
+  // Counts a key missing from the table in admission_sketch_, returns
+  // whether its estimate reached enter_threshold_. admitted_frequency is set
+  // to the estimate, or to 0 for a key already in the table, which is not
+  // counted.
+  bool AdmitKey(const K& key, uint16_t frequency,
+                uint16_t* admitted_frequency) {
+    *admitted_frequency = 0;
+    {
+      auto lock = GetScopedKeyLock(key, LockType::READ_LOCK);
+      if (kv_map()->FindOrNullUnsafe(key) != nullptr) {
+        return true;
+      }
+    }
+    *admitted_frequency =
+        admission_sketch_->Add(static_cast<uint64_t>(key), frequency);
+    return *admitted_frequency >= enter_threshold_;
+  }
+
+  Status FindOrZerosFrozen(OpKernelContext* ctx,
+                           const FrozenTable<K, V>& frozen, const Tensor& keys,
+                           Tensor* values) const {
+    const int64 num_keys = keys.NumElements();
+    auto DoWork = [this, &frozen, &keys, values](int64 start, int64 end) {
+      FindOrZerosFrozenRange(frozen, keys, values, start, end);
+    };
+    if (ctx != nullptr) {
+      auto worker_threads = *(ctx->device()->tensorflow_cpu_worker_threads());
+      ::tensorflow::Shard(worker_threads.num_threads, worker_threads.workers,
+                          num_keys, 5000, DoWork);
+    } else {
+      DoWork(0, num_keys);
+    }
+    return ::tensorflow::OkStatus();
+  }
+
+  void FindOrZerosFrozenRange(const FrozenTable<K, V>& frozen,
+                              const Tensor& keys, Tensor* values, int64 begin,
+                              int64 end) const {
+    const auto& keys_flat = keys.flat<K>();
+    auto values_flat = values->flat_outer_dims<V>();
+    for (int64 i = begin; i < end; ++i) {
+      const V* row = frozen.Find(keys_flat(i));
+      if (row != nullptr) {
+        std::copy_n(row, embedding_dim_, &values_flat(i, 0));
+      } else {
+        values_flat.chip(i, 0).setZero();
+      }
+    }
+  }
+
+  // The loader published a new model version, the finds are const for the
+  // callers but switching tables is not.
+  void MaybeRefreshSharedTable() const {
+    const uint64_t shared_version =
+        shared_table_checked_.load(std::memory_order_acquire);
+    if (shared_version != 0 && shared_version_->Load() != shared_version) {
+      const_cast<KvVariable*>(this)->RefreshSharedTable();
+    }
+  }
 
-  // Randomly generates initial value.
-  inline void GenerateRandomInitialValue(V* value) const {
-    const int64_t init_dim_size = random_init_table_.dim_size(0);
-    const int r1 = std::rand() % init_dim_size;
-    const int r2 = std::rand() % init_dim_size;
-    const auto& t = random_init_table_.flat_outer_dims<V>();
-    typename ::Eigen::Tensor<V, 1, ::Eigen::RowMajor> avg =
-        (t.chip(r1, 0) + t.chip(r2, 0)) * V(0.5f);
+  // Writes the frozen rows to the segment of the next version and makes it
+  // the version readers map.
+  ::tensorflow::Status ShareFrozenTableUnsafe(const std::vector<K>& keys,
+                                              const std::vector<V>& rows) {
+    if (shared_version_ == nullptr) {
+      TF_RETURN_IF_ERROR(SharedTableVersion::Open(
+          SharedTableName(variable_name_), true, &shared_version_));
+    }
+    const uint64_t version = shared_version_->Load() + 1;
+    std::unique_ptr<FrozenTable<K, V>> table;
+    TF_RETURN_IF_ERROR(FrozenTable<K, V>::Share(
+        shared_version_->SegmentName(version), keys, rows, embedding_dim_,
+        &table));
+    PublishFrozenTable(table.release());
+    shared_version_->Publish(version);
+    // Readers still mapping the previous version keep it until they switch.
+    SharedMemory::Unlink(shared_version_->SegmentName(version - 1));
+    LOG(INFO) << "KvVariable " << variable_name_ << " shared "
+              << keys.size() << " keys as version " << version;
+    return ::tensorflow::OkStatus();
+  }
+
+  ::tensorflow::Status TryAttachSharedTableUnsafe() {
+    if (shared_version_ == nullptr) {
+      TF_RETURN_IF_ERROR(SharedTableVersion::Open(
+          SharedTableName(variable_name_), false, &shared_version_));
+    }
+    const uint64_t version = shared_version_->Load();
+    if (version == 0) {
+      return ::tensorflow::errors::Unavailable(
+          "KvVariable ", variable_name_, " is not shared yet");
+    }
+    if (version == shared_table_attached_) {
+      return ::tensorflow::OkStatus();
+    }
+    // A version that fails to map is not tried again by FindOrZeros.
+    shared_table_checked_.store(version, std::memory_order_release);
+    std::unique_ptr<FrozenTable<K, V>> table;
+    TF_RETURN_IF_ERROR(FrozenTable<K, V>::Attach(
+        shared_version_->SegmentName(version), embedding_dim_, &table));
+    PublishFrozenTable(table.release());
+    shared_table_attached_ = version;
+    VLOG(1) << "KvVariable " << variable_name_ << " maps shared version "
+            << version;
+    return ::tensorflow::OkStatus();
+  }
+
+  void RefreshSharedTable() {
+    mutex_write_lock lock(*mu(), true, std::try_to_lock);
+    if (!lock) {
+      return;
+    }
+    ::tensorflow::Status status = TryAttachSharedTableUnsafe();
+    if (!status.ok()) {
+      LOG(WARNING) << "KvVariable " << variable_name_
+                   << " keeps its shared table: " << status;
+    }
+  }
+
+  // Makes table the frozen table read by FindOrZeros. Lookups that started
+  // before may still read the previous table, it is freed, or its shared
+  // segment unmapped, once they are done. Requires the write lock of mu().
+  void PublishFrozenTable(FrozenTable<K, V>* table) {
+    std::unique_ptr<const FrozenTable<K, V>> replaced =
+        std::move(frozen_table_owner_);
+    frozen_table_owner_.reset(table);
+    frozen_table_.store(table);
+    frozen_readers_.Synchronize();
+  }
+
+  // Lazy rows keep only their metadata, see lazy_rows_.
+  static bool IsLazyRow(const EmbeddingValue<V>* ev) {
+    return ev != nullptr && ev->Value() == nullptr && !ev->InBlacklist() &&
+           ev->GetStorageType() == StorageType::MEM_STORAGE;
+  }
+
+  void OutputInitialValue(const K& key,
+                          typename EVContext<V>::MatrixChip out) const {
+    AssignInitialValue(key, out);
+  }
+
+  // Writes the value of key held by context to out, a lazy row outputs the
+  // initial value of the key.
+  void OutputValue(const K& key, const EVContext<V>* context,
+                   typename EVContext<V>::MatrixChip out,
+                   int64_t offset = 0) const {
+    if (lazy_rows_ && context->Value() == nullptr &&
+        IsLazyRow(context->Meta())) {
+      OutputInitialValue(key, out);
+      return;
+    }
+    context->OutputEmbeddingData(out, embedding_dim_, offset);
+  }
+
+  // Allocates the row of a lazy key about to be updated, it starts from the
+  // value the key has been read as. Requires the key write lock.
+  void MaterializeLazyRowUnsafe(const K& key, EVContext<V>* context) {
+    if (!lazy_rows_ || context->Value() != nullptr ||
+        !IsLazyRow(context->Meta())) {
+      return;
+    }
+    V* row = table_->AllocateRow();
+    GenerateRandomInitialRow(key, row);
+    if (table_->CompactRows()) {
+      // The row is rounded into a compact one, context keeps it as its copy.
+      context->InitValue(row, true);
+      table_->StoreRowUnsafe(key, context);
+    } else {
+      table_->AttachRowUnsafe(context->Meta(), row);
+      context->InitValue(row, false);
+    }
+    UpdateUnderThreshold(context);
+  }
+
+  // Randomly generates the value of a new row and initializes its slots.
+  inline void GenerateRandomInitialRow(const K& key, V* row) const {
+    GenerateRandomInitialValue(key, row);
+    InitColocatedSlots(key, row);
+  }
+
+  void InitColocatedSlots(const K& key, V* row) const {
+    for (int i = 0; i < num_colocated_slots_; ++i) {
+      V* slot_value = SlotValue(row, i + 1);
+      if (colocated_slots_[i] != nullptr) {
+        colocated_slots_[i]->GenerateSlotInitialValue(key, slot_value);
+      } else {
+        std::fill_n(slot_value, embedding_dim_, V(0));
+      }
+    }
+  }
+
+  void GenerateSlotInitialValue(const K& key, V* value) const {
+    if (random_init_table_.NumElements() > 0) {
+      GenerateRandomInitialValue(key, value);
+    } else {
+      std::fill_n(value, embedding_dim_, V(0));
+    }
+  }
+
+  // Copies value into the row of context. A new key gets a full row first,
+  // with its colocated slots initialized.
+  void CopyToRow(const K& key, EVContext<V>* context, const V* value) const {
+    if (num_colocated_slots_ > 0 && context->Value() == nullptr) {
+      V* row = table_->AllocateRow();
+      InitColocatedSlots(key, row);
+      context->UpdateValue(row, true, value_bytes_);
+    }
+    context->UpdateValue(value, false, value_bytes_);
+  }
+
+  // Table holding the rows of this variable and the offset of its value in
+  // them, they belong to the primary while this variable is a colocated slot.
+  TableManager<K, V>* RowTable() const {
+    KvVariable<K, V>* primary = colocated_primary_.load();
+    return primary == nullptr ? table_ : primary->table_;
+  }
+
+  int64_t RowOffset() const {
+    return colocated_primary_.load() == nullptr ? 0 : colocated_offset_;
+  }
 
-    std::copy_n(avg.data(), embedding_dim_, value);
+  // Whether a row of RowTable() holds a value of this variable. Blacklisting
+  // only applies to the primary, its slots are kept in the row.
+  bool HasLiveRow(const EmbeddingValue<V>* ev) const {
+    if (colocated_primary_.load() != nullptr) {
+      return ev->Value() != nullptr;
+    }
+    return !ev->InBlacklist();
+  }
+
+  // Called by a slot before it writes its own table.
+  Status CheckCounts(const Tensor& keys, const Tensor* counts) const {
+    if (counts == nullptr) {
+      return ::tensorflow::OkStatus();
+    }
+    if (keys.shape() != counts->shape()) {
+      return ::tensorflow::errors::InvalidArgument(
+          "KvVariable ", variable_name_.c_str(),
+          ": increment count, indices shape ", keys.shape().DebugString(),
+          " does not match with counts shape ", counts->shape().DebugString());
+    }
+    if (counts->dtype() != DataType::DT_INT32) {
+      return ::tensorflow::errors::InvalidArgument(
+          "KvVariable ", variable_name_.c_str(),
+          ": increment count, counts dtype must be int32");
+    }
+    return ::tensorflow::OkStatus();
+  }
+
+  // Splits this slot from its primary and returns with mu() held as Lock.
+  // The primary merges and splits a slot under its mu() held exclusively,
+  // so the slot stays split while the lock is held. Only writes that do not
+  // come from the optimizer split a slot, reads go through the primary.
+  template <typename Lock>
+  Lock LockDetached(bool lockable = true) {
+    while (lockable) {
+      KvVariable<K, V>* primary = nullptr;
+      {
+        Lock lock(*mu());
+        primary = colocated_primary_.load();
+        if (primary == nullptr) {
+          return lock;
+        }
+        // Keeps the primary alive once the lock is released.
+        primary->Ref();
+      }
+      primary->SplitColocatedSlots();
+      primary->Unref();
+    }
+    return Lock(*mu(), false);
+  }
+
+  // FindOrInsert() of keys[begin, end) for a slot stored in the rows of its
+  // primary, the caller holds mu(). A key without a row in the primary reads
+  // the initial value of the slot and is not inserted, the primary gives its
+  // slots the same value when it inserts the key.
+  Status FindColocatedLocked(const Tensor& keys, Tensor* values, int64 begin,
+                             int64 end) const {
+    auto values_flat = values->flat_outer_dims<V>();
+    const int64_t offset = colocated_offset_;
+    auto find_fn = [this, &values_flat, offset](
+                       const K& key, EVContext<V>* context, size_t row) {
+      if (context->Value() == nullptr) {
+        GenerateSlotInitialValue(key, &values_flat(row, 0));
+        return;
+      }
+      OutputValue(key, context, values_flat.template chip<0>(row), offset);
+    };
+    auto init_fn = [this, &values_flat](const K& key, EVContext<V>* context,
+                                        size_t row) {
+      GenerateSlotInitialValue(key, &values_flat(row, 0));
+    };
+    return colocated_primary_.load()->table_->BatchGetRangeWithFn(
+        keys, begin, end, find_fn, init_fn);
+  }
+
+  // Copies the rows of slot into its region of the rows of this variable,
+  // both variables are locked by the caller.
+  void MergeSlotUnsafe(KvVariable<K, V>* slot, int slot_index) {
+    mutex_write_lock slot_lock(*slot->mu());
+    auto merge_fn = [this, slot, slot_index](const K& key,
+                                             const EVContext<V>* context) {
+      V* row = context->Meta()->Value();
+      if (row == nullptr) {
+        return;
+      }
+      V* slot_value = SlotValue(row, slot_index);
+      slot->table_->FindMetaWithFn(
+          key, [this, slot, &key, slot_value](const EmbeddingValue<V>* ev) {
+            if (ev != nullptr && ev->Value() != nullptr) {
+              std::copy_n(ev->Value(), embedding_dim_, slot_value);
+            } else {
+              slot->GenerateSlotInitialValue(key, slot_value);
+            }
+          });
+    };
+    table_->ForEach(merge_fn);
+    // Keys the slot holds without a row here, e.g. deleted from this variable
+    // or imported into the slot only, are dropped as an eviction along with
+    // this variable would. Keeping them in blacklisted rows would export and
+    // save them as keys of this variable.
+    slot->table_->clear();
+    ForgetTrackedSlot(slot);
+    Ref();
+    slot->colocated_offset_ = slot_index * embedding_dim_;
+    slot->colocated_primary_.store(this);
+    colocated_slots_[slot_index - 1] = slot;
+    VLOG(1) << "KvVariable " << slot->name() << " colocated as slot "
+            << slot_index << " of " << variable_name_;
+  }
+
+  // Reverse of MergeSlotUnsafe(), the reference on this variable is dropped
+  // by the caller.
+  void SplitSlotUnsafe(KvVariable<K, V>* slot) {
+    mutex_write_lock slot_lock(*slot->mu());
+    const int64_t offset = slot->colocated_offset_;
+    slot->table_->clear();
+    auto split_fn = [slot, offset](const K& key, const EVContext<V>* context) {
+      const V* row = context->Meta()->Value();
+      if (row == nullptr) {
+        return;
+      }
+      const uint32_t frequency = context->Meta()->GetFrequency();
+      auto insert_fn = [slot, row, offset,
+                        frequency](EVContext<V>* slot_context) {
+        V* value = slot->table_->AllocateRow();
+        std::copy_n(row + offset, slot->embedding_dim_, value);
+        slot_context->UpdateValue(value, true, slot->value_bytes_);
+        slot_context->Meta()->UpdateFrequency(frequency);
+      };
+      slot->table_->InsertWithFn(key, insert_fn);
+    };
+    table_->ForEach(split_fn);
+    slot->colocated_primary_.store(nullptr);
+    VLOG(1) << "KvVariable " << slot->name() << " split from "
+            << variable_name_;
+  }
+
+  // Stops tracking slot, which now lives in the rows of this variable, the
+  // reference on it would keep both alive otherwise.
+  void ForgetTrackedSlot(KvVariable<K, V>* slot) {
+    {
+      mutex_write_lock lock(slots_mu_);
+      auto it = std::find(tracked_slots_.begin(), tracked_slots_.end(), slot);
+      if (it == tracked_slots_.end()) {
+        return;
+      }
+      tracked_slots_.erase(it);
+      table_->StopEvictingAlong(slot->table_);
+    }
+    slot->Unref();
+  }
+
+  void ForgetColocatedSlot(const KvVariable<K, V>* slot) {
+    mutex_write_lock colocate_lock(colocate_mu_);
+    mutex_write_lock lock(*mu());
+    for (auto& colocated_slot : colocated_slots_) {
+      if (colocated_slot == slot) {
+        colocated_slot = nullptr;
+      }
+    }
+  }
+
+  // Drops the step of the last update of key, see update_steps_.
+  void ForgetStep(const K& key) {
+    if (update_steps_ != nullptr) {
+      update_steps_->erase(key);
+    }
   }
 
   // Check if the variable is already initialized.
@@ -944,9 +2191,11 @@ class KvVariable : public KvVariableInterface {
     auto&& freq_keys_flat = freq_keys->template flat<K>();
     auto&& freq_values_flat = freq_values->template flat<uint32_t>();
     for (auto iter = delta_keys.begin(); iter != delta_keys.end(); ++iter) {
-      const auto v = table_->FindOrNull(*iter);
       freq_keys_flat(num_rows) = *iter;
-      freq_values_flat(num_rows) = (v == nullptr ? 0 : v->GetFrequency());
+      RowTable()->FindMetaWithFn(
+          *iter, [&freq_values_flat, num_rows](const EmbeddingValue<V>* v) {
+            freq_values_flat(num_rows) = v == nullptr ? 0 : v->GetFrequency();
+          });
       ++num_rows;
     }
   }
@@ -0,0 +1,1337 @@
+// Copyright 2023 The TFPlus Authors. All rights reserved.
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Micro benchmarks for the KvVariable hot paths. They are tagged manual in
+// BUILD and print their results with LOG(INFO), run them with
+//   bazel run -c opt //tfplus/kv_variable:kv_variable_benchmark
+// The problem sizes can be changed with the environment variables below.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <numeric>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "tensorflow/core/platform/threadpool.h"
+#include "tfplus/kv_variable/kernels/kv_variable.h"
+#include "tfplus/kv_variable/kernels/row_kernels.h"
+
+namespace {
+using namespace tfplus;      // NOLINT(build/namespaces)
+using namespace tensorflow;  // NOLINT(build/namespaces)
+
+using Clock = std::chrono::steady_clock;
+
+int64_t BenchNumKeys() {
+  return GetEnvVar<int64_t>("TFPLUS_BENCH_NUM_KEYS", 1 << 22);
+}
+
+int BenchNumThreads() { return GetEnvVar<int>("TFPLUS_BENCH_THREADS", 8); }
+
+double ElapsedNs(Clock::time_point start) {
+  return std::chrono::duration<double, std::nano>(Clock::now() - start)
+      .count();
+}
+
+// Runs fn(thread_id, begin, end) on num_threads threads over [0, n).
+template <typename Fn>
+double RunParallel(int num_threads, int64_t n, Fn fn) {
+  std::vector<std::thread> threads;
+  auto start = Clock::now();
+  int64_t block = (n + num_threads - 1) / num_threads;
+  for (int t = 0; t < num_threads; ++t) {
+    int64_t begin = std::min(n, t * block);
+    int64_t end = std::min(n, begin + block);
+    threads.emplace_back([&fn, t, begin, end]() { fn(t, begin, end); });
+  }
+  for (auto& thread : threads) thread.join();
+  return ElapsedNs(start);
+}
+
+std::vector<int64> RandomKeys(int64_t n, uint64_t seed) {
+  std::mt19937_64 gen(seed);
+  std::vector<int64> keys(n);
+  for (auto& key : keys) key = static_cast<int64>(gen() >> 1);
+  return keys;
+}
+
+void BenchmarkMap(MapType map_type, const std::string& name,
+                  size_t num_segments = HASH_SIZE_DEFAULT) {
+  using EV = EmbeddingValue<float>;
+  const int64_t num_keys = BenchNumKeys();
+  const int num_threads = BenchNumThreads();
+  std::vector<int64> keys = RandomKeys(num_keys, 1);
+  std::vector<int64> misses = RandomKeys(num_keys, 2);
+  std::unique_ptr<IMap<int64, EV>> map(
+      MapFactory<int64, EV>::CreateMap(map_type, num_segments));
+
+  double insert_ns = RunParallel(
+      num_threads, num_keys, [&](int, int64_t begin, int64_t end) {
+        for (int64_t i = begin; i < end; ++i) {
+          auto lock = map->GetScopedKeyLock(keys[i], WRITE_LOCK);
+          map->InsertOrAssignUnsafe(keys[i], EV(nullptr, false, 1, false));
+        }
+      });
+
+  std::atomic<int64_t> found(0);
+  double hit_ns = RunParallel(
+      num_threads, num_keys, [&](int, int64_t begin, int64_t end) {
+        int64_t local = 0;
+        for (int64_t i = begin; i < end; ++i) {
+          auto lock = map->GetScopedKeyLock(keys[i], READ_LOCK);
+          local += map->FindOrNullUnsafe(keys[i]) != nullptr;
+        }
+        found += local;
+      });
+
+  double miss_ns = RunParallel(
+      num_threads, num_keys, [&](int, int64_t begin, int64_t end) {
+        int64_t local = 0;
+        for (int64_t i = begin; i < end; ++i) {
+          auto lock = map->GetScopedKeyLock(misses[i], READ_LOCK);
+          local += map->FindOrNullUnsafe(misses[i]) != nullptr;
+        }
+        found += local;
+      });
+
+  double erase_ns = RunParallel(
+      num_threads, num_keys, [&](int, int64_t begin, int64_t end) {
+        for (int64_t i = begin; i < end; ++i) {
+          map->erase(keys[i]);
+        }
+      });
+
+  LOG(INFO) << name << " keys=" << num_keys << " threads=" << num_threads
+            << " segments=" << num_segments
+            << " insert=" << insert_ns / num_keys << "ns/op"
+            << " hit=" << hit_ns / num_keys << "ns/op"
+            << " miss=" << miss_ns / num_keys << "ns/op"
+            << " erase=" << erase_ns / num_keys << "ns/op"
+            << " found=" << found.load();
+  EXPECT_EQ(map->size(), 0u);
+}
+
+TEST(KvVariableBenchmark, HashMap) {
+  BenchmarkMap(CONCURRENT_UNORDERED_MAP, "ConcurrentUnorderedMap");
+  BenchmarkMap(FLAT_SIMD_MAP, "ConcurrentFlatSimdMap");
+}
+
+// Fewer segments save memory, more lower the lock contention.
+TEST(KvVariableBenchmark, MapSegments) {
+  for (size_t num_segments : {64, 1024, 16384}) {
+    BenchmarkMap(CONCURRENT_UNORDERED_MAP, "ConcurrentUnorderedMap",
+                 num_segments);
+  }
+}
+
+// Churns rows the way eviction plus new keys do: every round frees half of
+// the live rows and allocates as many new ones.
+template <typename AllocFn, typename FreeFn>
+double ChurnRows(int num_threads, int64_t num_rows, AllocFn alloc_fn,
+                 FreeFn free_fn) {
+  return RunParallel(
+      num_threads, num_rows, [&](int, int64_t begin, int64_t end) {
+        std::vector<void*> rows;
+        for (int64_t i = begin; i < end; ++i) rows.push_back(alloc_fn());
+        for (int round = 0; round < 8; ++round) {
+          for (size_t i = round % 2; i < rows.size(); i += 2) {
+            free_fn(rows[i]);
+            rows[i] = alloc_fn();
+          }
+        }
+        for (void* row : rows) free_fn(row);
+      });
+}
+
+TEST(KvVariableBenchmark, RowAllocator) {
+  const int64_t num_rows = BenchNumKeys();
+  const int num_threads = BenchNumThreads();
+  for (size_t embedding_dim : {8, 64}) {
+    size_t row_bytes = embedding_dim * sizeof(float);
+    double raw_ns = ChurnRows(
+        num_threads, num_rows, [&]() { return AllocateRaw(row_bytes); },
+        [](void* row) { DeallocateRaw(row); });
+    SlabAllocator allocator(row_bytes);
+    double slab_ns = ChurnRows(
+        num_threads, num_rows, [&]() { return allocator.Allocate(); },
+        [](void* row) { DeallocateEmbedding(row); });
+    // 1 initial allocation, 4 frees and 4 allocations per row, 1 final free.
+    double ops = num_rows * 10.0;
+    LOG(INFO) << "RowAllocator dim=" << embedding_dim
+              << " threads=" << num_threads
+              << " cpu_allocator=" << raw_ns / ops << "ns/op"
+              << " slab=" << slab_ns / ops << "ns/op"
+              << " slab_reserved=" << allocator.AllocatedBytes() << "B";
+  }
+}
+
+// The initializer new keys used before the thread local generator, two
+// std::rand() draws and an Eigen temporary per key.
+void RandAverageInit(const Tensor& init_table, float* value) {
+  const int64_t init_dim_size = init_table.dim_size(0);
+  const int r1 = std::rand() % init_dim_size;
+  const int r2 = std::rand() % init_dim_size;
+  const auto& t = init_table.flat_outer_dims<float>();
+  Eigen::Tensor<float, 1, Eigen::RowMajor> avg =
+      (t.chip(r1, 0) + t.chip(r2, 0)) * 0.5f;
+  std::copy_n(avg.data(), avg.size(), value);
+}
+
+TEST(KvVariableBenchmark, NewKeyInsert) {
+  const int64_t num_keys = BenchNumKeys();
+  const int num_threads = BenchNumThreads();
+  const int64_t batch_size = 1024;
+  const int embedding_dim = 16;
+  Tensor init_table(DT_FLOAT, TensorShape({1024, embedding_dim}));
+  init_table.flat<float>().setRandom();
+
+  double rand_ns = RunParallel(
+      num_threads, num_keys, [&](int, int64_t begin, int64_t end) {
+        std::vector<float> value(embedding_dim);
+        for (int64_t i = begin; i < end; ++i) {
+          RandAverageInit(init_table, value.data());
+        }
+      });
+
+  for (bool deterministic : {false, true}) {
+    setenv("TFPLUS_KV_DETERMINISTIC_INIT", deterministic ? "1" : "0", 1);
+    auto variable = new KvVariable<int64, float>(
+        "bench_new_keys", TensorShape({embedding_dim}), 0);
+    core::ScopedUnref unref_variable(variable);
+    KvVariableInterface* variable_interface = variable;
+    TF_CHECK_OK(variable->InitRandomValues(init_table));
+    double insert_ns = RunParallel(
+        num_threads, num_keys, [&](int, int64_t begin, int64_t end) {
+          Tensor keys(DT_INT64, TensorShape({batch_size}));
+          Tensor values(DT_FLOAT, TensorShape({batch_size, embedding_dim}));
+          auto keys_flat = keys.flat<int64>();
+          for (int64_t start = begin; start < end; start += batch_size) {
+            for (int64_t i = 0; i < batch_size; ++i) {
+              keys_flat(i) = start + i;
+            }
+            TF_CHECK_OK(
+                variable_interface->FindOrInsert(nullptr, keys, &values));
+          }
+        });
+    LOG(INFO) << "NewKeyInsert keys=" << num_keys
+              << " threads=" << num_threads
+              << " deterministic=" << deterministic
+              << " insert=" << insert_ns / num_keys << "ns/key"
+              << " std_rand_init=" << rand_ns / num_keys << "ns/key";
+  }
+  unsetenv("TFPLUS_KV_DETERMINISTIC_INIT");
+}
+
+StorageOption BenchStorageOption(StorageCombination combination,
+                                 int64_t mem_rows) {
+  StorageOption option;
+  option.set_combination(combination);
+  StorageConfig mem_config;
+  mem_config.set_training_storage_size(mem_rows);
+  (*option.mutable_configs())[StorageType::MEM_STORAGE] = mem_config;
+  if (combination == StorageCombination::MEM_SSD) {
+    StorageConfig ssd_config;
+    ssd_config.set_storage_path(GetEnvVar<std::string>(
+        "TFPLUS_BENCH_SSD_PATH", ::testing::TempDir()));
+    ssd_config.set_training_storage_size(-1);
+    (*option.mutable_configs())[StorageType::SSD_STORAGE] = ssd_config;
+  }
+  return option;
+}
+
+// Looks up a skewed key stream in batches, the way a training step reads an
+// embedding, and reports the step time and the share of the lookups served
+// from memory.
+void BenchmarkStorage(const StorageOption& option, const std::string& name) {
+  const int64_t num_keys = BenchNumKeys();
+  const int64_t batch_size = 4096;
+  const int num_steps = GetEnvVar<int>("TFPLUS_BENCH_STEPS", 200);
+  const int embedding_dim = 16;
+  auto variable = new KvVariable<int64, float>(
+      name, TensorShape({embedding_dim}), 0, option);
+  core::ScopedUnref unref_variable(variable);
+  KvVariableInterface* variable_interface = variable;
+  Tensor init(DT_FLOAT, TensorShape({1, embedding_dim}));
+  init.flat<float>().setConstant(0.1f);
+  TF_CHECK_OK(variable->InitRandomValues(init));
+
+  Tensor keys(DT_INT64, TensorShape({batch_size}));
+  Tensor values(DT_FLOAT, TensorShape({batch_size, embedding_dim}));
+  auto keys_flat = keys.flat<int64>();
+  for (int64_t begin = 0; begin < num_keys; begin += batch_size) {
+    for (int64_t i = 0; i < batch_size; ++i) {
+      keys_flat(i) = (begin + i) % num_keys;
+    }
+    TF_CHECK_OK(variable_interface->FindOrInsert(nullptr, keys, &values));
+  }
+  auto table = variable->table_manager();
+  TF_CHECK_OK(table->TriggerTransferSSD(true));
+  auto storage_tables = table->GetStorageTables();
+  auto ssd_requests = [&]() {
+    return storage_tables->size() > 1 ? (*storage_tables)[1]->RequestCount()
+                                      : 0;
+  };
+  int64_t ssd_requests_before = ssd_requests();
+
+  // Key k is drawn with a probability that falls off like a power law.
+  std::mt19937_64 gen(3);
+  std::uniform_real_distribution<double> dist(0.0, 1.0);
+  std::vector<int64> stream(num_steps * batch_size);
+  for (auto& key : stream) {
+    key = static_cast<int64>(num_keys * std::pow(dist(gen), 4.0)) % num_keys;
+  }
+  auto start = Clock::now();
+  for (int step = 0; step < num_steps; ++step) {
+    std::copy_n(stream.begin() + step * batch_size, batch_size,
+                keys_flat.data());
+    TF_CHECK_OK(variable_interface->FindOrInsert(nullptr, keys, &values));
+  }
+  double step_ns = ElapsedNs(start) / num_steps;
+  double lookups = static_cast<double>(stream.size());
+  double hit_rate = 1.0 - (ssd_requests() - ssd_requests_before) / lookups;
+  auto storage_size = table->CountStorageSize();
+  LOG(INFO) << name << " keys=" << num_keys << " batch=" << batch_size
+            << " step=" << step_ns / 1e6 << "ms"
+            << " mem_hit_rate=" << hit_rate
+            << " ssd_rows=" << (storage_size.size() > 1 ? storage_size[1] : 0);
+}
+
+TEST(KvVariableBenchmark, SsdStorage) {
+  const int64_t num_keys = BenchNumKeys();
+  BenchmarkStorage(BenchStorageOption(StorageCombination::MEM, -1), "Mem");
+  BenchmarkStorage(BenchStorageOption(StorageCombination::MEM_SSD,
+                                      num_keys / 4),
+                   "MemSsd");
+}
+
+// Feeds a power law stream of keys, most of them seen once, to variables
+// with an enter threshold of 3 and admission sketches of several widths.
+// Reports the memory used by the keys and the share of rows whose key was
+// inserted before it was really seen 3 times, without a sketch those are all
+// the keys seen less often. The sketch never admits a key late.
+TEST(KvVariableBenchmark, AdmissionSketch) {
+  const int64_t num_keys = BenchNumKeys();
+  const int64_t batch_size = 4096;
+  const int embedding_dim = 16;
+  const int enter_threshold = 3;
+  std::mt19937_64 gen(4);
+  std::uniform_real_distribution<double> dist(0.0, 1.0);
+  const int64_t num_batches = std::max<int64_t>(1, num_keys / batch_size);
+  std::vector<int64> stream(num_batches * batch_size);
+  std::unordered_map<int64, int> true_counts;
+  for (auto& key : stream) {
+    key = static_cast<int64>(num_keys * 16 * std::pow(dist(gen), 4.0));
+    true_counts[key]++;
+  }
+  int64_t num_frequent = 0;
+  for (const auto& it : true_counts) {
+    num_frequent += it.second >= enter_threshold;
+  }
+  Tensor init(DT_FLOAT, TensorShape({1024, embedding_dim}));
+  init.flat<float>().setRandom();
+  for (int64_t width : {int64_t{0}, num_keys / 64, num_keys / 16,
+                        num_keys / 4}) {
+    StorageOption option = BenchStorageOption(StorageCombination::MEM, -1);
+    option.set_admission_sketch_width(width);
+    auto variable = new KvVariable<int64, float>(
+        "bench_admission", TensorShape({embedding_dim}), enter_threshold,
+        option);
+    core::ScopedUnref unref_variable(variable);
+    KvVariableInterface* variable_interface = variable;
+    TF_CHECK_OK(variable->InitRandomValues(init));
+    Tensor keys(DT_INT64, TensorShape({batch_size}));
+    Tensor values(DT_FLOAT, TensorShape({batch_size, embedding_dim}));
+    Tensor filter_out(DT_BOOL, TensorShape({batch_size}));
+    auto start = Clock::now();
+    for (int64_t batch = 0; batch < num_batches; ++batch) {
+      std::copy_n(stream.begin() + batch * batch_size, batch_size,
+                  keys.flat<int64>().data());
+      TF_CHECK_OK(variable_interface->FindOrInsertFillFilter(
+          nullptr, keys, &values, &filter_out));
+    }
+    double lookup_ns = ElapsedNs(start) / stream.size();
+    // Rows plus a rough size of the map nodes holding the keys.
+    const int64_t num_rows = variable->table_manager()->size();
+    const int64_t key_bytes =
+        num_rows * (sizeof(int64) + sizeof(EmbeddingValue<float>));
+    const double early_rows =
+        static_cast<double>(num_rows - num_frequent) / num_rows;
+    LOG(INFO) << "AdmissionSketch keys=" << stream.size()
+              << " distinct=" << true_counts.size()
+              << " frequent=" << num_frequent << " width=" << width
+              << " rows=" << num_rows
+              << " memory=" << (variable->MemoryUsed() + key_bytes) / 1e6
+              << "MB lookup=" << lookup_ns << "ns/key"
+              << " early_rows=" << early_rows;
+  }
+}
+
+// Runs the gather callbacks of TableManager::FindOrInsertWithDifferentFn as
+// template functors and wrapped in std::function, the way they were passed
+// before. The callbacks capture as much as those of FindOrInsertLocally, too
+// much for the small buffer of std::function, so every wrapped call
+// allocates.
+TEST(KvVariableBenchmark, LookupCallbacks) {
+  const int64_t num_keys = BenchNumKeys();
+  const int embedding_dim = 16;
+  auto variable = new KvVariable<int64, float>(
+      "bench_callbacks", TensorShape({embedding_dim}), 0);
+  core::ScopedUnref unref_variable(variable);
+  KvVariableInterface* variable_interface = variable;
+  Tensor init(DT_FLOAT, TensorShape({1024, embedding_dim}));
+  init.flat<float>().setRandom();
+  TF_CHECK_OK(variable->InitRandomValues(init));
+  Tensor keys(DT_INT64, TensorShape({num_keys}));
+  auto keys_flat = keys.flat<int64>();
+  for (int64_t i = 0; i < num_keys; ++i) keys_flat(i) = i;
+  Tensor values(DT_FLOAT, TensorShape({num_keys, embedding_dim}));
+  TF_CHECK_OK(variable_interface->FindOrInsert(nullptr, keys, &values));
+  auto values_flat = values.flat_outer_dims<float>();
+  auto* table = variable->table_manager();
+  uint16_t day = 1;
+  const Tensor* counts = nullptr;
+  bool apply_filter = true;
+  Tensor* filter_out = nullptr;
+
+  auto run = [&](bool type_erased) {
+    auto start = Clock::now();
+    for (int64_t i = 0; i < num_keys; ++i) {
+      const int64 key = keys_flat(i);
+      size_t row = i;
+      auto find_func = [&values_flat, &filter_out, &counts, &apply_filter,
+                        &day, &row, &key](EVContext<float>* context) {
+        context->Meta()->AddFrequency(1, day);
+        context->OutputEmbeddingData(values_flat.chip<0>(row),
+                                     values_flat.dimension(1));
+      };
+      auto insert_func = [&values_flat, &filter_out, &counts, &apply_filter,
+                          &day, &row, &key](EVContext<float>* context) {
+        LOG(FATAL) << "Unexpected insert of " << key;
+      };
+      EVContext<float> context;
+      if (type_erased) {
+        table->FindOrInsertWithDifferentFn(
+            key, std::function<void(EVContext<float>*)>(find_func),
+            std::function<void(EVContext<float>*)>(insert_func), &context);
+      } else {
+        table->FindOrInsertWithDifferentFn(key, find_func, insert_func,
+                                           &context);
+      }
+    }
+    return ElapsedNs(start) / num_keys;
+  };
+  // Warms up the table and the allocator.
+  run(true);
+  double function_ns = run(true);
+  double template_ns = run(false);
+  LOG(INFO) << "LookupCallbacks keys=" << num_keys
+            << " std_function=" << function_ns << "ns/key"
+            << " template=" << template_ns << "ns/key";
+}
+
+// Looks up random keys of a table larger than the last level cache, with
+// and without software prefetching. Without it every key waits for the
+// misses on its map slot and on its row, the prefetches issued a few keys
+// ahead overlap them. One thread shows the latency best.
+TEST(KvVariableBenchmark, PrefetchLookup) {
+  const int64_t num_keys = BenchNumKeys();
+  const int64_t batch_size = 1024;
+  const int embedding_dim = 64;
+  std::vector<int64> lookups = RandomKeys(num_keys, 5);
+  for (auto& key : lookups) key %= num_keys;
+  Tensor init(DT_FLOAT, TensorShape({1024, embedding_dim}));
+  init.flat<float>().setRandom();
+  for (int distance : {0, 8, 16}) {
+    setenv("TFPLUS_KV_PREFETCH_DISTANCE", std::to_string(distance).c_str(),
+           1);
+    auto variable = new KvVariable<int64, float>(
+        "bench_prefetch", TensorShape({embedding_dim}), 0);
+    core::ScopedUnref unref_variable(variable);
+    KvVariableInterface* variable_interface = variable;
+    TF_CHECK_OK(variable->InitRandomValues(init));
+    RunParallel(BenchNumThreads(), num_keys,
+                [&](int, int64_t begin, int64_t end) {
+                  Tensor keys(DT_INT64, TensorShape({end - begin}));
+                  auto keys_flat = keys.flat<int64>();
+                  for (int64_t i = begin; i < end; ++i) {
+                    keys_flat(i - begin) = i;
+                  }
+                  Tensor values(DT_FLOAT,
+                                TensorShape({end - begin, embedding_dim}));
+                  TF_CHECK_OK(
+                      variable_interface->FindOrInsert(nullptr, keys, &values));
+                });
+    Tensor keys(DT_INT64, TensorShape({batch_size}));
+    Tensor values(DT_FLOAT, TensorShape({batch_size, embedding_dim}));
+    double find_ns = 0;
+    double insert_ns = 0;
+    for (int64_t begin = 0; begin + batch_size <= num_keys;
+         begin += batch_size) {
+      std::copy_n(lookups.begin() + begin, batch_size,
+                  keys.flat<int64>().data());
+      auto start = Clock::now();
+      TF_CHECK_OK(variable_interface->FindOrZeros(nullptr, keys, &values));
+      find_ns += ElapsedNs(start);
+      start = Clock::now();
+      TF_CHECK_OK(variable_interface->FindOrInsert(nullptr, keys, &values));
+      insert_ns += ElapsedNs(start);
+    }
+    LOG(INFO) << "PrefetchLookup keys=" << num_keys << " dim=" << embedding_dim
+              << " distance=" << distance
+              << " find_or_zeros=" << find_ns / num_keys << "ns/key"
+              << " find_or_insert=" << insert_ns / num_keys << "ns/key";
+  }
+  unsetenv("TFPLUS_KV_PREFETCH_DISTANCE");
+}
+
+}  // namespace
+
+// Memory and lookup cost of float rows against rows stored as bfloat16 and
+// half, which convert to float on every read and round on every write.
+TEST(KvVariableBenchmark, CompactRows) {
+  const int64_t num_keys = BenchNumKeys();
+  const int64_t batch_size = 1024;
+  const int embedding_dim = 64;
+  std::vector<int64> lookups = RandomKeys(num_keys, 6);
+  for (auto& key : lookups) key %= num_keys;
+  Tensor init(DT_FLOAT, TensorShape({1024, embedding_dim}));
+  init.flat<float>().setRandom();
+  Tensor ones(DT_FLOAT, TensorShape({batch_size, embedding_dim}));
+  ones.flat<float>().setConstant(1.0f);
+  for (RowDtype row_dtype : {ROW_FLOAT, ROW_BFLOAT16, ROW_HALF}) {
+    StorageOption option = BenchStorageOption(StorageCombination::MEM, -1);
+    option.set_row_dtype(row_dtype);
+    auto variable = new KvVariable<int64, float>(
+        "bench_compact_rows", TensorShape({embedding_dim}), 0, option);
+    core::ScopedUnref unref_variable(variable);
+    KvVariableInterface* variable_interface = variable;
+    TF_CHECK_OK(variable->InitRandomValues(init));
+    RunParallel(BenchNumThreads(), num_keys,
+                [&](int, int64_t begin, int64_t end) {
+                  Tensor keys(DT_INT64, TensorShape({end - begin}));
+                  auto keys_flat = keys.flat<int64>();
+                  for (int64_t i = begin; i < end; ++i) {
+                    keys_flat(i - begin) = i;
+                  }
+                  Tensor values(DT_FLOAT,
+                                TensorShape({end - begin, embedding_dim}));
+                  TF_CHECK_OK(
+                      variable_interface->FindOrInsert(nullptr, keys, &values));
+                });
+    Tensor keys(DT_INT64, TensorShape({batch_size}));
+    Tensor values(DT_FLOAT, TensorShape({batch_size, embedding_dim}));
+    double find_ns = 0;
+    double update_ns = 0;
+    for (int64_t begin = 0; begin + batch_size <= num_keys;
+         begin += batch_size) {
+      std::copy_n(lookups.begin() + begin, batch_size,
+                  keys.flat<int64>().data());
+      auto start = Clock::now();
+      TF_CHECK_OK(variable_interface->FindOrZeros(nullptr, keys, &values));
+      find_ns += ElapsedNs(start);
+      start = Clock::now();
+      TF_CHECK_OK(variable_interface->ScatterUpdate(
+          nullptr, keys, ones, SCATTER_UPDATE_ADD));
+      update_ns += ElapsedNs(start);
+    }
+    LOG(INFO) << "CompactRows keys=" << num_keys << " dim=" << embedding_dim
+              << " row_dtype=" << RowDtype_Name(row_dtype)
+              << " memory=" << variable->MemoryUsed() / 1e6 << "MB"
+              << " find_or_zeros=" << find_ns / num_keys << "ns/key"
+              << " scatter_add=" << update_ns / num_keys << "ns/key";
+  }
+}
+
+// Concurrent FindOrZeros of small batches, the way serving sessions gather
+// embeddings, through the locked table and through a frozen copy of it.
+TEST(KvVariableBenchmark, FrozenTable) {
+  const int64_t num_keys = BenchNumKeys();
+  const int64_t batch_size = 256;
+  const int embedding_dim = 64;
+  std::vector<int64> lookups = RandomKeys(num_keys, 7);
+  for (auto& key : lookups) key %= num_keys;
+  Tensor init(DT_FLOAT, TensorShape({1024, embedding_dim}));
+  init.flat<float>().setRandom();
+  auto variable = new KvVariable<int64, float>(
+      "bench_frozen", TensorShape({embedding_dim}), 0);
+  core::ScopedUnref unref_variable(variable);
+  KvVariableInterface* variable_interface = variable;
+  TF_CHECK_OK(variable->InitRandomValues(init));
+  RunParallel(BenchNumThreads(), num_keys,
+              [&](int, int64_t begin, int64_t end) {
+                Tensor keys(DT_INT64, TensorShape({end - begin}));
+                auto keys_flat = keys.flat<int64>();
+                for (int64_t i = begin; i < end; ++i) {
+                  keys_flat(i - begin) = i;
+                }
+                Tensor values(DT_FLOAT,
+                              TensorShape({end - begin, embedding_dim}));
+                TF_CHECK_OK(
+                    variable_interface->FindOrInsert(nullptr, keys, &values));
+              });
+  for (bool frozen : {false, true}) {
+    if (frozen) {
+      variable->FreezeTable();
+    }
+    for (int num_threads : {1, 8, 64}) {
+      double ns = RunParallel(
+          num_threads, num_keys, [&](int, int64_t begin, int64_t end) {
+            Tensor keys(DT_INT64, TensorShape({batch_size}));
+            Tensor values(DT_FLOAT, TensorShape({batch_size, embedding_dim}));
+            for (; begin + batch_size <= end; begin += batch_size) {
+              std::copy_n(lookups.begin() + begin, batch_size,
+                          keys.flat<int64>().data());
+              TF_CHECK_OK(
+                  variable_interface->FindOrZeros(nullptr, keys, &values));
+            }
+          });
+      LOG(INFO) << "FrozenTable keys=" << num_keys << " dim=" << embedding_dim
+                << " frozen=" << frozen << " threads=" << num_threads
+                << " find_or_zeros=" << ns / num_keys << "ns/key";
+    }
+  }
+}
+
+// Latency of batched inserts into a map that grows from empty, with and
+// without reserving the final size. Growing std::unordered_map segments
+// rehash while their lock is held, which shows up in the tail; the flat map
+// spreads its growth over later insertions.
+TEST(KvVariableBenchmark, RehashLatency) {
+  using EV = EmbeddingValue<float>;
+  const int64_t num_keys = BenchNumKeys();
+  const int num_threads = BenchNumThreads();
+  const int64_t batch_size = 256;
+  std::vector<int64> keys = RandomKeys(num_keys, 8);
+  for (MapType map_type : {CONCURRENT_UNORDERED_MAP, FLAT_SIMD_MAP}) {
+    for (size_t num_segments : {size_t(16), HASH_SIZE_DEFAULT}) {
+      for (bool reserve : {false, true}) {
+        std::unique_ptr<IMap<int64, EV>> map(
+            MapFactory<int64, EV>::CreateMap(map_type, num_segments));
+        if (reserve) {
+          map->Reserve(num_keys);
+        }
+        std::vector<std::vector<double>> latencies(num_threads);
+        double ns = RunParallel(
+            num_threads, num_keys, [&](int t, int64_t begin, int64_t end) {
+              for (; begin < end; begin += batch_size) {
+                auto start = Clock::now();
+                for (int64_t i = begin; i < std::min(end, begin + batch_size);
+                     ++i) {
+                  map->FindOrInsertWithFn(keys[i], [](const int64& key) {
+                    return EV(nullptr, false, 1, false);
+                  });
+                }
+                latencies[t].push_back(ElapsedNs(start));
+              }
+            });
+        std::vector<double> all;
+        for (const auto& l : latencies) {
+          all.insert(all.end(), l.begin(), l.end());
+        }
+        std::sort(all.begin(), all.end());
+        auto percentile = [&all](double p) {
+          return all[std::min(all.size() - 1,
+                              static_cast<size_t>(p * all.size()))];
+        };
+        LOG(INFO) << "RehashLatency map=" << map_type
+                  << " segments=" << num_segments << " reserve=" << reserve
+                  << " keys=" << num_keys << " threads=" << num_threads
+                  << " insert=" << ns / num_keys << "ns/key"
+                  << " batch p50=" << percentile(0.5) / 1000
+                  << "us p99=" << percentile(0.99) / 1000
+                  << "us p99.9=" << percentile(0.999) / 1000
+                  << "us max=" << all.back() / 1000 << "us";
+      }
+    }
+  }
+}
+
+// Sparse updates the way the apply ops run them, once to insert the keys and
+// once to update their rows. With TFPLUS_KV_NUMA=1 the keys are grouped by
+// node and handed to the threads of that node, run the benchmark with and
+// without it. remote is the fraction of rows whose pages are on another node
+// than the threads updating them.
+TEST(KvVariableBenchmark, NumaPlacement) {
+  const int64_t num_keys = BenchNumKeys();
+  const int num_threads = BenchNumThreads();
+  const int embedding_dim = 64;
+  std::vector<int64> lookups = RandomKeys(num_keys, 9);
+  Tensor keys(DT_INT64, TensorShape({num_keys}));
+  std::copy(lookups.begin(), lookups.end(), keys.flat<int64>().data());
+  Tensor init(DT_FLOAT, TensorShape({1024, embedding_dim}));
+  init.flat<float>().setRandom();
+  auto variable = new KvVariable<int64, float>(
+      "bench_numa", TensorShape({embedding_dim}), 0);
+  core::ScopedUnref unref_variable(variable);
+  TF_CHECK_OK(variable->InitRandomValues(init));
+  const IndexOrder order = variable->NumaOrder(keys);
+  auto work = [&](int64_t begin, int64_t end) {
+    for (int64_t j = begin; j < end; ++j) {
+      const int64 key = lookups[order(j)];
+      EVContext<float> context;
+      auto lock = variable->GetScopedKeyLock(key, LockType::WRITE_LOCK);
+      variable->FindOrInsertUnsafe(key, &context, nullptr);
+      float* row = context.Value();
+      for (int d = 0; d < embedding_dim; ++d) row[d] -= 0.01f * row[d];
+      variable->CoverUpdateUnsafe(key, &context);
+    }
+  };
+  auto run = [&]() {
+    auto start = Clock::now();
+    if (order.identity()) {
+      RunParallel(num_threads, num_keys,
+                  [&work](int, int64_t begin, int64_t end) {
+                    work(begin, end);
+                  });
+    } else {
+      NumaWorkers::Get()->ParallelFor(order.group_begin(), 5000, work);
+    }
+    return ElapsedNs(start);
+  };
+  double insert_ns = run();
+  double apply_ns = run();
+  auto* table_manager = variable->table_manager();
+  int64_t remote = 0;
+  int64_t sampled = 0;
+  for (int64_t i = 0; i < num_keys; i += 97) {
+    EVContext<float> context;
+    variable->FindOrInsertUnsafe(lookups[i], &context, nullptr);
+    // Without NUMA mode any thread updates any row, the share of remote
+    // rows is then the one of rows off the node of this thread.
+    int expected = table_manager->num_numa_nodes() > 0
+                       ? table_manager->NumaNodeOf(lookups[i])
+                       : CurrentNumaNode();
+    remote += NumaNodeOfAddress(context.Value()) != expected;
+    ++sampled;
+  }
+  LOG(INFO) << "NumaPlacement numa=" << (NumaWorkers::Get() != nullptr)
+            << " nodes=" << NumaTopology::Get().num_nodes()
+            << " keys=" << num_keys << " dim=" << embedding_dim
+            << " insert=" << insert_ns / num_keys << "ns/key"
+            << " apply=" << apply_ns / num_keys << "ns/key"
+            << " remote=" << static_cast<double>(remote) / sampled;
+  std::vector<size_t> node_bytes = table_manager->NumaRowBytes();
+  for (size_t node = 0; node < node_bytes.size(); ++node) {
+    LOG(INFO) << "NumaPlacement node=" << node
+              << " row_bytes=" << node_bytes[node];
+  }
+}
+
+// Gathers and sparse updates of Zipf distributed keys on the same table, the
+// way data parallel workers hit the few heavy hitters of a feature. Half of
+// the threads look batches up with FindOrZeros, the other half update rows
+// under their key lock. With hot keys on the heaviest keys have a lock of
+// their own and their lookups take none, retries counts the lock free reads
+// that raced with an update.
+TEST(KvVariableBenchmark, HotKeys) {
+  const int64_t num_keys = BenchNumKeys();
+  const int num_threads = std::max(2, BenchNumThreads());
+  const int64_t batch_size = 256;
+  const int embedding_dim = 64;
+  // Rank r is drawn with probability ~1/r, key 0 is the heaviest.
+  std::mt19937_64 gen(10);
+  std::uniform_real_distribution<double> uniform(0.0, 1.0);
+  std::vector<int64> lookups(num_keys);
+  for (auto& key : lookups) {
+    key = static_cast<int64>(std::pow(num_keys, uniform(gen))) - 1;
+  }
+  Tensor init(DT_FLOAT, TensorShape({1024, embedding_dim}));
+  init.flat<float>().setRandom();
+  for (int num_hot_keys : {0, 1024}) {
+    setenv("TFPLUS_KV_HOT_KEYS", std::to_string(num_hot_keys).c_str(), 1);
+    setenv("TFPLUS_KV_HOT_KEYS_INTERVAL_MS", "3600000", 1);
+    auto variable = new KvVariable<int64, float>(
+        "bench_hot_keys", TensorShape({embedding_dim}), 0);
+    unsetenv("TFPLUS_KV_HOT_KEYS");
+    unsetenv("TFPLUS_KV_HOT_KEYS_INTERVAL_MS");
+    core::ScopedUnref unref_variable(variable);
+    KvVariableInterface* variable_interface = variable;
+    TF_CHECK_OK(variable->InitRandomValues(init));
+    auto update = [&](int64_t begin, int64_t end) {
+      for (int64_t i = begin; i < end; ++i) {
+        EVContext<float> context;
+        auto lock =
+            variable->GetScopedKeyLock(lookups[i], LockType::WRITE_LOCK);
+        variable->FindOrInsertUnsafe(lookups[i], &context, nullptr);
+        float* row = context.Value();
+        for (int d = 0; d < embedding_dim; ++d) row[d] -= 0.01f * row[d];
+        variable->CoverUpdateUnsafe(lookups[i], &context);
+      }
+    };
+    update(0, num_keys);
+    auto* table_manager = variable->table_manager();
+    const size_t pinned = table_manager->RefreshHotKeys();
+    std::vector<std::vector<double>> latencies(num_threads);
+    double ns = RunParallel(
+        num_threads, num_keys, [&](int t, int64_t begin, int64_t end) {
+          if (t % 2 == 1) {
+            update(begin, end);
+            return;
+          }
+          Tensor keys(DT_INT64, TensorShape({batch_size}));
+          Tensor values(DT_FLOAT, TensorShape({batch_size, embedding_dim}));
+          for (; begin + batch_size <= end; begin += batch_size) {
+            std::copy_n(lookups.begin() + begin, batch_size,
+                        keys.flat<int64>().data());
+            auto start = Clock::now();
+            TF_CHECK_OK(
+                variable_interface->FindOrZeros(nullptr, keys, &values));
+            latencies[t].push_back(ElapsedNs(start));
+          }
+        });
+    std::vector<double> all;
+    for (const auto& l : latencies) {
+      all.insert(all.end(), l.begin(), l.end());
+    }
+    std::sort(all.begin(), all.end());
+    auto* hot_map = table_manager->hot_map();
+    LOG(INFO) << "HotKeys keys=" << num_keys << " threads=" << num_threads
+              << " pinned=" << pinned << " mixed=" << ns / num_keys
+              << "ns/key lookup batch p50=" << all[all.size() / 2] / 1000
+              << "us p99="
+              << all[std::min(all.size() - 1, all.size() * 99 / 100)] / 1000
+              << "us lock_free_reads="
+              << (hot_map != nullptr ? hot_map->lock_free_reads() : 0)
+              << " retries="
+              << (hot_map != nullptr ? hot_map->read_retries() : 0);
+  }
+}
+
+// Gather of skewed batches where the heavy keys repeat many times per batch,
+// with and without TFPLUS_KV_DEDUP_KEYS.
+TEST(KvVariableBenchmark, DedupKeys) {
+  const int64_t num_keys = BenchNumKeys();
+  const int num_threads = BenchNumThreads();
+  const int64_t batch_size = 4096;
+  const int embedding_dim = 64;
+  std::mt19937_64 gen(11);
+  std::uniform_real_distribution<double> uniform(0.0, 1.0);
+  std::vector<int64> lookups(num_keys);
+  for (auto& key : lookups) {
+    key = static_cast<int64>(std::pow(num_keys, uniform(gen))) - 1;
+  }
+  const int64_t num_batches = num_keys / batch_size;
+  int64_t distinct = 0;
+  for (int64_t b = 0; b < num_batches; ++b) {
+    UniqueKeys<int64> unique(
+        nullptr, batch_size,
+        [&](int64_t i) { return lookups[b * batch_size + i]; },
+        [](int64_t) { return false; });
+    distinct += unique.size();
+  }
+  Tensor init(DT_FLOAT, TensorShape({1024, embedding_dim}));
+  init.flat<float>().setRandom();
+  for (bool dedup : {false, true}) {
+    if (dedup) {
+      setenv("TFPLUS_KV_DEDUP_KEYS", "1", 1);
+    }
+    auto variable = new KvVariable<int64, float>(
+        "bench_dedup_keys", TensorShape({embedding_dim}), 0);
+    unsetenv("TFPLUS_KV_DEDUP_KEYS");
+    core::ScopedUnref unref_variable(variable);
+    KvVariableInterface* variable_interface = variable;
+    TF_CHECK_OK(variable->InitRandomValues(init));
+    double ns = RunParallel(
+        num_threads, num_keys, [&](int, int64_t begin, int64_t end) {
+          Tensor keys(DT_INT64, TensorShape({batch_size}));
+          Tensor values(DT_FLOAT, TensorShape({batch_size, embedding_dim}));
+          for (; begin + batch_size <= end; begin += batch_size) {
+            std::copy_n(lookups.begin() + begin, batch_size,
+                        keys.flat<int64>().data());
+            TF_CHECK_OK(
+                variable_interface->FindOrInsert(nullptr, keys, &values));
+          }
+        });
+    LOG(INFO) << "DedupKeys keys=" << num_keys << " threads=" << num_threads
+              << " batch=" << batch_size << " distinct_per_batch="
+              << (num_batches > 0 ? distinct / num_batches : 0)
+              << " dedup=" << dedup << " find_or_insert=" << ns / num_keys
+              << "ns/key";
+  }
+}
+
+// Tables of the batch ops benchmarks, with batch sizes Zipf skewed the way
+// feature columns are. Table t gets 16384 / (t + 1) keys, 1 in 4 of them
+// missing from its num_keys rows.
+struct SkewedTables {
+  SkewedTables(const std::string& name, int num_tables, int64_t num_keys,
+               int embedding_dim) {
+    Tensor init(DT_FLOAT, TensorShape({1024, embedding_dim}));
+    init.flat<float>().setRandom();
+    Tensor inserted(DT_INT64, TensorShape({num_keys}));
+    auto inserted_flat = inserted.flat<int64>();
+    for (int64_t i = 0; i < num_keys; ++i) inserted_flat(i) = i;
+    Tensor values(DT_FLOAT, TensorShape({num_keys, embedding_dim}));
+    std::mt19937_64 gen(12);
+    for (int t = 0; t < num_tables; ++t) {
+      auto variable = new KvVariable<int64, float>(
+          name + "_" + std::to_string(t), TensorShape({embedding_dim}), 0);
+      tables.emplace_back(variable);
+      TF_CHECK_OK(variable->InitRandomValues(init));
+      TF_CHECK_OK(variable->FindOrInsert(nullptr, inserted, &values));
+      const int64_t n = std::max<int64_t>(1, 16384 / (t + 1));
+      keys.emplace_back(DT_INT64, TensorShape({n}));
+      auto keys_flat = keys.back().flat<int64>();
+      for (int64_t i = 0; i < n; ++i) {
+        keys_flat(i) = static_cast<int64>(gen() % (num_keys * 4 / 3));
+      }
+      outs.emplace_back(DT_FLOAT, TensorShape({n, embedding_dim}));
+      sizes.push_back(n);
+    }
+  }
+
+  // Runs num_requests requests of work(t, begin, end) over the keys of all
+  // the tables, sharded per table or flattened with ShardTables(), and logs
+  // their latency.
+  template <typename Work>
+  void Run(const std::string& name, int num_requests, int num_threads,
+           thread::ThreadPool* pool, Work work) {
+    for (bool flattened : {false, true}) {
+      std::vector<double> latencies;
+      auto start = Clock::now();
+      for (int r = 0; r < num_requests; ++r) {
+        auto request_start = Clock::now();
+        if (flattened) {
+          ShardTables(num_threads, pool, sizes, 5000, work);
+        } else {
+          for (size_t t = 0; t < tables.size(); ++t) {
+            Shard(num_threads, pool, sizes[t], 5000,
+                  [&](int64_t begin, int64_t end) { work(t, begin, end); });
+          }
+        }
+        latencies.push_back(ElapsedNs(request_start));
+      }
+      double ns = ElapsedNs(start);
+      std::sort(latencies.begin(), latencies.end());
+      auto percentile = [&latencies](double p) {
+        return latencies[std::min(latencies.size() - 1,
+                                  static_cast<size_t>(p * latencies.size()))];
+      };
+      LOG(INFO) << name << " tables=" << tables.size() << " batch_keys="
+                << std::accumulate(sizes.begin(), sizes.end(), int64_t{0})
+                << " threads=" << num_threads << " flattened=" << flattened
+                << " request=" << ns / num_requests / 1000 << "us"
+                << " p50=" << percentile(0.5) / 1000
+                << "us p99=" << percentile(0.99) / 1000 << "us";
+    }
+  }
+
+  std::vector<core::RefCountPtr<KvVariableInterface>> tables;
+  std::vector<Tensor> keys;
+  std::vector<Tensor> outs;
+  std::vector<int64_t> sizes;
+};
+
+// Requests of BatchKvVariableGatherOrZeros, per_table shards each table on
+// its own like the op used to.
+TEST(KvVariableBenchmark, BatchGatherOrZeros) {
+  const int num_threads = BenchNumThreads();
+  thread::ThreadPool pool(Env::Default(), "bench_batch_gather", num_threads);
+  SkewedTables skewed("bench_batch_gather", 300,
+                      std::min<int64_t>(BenchNumKeys(), 1 << 18), 16);
+  skewed.Run("BatchGatherOrZeros", 200, num_threads, &pool,
+             [&skewed](int t, int64_t begin, int64_t end) {
+               TF_CHECK_OK(skewed.tables[t]->FindOrZerosRange(
+                   skewed.keys[t], &skewed.outs[t], begin, end));
+             });
+}
+
+// Training steps of a wide model, per_table is one KvVariableGatherOrInsertV2
+// per feature and flattened is BatchKvVariableGatherOrInsert. The tables are
+// filled up front, so the steps measure the lookups and not the inserts.
+TEST(KvVariableBenchmark, BatchGatherOrInsert) {
+  const int num_threads = BenchNumThreads();
+  thread::ThreadPool pool(Env::Default(), "bench_batch_insert", num_threads);
+  SkewedTables skewed("bench_batch_insert", 300,
+                      std::min<int64_t>(BenchNumKeys(), 1 << 18), 16);
+  for (size_t t = 0; t < skewed.tables.size(); ++t) {
+    TF_CHECK_OK(skewed.tables[t]->FindOrInsert(nullptr, skewed.keys[t],
+                                               &skewed.outs[t]));
+  }
+  skewed.Run("BatchGatherOrInsert", 200, num_threads, &pool,
+             [&skewed](int t, int64_t begin, int64_t end) {
+               TF_CHECK_OK(skewed.tables[t]->FindOrInsertRange(
+                   skewed.keys[t], &skewed.outs[t], nullptr, nullptr, false,
+                   begin, end));
+             });
+}
+
+// Optimizer steps of a wide model with 400 tables, per_table is one
+// KvVariableSparseApplyAdagrad per table and flattened is
+// BatchKvVariableSparseApplyAdagrad, each key takes the update of the ops.
+// This compares the schedules only, benchmark_batch_sparse_apply_adagrad in
+// py_ut/tests/test_training_ops.py runs the ops themselves.
+TEST(KvVariableBenchmark, BatchApplyAdagrad) {
+  const int num_threads = BenchNumThreads();
+  const int embedding_dim = 16;
+  thread::ThreadPool pool(Env::Default(), "bench_batch_apply", num_threads);
+  SkewedTables skewed("bench_batch_apply", 400,
+                      std::min<int64_t>(BenchNumKeys(), 1 << 16),
+                      embedding_dim);
+  std::vector<IndexOrder> orders;
+  for (size_t t = 0; t < skewed.tables.size(); ++t) {
+    orders.push_back(static_cast<KvVariable<int64, float>*>(
+                         skewed.tables[t].get())
+                         ->ApplyOrder(skewed.keys[t]));
+  }
+  skewed.Run(
+      "BatchApplyAdagrad", 200, num_threads, &pool,
+      [&skewed, &orders, embedding_dim](int t, int64_t begin, int64_t end) {
+        auto* variable =
+            static_cast<KvVariable<int64, float>*>(skewed.tables[t].get());
+        const auto keys_flat = skewed.keys[t].flat<int64>();
+        auto apply_lock = variable->GetApplyLock(orders[t]);
+        for (int64_t j = begin; j < end; ++j) {
+          const int64 key = keys_flat(orders[t](j));
+          EVContext<float> context;
+          auto lock = apply_lock.Lock(key);
+          variable->FindOrInsertUnsafe(key, &context, nullptr);
+          float* row = context.Value();
+          for (int d = 0; d < embedding_dim; ++d) {
+            row[d] -= 0.01f * row[d] / std::sqrt(1.0f + row[d] * row[d]);
+          }
+          variable->CoverUpdateUnsafe(key, &context);
+        }
+      });
+}
+
+// The per key row update shared by the group lasso Adam optimizers, the
+// moments and the norm of the group lasso step, written with Eigen
+// expressions the way the ops used to and with the row kernels.
+TEST(KvVariableBenchmark, RowKernels) {
+  const int64_t num_rows = std::min<int64_t>(BenchNumKeys(), 1 << 16);
+  const float beta1 = 0.9f, beta2 = 0.999f, l1 = 0.01f;
+  using Row = TTypes<float>::Tensor;
+  for (int dim : {8, 16, 32, 64, 128, 256}) {
+    std::mt19937 gen(13);
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+    std::vector<float> grad(num_rows * dim), m(num_rows * dim),
+        v(num_rows * dim), linear(num_rows * dim);
+    for (int64_t i = 0; i < num_rows * dim; ++i) {
+      grad[i] = dist(gen);
+      m[i] = dist(gen);
+      v[i] = std::fabs(dist(gen));
+      linear[i] = dist(gen);
+    }
+    double norms = 0;
+    auto start = Clock::now();
+    for (int64_t r = 0; r < num_rows; ++r) {
+      Row m_row(m.data() + r * dim, dim), v_row(v.data() + r * dim, dim);
+      Row linear_row(linear.data() + r * dim, dim);
+      Row grad_row(grad.data() + r * dim, dim);
+      m_row = beta1 * m_row + (1.0f - beta1) * grad_row;
+      v_row = beta2 * v_row + (1.0f - beta2) * grad_row.square();
+      auto l1_linear = linear_row.cwiseMin(l1).cwiseMax(-l1) - linear_row;
+      Eigen::Tensor<float, 0, Eigen::RowMajor> norm =
+          l1_linear.square().sum().sqrt();
+      norms += norm(0);
+    }
+    double eigen_ns = ElapsedNs(start);
+    start = Clock::now();
+    for (int64_t r = 0; r < num_rows; ++r) {
+      const int64_t offset = r * dim;
+      AdamMoments(m.data() + offset, v.data() + offset, grad.data() + offset,
+                  grad.data() + offset, beta1, beta2, dim);
+      norms += GroupShrinkNorm(linear.data() + offset, l1, dim);
+    }
+    double kernel_ns = ElapsedNs(start);
+    LOG(INFO) << "RowKernels isa=" << RowKernelIsa() << " dim=" << dim
+              << " rows=" << num_rows << " eigen=" << eigen_ns / num_rows
+              << "ns/row kernels=" << kernel_ns / num_rows
+              << "ns/row norms=" << norms;
+  }
+}
+
+// The row update of each optimizer ported to the row kernels, written with
+// Eigen expressions the way its op used to and with the kernels. Ftrl is the
+// lr_power -0.5 step, AMSGrad and AdaBelief their group lasso step and
+// RectifiedAdam its moments, the rest of its step is still Eigen.
+TEST(KvVariableBenchmark, OptimizerRowKernels) {
+  const int64_t num_rows = std::min<int64_t>(BenchNumKeys(), 1 << 16);
+  const float lr = 0.01f, l1 = 0.01f, l2 = 0.001f, l21_norm = 0.01f,
+              epsilon = 1e-8f, beta1 = 0.9f, beta2 = 0.999f;
+  const float m_correction = 1.0f - 0.9f * 0.9f;
+  const float v_correction = 1.0f - 0.999f * 0.999f;
+  using Row = TTypes<float>::Tensor;
+  for (int dim : {8, 16, 32, 64, 128, 256}) {
+    std::mt19937 gen(23);
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+    std::vector<float> grad(num_rows * dim), var(num_rows * dim),
+        accum(num_rows * dim), linear(num_rows * dim), m(num_rows * dim),
+        v(num_rows * dim);
+    for (int64_t i = 0; i < num_rows * dim; ++i) {
+      grad[i] = dist(gen);
+      var[i] = dist(gen);
+      accum[i] = std::fabs(dist(gen)) + 0.1f;
+      linear[i] = dist(gen);
+      m[i] = dist(gen);
+      v[i] = std::fabs(dist(gen));
+    }
+    // Runs eigen(grad, var, accum, linear, m, v) and kernels(offset) over
+    // every row and logs both.
+    auto bench = [&](const char* optimizer,
+                     std::function<void(Row, Row, Row, Row, Row, Row)> eigen,
+                     std::function<void(int64_t)> kernels) {
+      auto start = Clock::now();
+      for (int64_t r = 0; r < num_rows; ++r) {
+        const int64_t offset = r * dim;
+        eigen(Row(grad.data() + offset, dim),
+              Row(var.data() + offset, dim), Row(accum.data() + offset, dim),
+              Row(linear.data() + offset, dim), Row(m.data() + offset, dim),
+              Row(v.data() + offset, dim));
+      }
+      double eigen_ns = ElapsedNs(start);
+      start = Clock::now();
+      for (int64_t r = 0; r < num_rows; ++r) {
+        kernels(r * dim);
+      }
+      double kernel_ns = ElapsedNs(start);
+      LOG(INFO) << "OptimizerRowKernels " << optimizer
+                << " isa=" << RowKernelIsa() << " dim=" << dim
+                << " rows=" << num_rows << " eigen=" << eigen_ns / num_rows
+                << "ns/row kernels=" << kernel_ns / num_rows << "ns/row";
+    };
+    // The group lasso step of the Eigen ops, accum is the new accumulator.
+    auto eigen_group_step = [&](Row var_row, Row accum_row, Row linear_row) {
+      auto l1_linear = linear_row.cwiseMin(l1).cwiseMax(-l1) - linear_row;
+      Eigen::Tensor<float, 0, Eigen::RowMajor> norm =
+          l1_linear.square().sum().sqrt();
+      if (norm(0) > l21_norm) {
+        auto y = (accum_row.sqrt() + accum_row.constant(epsilon)) / lr +
+                 linear_row.constant(2.0f * l2);
+        var_row = l1_linear * (1.0f - l21_norm / norm(0)) / y;
+      }
+    };
+
+    bench(
+        "Adagrad",
+        [&](Row g, Row var_row, Row accum_row, Row, Row, Row) {
+          accum_row += g.square();
+          var_row -= g.constant(lr) * g / accum_row.sqrt();
+        },
+        [&](int64_t offset) {
+          AdagradRow(var.data() + offset, accum.data() + offset,
+                     grad.data() + offset, lr, true, dim);
+        });
+    bench(
+        "Ftrl",
+        [&](Row g, Row var_row, Row accum_row, Row linear_row, Row, Row) {
+          auto new_accum = accum_row + g.square();
+          linear_row +=
+              g - (new_accum.sqrt() - accum_row.sqrt()) / lr * var_row;
+          auto x = linear_row.cwiseMin(l1).cwiseMax(-l1) - linear_row;
+          auto y = new_accum.sqrt() / new_accum.constant(lr) +
+                   linear_row.constant(2.0f * l2);
+          var_row = x / y;
+          accum_row += g.square();
+        },
+        [&](int64_t offset) {
+          FtrlLinear(linear.data() + offset, accum.data() + offset,
+                     var.data() + offset, grad.data() + offset, lr, dim);
+          ProximalStep(var.data() + offset, linear.data() + offset,
+                       accum.data() + offset, lr, l1, l2, 0.0f, 1.0f, dim);
+        });
+    bench(
+        "AMSGrad",
+        [&](Row g, Row var_row, Row vhat_row, Row linear_row, Row m_row,
+            Row v_row) {
+          m_row = beta1 * m_row + (1.0f - beta1) * g;
+          v_row = beta2 * v_row + (1.0f - beta2) * g.square();
+          auto new_vhat = vhat_row.cwiseMax(v_row / v_correction);
+          linear_row += m_row / m_correction -
+                        (new_vhat.sqrt() - vhat_row.sqrt()) / lr * var_row;
+          vhat_row = new_vhat;
+          eigen_group_step(var_row, vhat_row, linear_row);
+        },
+        [&](int64_t offset) {
+          AdamMoments(m.data() + offset, v.data() + offset,
+                      grad.data() + offset, grad.data() + offset, beta1,
+                      beta2, dim);
+          AdaptiveLinear(linear.data() + offset, accum.data() + offset,
+                         var.data() + offset, m.data() + offset,
+                         v.data() + offset, m_correction, v_correction, lr,
+                         true, dim);
+          GroupProximalStep(var.data() + offset, linear.data() + offset,
+                            accum.data() + offset, lr, l1, l2, epsilon,
+                            l21_norm, dim);
+        });
+    bench(
+        "AdaBelief",
+        [&](Row g, Row var_row, Row accum_row, Row linear_row, Row m_row,
+            Row v_row) {
+          m_row = beta1 * m_row + (1.0f - beta1) * g;
+          v_row = beta2 * v_row + (1.0f - beta2) * (g - m_row).square();
+          auto new_accum = v_row / v_correction;
+          linear_row += m_row / m_correction -
+                        (new_accum.sqrt() - accum_row.sqrt()) / lr * var_row;
+          accum_row = new_accum;
+          eigen_group_step(var_row, accum_row, linear_row);
+        },
+        [&](int64_t offset) {
+          AdaBeliefMoments(m.data() + offset, v.data() + offset,
+                           grad.data() + offset, beta1, beta2, dim);
+          AdaptiveLinear(linear.data() + offset, accum.data() + offset,
+                         var.data() + offset, m.data() + offset,
+                         v.data() + offset, m_correction, v_correction, lr,
+                         false, dim);
+          GroupProximalStep(var.data() + offset, linear.data() + offset,
+                            accum.data() + offset, lr, l1, l2, epsilon,
+                            l21_norm, dim);
+        });
+    bench(
+        "RectifiedAdam",
+        [&](Row g, Row, Row, Row, Row m_row, Row v_row) {
+          m_row = beta1 * m_row + (1.0f - beta1) * g;
+          auto new_v = beta2 * v_row + (1.0f - beta2) * g.square();
+          v_row = new_v;
+        },
+        [&](int64_t offset) {
+          AdamMoments(m.data() + offset, v.data() + offset,
+                      grad.data() + offset, grad.data() + offset, beta1,
+                      beta2, dim);
+        });
+  }
+}
+
+// The update loop of the sparse apply ops over Zipf skewed keys, locking
+// each key on contiguous ranges of the batch and, with
+// TFPLUS_KV_SEGMENT_APPLY, holding each segment on the ranges of segments
+// of an ApplyOrder(), from 8 to 96 threads.
+TEST(KvVariableBenchmark, SegmentApply) {
+  const int64_t num_keys = BenchNumKeys();
+  const int embedding_dim = 32;
+  std::mt19937_64 gen(17);
+  std::uniform_real_distribution<double> uniform(0.0, 1.0);
+  Tensor keys(DT_INT64, TensorShape({num_keys}));
+  auto keys_flat = keys.flat<int64>();
+  for (int64_t i = 0; i < num_keys; ++i) {
+    keys_flat(i) = static_cast<int64>(std::pow(num_keys, uniform(gen))) - 1;
+  }
+  Tensor init(DT_FLOAT, TensorShape({1024, embedding_dim}));
+  init.flat<float>().setRandom();
+  for (bool by_segment : {false, true}) {
+    if (by_segment) {
+      setenv("TFPLUS_KV_SEGMENT_APPLY", "1", 1);
+    }
+    auto variable = new KvVariable<int64, float>(
+        "bench_segment_apply", TensorShape({embedding_dim}), 0);
+    unsetenv("TFPLUS_KV_SEGMENT_APPLY");
+    core::ScopedUnref unref_variable(variable);
+    TF_CHECK_OK(variable->InitRandomValues(init));
+    const IndexOrder order = variable->ApplyOrder(keys);
+    auto update = [&](int64_t begin, int64_t end) {
+      auto apply_lock = variable->GetApplyLock(order);
+      for (int64_t j = begin; j < end; ++j) {
+        const int64 key = keys_flat(order(j));
+        EVContext<float> context;
+        auto lock = apply_lock.Lock(key);
+        variable->FindOrInsertUnsafe(key, &context, nullptr);
+        float* row = context.Value();
+        for (int d = 0; d < embedding_dim; ++d) {
+          row[d] -= 0.01f * row[d];
+        }
+        variable->CoverUpdateUnsafe(key, &context);
+      }
+    };
+    for (int num_threads : {8, 16, 32, 64, 96}) {
+      double ns;
+      if (order.by_segment()) {
+        const std::vector<int64_t>& segment_begin = order.group_begin();
+        ns = RunParallel(num_threads, segment_begin.size() - 1,
+                         [&](int, int64_t first, int64_t last) {
+                           update(segment_begin[first], segment_begin[last]);
+                         });
+      } else {
+        ns = RunParallel(num_threads, num_keys,
+                         [&](int, int64_t begin, int64_t end) {
+                           update(begin, end);
+                         });
+      }
+      LOG(INFO) << "SegmentApply keys=" << num_keys
+                << " threads=" << num_threads << " by_segment="
+                << order.by_segment() << " apply=" << ns / num_keys
+                << "ns/key";
+    }
+  }
+}
+
+// The lookups of the apply ops over Zipf skewed keys, probing the map and
+// with the handles of a FindOrInsertWithHandles() of the same keys.
+TEST(KvVariableBenchmark, RowHandles) {
+  const int64_t num_keys = BenchNumKeys();
+  const int embedding_dim = 32;
+  std::mt19937_64 gen(19);
+  std::uniform_real_distribution<double> uniform(0.0, 1.0);
+  Tensor keys(DT_INT64, TensorShape({num_keys}));
+  auto keys_flat = keys.flat<int64>();
+  for (int64_t i = 0; i < num_keys; ++i) {
+    keys_flat(i) = static_cast<int64>(std::pow(num_keys, uniform(gen))) - 1;
+  }
+  Tensor init(DT_FLOAT, TensorShape({1024, embedding_dim}));
+  init.flat<float>().setRandom();
+  auto variable = new KvVariable<int64, float>(
+      "bench_row_handles", TensorShape({embedding_dim}), 0);
+  core::ScopedUnref unref_variable(variable);
+  TF_CHECK_OK(variable->InitRandomValues(init));
+  Tensor values(DT_FLOAT, TensorShape({num_keys, embedding_dim}));
+  auto resolution = variable->NewRowResolution(num_keys);
+  {
+    mutex_read_lock lock(*variable->mu());
+    TF_CHECK_OK(
+        variable->ResolveRowsLocked(nullptr, keys, &values, resolution));
+  }
+  Tensor handles(DT_INT64, TensorShape({num_keys, 3}));
+  auto handles_matrix = handles.matrix<int64>();
+  for (int64_t i = 0; i < num_keys; ++i) {
+    handles_matrix(i, 0) = 1;
+    handles_matrix(i, 1) = i;
+    handles_matrix(i, 2) = keys_flat(i);
+  }
+  for (bool seeded : {false, true}) {
+    if (seeded) {
+      resolution->Ref();
+    }
+    const KvVariable<int64, float>::RowHandles rows =
+        seeded ? KvVariable<int64, float>::RowHandles(handles_matrix.data(),
+                                                      resolution)
+               : KvVariable<int64, float>::RowHandles();
+    float sum = 0.0f;
+    auto start = Clock::now();
+    for (int64_t i = 0; i < num_keys; ++i) {
+      auto lock =
+          variable->GetScopedKeyLock(keys_flat(i), LockType::WRITE_LOCK);
+      EVContext<float> context;
+      rows.Seed(i, keys_flat(i), &context);
+      variable->FindOrInsertUnsafe(keys_flat(i), &context, nullptr);
+      sum += context.Value()[0];
+    }
+    LOG(INFO) << "RowHandles keys=" << num_keys << " seeded=" << seeded
+              << " lookup=" << ElapsedNs(start) / num_keys
+              << "ns/key sum=" << sum;
+  }
+  resolution->Unref();
+}
+
+int main(int argc, char** argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -87,6 +87,12 @@ class KvVariableInterface : public ::tensorflow::ResourceBase {
   virtual Status FindOrZeros(OpKernelContext* ctx, const Tensor& keys,
                              Tensor* values) const = 0;
 
+  // FindOrZeros() of keys[begin, end) into the same rows of values, on the
+  // calling thread. BatchKvVariableGatherOrZeros shards the keys of all its
+  // tables together with it.
+  virtual Status FindOrZerosRange(const Tensor& keys, Tensor* values,
+                                  int64 begin, int64 end) const = 0;
+
   Status FindOrInsert(OpKernelContext* ctx, const Tensor& keys,
                       Tensor* values) {
     return FindOrInsert(ctx, keys, values, nullptr, nullptr);
@@ -118,6 +124,23 @@ class KvVariableInterface : public ::tensorflow::ResourceBase {
                               Tensor* values, const Tensor* counts,
                               Tensor* filter_out, bool apply_filter = true) = 0;
 
+  // FindOrInsert() of keys[begin, end) on the calling thread, keys are not
+  // deduplicated. BatchKvVariableGatherOrInsert shards the keys of all its
+  // tables together with it.
+  virtual Status FindOrInsertRange(const Tensor& keys, Tensor* values,
+                                   const Tensor* counts, Tensor* filter_out,
+                                   bool apply_filter, int64 begin,
+                                   int64 end) = 0;
+
+  // FindOrInsert() that also fills handles, an int64 [keys.NumElements(), 3]
+  // tensor, which names the rows the lookups resolved in the step of ctx and
+  // holds the position and the key of each row. The optimizer ops of the
+  // step take them to skip looking the keys up again. Tables whose rows can
+  // move, or lookups outside of a step, output zeros, which no op uses.
+  virtual Status FindOrInsertWithHandles(OpKernelContext* ctx,
+                                         const Tensor& keys, Tensor* values,
+                                         Tensor* handles) = 0;
+
   /*
     InsertOrUpdate is used after optimizer complete the backward computing.
     The filter_out are low frequency keys which will not be updated.
@@ -174,6 +197,12 @@ class KvVariableInterface : public ::tensorflow::ResourceBase {
 
   virtual Status CountStorageSize(OpKernelContext* ctx) = 0;
 
+  // The admission sketch is saved with the checkpoint, its counters are
+  // output as "sketch", which is empty when every key is admitted.
+  virtual Status ExportAdmissionSketch(OpKernelContext* ctx) = 0;
+
+  virtual Status ImportAdmissionSketch(const Tensor& sketch) = 0;
+
   virtual Status FullOrDeltaImport(OpKernelContext* ctx, int first_n,
                                    const Tensor& keys, const Tensor& values,
                                    const std::vector<Tensor>& others) = 0;
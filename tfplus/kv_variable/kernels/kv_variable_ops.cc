@@ -11,6 +11,10 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <memory>
+#include <mutex>
+#include <vector>
+
 #include "tensorflow/core/framework/op.h"
 #include "tensorflow/core/framework/op_kernel.h"
 #include "tensorflow/core/framework/register_types.h"
@@ -21,6 +25,7 @@
 #include "tensorflow/core/framework/types.h"
 #include "tensorflow/core/lib/strings/str_util.h"
 #include "tensorflow/core/platform/types.h"
+#include "tfplus/kv_variable/kernels/index_order.h"
 #include "tfplus/kv_variable/kernels/kv_variable.h"
 #include "tfplus/kv_variable/kernels/utility.h"
 #include "tfplus/kv_variable/kernels/hybrid_embedding/storage_config.pb.h"
@@ -80,6 +85,20 @@ class CreateKvVariableOp : public OpKernel {
       storage_config.set_inference_storage_size(-1);
       storage_option.set_combination(StorageCombination::MEM);
       storage_option.mutable_configs()->insert({MEM, storage_config});
+      // Older op versions carry no storage option.
+      if (TryGetNodeAttr(this->def(), "storage_option",
+                         &storage_option_string)) {
+        StorageOption requested_option;
+        if (requested_option.ParseFromString(storage_option_string)) {
+          // Without configs the default storage is kept, the other fields,
+          // e.g. the num_segments slots share with their variable, apply.
+          if (requested_option.configs().empty()) {
+            requested_option.set_combination(storage_option.combination());
+            *requested_option.mutable_configs() = storage_option.configs();
+          }
+          storage_option = requested_option;
+        }
+      }
       auto creator =
           [ctx, this, enter_threshold, &value_shape, &storage_option](
               tfplus::KvVariableInterface** ret) {
@@ -271,6 +290,38 @@ class KvVariableStorageSizeOp : public OpKernel {
 REGISTER_KERNEL_BUILDER(Name("KvVariableSizeV3").Device(DEVICE_CPU),
                         KvVariableStorageSizeOp);
 
+class KvVariableExportAdmissionSketchOp : public OpKernel {
+ public:
+  explicit KvVariableExportAdmissionSketchOp(OpKernelConstruction* ctx)
+      : OpKernel(ctx) {}
+
+  void Compute(OpKernelContext* ctx) override {
+    KvVariableInterface* table;
+    OP_REQUIRES_OK(ctx, LookupResource(ctx, HandleFromInput(ctx, 0), &table));
+    core::ScopedUnref unref_me(table);
+    OP_REQUIRES_OK(ctx, table->ExportAdmissionSketch(ctx));
+  }
+};
+REGISTER_KERNEL_BUILDER(
+    Name("KvVariableExportAdmissionSketch").Device(DEVICE_CPU),
+    KvVariableExportAdmissionSketchOp);
+
+class KvVariableImportAdmissionSketchOp : public OpKernel {
+ public:
+  explicit KvVariableImportAdmissionSketchOp(OpKernelConstruction* ctx)
+      : OpKernel(ctx) {}
+
+  void Compute(OpKernelContext* ctx) override {
+    KvVariableInterface* table;
+    OP_REQUIRES_OK(ctx, LookupResource(ctx, HandleFromInput(ctx, 0), &table));
+    core::ScopedUnref unref_me(table);
+    OP_REQUIRES_OK(ctx, table->ImportAdmissionSketch(ctx->input(1)));
+  }
+};
+REGISTER_KERNEL_BUILDER(
+    Name("KvVariableImportAdmissionSketch").Device(DEVICE_CPU),
+    KvVariableImportAdmissionSketchOp);
+
 class KvVariableFrequencyOp : public OpKernel {
  public:
   explicit KvVariableFrequencyOp(OpKernelConstruction* ctx) : OpKernel(ctx) {}
@@ -440,13 +491,16 @@ class BatchKvVariableGatherOrZerosOp : public OpKernel {
   }
 
   void Compute(OpKernelContext* ctx) override {
+    std::vector<KvVariableInterface*> tables(N_, nullptr);
+    std::vector<std::unique_ptr<core::ScopedUnref>> unrefs;
+    std::vector<Tensor*> outs(N_, nullptr);
+    std::vector<int64_t> sizes(N_, 0);
     for (int i = 0; i < N_; i++) {
       KvVariableInterface* table;
       OP_REQUIRES_OK(ctx, LookupResource(ctx, HandleFromInput(ctx, i), &table));
       // bugfix(mochen.bmc): memory leak
-      core::ScopedUnref unref_me(table);
+      unrefs.emplace_back(new core::ScopedUnref(table));
       const Tensor& indices = ctx->input(N_ + i);
-      const int64_t ne = indices.NumElements();
 
       // The result shape is indices.shape + value_shape.
       const TensorShape& value_shape = table->value_shape();
@@ -458,14 +512,25 @@ class BatchKvVariableGatherOrZerosOp : public OpKernel {
       }
 
       // allocate the output buffer
-      Tensor* out = nullptr;
-      OP_REQUIRES_OK(ctx, ctx->allocate_output(i, result_shape, &out));
-
-      // gather the data
-      if (ne > 0) {
-        OP_REQUIRES_OK(ctx, table->FindOrZeros(ctx, indices, out));
-      }
+      OP_REQUIRES_OK(ctx, ctx->allocate_output(i, result_shape, &outs[i]));
+      tables[i] = table;
+      sizes[i] = indices.NumElements();
     }
+
+    // gather the data, the keys of all the tables are sharded together
+    std::mutex mu;
+    Status status;
+    auto worker_threads = *(ctx->device()->tensorflow_cpu_worker_threads());
+    ShardTables(worker_threads.num_threads, worker_threads.workers, sizes,
+                5000, [&](int i, int64_t begin, int64_t end) {
+                  Status s = tables[i]->FindOrZerosRange(
+                      ctx->input(N_ + i), outs[i], begin, end);
+                  if (!s.ok()) {
+                    std::lock_guard<std::mutex> lock(mu);
+                    status.Update(s);
+                  }
+                });
+    OP_REQUIRES_OK(ctx, status);
   }
 
  private:
@@ -499,7 +564,7 @@ template <typename T, typename Index>
 class KvVariableGatherOrInsertOp : public OpKernel {
  public:
   explicit KvVariableGatherOrInsertOp(OpKernelConstruction* ctx)
-      : OpKernel(ctx) {}
+      : OpKernel(ctx), with_handles_(ctx->num_outputs() > 1) {}
 
   void Compute(OpKernelContext* ctx) override {
     KvVariableInterface* table;
@@ -527,6 +592,17 @@ class KvVariableGatherOrInsertOp : public OpKernel {
     Tensor* out = nullptr;
     OP_REQUIRES_OK(ctx, ctx->allocate_output(0, result_shape, &out));
 
+    if (with_handles_) {
+      Tensor* handles = nullptr;
+      OP_REQUIRES_OK(ctx,
+                     ctx->allocate_output(1, TensorShape({N, 3}), &handles));
+      if (N > 0) {
+        OP_REQUIRES_OK(ctx, table->FindOrInsertWithHandles(ctx, indices, out,
+                                                           handles));
+      }
+      return;
+    }
+
     // gather the data
     if (N > 0) {
       OP_REQUIRES_OK(ctx, table->FindOrInsert(ctx, indices, out));
@@ -535,6 +611,10 @@ class KvVariableGatherOrInsertOp : public OpKernel {
     // VLOG(1) << "table " << ctx->op_kernel().name() << " current size "
     //         << table->size();
   }
+
+ private:
+  // KvVariableGatherOrInsertWithHandles.
+  const bool with_handles_;
 };
 
 #define REGISTER_GATHER_INSERT_FULL(dev, type, index_type)             \
@@ -543,6 +623,12 @@ class KvVariableGatherOrInsertOp : public OpKernel {
                               .HostMemory("table_handle")              \
                               .TypeConstraint<type>("dtype")           \
                               .TypeConstraint<index_type>("Tindices"), \
+                          KvVariableGatherOrInsertOp<type, index_type>);\
+  REGISTER_KERNEL_BUILDER(Name("KvVariableGatherOrInsertWithHandles")  \
+                              .Device(DEVICE_##dev)                    \
+                              .HostMemory("table_handle")              \
+                              .TypeConstraint<type>("dtype")           \
+                              .TypeConstraint<index_type>("Tindices"), \
                           KvVariableGatherOrInsertOp<type, index_type>)
 
 #define REGISTER_GATHER_INSERT_ALL_INDICES(dev, type) \
@@ -630,6 +716,100 @@ TF_CALL_QUANTIZED_TYPES(REGISTER_GATHER_INSERT_COUNTS_CPU);
 #undef REGISTER_GATHER_INSERT_COUNTS_ALL_INDICES
 #undef REGISTER_GATHER_INSERT_COUNTS_FULL
 
+template <typename T, typename Index>
+class BatchKvVariableGatherOrInsertOp : public OpKernel {
+ public:
+  explicit BatchKvVariableGatherOrInsertOp(OpKernelConstruction* ctx)
+      : OpKernel(ctx) {
+    OP_REQUIRES_OK(ctx, ctx->GetAttr("N", &N_));
+    OP_REQUIRES_OK(ctx, ctx->GetAttr("num_counts", &num_counts_));
+    OP_REQUIRES_OK(ctx, ctx->GetAttr("num_filter_out", &num_filter_out_));
+    OP_REQUIRES(ctx, num_counts_ == 0 || num_counts_ == N_,
+                errors::InvalidArgument("Expected 0 or ", N_,
+                                        " counts, got ", num_counts_));
+    OP_REQUIRES(ctx, num_filter_out_ == 0 || num_filter_out_ == N_,
+                errors::InvalidArgument("Expected 0 or ", N_,
+                                        " filter_out, got ", num_filter_out_));
+  }
+
+  void Compute(OpKernelContext* ctx) override {
+    std::vector<KvVariableInterface*> tables(N_, nullptr);
+    std::vector<std::unique_ptr<core::ScopedUnref>> unrefs;
+    std::vector<Tensor*> outs(N_, nullptr);
+    std::vector<Tensor*> filters(N_, nullptr);
+    std::vector<int64_t> sizes(N_, 0);
+    for (int i = 0; i < N_; i++) {
+      KvVariableInterface* table;
+      OP_REQUIRES_OK(ctx, LookupResource(ctx, HandleFromInput(ctx, i), &table));
+      unrefs.emplace_back(new core::ScopedUnref(table));
+      const Tensor& indices = ctx->input(N_ + i);
+
+      // The result shape is indices.shape + value_shape.
+      const TensorShape& value_shape = table->value_shape();
+      TensorShape result_shape = indices.shape();
+      for (int d = 0; d < value_shape.dims(); d++) {
+        result_shape.AddDim(value_shape.dim_size(d));
+      }
+      OP_REQUIRES_OK(ctx, ctx->allocate_output(i, result_shape, &outs[i]));
+      if (num_filter_out_ > 0) {
+        OP_REQUIRES_OK(ctx, ctx->allocate_output(N_ + i, indices.shape(),
+                                                 &filters[i]));
+        filters[i]->flat<bool>().setConstant(false);
+      }
+      tables[i] = table;
+      sizes[i] = indices.NumElements();
+    }
+
+    // The keys of all the tables are sharded together, each table does not
+    // pay a Shard() of its own.
+    std::mutex mu;
+    Status status;
+    auto worker_threads = *(ctx->device()->tensorflow_cpu_worker_threads());
+    ShardTables(
+        worker_threads.num_threads, worker_threads.workers, sizes, 5000,
+        [&](int i, int64_t begin, int64_t end) {
+          const Tensor* counts =
+              num_counts_ > 0 ? &ctx->input(2 * N_ + i) : nullptr;
+          Status s = tables[i]->FindOrInsertRange(ctx->input(N_ + i), outs[i],
+                                                  counts, filters[i], false,
+                                                  begin, end);
+          if (!s.ok()) {
+            std::lock_guard<std::mutex> lock(mu);
+            status.Update(s);
+          }
+        });
+    OP_REQUIRES_OK(ctx, status);
+  }
+
+ private:
+  int N_;
+  int num_counts_;
+  int num_filter_out_;
+};
+
+#define REGISTER_BATCH_GATHER_INSERT_FULL(dev, type, index_type)       \
+  REGISTER_KERNEL_BUILDER(Name("BatchKvVariableGatherOrInsert")        \
+                              .Device(DEVICE_##dev)                    \
+                              .HostMemory("table_handles")             \
+                              .TypeConstraint<type>("dtype")           \
+                              .TypeConstraint<index_type>("Tindices"), \
+                          BatchKvVariableGatherOrInsertOp<type, index_type>)
+
+#define REGISTER_BATCH_GATHER_INSERT_ALL_INDICES(dev, type) \
+  REGISTER_BATCH_GATHER_INSERT_FULL(dev, type, int32);      \
+  REGISTER_BATCH_GATHER_INSERT_FULL(dev, type, int64);      \
+  REGISTER_BATCH_GATHER_INSERT_FULL(dev, type, uint64)
+
+#define REGISTER_BATCH_GATHER_INSERT_CPU(type) \
+  REGISTER_BATCH_GATHER_INSERT_ALL_INDICES(CPU, type)
+
+// Registration of the CPU implementations.
+TF_CALL_ALL_TYPES(REGISTER_BATCH_GATHER_INSERT_CPU);
+TF_CALL_QUANTIZED_TYPES(REGISTER_BATCH_GATHER_INSERT_CPU);
+#undef REGISTER_BATCH_GATHER_INSERT_CPU
+#undef REGISTER_BATCH_GATHER_INSERT_ALL_INDICES
+#undef REGISTER_BATCH_GATHER_INSERT_FULL
+
 template <typename T, typename Index>
 class KvVariableGatherOp : public OpKernel {
  public:
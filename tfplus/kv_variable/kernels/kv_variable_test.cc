@@ -13,13 +13,22 @@
 
 #include "tfplus/kv_variable/kernels/kv_variable.h"
 
+#include <sys/stat.h>
+
+#include <atomic>
+#include <chrono>  // NOLINT(build/c++11)
+#include <cmath>
+#include <cstdlib>
 #include <cstring>
 #include <iostream>
 #include <memory>
 #include <random>
 #include <set>
+#include <thread>  // NOLINT(build/c++11)
+#include <vector>
 
 #include "gtest/gtest.h"
+#include "tfplus/kv_variable/kernels/row_kernels.h"
 
 namespace {
 using namespace tfplus;      // NOLINT(build/namespaces)
@@ -449,6 +458,1713 @@ TEST(KvVariableTest, Delete) {
   }
 }
 
+TEST(KvVariableTest, FlatSimdMap) {
+  std::unique_ptr<IMap<int64, EmbeddingValue<float>>> map(
+      MapFactory<int64, EmbeddingValue<float>>::CreateMap(FLAT_SIMD_MAP));
+  const int64_t num_keys = 10000;
+  for (int64_t i = 0; i < num_keys; ++i) {
+    map->FindOrInsertWithFn(i, [](const int64& key) {
+      return EmbeddingValue<float>(nullptr, false, key, false);
+    });
+  }
+  EXPECT_EQ(static_cast<int64_t>(map->size()), num_keys);
+  for (int64_t i = 0; i < num_keys; i += 2) {
+    EXPECT_TRUE(map->erase(i));
+  }
+  EXPECT_EQ(static_cast<int64_t>(map->size()), num_keys / 2);
+  for (int64_t i = 0; i < num_keys; ++i) {
+    auto* ev = map->FindOrNull(i);
+    if (i % 2 == 0) {
+      EXPECT_EQ(ev, nullptr);
+    } else {
+      ASSERT_NE(ev, nullptr);
+      EXPECT_EQ(ev->GetFrequency(), i);
+    }
+  }
+  size_t visited = 0;
+  map->ForEach([&](const int64& key, const EmbeddingValue<float>* ev) {
+    EXPECT_EQ(key % 2, 1);
+    ++visited;
+  });
+  EXPECT_EQ(static_cast<int64_t>(visited), num_keys / 2);
+
+  // The KvVariable api works on top of the flat map as well.
+  const int embedding_dim = 16;
+  int saved_map_type = gConf.map_type;
+  gConf.map_type = FLAT_SIMD_MAP;
+  auto table =
+      std::unique_ptr<KvVariableInterface>(new KvVariable<int64, float>(
+          std::string("test_kv_variable_flat_map"),
+          TensorShape({embedding_dim}), 0,
+          GetStorageOption(StorageCombination::MEM)));
+  gConf.map_type = saved_map_type;
+  Tensor random_init(DataTypeToEnum<float>::v(),
+                     TensorShape({1024, embedding_dim}));
+  TFPLUS_EXPECT_OK(GenerateRandomRealTensor(0.1, 1.0, &random_init));
+  TFPLUS_EXPECT_OK(table->InitRandomValues(random_init));
+
+  Tensor keys(DataTypeToEnum<int64>::v(), TensorShape({num_keys}));
+  TFPLUS_EXPECT_OK(GenerateIndexTensor<int64>(0, &keys));
+  Tensor values(DataTypeToEnum<float>::v(),
+                TensorShape({num_keys, embedding_dim}));
+  TFPLUS_EXPECT_OK(table->FindOrInsert(nullptr, keys, &values));
+  EXPECT_EQ(static_cast<int64_t>(table->size()), num_keys);
+  Tensor found(DataTypeToEnum<float>::v(),
+               TensorShape({num_keys, embedding_dim}));
+  TFPLUS_EXPECT_OK(table->FindOrZeros(nullptr, keys, &found));
+  auto values_flat = values.flat<float>();
+  auto found_flat = found.flat<float>();
+  for (int64_t i = 0; i < values_flat.size(); ++i) {
+    if (values_flat(i) != found_flat(i)) {
+      TFPLUS_EXPECT_OK(errors::InvalidArgument(
+          "FlatSimdMap lookup mismatch: ", values_flat(i),
+          " != ", found_flat(i)));
+      break;
+    }
+  }
+}
+
+TEST(KvVariableTest, MapSegments) {
+  SegmentSelector selector(1000);
+  EXPECT_EQ(selector.num_segments(), 1024u);
+  EXPECT_EQ(SegmentSelector(0).num_segments(), 1u);
+  EXPECT_EQ(SegmentSelector(HASH_SIZE_MAX + 1).num_segments(), HASH_SIZE_MAX);
+  // Strided keys still spread over the segments with an identity hash.
+  std::vector<int> keys_per_segment(selector.num_segments());
+  for (size_t key = 0; key < 100 * selector.num_segments(); ++key) {
+    ++keys_per_segment[selector(key * 1024)];
+  }
+  EXPECT_LE(*std::max_element(keys_per_segment.begin(),
+                              keys_per_segment.end()),
+            200);
+
+  const int64_t num_keys = 10000;
+  for (MapType map_type : {CONCURRENT_UNORDERED_MAP, CONCURRENT_DENSE_HASH_MAP,
+                           FLAT_SIMD_MAP}) {
+    std::unique_ptr<IMap<int64, EmbeddingValue<float>>> map(
+        MapFactory<int64, EmbeddingValue<float>>::CreateMap(map_type, 3));
+    for (int64_t i = 0; i < num_keys; ++i) {
+      map->FindOrInsertWithFn(i, [](const int64& key) {
+        return EmbeddingValue<float>(nullptr, false, key, false);
+      });
+      // Assigning an existing key does not change the size.
+      map->InsertOrAssign(i / 2, EmbeddingValue<float>(nullptr, false, i,
+                                                       false));
+    }
+    EXPECT_EQ(static_cast<int64_t>(map->size()), num_keys);
+    for (int64_t i = 0; i < num_keys; i += 2) {
+      EXPECT_TRUE(map->erase(i));
+      EXPECT_FALSE(map->erase(i));
+    }
+    EXPECT_EQ(static_cast<int64_t>(map->size()), num_keys / 2);
+    size_t visited = 0;
+    map->ForEach([&](const int64& key, const EmbeddingValue<float>* ev) {
+      ++visited;
+    });
+    EXPECT_EQ(visited, map->size());
+    map->clear();
+    EXPECT_EQ(map->size(), 0u);
+  }
+
+  // The segment count of a KvVariable comes from its storage option.
+  StorageOption storage_option = GetStorageOption(StorageCombination::MEM);
+  storage_option.set_num_segments(16);
+  auto table =
+      std::unique_ptr<KvVariableInterface>(new KvVariable<int64, float>(
+          std::string("test_kv_variable_segments"), TensorShape({8}), 0,
+          storage_option));
+  Tensor random_init(DataTypeToEnum<float>::v(), TensorShape({1024, 8}));
+  TFPLUS_EXPECT_OK(GenerateRandomRealTensor(0.1, 1.0, &random_init));
+  TFPLUS_EXPECT_OK(table->InitRandomValues(random_init));
+  Tensor keys(DataTypeToEnum<int64>::v(), TensorShape({100}));
+  TFPLUS_EXPECT_OK(GenerateIndexTensor<int64>(0, &keys));
+  Tensor values(DataTypeToEnum<float>::v(), TensorShape({100, 8}));
+  TFPLUS_EXPECT_OK(table->FindOrInsert(nullptr, keys, &values));
+  EXPECT_EQ(table->size(), 100u);
+}
+
+TEST(KvVariableTest, PrefetchLookup) {
+  // A short distance so that the batches below run the whole pipeline.
+  setenv("TFPLUS_KV_PREFETCH_DISTANCE", "3", 1);
+  const int embedding_dim = 8;
+  auto table =
+      std::unique_ptr<KvVariableInterface>(new KvVariable<int64, float>(
+          std::string("test_kv_variable_prefetch"),
+          TensorShape({embedding_dim}), 0));
+  unsetenv("TFPLUS_KV_PREFETCH_DISTANCE");
+  Tensor random_init(DataTypeToEnum<float>::v(),
+                     TensorShape({1024, embedding_dim}));
+  TFPLUS_EXPECT_OK(GenerateRandomRealTensor(0.1, 1.0, &random_init));
+  TFPLUS_EXPECT_OK(table->InitRandomValues(random_init));
+
+  const int64_t num_keys = 100;
+  Tensor keys(DataTypeToEnum<int64>::v(), TensorShape({num_keys}));
+  TFPLUS_EXPECT_OK(GenerateIndexTensor<int64>(0, &keys));
+  Tensor values(DataTypeToEnum<float>::v(),
+                TensorShape({num_keys, embedding_dim}));
+  TFPLUS_EXPECT_OK(table->FindOrInsert(nullptr, keys, &values));
+
+  // Every other key is missing and reads zeros.
+  Tensor lookup_keys(DataTypeToEnum<int64>::v(), TensorShape({2 * num_keys}));
+  for (int64_t i = 0; i < 2 * num_keys; ++i) {
+    lookup_keys.flat<int64>()(i) = i % 2 == 0 ? i / 2 : num_keys + i;
+  }
+  Tensor found(DataTypeToEnum<float>::v(),
+               TensorShape({2 * num_keys, embedding_dim}));
+  TFPLUS_EXPECT_OK(table->FindOrZeros(nullptr, lookup_keys, &found));
+  auto values_flat = values.flat_outer_dims<float>();
+  auto found_flat = found.flat_outer_dims<float>();
+  for (int64_t i = 0; i < 2 * num_keys; ++i) {
+    for (int j = 0; j < embedding_dim; ++j) {
+      float expected = i % 2 == 0 ? values_flat(i / 2, j) : 0.0f;
+      EXPECT_EQ(found_flat(i, j), expected);
+    }
+  }
+
+  // A second gather of the same keys reads the inserted rows.
+  Tensor again(DataTypeToEnum<float>::v(),
+               TensorShape({num_keys, embedding_dim}));
+  TFPLUS_EXPECT_OK(table->FindOrInsert(nullptr, keys, &again));
+  auto again_flat = again.flat<float>();
+  for (int64_t i = 0; i < again_flat.size(); ++i) {
+    EXPECT_EQ(again_flat(i), values.flat<float>()(i));
+  }
+  EXPECT_EQ(table->size(), static_cast<size_t>(num_keys));
+
+  // Prefetching keys whose segment the caller holds does not wait for it.
+  auto* variable = static_cast<KvVariable<int64, float>*>(table.get());
+  const auto& keys_flat = keys.flat<int64>();
+  auto key_at = [&keys_flat](int64 j) { return keys_flat(j); };
+  auto lock = variable->GetScopedKeyLock(keys_flat(0), LockType::WRITE_LOCK);
+  for (int64_t j = 0; j < num_keys; ++j) {
+    variable->PrefetchLookup(key_at, 0, j, num_keys);
+  }
+}
+
+TEST(KvVariableTest, SlabAllocator) {
+  const int embedding_dim = 64;
+  SlabAllocator allocator(embedding_dim * sizeof(float));
+  std::vector<void*> rows;
+  for (int i = 0; i < 1000; ++i) {
+    rows.push_back(allocator.Allocate());
+    std::memset(rows.back(), 0, embedding_dim * sizeof(float));
+  }
+  size_t reserved = allocator.AllocatedBytes();
+  EXPECT_GT(reserved, 0u);
+  EXPECT_EQ(allocator.InUseBytes(), 1000 * embedding_dim * sizeof(float));
+  for (void* row : rows) {
+    DeallocateEmbedding(row);
+  }
+  EXPECT_EQ(allocator.NumFreeRows(), 1000u);
+  EXPECT_EQ(allocator.InUseBytes(), 0u);
+  // Freed rows are reused before any new slab is carved.
+  std::set<void*> recycled(rows.begin(), rows.end());
+  for (int i = 0; i < 1000; ++i) {
+    EXPECT_EQ(recycled.count(allocator.Allocate()), 1u);
+  }
+  EXPECT_EQ(allocator.AllocatedBytes(), reserved);
+
+  // Buffers that do not come from a slab go back to the cpu allocator.
+  DeallocateEmbedding(AllocateRaw(embedding_dim * sizeof(float)));
+
+  // Rows released by Delete are recycled by the next insertions.
+  auto table =
+      std::unique_ptr<KvVariableInterface>(new KvVariable<int64, float>(
+          std::string("test_kv_variable_slab"), TensorShape({embedding_dim}),
+          0, GetStorageOption(StorageCombination::MEM)));
+  Tensor random_init(DataTypeToEnum<float>::v(),
+                     TensorShape({1024, embedding_dim}));
+  TFPLUS_EXPECT_OK(GenerateRandomRealTensor(0.1, 1.0, &random_init));
+  TFPLUS_EXPECT_OK(table->InitRandomValues(random_init));
+  int64_t base_memory = table->MemoryUsed();
+  const int num_keys = 1000;
+  Tensor keys(DataTypeToEnum<int64>::v(), TensorShape({num_keys}));
+  TFPLUS_EXPECT_OK(GenerateIndexTensor<int64>(0, &keys));
+  Tensor values(DataTypeToEnum<float>::v(),
+                TensorShape({num_keys, embedding_dim}));
+  TFPLUS_EXPECT_OK(table->FindOrInsert(nullptr, keys, &values));
+  int64_t used_memory = table->MemoryUsed();
+  EXPECT_GT(used_memory, base_memory);
+  TFPLUS_EXPECT_OK(table->Delete(keys));
+  Tensor new_keys(DataTypeToEnum<int64>::v(), TensorShape({num_keys}));
+  TFPLUS_EXPECT_OK(GenerateIndexTensor<int64>(num_keys, &new_keys));
+  TFPLUS_EXPECT_OK(table->FindOrInsert(nullptr, new_keys, &values));
+  EXPECT_EQ(table->MemoryUsed(), used_memory);
+}
+
+
+TEST(KvVariableTest, ColocatedSlots) {
+  const int embedding_dim = 8;
+  const int num_keys = 16;
+  StorageOption primary_options = GetStorageOption(StorageCombination::MEM);
+  primary_options.set_colocated_slots(2);
+  auto primary = new KvVariable<int64, float>(
+      std::string("test_kv_variable_colocated"), TensorShape({embedding_dim}),
+      0, primary_options);
+  core::ScopedUnref unref_primary(primary);
+  KvVariableInterface* slot = new KvVariable<int64, float>(
+      std::string("test_kv_variable_colocated/slot"),
+      TensorShape({embedding_dim}), 0,
+      GetStorageOption(StorageCombination::MEM));
+  core::ScopedUnref unref_slot(slot);
+  KvVariableInterface* other_slot = new KvVariable<int64, float>(
+      std::string("test_kv_variable_colocated/other_slot"),
+      TensorShape({embedding_dim}), 0,
+      GetStorageOption(StorageCombination::MEM));
+  core::ScopedUnref unref_other_slot(other_slot);
+
+  Tensor random_init(DataTypeToEnum<float>::v(),
+                     TensorShape({1024, embedding_dim}));
+  TFPLUS_EXPECT_OK(GenerateRandomRealTensor(0.1, 1.0, &random_init));
+  TFPLUS_EXPECT_OK(primary->InitRandomValues(random_init));
+  Tensor slot_init(DataTypeToEnum<float>::v(), TensorShape({1, embedding_dim}));
+  slot_init.flat<float>().setConstant(0.5f);
+  TFPLUS_EXPECT_OK(slot->InitRandomValues(slot_init));
+  TFPLUS_EXPECT_OK(other_slot->InitRandomValues(slot_init));
+
+  // The slot holds half of the keys before it is colocated.
+  Tensor keys(DataTypeToEnum<int64>::v(), TensorShape({num_keys}));
+  TFPLUS_EXPECT_OK(GenerateIndexTensor<int64>(0, &keys));
+  Tensor slot_keys(DataTypeToEnum<int64>::v(), TensorShape({num_keys / 2}));
+  TFPLUS_EXPECT_OK(GenerateIndexTensor<int64>(0, &slot_keys));
+  Tensor slot_values(DataTypeToEnum<float>::v(),
+                     TensorShape({num_keys / 2, embedding_dim}));
+  TFPLUS_EXPECT_OK(GenerateRandomRealTensor(2.0, 3.0, &slot_values));
+  TFPLUS_EXPECT_OK(slot->InsertOrUpdate(nullptr, slot_keys, slot_values));
+  Tensor values(DataTypeToEnum<float>::v(),
+                TensorShape({num_keys, embedding_dim}));
+  KvVariableInterface* primary_interface = primary;
+  TFPLUS_EXPECT_OK(primary_interface->FindOrInsert(nullptr, keys, &values));
+
+  TFPLUS_EXPECT_OK(primary->ColocateSlots({slot, other_slot}));
+  EXPECT_EQ(primary->NumColocatedSlots(), 2);
+  EXPECT_EQ(static_cast<int64_t>(slot->size()), num_keys);
+
+  // Slot values are served from the rows of the primary, keys the slot did
+  // not hold get its initial value.
+  auto check_slot = [&](const std::string& step) {
+    Tensor found(DataTypeToEnum<float>::v(),
+                 TensorShape({num_keys, embedding_dim}));
+    TFPLUS_EXPECT_OK(slot->FindOrZeros(nullptr, keys, &found));
+    auto found_flat = found.flat_outer_dims<float>();
+    auto slot_values_flat = slot_values.flat_outer_dims<float>();
+    for (int64_t i = 0; i < num_keys; ++i) {
+      for (int j = 0; j < embedding_dim; ++j) {
+        float expected = i < num_keys / 2 ? slot_values_flat(i, j) : 0.5f;
+        if (found_flat(i, j) != expected) {
+          TFPLUS_EXPECT_OK(errors::InvalidArgument(
+              step, ": slot value of key ", i, " is ", found_flat(i, j),
+              " instead of ", expected));
+          return;
+        }
+      }
+    }
+  };
+  check_slot("colocated");
+
+  // Blacklisting the primary keeps the slots of the key.
+  {
+    auto lock = primary->GetScopedKeyLock(0, LockType::WRITE_LOCK);
+    primary->MarkBlacklistUnsafe(0, nullptr);
+  }
+  Tensor found(DataTypeToEnum<float>::v(),
+               TensorShape({num_keys, embedding_dim}));
+  TFPLUS_EXPECT_OK(primary->FindOrZeros(nullptr, keys, &found));
+  EXPECT_EQ(found.flat_outer_dims<float>()(0, 0), 0.0f);
+  EXPECT_EQ(static_cast<int64_t>(primary->size()), num_keys - 1);
+  check_slot("blacklisted");
+
+  // Writing the slot splits it back into its own table.
+  Tensor no_keys(DataTypeToEnum<int64>::v(), TensorShape({0}));
+  Tensor no_values(DataTypeToEnum<float>::v(),
+                   TensorShape({0, embedding_dim}));
+  TFPLUS_EXPECT_OK(slot->InsertOrUpdate(nullptr, no_keys, no_values));
+  std::vector<KvVariableInterface*> slots = {slot, other_slot};
+  {
+    mutex_read_lock l(*primary->colocate_mu());
+    EXPECT_FALSE(primary->SlotsColocatedUnsafe(slots));
+  }
+  EXPECT_EQ(static_cast<int64_t>(slot->size()), num_keys);
+  check_slot("split");
+
+  TFPLUS_EXPECT_OK(primary->ColocateSlots(slots));
+  check_slot("colocated again");
+
+  // Gathering the slot reads the primary and keeps it colocated, a key the
+  // primary does not hold reads the initial value and is not inserted.
+  Tensor gather_keys(DataTypeToEnum<int64>::v(), TensorShape({2}));
+  gather_keys.flat<int64>()(0) = 1;
+  gather_keys.flat<int64>()(1) = num_keys;
+  Tensor gathered(DataTypeToEnum<float>::v(), TensorShape({2, embedding_dim}));
+  TFPLUS_EXPECT_OK(slot->FindOrInsert(nullptr, gather_keys, &gathered));
+  {
+    mutex_read_lock l(*primary->colocate_mu());
+    EXPECT_TRUE(primary->SlotsColocatedUnsafe(slots));
+  }
+  auto gathered_flat = gathered.flat_outer_dims<float>();
+  EXPECT_EQ(gathered_flat(0, 0), slot_values.flat_outer_dims<float>()(1, 0));
+  EXPECT_EQ(gathered_flat(1, 0), 0.5f);
+  EXPECT_EQ(static_cast<int64_t>(slot->size()), num_keys);
+
+  KvVariableInterface* wide_slot = new KvVariable<int64, float>(
+      std::string("test_kv_variable_colocated/wide_slot"),
+      TensorShape({embedding_dim * 2}), 0,
+      GetStorageOption(StorageCombination::MEM));
+  core::ScopedUnref unref_wide_slot(wide_slot);
+  EXPECT_NE(::tensorflow::OkStatus(), primary->ColocateSlots({wide_slot}));
+}
+
+TEST(KvVariableTest, ColocatedSlotsDropSlotOnlyKeys) {
+  const int embedding_dim = 8;
+  const int num_keys = 16;
+  StorageOption primary_options = GetStorageOption(StorageCombination::MEM);
+  primary_options.set_colocated_slots(1);
+  auto primary = new KvVariable<int64, float>(
+      std::string("test_kv_variable_colocated_keys"),
+      TensorShape({embedding_dim}), 0, primary_options);
+  core::ScopedUnref unref_primary(primary);
+  KvVariableInterface* slot = new KvVariable<int64, float>(
+      std::string("test_kv_variable_colocated_keys/slot"),
+      TensorShape({embedding_dim}), 0,
+      GetStorageOption(StorageCombination::MEM));
+  core::ScopedUnref unref_slot(slot);
+  Tensor random_init(DataTypeToEnum<float>::v(),
+                     TensorShape({1024, embedding_dim}));
+  TFPLUS_EXPECT_OK(GenerateRandomRealTensor(0.1, 1.0, &random_init));
+  TFPLUS_EXPECT_OK(primary->InitRandomValues(random_init));
+  TFPLUS_EXPECT_OK(slot->InitRandomValues(random_init));
+
+  // The primary holds the first half of the keys the slot holds, one of
+  // them blacklisted.
+  Tensor keys(DataTypeToEnum<int64>::v(), TensorShape({num_keys}));
+  TFPLUS_EXPECT_OK(GenerateIndexTensor<int64>(0, &keys));
+  Tensor slot_values(DataTypeToEnum<float>::v(),
+                     TensorShape({num_keys, embedding_dim}));
+  TFPLUS_EXPECT_OK(GenerateRandomRealTensor(2.0, 3.0, &slot_values));
+  TFPLUS_EXPECT_OK(slot->InsertOrUpdate(nullptr, keys, slot_values));
+  Tensor primary_keys(DataTypeToEnum<int64>::v(), TensorShape({num_keys / 2}));
+  TFPLUS_EXPECT_OK(GenerateIndexTensor<int64>(0, &primary_keys));
+  Tensor values(DataTypeToEnum<float>::v(),
+                TensorShape({num_keys / 2, embedding_dim}));
+  KvVariableInterface* primary_interface = primary;
+  TFPLUS_EXPECT_OK(
+      primary_interface->FindOrInsert(nullptr, primary_keys, &values));
+  {
+    auto lock = primary->GetScopedKeyLock(num_keys - 1, LockType::WRITE_LOCK);
+    primary->MarkBlacklistUnsafe(num_keys - 1, nullptr);
+  }
+
+  TFPLUS_EXPECT_OK(primary->ColocateSlots({slot}));
+  // The keys only the slot held are dropped, the primary does not save them.
+  EXPECT_EQ(static_cast<int64_t>(slot->size()), num_keys / 2);
+  EXPECT_EQ(static_cast<int64_t>(primary->size()), num_keys / 2);
+  Tensor found(DataTypeToEnum<float>::v(),
+               TensorShape({num_keys, embedding_dim}));
+  TFPLUS_EXPECT_OK(slot->FindOrZeros(nullptr, keys, &found));
+  auto found_flat = found.flat<float>();
+  auto slot_values_flat = slot_values.flat<float>();
+  for (int64_t i = 0; i < found_flat.size(); ++i) {
+    EXPECT_EQ(found_flat(i),
+              i < num_keys / 2 * embedding_dim ? slot_values_flat(i) : 0.0f);
+  }
+}
+
+TEST(KvVariableTest, DeterministicInit) {
+  const int embedding_dim = 8;
+  const int num_keys = 64;
+  setenv("TFPLUS_KV_DETERMINISTIC_INIT", "1", 1);
+  // Two workers holding the same variable see the keys in different orders.
+  auto first = new KvVariable<int64, float>(
+      std::string("test_kv_variable_init"), TensorShape({embedding_dim}), 0);
+  core::ScopedUnref unref_first(first);
+  auto second = new KvVariable<int64, float>(
+      std::string("test_kv_variable_init"), TensorShape({embedding_dim}), 0);
+  core::ScopedUnref unref_second(second);
+  unsetenv("TFPLUS_KV_DETERMINISTIC_INIT");
+  Tensor random_init(DataTypeToEnum<float>::v(),
+                     TensorShape({1024, embedding_dim}));
+  TFPLUS_EXPECT_OK(GenerateRandomRealTensor(0.1, 1.0, &random_init));
+  TFPLUS_EXPECT_OK(first->InitRandomValues(random_init));
+  TFPLUS_EXPECT_OK(second->InitRandomValues(random_init));
+
+  Tensor keys(DataTypeToEnum<int64>::v(), TensorShape({num_keys}));
+  Tensor reversed_keys(DataTypeToEnum<int64>::v(), TensorShape({num_keys}));
+  for (int i = 0; i < num_keys; ++i) {
+    keys.flat<int64>()(i) = i;
+    reversed_keys.flat<int64>()(i) = num_keys - 1 - i;
+  }
+  Tensor first_values(DataTypeToEnum<float>::v(),
+                      TensorShape({num_keys, embedding_dim}));
+  Tensor second_values(DataTypeToEnum<float>::v(),
+                       TensorShape({num_keys, embedding_dim}));
+  KvVariableInterface* first_interface = first;
+  KvVariableInterface* second_interface = second;
+  TFPLUS_EXPECT_OK(first_interface->FindOrInsert(nullptr, keys, &first_values));
+  TFPLUS_EXPECT_OK(
+      second_interface->FindOrInsert(nullptr, reversed_keys, &second_values));
+
+  auto first_flat = first_values.flat_outer_dims<float>();
+  auto second_flat = second_values.flat_outer_dims<float>();
+  for (int i = 0; i < num_keys; ++i) {
+    for (int j = 0; j < embedding_dim; ++j) {
+      EXPECT_EQ(first_flat(i, j), second_flat(num_keys - 1 - i, j));
+    }
+  }
+}
+
+TEST(KvVariableTest, LazyRows) {
+  const int embedding_dim = 8;
+  const int num_keys = 1000;
+  const int num_trained_keys = 10;
+  setenv("TFPLUS_KV_LAZY_ROWS", "1", 1);
+  auto variable = new KvVariable<int64, float>(
+      std::string("test_kv_variable_lazy"), TensorShape({embedding_dim}), 0,
+      GetStorageOption(StorageCombination::MEM));
+  core::ScopedUnref unref_variable(variable);
+  unsetenv("TFPLUS_KV_LAZY_ROWS");
+  KvVariableInterface* variable_interface = variable;
+  Tensor random_init(DataTypeToEnum<float>::v(),
+                     TensorShape({1024, embedding_dim}));
+  TFPLUS_EXPECT_OK(GenerateRandomRealTensor(0.1, 1.0, &random_init));
+  TFPLUS_EXPECT_OK(variable->InitRandomValues(random_init));
+  int64_t base_memory = variable->MemoryUsed();
+
+  // Gathering new keys stores no row.
+  Tensor keys(DataTypeToEnum<int64>::v(), TensorShape({num_keys}));
+  TFPLUS_EXPECT_OK(GenerateIndexTensor<int64>(0, &keys));
+  Tensor values(DataTypeToEnum<float>::v(),
+                TensorShape({num_keys, embedding_dim}));
+  TFPLUS_EXPECT_OK(variable_interface->FindOrInsert(nullptr, keys, &values));
+  EXPECT_EQ(static_cast<int64_t>(variable->size()), num_keys);
+  EXPECT_EQ(variable->MemoryUsed(), base_memory);
+
+  auto expect_values = [&](const std::string& step, float trained_delta) {
+    Tensor gathered(DataTypeToEnum<float>::v(),
+                    TensorShape({num_keys, embedding_dim}));
+    TFPLUS_EXPECT_OK(
+        variable_interface->FindOrInsert(nullptr, keys, &gathered));
+    Tensor found(DataTypeToEnum<float>::v(),
+                 TensorShape({num_keys, embedding_dim}));
+    TFPLUS_EXPECT_OK(variable->FindOrZeros(nullptr, keys, &found));
+    auto values_flat = values.flat_outer_dims<float>();
+    auto gathered_flat = gathered.flat_outer_dims<float>();
+    auto found_flat = found.flat_outer_dims<float>();
+    for (int i = 0; i < num_keys; ++i) {
+      float delta = i < num_trained_keys ? trained_delta : 0.0f;
+      for (int j = 0; j < embedding_dim; ++j) {
+        if (gathered_flat(i, j) != values_flat(i, j) + delta ||
+            found_flat(i, j) != gathered_flat(i, j)) {
+          TFPLUS_EXPECT_OK(errors::InvalidArgument(
+              step, ": value of key ", i, " is ", gathered_flat(i, j),
+              " and ", found_flat(i, j), " instead of ",
+              values_flat(i, j) + delta));
+          return;
+        }
+      }
+    }
+  };
+  expect_values("lazy", 0.0f);
+
+  // The first update starts from the value the keys were read as.
+  for (int64 key = 0; key < num_trained_keys; ++key) {
+    auto lock = variable->GetScopedKeyLock(key, LockType::WRITE_LOCK);
+    EVContext<float> context;
+    variable->FindOrInsertUnsafe(key, &context, nullptr);
+    ASSERT_NE(context.Value(), nullptr);
+    for (int j = 0; j < embedding_dim; ++j) {
+      context.Value()[j] += 1.0f;
+    }
+  }
+  EXPECT_GT(variable->MemoryUsed(), base_memory);
+  expect_values("trained", 1.0f);
+
+  // Assigning a lazy key allocates its row as well.
+  Tensor assigned_keys(DataTypeToEnum<int64>::v(), TensorShape({1}));
+  assigned_keys.flat<int64>()(0) = num_keys - 1;
+  Tensor assigned_values(DataTypeToEnum<float>::v(),
+                         TensorShape({1, embedding_dim}));
+  assigned_values.flat<float>().setConstant(3.0f);
+  TFPLUS_EXPECT_OK(variable_interface->InsertOrUpdate(nullptr, assigned_keys,
+                                                      assigned_values));
+  Tensor assigned_found(DataTypeToEnum<float>::v(),
+                        TensorShape({1, embedding_dim}));
+  TFPLUS_EXPECT_OK(
+      variable->FindOrZeros(nullptr, assigned_keys, &assigned_found));
+  EXPECT_EQ(assigned_found.flat<float>()(0), 3.0f);
+  EXPECT_EQ(static_cast<int64_t>(variable->size()), num_keys);
+}
+
+TEST(KvVariableTest, AdmissionSketch) {
+  const int embedding_dim = 8;
+  const int num_keys = 100;
+  const int enter_threshold = 3;
+  StorageOption storage_options = GetStorageOption(StorageCombination::MEM);
+  storage_options.set_admission_sketch_width(1 << 12);
+  auto variable = new KvVariable<int64, float>(
+      std::string("test_kv_variable_admission"), TensorShape({embedding_dim}),
+      enter_threshold, storage_options);
+  core::ScopedUnref unref_variable(variable);
+  KvVariableInterface* variable_interface = variable;
+  Tensor random_init(DataTypeToEnum<float>::v(),
+                     TensorShape({1024, embedding_dim}));
+  TFPLUS_EXPECT_OK(GenerateRandomRealTensor(0.1, 1.0, &random_init));
+  TFPLUS_EXPECT_OK(variable->InitRandomValues(random_init));
+
+  Tensor keys(DataTypeToEnum<int64>::v(), TensorShape({num_keys}));
+  TFPLUS_EXPECT_OK(GenerateIndexTensor<int64>(0, &keys));
+  Tensor first_values(DataTypeToEnum<float>::v(),
+                      TensorShape({num_keys, embedding_dim}));
+  Tensor values(DataTypeToEnum<float>::v(),
+                TensorShape({num_keys, embedding_dim}));
+  Tensor filter_out(DataTypeToEnum<bool>::v(), TensorShape({num_keys}));
+  for (int step = 1; step <= enter_threshold; ++step) {
+    filter_out.flat<bool>().setConstant(false);
+    TFPLUS_EXPECT_OK(variable_interface->FindOrInsertFillFilter(
+        nullptr, keys, step == 1 ? &first_values : &values, &filter_out));
+    const bool admitted = step == enter_threshold;
+    EXPECT_EQ(static_cast<int64_t>(variable->size()), admitted ? num_keys : 0);
+    for (int i = 0; i < num_keys; ++i) {
+      EXPECT_EQ(filter_out.flat<bool>()(i), !admitted);
+    }
+  }
+  // Keys read the same value before and after their admission.
+  auto first_flat = first_values.flat<float>();
+  auto values_flat = values.flat<float>();
+  for (int64_t i = 0; i < first_values.NumElements(); ++i) {
+    EXPECT_EQ(first_flat(i), values_flat(i));
+  }
+
+  // Optimizers skip the keys that are not admitted.
+  {
+    const int64 key = num_keys;
+    auto lock = variable->GetScopedKeyLock(key, LockType::WRITE_LOCK);
+    EVContext<float> context;
+    bool should_filter = false;
+    variable->FindOrInsertUnsafe(key, &context, &should_filter);
+    EXPECT_TRUE(should_filter);
+  }
+  EXPECT_EQ(static_cast<int64_t>(variable->size()), num_keys);
+
+  // The sketch is saved and restored as its counters.
+  CountMinSketch sketch(1 << 10);
+  for (uint64_t key = 0; key < 1000; ++key) {
+    sketch.Add(key, static_cast<uint16_t>(key % 7 + 1));
+  }
+  for (uint64_t key = 0; key < 1000; ++key) {
+    EXPECT_GE(sketch.Estimate(key), key % 7 + 1);
+  }
+  std::vector<uint16_t> counters(sketch.num_counters());
+  sketch.Export(counters.data());
+  CountMinSketch restored(1 << 10);
+  restored.Import(counters.data());
+  for (uint64_t key = 0; key < 1000; ++key) {
+    EXPECT_EQ(restored.Estimate(key), sketch.Estimate(key));
+  }
+}
+
+TEST(KvVariableTest, EvictToCapacity) {
+  const int embedding_dim = 8;
+  const int num_keys = 1000;
+  const int num_hot_keys = 50;
+  const int capacity = 100;
+  // Rows are only evicted by EvictToCapacity below.
+  setenv("TFPLUS_KV_EVICTION_INTERVAL_MS", "3600000", 1);
+  StorageOption storage_options = GetStorageOption(StorageCombination::MEM);
+  (*storage_options.mutable_configs())[StorageType::MEM_STORAGE]
+      .set_training_storage_size(capacity);
+  auto variable = new KvVariable<int64, float>(
+      std::string("test_kv_variable_evict"), TensorShape({embedding_dim}), 0,
+      storage_options);
+  core::ScopedUnref unref_variable(variable);
+  KvVariableInterface* variable_interface = variable;
+  Tensor random_init(DataTypeToEnum<float>::v(),
+                     TensorShape({1024, embedding_dim}));
+  TFPLUS_EXPECT_OK(GenerateRandomRealTensor(0.1, 1.0, &random_init));
+  TFPLUS_EXPECT_OK(variable->InitRandomValues(random_init));
+
+  Tensor keys(DataTypeToEnum<int64>::v(), TensorShape({num_keys}));
+  TFPLUS_EXPECT_OK(GenerateIndexTensor<int64>(0, &keys));
+  Tensor values(DataTypeToEnum<float>::v(),
+                TensorShape({num_keys, embedding_dim}));
+  TFPLUS_EXPECT_OK(variable_interface->FindOrInsert(nullptr, keys, &values));
+  // The hot keys are seen twice, all keys share the same update day.
+  Tensor hot_keys(DataTypeToEnum<int64>::v(), TensorShape({num_hot_keys}));
+  TFPLUS_EXPECT_OK(GenerateIndexTensor<int64>(0, &hot_keys));
+  Tensor hot_values(DataTypeToEnum<float>::v(),
+                    TensorShape({num_hot_keys, embedding_dim}));
+  TFPLUS_EXPECT_OK(
+      variable_interface->FindOrInsert(nullptr, hot_keys, &hot_values));
+
+  auto table = variable->table_manager();
+  table->EvictToCapacity();
+  int64_t expected_rows = static_cast<int64_t>(capacity * EVICTION_WATERMARK);
+  EXPECT_EQ(static_cast<int64_t>(variable->size()), expected_rows);
+  EXPECT_EQ((*table->GetStorageTables())[0]->Size(), expected_rows);
+  for (int64 key = 0; key < num_hot_keys; ++key) {
+    EXPECT_NE(variable->kv_map()->FindOrNull(key), nullptr);
+  }
+  // A table under its capacity is left alone.
+  table->EvictToCapacity();
+  EXPECT_EQ(static_cast<int64_t>(variable->size()), expected_rows);
+
+  LfuEvictionPolicy lfu;
+  LruEvictionPolicy lru;
+  // Day 2 seen once against day 1 seen 3 times.
+  uint32_t recent = (2u << 16) | 1u;
+  uint32_t frequent = (1u << 16) | 3u;
+  EXPECT_LT(lfu.Score(recent), lfu.Score(frequent));
+  EXPECT_GT(lru.Score(recent), lru.Score(frequent));
+}
+
+TEST(KvVariableTest, EvictSlotsAlong) {
+  const int embedding_dim = 8;
+  const int num_keys = 1000;
+  const int capacity = 100;
+  setenv("TFPLUS_KV_EVICTION_INTERVAL_MS", "3600000", 1);
+  StorageOption storage_options = GetStorageOption(StorageCombination::MEM);
+  (*storage_options.mutable_configs())[StorageType::MEM_STORAGE]
+      .set_training_storage_size(capacity);
+  auto variable = new KvVariable<int64, float>(
+      std::string("test_kv_variable_evict_var"), TensorShape({embedding_dim}),
+      0, storage_options);
+  core::ScopedUnref unref_variable(variable);
+  auto slot = new KvVariable<int64, float>(
+      std::string("test_kv_variable_evict_slot"), TensorShape({embedding_dim}),
+      0, storage_options);
+  core::ScopedUnref unref_slot(slot);
+  Tensor random_init(DataTypeToEnum<float>::v(),
+                     TensorShape({1024, embedding_dim}));
+  TFPLUS_EXPECT_OK(GenerateRandomRealTensor(0.1, 1.0, &random_init));
+  TFPLUS_EXPECT_OK(variable->InitRandomValues(random_init));
+  TFPLUS_EXPECT_OK(slot->InitRandomValues(random_init));
+
+  Tensor keys(DataTypeToEnum<int64>::v(), TensorShape({num_keys}));
+  TFPLUS_EXPECT_OK(GenerateIndexTensor<int64>(0, &keys));
+  Tensor values(DataTypeToEnum<float>::v(),
+                TensorShape({num_keys, embedding_dim}));
+  KvVariableInterface* variable_interface = variable;
+  KvVariableInterface* slot_interface = slot;
+  TFPLUS_EXPECT_OK(variable_interface->FindOrInsert(nullptr, keys, &values));
+  TFPLUS_EXPECT_OK(slot_interface->FindOrInsert(nullptr, keys, &values));
+  TFPLUS_EXPECT_OK(variable->TrackSlots({slot}));
+  // Tracking twice keeps a single reference.
+  TFPLUS_EXPECT_OK(variable->TrackSlots({slot}));
+
+  // A tracked slot never evicts by itself.
+  slot->table_manager()->EvictToCapacity();
+  EXPECT_EQ(static_cast<int64_t>(slot->size()), num_keys);
+
+  variable->table_manager()->EvictToCapacity();
+  int64_t expected_rows = static_cast<int64_t>(capacity * EVICTION_WATERMARK);
+  EXPECT_EQ(static_cast<int64_t>(variable->size()), expected_rows);
+  EXPECT_EQ(static_cast<int64_t>(slot->size()), expected_rows);
+  for (int64 key = 0; key < num_keys; ++key) {
+    EXPECT_EQ(variable->kv_map()->FindOrNull(key) == nullptr,
+              slot->kv_map()->FindOrNull(key) == nullptr);
+  }
+
+  // The optimizers lock the keys of a slot through the segments of var.
+  storage_options.set_num_segments(variable->table_manager()->NumSegments() *
+                                   2);
+  auto other_slot = new KvVariable<int64, float>(
+      std::string("test_kv_variable_evict_other_slot"),
+      TensorShape({embedding_dim}), 0, storage_options);
+  core::ScopedUnref unref_other_slot(other_slot);
+  EXPECT_TRUE(errors::IsInvalidArgument(variable->TrackSlots({other_slot})));
+}
+
+TEST(KvVariableTest, SsdStorage) {
+  const int embedding_dim = 8;
+  const int num_keys = 1000;
+  const int mem_capacity = 100;
+  // Rows are only demoted by TriggerTransferSSD below.
+  setenv("TFPLUS_KV_SSD_DEMOTE_INTERVAL_MS", "3600000", 1);
+  StorageOption storage_options = GetStorageOption(StorageCombination::MEM_SSD);
+  auto configs = storage_options.mutable_configs();
+  (*configs)[StorageType::MEM_STORAGE].set_training_storage_size(mem_capacity);
+  StorageConfig ssd_storage_config;
+  ssd_storage_config.set_storage_path(::testing::TempDir());
+  ssd_storage_config.set_training_storage_size(-1);
+  (*configs)[StorageType::SSD_STORAGE] = ssd_storage_config;
+  auto variable = new KvVariable<int64, float>(
+      std::string("test_kv_variable_ssd"), TensorShape({embedding_dim}), 0,
+      storage_options);
+  core::ScopedUnref unref_variable(variable);
+  KvVariableInterface* variable_interface = variable;
+
+  Tensor random_init(DataTypeToEnum<float>::v(),
+                     TensorShape({1024, embedding_dim}));
+  TFPLUS_EXPECT_OK(GenerateRandomRealTensor(0.1, 1.0, &random_init));
+  TFPLUS_EXPECT_OK(variable->InitRandomValues(random_init));
+  Tensor keys(DataTypeToEnum<int64>::v(), TensorShape({num_keys}));
+  TFPLUS_EXPECT_OK(GenerateIndexTensor<int64>(0, &keys));
+  Tensor values(DataTypeToEnum<float>::v(),
+                TensorShape({num_keys, embedding_dim}));
+  TFPLUS_EXPECT_OK(variable_interface->FindOrInsert(nullptr, keys, &values));
+
+  auto table = variable->table_manager();
+  EXPECT_TRUE(table->SSDStorageEneabled());
+  TFPLUS_EXPECT_OK(table->TriggerTransferSSD(true));
+  auto storage_size = table->CountStorageSize();
+  ASSERT_EQ(storage_size.size(), 2u);
+  auto mem_rows = (*table->GetStorageTables())[0]->Size();
+  EXPECT_LE(mem_rows, mem_capacity);
+  EXPECT_EQ(static_cast<int64_t>(storage_size[1]), num_keys - mem_rows);
+  EXPECT_EQ(static_cast<int64_t>(variable->size()), num_keys);
+
+  // Rows on SSD read back unchanged, first through the batched read of
+  // FindOrZeros and then through FindOrInsert, which promotes them.
+  auto check_values = [&](const std::string& step, const Tensor& found) {
+    auto found_flat = found.flat<float>();
+    auto values_flat = values.flat<float>();
+    for (int64_t i = 0; i < found_flat.size(); ++i) {
+      if (found_flat(i) != values_flat(i)) {
+        TFPLUS_EXPECT_OK(errors::InvalidArgument(
+            step, ": value ", i, " is ", found_flat(i), " instead of ",
+            values_flat(i)));
+        return;
+      }
+    }
+  };
+  Tensor found(DataTypeToEnum<float>::v(),
+               TensorShape({num_keys, embedding_dim}));
+  TFPLUS_EXPECT_OK(variable->FindOrZeros(nullptr, keys, &found));
+  check_values("find or zeros", found);
+  TFPLUS_EXPECT_OK(variable_interface->FindOrInsert(nullptr, keys, &found));
+  check_values("promoted", found);
+  EXPECT_EQ(table->CountStorageSize()[1], 0u);
+  EXPECT_EQ((*table->GetStorageTables())[0]->Size(), num_keys);
+}
+
+TEST(KvVariableTest, SsdStorageRecyclesUnderReads) {
+  const int embedding_dim = 8;
+  const int num_keys = 64;
+  const int num_writes = 4 * SSD_MAX_RETIRED_SLOTS;
+  SsdStorageTable<int64, float> storage(-1, embedding_dim,
+                                        ::testing::TempDir(),
+                                        "test_ssd_recycle");
+  ASSERT_TRUE(storage.StoageReady());
+  std::vector<float> row(embedding_dim, 1.0f);
+  std::vector<int64> keys(num_keys);
+  for (int i = 0; i < num_keys; ++i) {
+    keys[i] = i;
+    storage.Write(keys[i], row.data());
+  }
+  // Readers keep io_mu_ held shared nearly all the time, so the writer
+  // rarely gets it with a try.
+  std::atomic<bool> stop(false);
+  std::vector<std::thread> readers;
+  for (int t = 0; t < 4; ++t) {
+    readers.emplace_back([&]() {
+      std::vector<float> out(num_keys * embedding_dim);
+      std::vector<bool> found;
+      while (!stop.load()) {
+        storage.BatchGet(keys, out.data(), &found);
+      }
+    });
+  }
+  for (int i = 0; i < num_writes; ++i) {
+    storage.Write(keys[i % num_keys], row.data());
+  }
+  stop = true;
+  for (auto& reader : readers) {
+    reader.join();
+  }
+  // Every replaced slot is retired, the file holds at most the live rows,
+  // the retired ones and the slot taken while they are recycled.
+  const off_t max_bytes =
+      (num_keys + SSD_MAX_RETIRED_SLOTS + 1) * embedding_dim * sizeof(float);
+  struct stat file_stat;
+  ASSERT_EQ(::stat(storage.FilePath().c_str(), &file_stat), 0);
+  EXPECT_LE(file_stat.st_size, max_bytes);
+  EXPECT_EQ(storage.Size(), num_keys);
+}
+
+TEST(KvVariableTest, CompactRows) {
+  // Values that fit in a compact element convert back exactly, others are
+  // rounded to the nearest one.
+  for (float value : {0.0f, -2.5f, 1.0f / 1024, 65504.0f}) {
+    EXPECT_EQ(Bfloat16ToFloat(FloatToBfloat16(value)), value);
+    EXPECT_EQ(HalfToFloat(FloatToHalf(value)), value);
+  }
+  EXPECT_EQ(Bfloat16ToFloat(FloatToBfloat16(1.0f + 1.0f / 1024)), 1.0f);
+  EXPECT_EQ(HalfToFloat(FloatToHalf(1.0f + 1.0f / 4096)), 1.0f);
+  EXPECT_TRUE(std::isinf(HalfToFloat(FloatToHalf(1e6f))));
+  // Stochastic rounding keeps the value on average.
+  RowCodec stochastic(ROW_BFLOAT16, true);
+  const float small_step = 1.0f + 1.0f / 512;
+  double sum = 0;
+  for (int i = 0; i < 10000; ++i) {
+    uint16_t element;
+    float rounded;
+    stochastic.Encode(&small_step, &element, 1);
+    stochastic.Decode(&element, &rounded, 1);
+    sum += rounded;
+  }
+  EXPECT_NEAR(sum / 10000, small_step, 1e-4);
+
+  const int embedding_dim = 8;
+  const int64_t num_keys = 100;
+  for (RowDtype row_dtype : {ROW_BFLOAT16, ROW_HALF}) {
+    StorageOption storage_option = GetStorageOption(StorageCombination::MEM);
+    storage_option.set_row_dtype(row_dtype);
+    auto variable = new KvVariable<int64, float>(
+        std::string("test_kv_variable_compact"), TensorShape({embedding_dim}),
+        0, storage_option);
+    auto table = std::unique_ptr<KvVariableInterface>(variable);
+    EXPECT_TRUE(variable->table_manager()->CompactRows());
+    Tensor random_init(DataTypeToEnum<float>::v(),
+                       TensorShape({1024, embedding_dim}));
+    TFPLUS_EXPECT_OK(GenerateRandomRealTensor(0.1, 1.0, &random_init));
+    TFPLUS_EXPECT_OK(table->InitRandomValues(random_init));
+    const RowCodec codec(row_dtype, false);
+    auto round = [&codec](float value) {
+      uint16_t element;
+      float rounded;
+      codec.Encode(&value, &element, 1);
+      codec.Decode(&element, &rounded, 1);
+      return rounded;
+    };
+
+    // New rows are read back as stored.
+    Tensor keys(DataTypeToEnum<int64>::v(), TensorShape({num_keys}));
+    TFPLUS_EXPECT_OK(GenerateIndexTensor<int64>(0, &keys));
+    Tensor inserted(DataTypeToEnum<float>::v(),
+                    TensorShape({num_keys, embedding_dim}));
+    TFPLUS_EXPECT_OK(table->FindOrInsert(nullptr, keys, &inserted));
+    Tensor found(DataTypeToEnum<float>::v(),
+                 TensorShape({num_keys, embedding_dim}));
+    TFPLUS_EXPECT_OK(table->FindOrZeros(nullptr, keys, &found));
+    auto inserted_flat = inserted.flat<float>();
+    auto found_flat = found.flat<float>();
+    for (int64_t i = 0; i < inserted_flat.size(); ++i) {
+      EXPECT_EQ(found_flat(i), round(inserted_flat(i)));
+    }
+
+    // Written values are rounded once and updates start from them.
+    Tensor values(DataTypeToEnum<float>::v(),
+                  TensorShape({num_keys, embedding_dim}));
+    TFPLUS_EXPECT_OK(GenerateRandomRealTensor(0.1, 1.0, &values));
+    TFPLUS_EXPECT_OK(table->InsertOrUpdate(nullptr, keys, values));
+    TFPLUS_EXPECT_OK(table->FindOrZeros(nullptr, keys, &found));
+    auto values_flat = values.flat<float>();
+    for (int64_t i = 0; i < values_flat.size(); ++i) {
+      EXPECT_EQ(found_flat(i), round(values_flat(i)));
+    }
+    Tensor ones(DataTypeToEnum<float>::v(),
+                TensorShape({num_keys, embedding_dim}));
+    ones.flat<float>().setConstant(1.0f);
+    TFPLUS_EXPECT_OK(
+        table->ScatterUpdate(nullptr, keys, ones, SCATTER_UPDATE_ADD));
+    TFPLUS_EXPECT_OK(table->FindOrZeros(nullptr, keys, &found));
+    for (int64_t i = 0; i < values_flat.size(); ++i) {
+      EXPECT_EQ(found_flat(i), round(round(values_flat(i)) + 1.0f));
+    }
+    EXPECT_EQ(table->size(), static_cast<size_t>(num_keys));
+  }
+
+  // Other variables keep full precision rows.
+  StorageOption ssd_option = GetStorageOption(StorageCombination::MEM_SSD);
+  ssd_option.set_row_dtype(ROW_BFLOAT16);
+  auto ssd_variable = new KvVariable<int64, float>(
+      std::string("test_kv_variable_compact_ssd"),
+      TensorShape({embedding_dim}), 0, ssd_option);
+  auto ssd_table = std::unique_ptr<KvVariableInterface>(ssd_variable);
+  EXPECT_FALSE(ssd_variable->table_manager()->CompactRows());
+}
+
+TEST(KvVariableTest, FrozenTable) {
+  const int embedding_dim = 8;
+  const int64_t num_keys = 100;
+  auto variable = new KvVariable<int64, float>(
+      std::string("test_kv_variable_frozen"), TensorShape({embedding_dim}), 0,
+      GetStorageOption(StorageCombination::MEM));
+  auto table = std::unique_ptr<KvVariableInterface>(variable);
+  Tensor random_init(DataTypeToEnum<float>::v(),
+                     TensorShape({1024, embedding_dim}));
+  TFPLUS_EXPECT_OK(GenerateRandomRealTensor(0.1, 1.0, &random_init));
+  TFPLUS_EXPECT_OK(table->InitRandomValues(random_init));
+  Tensor keys(DataTypeToEnum<int64>::v(), TensorShape({num_keys}));
+  TFPLUS_EXPECT_OK(GenerateIndexTensor<int64>(0, &keys));
+  Tensor values(DataTypeToEnum<float>::v(),
+                TensorShape({num_keys, embedding_dim}));
+  TFPLUS_EXPECT_OK(GenerateRandomRealTensor(0.1, 1.0, &values));
+  TFPLUS_EXPECT_OK(table->InsertOrUpdate(nullptr, keys, values));
+  // Blacklisted keys read zeros from the frozen table too.
+  Tensor blacklist(DataTypeToEnum<bool>::v(), TensorShape({num_keys}));
+  auto blacklist_flat = blacklist.flat<bool>();
+  for (int64_t i = 0; i < num_keys; ++i) {
+    blacklist_flat(i) = i % 10 == 0;
+  }
+  TFPLUS_EXPECT_OK(table->InsertOrUpdate(nullptr, keys, values, nullptr,
+                                         &blacklist));
+
+  // Keys 100 to 199 are missing.
+  Tensor lookup_keys(DataTypeToEnum<int64>::v(), TensorShape({2 * num_keys}));
+  TFPLUS_EXPECT_OK(GenerateIndexTensor<int64>(0, &lookup_keys));
+  Tensor expected(DataTypeToEnum<float>::v(),
+                  TensorShape({2 * num_keys, embedding_dim}));
+  TFPLUS_EXPECT_OK(table->FindOrZeros(nullptr, lookup_keys, &expected));
+  variable->FreezeTable();
+  Tensor found(DataTypeToEnum<float>::v(),
+               TensorShape({2 * num_keys, embedding_dim}));
+  TFPLUS_EXPECT_OK(table->FindOrZeros(nullptr, lookup_keys, &found));
+  auto expected_flat = expected.flat<float>();
+  auto found_flat = found.flat<float>();
+  for (int64_t i = 0; i < found_flat.size(); ++i) {
+    EXPECT_EQ(found_flat(i), expected_flat(i));
+  }
+
+  // Updates are only seen once the table is frozen again.
+  Tensor ones(DataTypeToEnum<float>::v(),
+              TensorShape({num_keys, embedding_dim}));
+  ones.flat<float>().setConstant(1.0f);
+  TFPLUS_EXPECT_OK(table->InsertOrUpdate(nullptr, keys, ones));
+  TFPLUS_EXPECT_OK(table->FindOrZeros(nullptr, lookup_keys, &found));
+  for (int64_t i = 0; i < found_flat.size(); ++i) {
+    EXPECT_EQ(found_flat(i), expected_flat(i));
+  }
+  variable->FreezeTable();
+  TFPLUS_EXPECT_OK(table->FindOrZeros(nullptr, lookup_keys, &found));
+  for (int64_t i = 0; i < found_flat.size(); ++i) {
+    const int64_t key = i / embedding_dim;
+    EXPECT_EQ(found_flat(i), key < num_keys && key % 10 != 0 ? 1.0f : 0.0f);
+  }
+}
+
+TEST(KvVariableTest, FrozenTableReaders) {
+  FrozenTableReaders readers;
+  std::atomic<bool> synchronized{false};
+  std::thread publisher;
+  {
+    FrozenTableReaders::Scope reader(&readers);
+    publisher = std::thread([&readers, &synchronized]() {
+      readers.Synchronize();
+      synchronized = true;
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    EXPECT_FALSE(synchronized);
+  }
+  publisher.join();
+  EXPECT_TRUE(synchronized);
+}
+
+TEST(KvVariableTest, SharedFrozenTable) {
+  const int64_t embedding_dim = 4;
+  const int64_t num_keys = 1000;
+  const std::string name = SharedTableName("test_kv_variable_shared");
+  std::unique_ptr<SharedTableVersion> reader_version;
+  SharedMemory::Unlink(name);
+  EXPECT_TRUE(errors::IsUnavailable(
+      SharedTableVersion::Open(name, false, &reader_version)));
+  std::unique_ptr<SharedTableVersion> loader_version;
+  TFPLUS_EXPECT_OK(SharedTableVersion::Open(name, true, &loader_version));
+  EXPECT_EQ(loader_version->Load(), 0u);
+
+  std::vector<int64> keys;
+  std::vector<float> rows;
+  for (int64_t i = 0; i < num_keys; ++i) {
+    keys.push_back(i * 7919);
+    for (int64_t j = 0; j < embedding_dim; ++j) {
+      rows.push_back(i + j * 0.5f);
+    }
+  }
+  std::unique_ptr<FrozenTable<int64, float>> loader_table;
+  TFPLUS_EXPECT_OK((FrozenTable<int64, float>::Share(
+      loader_version->SegmentName(1), keys, rows, embedding_dim,
+      &loader_table)));
+  loader_version->Publish(1);
+
+  // A reader maps the rows at another address without copying them.
+  TFPLUS_EXPECT_OK(SharedTableVersion::Open(name, false, &reader_version));
+  EXPECT_EQ(reader_version->Load(), 1u);
+  std::unique_ptr<FrozenTable<int64, float>> reader_table;
+  TFPLUS_EXPECT_OK((FrozenTable<int64, float>::Attach(
+      reader_version->SegmentName(1), embedding_dim, &reader_table)));
+  EXPECT_TRUE(reader_table->shared());
+  EXPECT_EQ(reader_table->size(), static_cast<size_t>(num_keys));
+  EXPECT_EQ(reader_table->MemoryUsed(), sizeof(FrozenTable<int64, float>));
+  for (int64_t i = 0; i < num_keys; ++i) {
+    const float* row = reader_table->Find(i * 7919);
+    ASSERT_NE(row, nullptr);
+    EXPECT_NE(row, loader_table->Find(i * 7919));
+    EXPECT_EQ(row[0], static_cast<float>(i));
+    EXPECT_EQ(row[embedding_dim - 1], i + 1.5f);
+  }
+  EXPECT_EQ(reader_table->Find(1), nullptr);
+  std::unique_ptr<FrozenTable<int64, float>> other_table;
+  EXPECT_TRUE(errors::IsInvalidArgument(FrozenTable<int64, float>::Attach(
+      reader_version->SegmentName(1), embedding_dim + 1, &other_table)));
+
+  // The segment of an old version stays mapped after it is unlinked.
+  SharedMemory::Unlink(loader_version->SegmentName(1));
+  EXPECT_TRUE(errors::IsNotFound(FrozenTable<int64, float>::Attach(
+      reader_version->SegmentName(1), embedding_dim, &other_table)));
+  EXPECT_EQ(reader_table->Find(7919)[0], 1.0f);
+
+  // A reader that switched versions unmaps the old one only once the
+  // lookups reading it are done.
+  FrozenTableReaders readers;
+  std::atomic<bool> unmapped{false};
+  std::thread switcher;
+  {
+    FrozenTableReaders::Scope lookup(&readers);
+    switcher = std::thread([&readers, &reader_table, &unmapped]() {
+      readers.Synchronize();
+      reader_table.reset();
+      unmapped = true;
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    EXPECT_FALSE(unmapped);
+    EXPECT_EQ(reader_table->Find(7919)[0], 1.0f);
+  }
+  switcher.join();
+  EXPECT_TRUE(unmapped);
+  SharedMemory::Unlink(name);
+}
+
+TEST(KvVariableTest, ReserveAndGrow) {
+  // A growing FlatHashMap keeps its old slots until later insertions have
+  // moved them, every key stays visible meanwhile.
+  FlatHashMap<int64, int64> flat;
+  int64_t key = 0;
+  while (!flat.migrating()) {
+    flat.insert_or_assign(key, key * 2);
+    ++key;
+  }
+  const int64_t num_flat_keys = key + 10;
+  for (; key < num_flat_keys; ++key) {
+    flat.insert_or_assign(key, key * 2);
+  }
+  EXPECT_TRUE(flat.migrating());
+  for (int64_t i = 0; i < num_flat_keys; i += 3) {
+    EXPECT_TRUE(flat.erase(i));
+  }
+  for (int64_t i = 0; i < num_flat_keys; ++i) {
+    auto* kv = flat.find(i);
+    if (i % 3 == 0) {
+      EXPECT_EQ(kv, nullptr);
+    } else {
+      ASSERT_NE(kv, nullptr);
+      EXPECT_EQ(kv->second, i * 2);
+    }
+  }
+  size_t visited = 0;
+  flat.for_each([&](const std::pair<int64, int64>& kv) { ++visited; });
+  EXPECT_EQ(visited, flat.size());
+  flat.reserve(4 * num_flat_keys);
+  EXPECT_FALSE(flat.migrating());
+  EXPECT_EQ(flat.size(), visited);
+
+  // Reserving up front means filling a map to that size never rehashes.
+  const int64_t num_keys = 10000;
+  for (MapType map_type : {CONCURRENT_UNORDERED_MAP, CONCURRENT_DENSE_HASH_MAP,
+                           FLAT_SIMD_MAP}) {
+    std::unique_ptr<IMap<int64, EmbeddingValue<float>>> map(
+        MapFactory<int64, EmbeddingValue<float>>::CreateMap(map_type, 16));
+    map->Reserve(num_keys);
+    for (int64_t i = 0; i < num_keys; ++i) {
+      map->FindOrInsertWithFn(i, [](const int64& key) {
+        return EmbeddingValue<float>(nullptr, false, key, false);
+      });
+    }
+    EXPECT_EQ(static_cast<int64_t>(map->size()), num_keys);
+    for (int64_t i = 0; i < num_keys; i += 7) {
+      EXPECT_NE(map->FindOrNull(i), nullptr);
+    }
+  }
+
+  // The expected size of a KvVariable comes from its storage option and
+  // does not show up as keys.
+  StorageOption storage_option = GetStorageOption(StorageCombination::MEM);
+  storage_option.set_expected_size(num_keys);
+  auto table =
+      std::unique_ptr<KvVariableInterface>(new KvVariable<int64, float>(
+          std::string("test_kv_variable_expected_size"), TensorShape({8}), 0,
+          storage_option));
+  Tensor random_init(DataTypeToEnum<float>::v(), TensorShape({1024, 8}));
+  TFPLUS_EXPECT_OK(GenerateRandomRealTensor(0.1, 1.0, &random_init));
+  TFPLUS_EXPECT_OK(table->InitRandomValues(random_init));
+  EXPECT_EQ(table->size(), 0u);
+  Tensor keys(DataTypeToEnum<int64>::v(), TensorShape({100}));
+  TFPLUS_EXPECT_OK(GenerateIndexTensor<int64>(0, &keys));
+  Tensor values(DataTypeToEnum<float>::v(), TensorShape({100, 8}));
+  TFPLUS_EXPECT_OK(table->FindOrInsert(nullptr, keys, &values));
+  EXPECT_EQ(table->size(), 100u);
+}
+
+TEST(KvVariableTest, NumaOrder) {
+  // Stable grouping of positions, each group keeps its relative order.
+  std::vector<int> groups = {1, 0, 2, 1, 0, 1};
+  IndexOrder order = IndexOrder::GroupBy(
+      groups.size(), 3, [&groups](int64_t i) { return groups[i]; });
+  EXPECT_FALSE(order.identity());
+  EXPECT_EQ(order.group_begin(), std::vector<int64_t>({0, 2, 5, 6}));
+  std::vector<int64_t> positions;
+  for (int64_t j = 0; j < 6; ++j) positions.push_back(order(j));
+  EXPECT_EQ(positions, std::vector<int64_t>({1, 4, 0, 3, 5, 2}));
+  auto keys = [](int64_t i) { return i * 10; };
+  EXPECT_EQ(order.Reorder(keys)(1), 40);
+  EXPECT_EQ(IndexOrder()(7), 7);
+
+  const NumaTopology& topology = NumaTopology::Get();
+  ASSERT_GE(topology.num_nodes(), 1);
+  for (int node = 0; node < topology.num_nodes(); ++node) {
+    EXPECT_FALSE(topology.cpus(node).empty());
+    for (int cpu : topology.cpus(node)) {
+      EXPECT_EQ(topology.NodeOfCpu(cpu), node);
+    }
+  }
+  EXPECT_GE(CurrentNumaNode(), 0);
+  EXPECT_LT(CurrentNumaNode(), topology.num_nodes());
+
+  auto table =
+      std::unique_ptr<KvVariableInterface>(new KvVariable<int64, float>(
+          std::string("test_kv_variable_numa"), TensorShape({8}), 0,
+          GetStorageOption(StorageCombination::MEM)));
+  auto* kv = static_cast<KvVariable<int64, float>*>(table.get());
+  Tensor keys(DataTypeToEnum<int64>::v(), TensorShape({1000}));
+  TFPLUS_EXPECT_OK(GenerateIndexTensor<int64>(0, &keys));
+  IndexOrder numa_order = kv->NumaOrder(keys);
+  auto* table_manager = kv->table_manager();
+  if (NumaWorkers::Get() == nullptr) {
+    // Without TFPLUS_KV_NUMA sparse ops keep the order of their indices.
+    EXPECT_EQ(table_manager->num_numa_nodes(), 0);
+    EXPECT_TRUE(numa_order.identity());
+    return;
+  }
+  ASSERT_EQ(table_manager->num_numa_nodes(), topology.num_nodes());
+  const auto& keys_flat = keys.flat<int64>();
+  for (int node = 0; node < table_manager->num_numa_nodes(); ++node) {
+    for (int64_t j = numa_order.group_begin()[node];
+         j < numa_order.group_begin()[node + 1]; ++j) {
+      EXPECT_EQ(table_manager->NumaNodeOf(keys_flat(numa_order(j))), node);
+    }
+  }
+}
+
+TEST(KvVariableTest, HotKeys) {
+  const int embedding_dim = 8;
+  const int64_t num_keys = 100;
+  const int64_t num_hot_keys = 10;
+  // Keys are only pinned by RefreshHotKeys below.
+  setenv("TFPLUS_KV_HOT_KEYS", "10", 1);
+  setenv("TFPLUS_KV_HOT_KEYS_INTERVAL_MS", "3600000", 1);
+  auto variable = new KvVariable<int64, float>(
+      std::string("test_kv_variable_hot_keys"), TensorShape({embedding_dim}),
+      0, GetStorageOption(StorageCombination::MEM));
+  unsetenv("TFPLUS_KV_HOT_KEYS");
+  unsetenv("TFPLUS_KV_HOT_KEYS_INTERVAL_MS");
+  auto table = std::unique_ptr<KvVariableInterface>(variable);
+  auto* table_manager = variable->table_manager();
+  auto* hot_map = table_manager->hot_map();
+  ASSERT_NE(hot_map, nullptr);
+  Tensor random_init(DataTypeToEnum<float>::v(),
+                     TensorShape({1024, embedding_dim}));
+  TFPLUS_EXPECT_OK(GenerateRandomRealTensor(0.1, 1.0, &random_init));
+  TFPLUS_EXPECT_OK(table->InitRandomValues(random_init));
+  Tensor keys(DataTypeToEnum<int64>::v(), TensorShape({num_keys}));
+  TFPLUS_EXPECT_OK(GenerateIndexTensor<int64>(0, &keys));
+  Tensor values(DataTypeToEnum<float>::v(),
+                TensorShape({num_keys, embedding_dim}));
+  TFPLUS_EXPECT_OK(table->FindOrInsert(nullptr, keys, &values));
+  // The hot keys are seen three times.
+  Tensor hot_keys(DataTypeToEnum<int64>::v(), TensorShape({num_hot_keys}));
+  TFPLUS_EXPECT_OK(GenerateIndexTensor<int64>(0, &hot_keys));
+  Tensor hot_values(DataTypeToEnum<float>::v(),
+                    TensorShape({num_hot_keys, embedding_dim}));
+  for (int round = 0; round < 2; ++round) {
+    TFPLUS_EXPECT_OK(table->FindOrInsert(nullptr, hot_keys, &hot_values));
+  }
+
+  Tensor expected(DataTypeToEnum<float>::v(),
+                  TensorShape({num_keys, embedding_dim}));
+  TFPLUS_EXPECT_OK(table->FindOrZeros(nullptr, keys, &expected));
+  EXPECT_EQ(table_manager->RefreshHotKeys(), num_hot_keys);
+  for (int64 key = 0; key < num_keys; ++key) {
+    EXPECT_EQ(hot_map->IsPinned(key), key < num_hot_keys);
+  }
+  // Pinned rows read the same without locks.
+  Tensor found(DataTypeToEnum<float>::v(),
+               TensorShape({num_keys, embedding_dim}));
+  TFPLUS_EXPECT_OK(table->FindOrZeros(nullptr, keys, &found));
+  auto expected_flat = expected.flat<float>();
+  auto found_flat = found.flat<float>();
+  for (int64_t i = 0; i < found_flat.size(); ++i) {
+    EXPECT_EQ(found_flat(i), expected_flat(i));
+  }
+  EXPECT_EQ(hot_map->lock_free_reads(), num_hot_keys);
+
+  // Updates of pinned rows go through their slot.
+  Tensor ones(DataTypeToEnum<float>::v(),
+              TensorShape({num_keys, embedding_dim}));
+  ones.flat<float>().setConstant(1.0f);
+  TFPLUS_EXPECT_OK(table->InsertOrUpdate(nullptr, keys, ones));
+  TFPLUS_EXPECT_OK(table->FindOrZeros(nullptr, keys, &found));
+  for (int64_t i = 0; i < found_flat.size(); ++i) {
+    EXPECT_EQ(found_flat(i), 1.0f);
+  }
+
+  // Deleted keys leave the pinned set, the others stay until the next
+  // refresh.
+  Tensor delete_keys(DataTypeToEnum<int64>::v(), TensorShape({2}));
+  TFPLUS_EXPECT_OK(GenerateIndexTensor<int64>(0, &delete_keys));
+  TFPLUS_EXPECT_OK(table->Delete(delete_keys));
+  EXPECT_EQ(table->size(), num_keys - 2);
+  EXPECT_FALSE(hot_map->IsPinned(0));
+  EXPECT_FALSE(hot_map->IsPinned(1));
+  EXPECT_TRUE(hot_map->IsPinned(2));
+  TFPLUS_EXPECT_OK(table->FindOrZeros(nullptr, keys, &found));
+  for (int64_t i = 0; i < found_flat.size(); ++i) {
+    EXPECT_EQ(found_flat(i), i < 2 * embedding_dim ? 0.0f : 1.0f);
+  }
+  EXPECT_EQ(table_manager->RefreshHotKeys(), num_hot_keys);
+  EXPECT_FALSE(hot_map->IsPinned(0));
+  EXPECT_TRUE(hot_map->IsPinned(2));
+
+  // A pinned key does not lock the rows of optimizer slots.
+  auto slot = new KvVariable<int64, float>(
+      std::string("test_kv_variable_hot_keys_slot"),
+      TensorShape({embedding_dim}), 0,
+      GetStorageOption(StorageCombination::MEM));
+  core::ScopedUnref unref_slot(slot);
+  EXPECT_TRUE(errors::IsInvalidArgument(variable->TrackSlots({slot})));
+}
+
+TEST(KvVariableTest, DedupKeys) {
+  const int embedding_dim = 8;
+  const int num_keys = 200;
+  const int num_distinct_keys = 50;
+  // Both variables read the same initial value of a key.
+  setenv("TFPLUS_KV_DETERMINISTIC_INIT", "1", 1);
+  auto plain = new KvVariable<int64, float>(
+      std::string("test_kv_variable_dedup"), TensorShape({embedding_dim}), 0);
+  core::ScopedUnref unref_plain(plain);
+  setenv("TFPLUS_KV_DEDUP_KEYS", "1", 1);
+  auto dedup = new KvVariable<int64, float>(
+      std::string("test_kv_variable_dedup"), TensorShape({embedding_dim}), 0);
+  core::ScopedUnref unref_dedup(dedup);
+  unsetenv("TFPLUS_KV_DEDUP_KEYS");
+  unsetenv("TFPLUS_KV_DETERMINISTIC_INIT");
+  EXPECT_FALSE(plain->dedup_keys());
+  EXPECT_TRUE(dedup->dedup_keys());
+  Tensor random_init(DataTypeToEnum<float>::v(),
+                     TensorShape({1024, embedding_dim}));
+  TFPLUS_EXPECT_OK(GenerateRandomRealTensor(0.1, 1.0, &random_init));
+  TFPLUS_EXPECT_OK(plain->InitRandomValues(random_init));
+  TFPLUS_EXPECT_OK(dedup->InitRandomValues(random_init));
+
+  Tensor keys(DataTypeToEnum<int64>::v(), TensorShape({num_keys}));
+  for (int i = 0; i < num_keys; ++i) {
+    keys.flat<int64>()(i) = (i * 7) % num_distinct_keys;
+  }
+  Tensor plain_values(DataTypeToEnum<float>::v(),
+                      TensorShape({num_keys, embedding_dim}));
+  Tensor dedup_values(DataTypeToEnum<float>::v(),
+                      TensorShape({num_keys, embedding_dim}));
+  KvVariableInterface* plain_interface = plain;
+  KvVariableInterface* dedup_interface = dedup;
+  TFPLUS_EXPECT_OK(plain_interface->FindOrInsert(nullptr, keys, &plain_values));
+  TFPLUS_EXPECT_OK(dedup_interface->FindOrInsert(nullptr, keys, &dedup_values));
+  EXPECT_EQ(static_cast<int>(dedup->size()), num_distinct_keys);
+  auto plain_flat = plain_values.flat<float>();
+  auto dedup_flat = dedup_values.flat<float>();
+  for (int64_t i = 0; i < plain_flat.size(); ++i) {
+    EXPECT_EQ(dedup_flat(i), plain_flat(i));
+  }
+
+  // Every occurrence of a key still counts.
+  for (int64 key = 0; key < num_distinct_keys; ++key) {
+    EVContext<float> plain_context;
+    EVContext<float> dedup_context;
+    {
+      auto lock = plain->GetScopedKeyLock(key, LockType::WRITE_LOCK);
+      plain->FindOrInsertUnsafe(key, &plain_context, nullptr);
+    }
+    {
+      auto lock = dedup->GetScopedKeyLock(key, LockType::WRITE_LOCK);
+      dedup->FindOrInsertUnsafe(key, &dedup_context, nullptr);
+    }
+    EXPECT_EQ(dedup_context.GetFrequency(), plain_context.GetFrequency());
+    EXPECT_EQ(dedup_context.GetFrequency(), num_keys / num_distinct_keys + 1);
+  }
+}
+
+TEST(KvVariableTest, FindOrZerosRange) {
+  const int embedding_dim = 8;
+  const int64_t num_keys = 100;
+  auto variable = new KvVariable<int64, float>(
+      std::string("test_kv_variable_find_range"), TensorShape({embedding_dim}),
+      0, GetStorageOption(StorageCombination::MEM));
+  auto table = std::unique_ptr<KvVariableInterface>(variable);
+  Tensor random_init(DataTypeToEnum<float>::v(),
+                     TensorShape({1024, embedding_dim}));
+  TFPLUS_EXPECT_OK(GenerateRandomRealTensor(0.1, 1.0, &random_init));
+  TFPLUS_EXPECT_OK(table->InitRandomValues(random_init));
+  Tensor keys(DataTypeToEnum<int64>::v(), TensorShape({num_keys}));
+  TFPLUS_EXPECT_OK(GenerateIndexTensor<int64>(0, &keys));
+  Tensor values(DataTypeToEnum<float>::v(),
+                TensorShape({num_keys, embedding_dim}));
+  TFPLUS_EXPECT_OK(GenerateRandomRealTensor(0.1, 1.0, &values));
+  TFPLUS_EXPECT_OK(table->InsertOrUpdate(nullptr, keys, values));
+
+  // Keys 100 to 199 are missing. The ranges together fill every row, and
+  // rows outside a range are left alone.
+  Tensor lookup_keys(DataTypeToEnum<int64>::v(), TensorShape({2 * num_keys}));
+  TFPLUS_EXPECT_OK(GenerateIndexTensor<int64>(0, &lookup_keys));
+  Tensor expected(DataTypeToEnum<float>::v(),
+                  TensorShape({2 * num_keys, embedding_dim}));
+  Tensor found(DataTypeToEnum<float>::v(),
+               TensorShape({2 * num_keys, embedding_dim}));
+  auto expected_flat = expected.flat<float>();
+  auto found_flat = found.flat<float>();
+  for (bool frozen : {false, true}) {
+    if (frozen) {
+      variable->FreezeTable();
+    }
+    TFPLUS_EXPECT_OK(table->FindOrZeros(nullptr, lookup_keys, &expected));
+    found.flat<float>().setConstant(-1.0f);
+    TFPLUS_EXPECT_OK(table->FindOrZerosRange(lookup_keys, &found, 10, 150));
+    for (int64_t i = 0; i < found_flat.size(); ++i) {
+      const int64_t row = i / embedding_dim;
+      EXPECT_EQ(found_flat(i),
+                row >= 10 && row < 150 ? expected_flat(i) : -1.0f);
+    }
+    TFPLUS_EXPECT_OK(table->FindOrZerosRange(lookup_keys, &found, 0, 10));
+    TFPLUS_EXPECT_OK(
+        table->FindOrZerosRange(lookup_keys, &found, 150, 2 * num_keys));
+    for (int64_t i = 0; i < found_flat.size(); ++i) {
+      EXPECT_EQ(found_flat(i), expected_flat(i));
+    }
+  }
+}
+
+TEST(KvVariableTest, FindOrInsertRange) {
+  const int embedding_dim = 8;
+  const int64_t num_keys = 100;
+  auto variable = new KvVariable<int64, float>(
+      std::string("test_kv_variable_insert_range"),
+      TensorShape({embedding_dim}), 0,
+      GetStorageOption(StorageCombination::MEM));
+  auto table = std::unique_ptr<KvVariableInterface>(variable);
+  Tensor random_init(DataTypeToEnum<float>::v(),
+                     TensorShape({1024, embedding_dim}));
+  TFPLUS_EXPECT_OK(GenerateRandomRealTensor(0.1, 1.0, &random_init));
+  TFPLUS_EXPECT_OK(table->InitRandomValues(random_init));
+  Tensor keys(DataTypeToEnum<int64>::v(), TensorShape({num_keys}));
+  TFPLUS_EXPECT_OK(GenerateIndexTensor<int64>(0, &keys));
+  Tensor counts(DataTypeToEnum<int32>::v(), TensorShape({num_keys}));
+  counts.flat<int32>().setConstant(3);
+
+  // The ranges together insert every key with its count and leave the rows
+  // outside them alone.
+  Tensor values(DataTypeToEnum<float>::v(),
+                TensorShape({num_keys, embedding_dim}));
+  values.flat<float>().setConstant(-1.0f);
+  TFPLUS_EXPECT_OK(table->FindOrInsertRange(keys, &values, &counts, nullptr,
+                                            false, 0, 30));
+  EXPECT_EQ(table->size(), 30u);
+  auto values_flat = values.flat<float>();
+  for (int64_t i = 30 * embedding_dim; i < values_flat.size(); ++i) {
+    EXPECT_EQ(values_flat(i), -1.0f);
+  }
+  TFPLUS_EXPECT_OK(table->FindOrInsertRange(keys, &values, &counts, nullptr,
+                                            false, 30, num_keys));
+  EXPECT_EQ(table->size(), static_cast<size_t>(num_keys));
+  EXPECT_EQ(table->sum_freq(), static_cast<size_t>(3 * num_keys));
+  Tensor found(DataTypeToEnum<float>::v(),
+               TensorShape({num_keys, embedding_dim}));
+  TFPLUS_EXPECT_OK(table->FindOrZeros(nullptr, keys, &found));
+  auto found_flat = found.flat<float>();
+  for (int64_t i = 0; i < found_flat.size(); ++i) {
+    EXPECT_EQ(found_flat(i), values_flat(i));
+  }
+
+  Tensor wrong_counts(DataTypeToEnum<int32>::v(), TensorShape({1}));
+  EXPECT_FALSE(table->FindOrInsertRange(keys, &values, &wrong_counts, nullptr,
+                                        false, 0, num_keys)
+                   .ok());
+}
+
+TEST(KvVariableTest, RowKernels) {
+  // The vectorized float kernels match the loops run in double, for every
+  // length of the vector tail.
+  std::mt19937 gen(3);
+  std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+  for (int n = 0; n <= 70; ++n) {
+    std::vector<float> x(n), m(n), v(n), grad(n), hessian(n);
+    for (int i = 0; i < n; ++i) {
+      x[i] = dist(gen);
+      m[i] = dist(gen);
+      v[i] = std::fabs(dist(gen));
+      grad[i] = dist(gen);
+      hessian[i] = dist(gen);
+    }
+    std::vector<double> xd(x.begin(), x.end()), md(m.begin(), m.end()),
+        vd(v.begin(), v.end()), grad_d(grad.begin(), grad.end()),
+        hessian_d(hessian.begin(), hessian.end());
+    EXPECT_NEAR(RowNorm(x.data(), n), RowNorm(xd.data(), n), 1e-5);
+    EXPECT_NEAR(GroupShrinkNorm(x.data(), 0.3f, n),
+                GroupShrinkNorm(xd.data(), 0.3, n), 1e-5);
+    // Nothing past n is written.
+    m.push_back(7.0f);
+    v.push_back(7.0f);
+    AdamMoments(m.data(), v.data(), grad.data(), hessian.data(), 0.9f, 0.999f,
+                n);
+    AdamMoments(md.data(), vd.data(), grad_d.data(), hessian_d.data(), 0.9,
+                0.999, n);
+    for (int i = 0; i < n; ++i) {
+      EXPECT_NEAR(m[i], md[i], 1e-6);
+      EXPECT_NEAR(v[i], vd[i], 1e-6);
+    }
+    EXPECT_EQ(m[n], 7.0f);
+    EXPECT_EQ(v[n], 7.0f);
+  }
+  LOG(INFO) << "Row kernels use " << RowKernelIsa();
+}
+
+TEST(KvVariableTest, OptimizerRowKernels) {
+  // The steps of Adagrad, Ftrl, AMSGrad and AdaBelief in float match the
+  // loops run in double.
+  std::mt19937 gen(5);
+  std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+  for (int n = 0; n <= 70; ++n) {
+    std::vector<float> var(n), accum(n), linear(n), m(n), v(n), grad(n);
+    for (int i = 0; i < n; ++i) {
+      var[i] = dist(gen);
+      accum[i] = std::fabs(dist(gen)) + 0.1f;
+      linear[i] = dist(gen);
+      m[i] = dist(gen);
+      v[i] = std::fabs(dist(gen));
+      grad[i] = dist(gen);
+    }
+    std::vector<double> var_d(var.begin(), var.end()),
+        accum_d(accum.begin(), accum.end()),
+        linear_d(linear.begin(), linear.end()), md(m.begin(), m.end()),
+        vd(v.begin(), v.end()), grad_d(grad.begin(), grad.end());
+    // Nothing past n is written.
+    for (auto* row : {&var, &accum, &linear, &m, &v}) {
+      row->push_back(7.0f);
+    }
+    AdaBeliefMoments(m.data(), v.data(), grad.data(), 0.9f, 0.999f, n);
+    AdaBeliefMoments(md.data(), vd.data(), grad_d.data(), 0.9, 0.999, n);
+    for (bool update_accum : {true, false}) {
+      AdagradRow(var.data(), accum.data(), grad.data(), 0.1f, update_accum,
+                 n);
+      AdagradRow(var_d.data(), accum_d.data(), grad_d.data(), 0.1,
+                 update_accum, n);
+    }
+    FtrlLinear(linear.data(), accum.data(), var.data(), grad.data(), 0.1f, n);
+    FtrlLinear(linear_d.data(), accum_d.data(), var_d.data(), grad_d.data(),
+               0.1, n);
+    for (bool amsgrad : {true, false}) {
+      AdaptiveLinear(linear.data(), accum.data(), var.data(), m.data(),
+                     v.data(), 0.1f, 0.01f, 0.1f, amsgrad, n);
+      AdaptiveLinear(linear_d.data(), accum_d.data(), var_d.data(), md.data(),
+                     vd.data(), 0.1, 0.01, 0.1, amsgrad, n);
+    }
+    ProximalStep(var.data(), linear.data(), accum.data(), 0.1f, 0.3f, 0.01f,
+                 1e-8f, 0.5f, n);
+    ProximalStep(var_d.data(), linear_d.data(), accum_d.data(), 0.1, 0.3,
+                 0.01, 1e-8, 0.5, n);
+    EXPECT_EQ(GroupProximalStep(var.data(), linear.data(), accum.data(), 0.1f,
+                                0.3f, 0.01f, 0.0f, 0.01f, n),
+              GroupProximalStep(var_d.data(), linear_d.data(), accum_d.data(),
+                                0.1, 0.3, 0.01, 0.0, 0.01, n));
+    for (int i = 0; i < n; ++i) {
+      EXPECT_NEAR(m[i], md[i], 1e-5);
+      EXPECT_NEAR(v[i], vd[i], 1e-5);
+      EXPECT_NEAR(var[i], var_d[i], 1e-4 * (1 + std::fabs(var_d[i])));
+      EXPECT_NEAR(accum[i], accum_d[i], 1e-4 * (1 + std::fabs(accum_d[i])));
+      EXPECT_NEAR(linear[i], linear_d[i],
+                  1e-4 * (1 + std::fabs(linear_d[i])));
+    }
+    for (auto* row : {&var, &accum, &linear, &m, &v}) {
+      EXPECT_EQ((*row)[n], 7.0f);
+    }
+  }
+}
+
+TEST(KvVariableTest, SegmentApply) {
+  setenv("TFPLUS_KV_SEGMENT_APPLY", "1", 1);
+  auto variable = new KvVariable<int64, float>(
+      std::string("test_kv_variable_segment_apply"), TensorShape({8}), 0,
+      GetStorageOption(StorageCombination::MEM));
+  unsetenv("TFPLUS_KV_SEGMENT_APPLY");
+  auto table = std::unique_ptr<KvVariableInterface>(variable);
+  auto* table_manager = variable->table_manager();
+  Tensor keys(DataTypeToEnum<int64>::v(), TensorShape({1000}));
+  TFPLUS_EXPECT_OK(GenerateIndexTensor<int64>(0, &keys));
+  const auto& keys_flat = keys.flat<int64>();
+  IndexOrder order = variable->ApplyOrder(keys);
+  if (NumaWorkers::Get() != nullptr || !table_manager->SegmentLocks()) {
+    EXPECT_FALSE(order.by_segment());
+    return;
+  }
+  ASSERT_TRUE(order.by_segment());
+  ASSERT_EQ(order.group_begin().size(), table_manager->NumSegments() + 1);
+  EXPECT_EQ(order.group_begin().back(), keys.NumElements());
+  for (size_t segment = 0; segment < table_manager->NumSegments();
+       ++segment) {
+    for (int64_t j = order.group_begin()[segment];
+         j < order.group_begin()[segment + 1]; ++j) {
+      EXPECT_EQ(table_manager->SegmentOf(keys_flat(order(j))), segment);
+    }
+  }
+
+  // Over another order every key is locked on its own.
+  {
+    auto apply_lock = variable->GetApplyLock(IndexOrder());
+    auto lock = apply_lock.Lock(keys_flat(0));
+    EXPECT_NE(lock.mu(), nullptr);
+  }
+  {
+    auto apply_lock = variable->GetApplyLock(order);
+    for (int64_t j = 0; j < keys.NumElements(); ++j) {
+      auto lock = apply_lock.Lock(keys_flat(order(j)));
+      EXPECT_EQ(lock.mu(), nullptr);
+    }
+  }
+  // The segments were unlocked, locking them again does not block.
+  for (int64_t i = 0; i < keys.NumElements(); ++i) {
+    auto lock = variable->GetScopedKeyLock(keys_flat(i), LockType::WRITE_LOCK);
+  }
+}
+
+TEST(KvVariableTest, RowHandles) {
+  const int embedding_dim = 8;
+  const int64_t num_keys = 100;
+  auto variable = new KvVariable<int64, float>(
+      std::string("test_kv_variable_row_handles"),
+      TensorShape({embedding_dim}), 0,
+      GetStorageOption(StorageCombination::MEM));
+  auto table = std::unique_ptr<KvVariableInterface>(variable);
+  Tensor random_init(DataTypeToEnum<float>::v(),
+                     TensorShape({1024, embedding_dim}));
+  TFPLUS_EXPECT_OK(GenerateRandomRealTensor(0.1, 1.0, &random_init));
+  TFPLUS_EXPECT_OK(table->InitRandomValues(random_init));
+  Tensor keys(DataTypeToEnum<int64>::v(), TensorShape({num_keys}));
+  TFPLUS_EXPECT_OK(GenerateIndexTensor<int64>(0, &keys));
+  const auto& keys_flat = keys.flat<int64>();
+  Tensor values(DataTypeToEnum<float>::v(),
+                TensorShape({num_keys, embedding_dim}));
+  // Without a step the gather resolves no rows.
+  Tensor handles(DataTypeToEnum<int64>::v(), TensorShape({num_keys, 3}));
+  TFPLUS_EXPECT_OK(
+      table->FindOrInsertWithHandles(nullptr, keys, &values, &handles));
+  EXPECT_EQ(table->size(), static_cast<size_t>(num_keys));
+  auto handles_matrix = handles.matrix<int64>();
+  for (int64_t i = 0; i < num_keys; ++i) {
+    EXPECT_EQ(handles_matrix(i, 0), 0);
+  }
+  if (!variable->table_manager()->CachesRows()) {
+    return;
+  }
+
+  // Handles as FindOrInsertWithHandles() outputs them.
+  auto resolution = variable->NewRowResolution(num_keys);
+  {
+    mutex_read_lock lock(*variable->mu());
+    TFPLUS_EXPECT_OK(
+        variable->ResolveRowsLocked(nullptr, keys, &values, resolution));
+  }
+  for (int64_t i = 0; i < num_keys; ++i) {
+    handles_matrix(i, 0) = 1;
+    handles_matrix(i, 1) = i;
+    handles_matrix(i, 2) = keys_flat(i);
+  }
+  KvVariable<int64, float>::RowHandles rows(handles_matrix.data(),
+                                            resolution);
+
+  // A seeded context is the row the lookup finds.
+  auto values_matrix = values.matrix<float>();
+  for (int64_t i = 0; i < num_keys; ++i) {
+    auto lock = variable->GetScopedKeyLock(keys_flat(i), LockType::WRITE_LOCK);
+    EVContext<float> context;
+    rows.Seed(i, keys_flat(i), &context);
+    ASSERT_NE(context.Meta(), nullptr);
+    auto* meta = context.Meta();
+    variable->FindOrInsertUnsafe(keys_flat(i), &context, nullptr);
+    EXPECT_EQ(context.Meta(), meta);
+    for (int d = 0; d < embedding_dim; ++d) {
+      EXPECT_EQ(context.Value()[d], values_matrix(i, d));
+    }
+  }
+
+  // Handles of other indices, e.g. of another gather of the same batch size
+  // or reordered, are not used.
+  for (int64_t i = 0; i + 1 < num_keys; ++i) {
+    EVContext<float> context;
+    rows.Seed(i, keys_flat(i + 1), &context);
+    EXPECT_EQ(context.Meta(), nullptr);
+  }
+  // Nor is a handle whose key column was altered to match the indices, or
+  // whose position is out of range.
+  handles_matrix(0, 2) = keys_flat(1);
+  EVContext<float> altered_context;
+  rows.Seed(0, keys_flat(1), &altered_context);
+  EXPECT_EQ(altered_context.Meta(), nullptr);
+  handles_matrix(0, 1) = num_keys;
+  handles_matrix(0, 2) = keys_flat(0);
+  rows.Seed(0, keys_flat(0), &altered_context);
+  EXPECT_EQ(altered_context.Meta(), nullptr);
+
+  // Erasing any key drops all the handles.
+  Tensor deleted(DataTypeToEnum<int64>::v(), TensorShape({1}));
+  deleted.flat<int64>()(0) = keys_flat(0);
+  TFPLUS_EXPECT_OK(table->Delete(deleted));
+  for (int64_t i = 1; i < num_keys; ++i) {
+    EVContext<float> context;
+    rows.Seed(i, keys_flat(i), &context);
+    EXPECT_EQ(context.Meta(), nullptr);
+  }
+}
+
+TEST(KvVariableTest, LazyDecay) {
+  const int embedding_dim = 8;
+  setenv("TFPLUS_KV_LAZY_DECAY", "1", 1);
+  auto variable = new KvVariable<int64, float>(
+      std::string("test_kv_variable_lazy_decay"),
+      TensorShape({embedding_dim}), 0,
+      GetStorageOption(StorageCombination::MEM));
+  unsetenv("TFPLUS_KV_LAZY_DECAY");
+  auto table = std::unique_ptr<KvVariableInterface>(variable);
+  ASSERT_TRUE(variable->lazy_decay());
+  Tensor random_init(DataTypeToEnum<float>::v(),
+                     TensorShape({1024, embedding_dim}));
+  TFPLUS_EXPECT_OK(GenerateRandomRealTensor(0.1, 1.0, &random_init));
+  TFPLUS_EXPECT_OK(table->InitRandomValues(random_init));
+  // A new key missed nothing, nor does a key touched on consecutive steps.
+  const int64 key = 7;
+  {
+    auto lock = variable->GetScopedKeyLock(key, LockType::WRITE_LOCK);
+    EVContext<float> context;
+    variable->FindOrInsertUnsafe(key, &context, nullptr);
+    ASSERT_NE(context.Meta(), nullptr);
+    EXPECT_EQ(variable->TouchStepUnsafe(key, 1), 0u);
+    EXPECT_EQ(variable->TouchStepUnsafe(key, 2), 0u);
+    EXPECT_EQ(variable->TouchStepUnsafe(key, 2), 0u);
+    EXPECT_EQ(variable->TouchStepUnsafe(key, 5), 2u);
+    EXPECT_EQ(variable->TouchStepUnsafe(key, 6), 0u);
+  }
+
+  // A deleted key starts over.
+  Tensor deleted(DataTypeToEnum<int64>::v(), TensorShape({1}));
+  deleted.flat<int64>()(0) = key;
+  TFPLUS_EXPECT_OK(table->Delete(deleted));
+  EXPECT_EQ(variable->TouchStepUnsafe(key, 9), 0u);
+
+  // The steps are kept out of the rows of every variable.
+  EXPECT_EQ(sizeof(EmbeddingValue<float>), 16u);
+
+  // Without the flag nothing is tracked.
+  auto plain = std::unique_ptr<KvVariable<int64, float>>(
+      new KvVariable<int64, float>(
+          std::string("test_kv_variable_lazy_decay_plain"),
+          TensorShape({embedding_dim}), 0,
+          GetStorageOption(StorageCombination::MEM)));
+  EXPECT_FALSE(plain->lazy_decay());
+}
 
 }  // namespace
 
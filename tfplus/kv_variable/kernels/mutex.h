@@ -13,6 +13,9 @@
 
 #ifndef TFPLUS_KV_VARIABLE_KERNELS_MUTEX_H_
 #define TFPLUS_KV_VARIABLE_KERNELS_MUTEX_H_
+#include <atomic>
+#include <cstdint>
+
 #include "tbb/spin_rw_mutex.h"
 #include "tensorflow/core/platform/mutex.h"
 #include "tensorflow/core/platform/thread_annotations.h"
@@ -30,12 +33,39 @@ class ScopedSpinLock : public spin_rw_mutex::scoped_lock {
   explicit ScopedSpinLock(spin_rw_mutex& m, bool write = true)  // NOLINT
       : spin_rw_mutex::scoped_lock(m, write) {}
 
+  // A writer also makes seq odd while it holds the lock, readers that do not
+  // take it retry when seq changed under them, see HotKeyMap.
+  ScopedSpinLock(spin_rw_mutex& m, bool write,  // NOLINT
+                 std::atomic<uint32_t>* seq)
+      : spin_rw_mutex::scoped_lock(m, write), seq_(seq) {
+    if (write) BumpSeq();
+  }
+
   ScopedSpinLock(ScopedSpinLock&& other) {
     mutex = other.mutex;
     is_writer = other.is_writer;
+    seq_ = other.seq_;
     other.mutex = nullptr;
     other.is_writer = false;
+    other.seq_ = nullptr;
   }
+
+  ~ScopedSpinLock() {
+    if (mutex != nullptr && is_writer) BumpSeq();
+  }
+
+  bool upgrade_to_writer() {
+    bool result = spin_rw_mutex::scoped_lock::upgrade_to_writer();
+    BumpSeq();
+    return result;
+  }
+
+ private:
+  void BumpSeq() {
+    if (seq_ != nullptr) seq_->fetch_add(1, std::memory_order_acq_rel);
+  }
+
+  std::atomic<uint32_t>* seq_ = nullptr;
 };
 
 class TF_SCOPED_LOCKABLE tfplus_mutex_lock {
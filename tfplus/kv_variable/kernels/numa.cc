@@ -0,0 +1,266 @@
+// Copyright 2023 The TFPlus Authors. All rights reserved.
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tfplus/kv_variable/kernels/numa.h"
+
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+
+#include "tensorflow/core/platform/logging.h"
+#include "tfplus/kv_variable/kernels/utility.h"
+
+namespace tfplus {
+namespace {
+// Values of <linux/mempolicy.h>, the syscalls are called directly so that
+// libnuma is not needed.
+constexpr int kMpolPreferred = 1;
+constexpr unsigned long kMpolFNode = 1 << 0;  // NOLINT(runtime/int)
+constexpr unsigned long kMpolFAddr = 1 << 1;  // NOLINT(runtime/int)
+constexpr int kMaxNodes = 1024;
+constexpr int64_t kMinCostPerBlock = 10000;
+
+thread_local int pinned_node = -1;
+
+// Parses a cpulist such as "0-23,48-71".
+std::vector<int> ParseCpuList(const std::string& list) {
+  std::vector<int> cpus;
+  std::stringstream ss(list);
+  std::string range;
+  while (std::getline(ss, range, ',')) {
+    if (range.empty() || range == "\n") continue;
+    size_t dash = range.find('-');
+    int first = std::atoi(range.c_str());
+    int last = dash == std::string::npos
+                   ? first
+                   : std::atoi(range.c_str() + dash + 1);
+    for (int cpu = first; cpu <= last; ++cpu) cpus.push_back(cpu);
+  }
+  return cpus;
+}
+
+std::string FormatCpuList(const std::vector<int>& cpus) {
+  std::string out;
+  for (size_t i = 0; i < cpus.size();) {
+    size_t j = i;
+    while (j + 1 < cpus.size() && cpus[j + 1] == cpus[j] + 1) ++j;
+    if (!out.empty()) out += ",";
+    out += std::to_string(cpus[i]);
+    if (j > i) out += "-" + std::to_string(cpus[j]);
+    i = j + 1;
+  }
+  return out;
+}
+}  // namespace
+
+NumaTopology::NumaTopology() {
+  const std::string root = "/sys/devices/system/node";
+  std::vector<int> ids;
+  if (DIR* dir = opendir(root.c_str())) {
+    while (struct dirent* entry = readdir(dir)) {
+      const std::string name = entry->d_name;
+      if (name.compare(0, 4, "node") == 0 && name.size() > 4 &&
+          std::all_of(name.begin() + 4, name.end(), ::isdigit)) {
+        ids.push_back(std::atoi(name.c_str() + 4));
+      }
+    }
+    closedir(dir);
+  }
+  std::sort(ids.begin(), ids.end());
+  for (int id : ids) {
+    std::ifstream file(root + "/node" + std::to_string(id) + "/cpulist");
+    std::string list;
+    std::getline(file, list);
+    std::vector<int> cpus = ParseCpuList(list);
+    // Nodes with memory only can not run the work of their keys.
+    if (cpus.empty()) continue;
+    node_ids_.push_back(id);
+    cpus_.push_back(std::move(cpus));
+  }
+  if (cpus_.empty()) {
+    std::vector<int> cpus(std::max<long>(sysconf(_SC_NPROCESSORS_CONF), 1));
+    for (size_t i = 0; i < cpus.size(); ++i) cpus[i] = static_cast<int>(i);
+    node_ids_.push_back(0);
+    cpus_.push_back(std::move(cpus));
+  }
+  for (int node = 0; node < num_nodes(); ++node) {
+    for (int cpu : cpus_[node]) {
+      if (cpu >= static_cast<int>(node_of_cpu_.size())) {
+        node_of_cpu_.resize(cpu + 1, 0);
+      }
+      node_of_cpu_[cpu] = node;
+    }
+  }
+}
+
+const NumaTopology& NumaTopology::Get() {
+  static const NumaTopology* topology = new NumaTopology();
+  return *topology;
+}
+
+int NumaTopology::NodeOfCpu(int cpu) const {
+  return cpu >= 0 && cpu < static_cast<int>(node_of_cpu_.size())
+             ? node_of_cpu_[cpu]
+             : 0;
+}
+
+int CurrentNumaNode() {
+  if (pinned_node >= 0) return pinned_node;
+  return NumaTopology::Get().NodeOfCpu(sched_getcpu());
+}
+
+bool BindMemoryToNode(void* addr, size_t bytes, int node) {
+  const int id = NumaTopology::Get().node_id(node);
+  if (id >= kMaxNodes) return false;
+  unsigned long mask[kMaxNodes / 64] = {0};  // NOLINT(runtime/int)
+  mask[id / 64] |= 1UL << (id % 64);
+  return syscall(SYS_mbind, addr, bytes, kMpolPreferred, mask, kMaxNodes + 1,
+                 0) == 0;
+}
+
+int NumaNodeOfAddress(const void* addr) {
+  int id = -1;
+  if (syscall(SYS_get_mempolicy, &id, nullptr, 0, addr,
+              kMpolFNode | kMpolFAddr) != 0) {
+    return -1;
+  }
+  const NumaTopology& topology = NumaTopology::Get();
+  for (int node = 0; node < topology.num_nodes(); ++node) {
+    if (topology.node_id(node) == id) return node;
+  }
+  return -1;
+}
+
+NumaWorkers* NumaWorkers::Get() {
+  static NumaWorkers* workers = []() -> NumaWorkers* {
+    if (!GetEnvVar<bool>("TFPLUS_KV_NUMA", false)) return nullptr;
+    if (NumaTopology::Get().num_nodes() < 2) {
+      LOG(WARNING) << "TFPLUS_KV_NUMA is set but the host has one NUMA node";
+      return nullptr;
+    }
+    auto* w = new NumaWorkers(
+        GetEnvVar<int>("TFPLUS_KV_NUMA_THREADS_PER_NODE", 0));
+    LOG(INFO) << w->DebugString();
+    return w;
+  }();
+  return workers;
+}
+
+NumaWorkers::NumaWorkers(int threads_per_node) {
+  const NumaTopology& topology = NumaTopology::Get();
+  for (int node = 0; node < topology.num_nodes(); ++node) {
+    nodes_.emplace_back(new Node());
+  }
+  for (int node = 0; node < topology.num_nodes(); ++node) {
+    const std::vector<int>& cpus = topology.cpus(node);
+    int num_threads = threads_per_node > 0
+                          ? std::min<int>(threads_per_node, cpus.size())
+                          : static_cast<int>(cpus.size());
+    for (int t = 0; t < num_threads; ++t) {
+      nodes_[node]->threads.emplace_back([this, node]() { WorkerLoop(node); });
+    }
+  }
+}
+
+void NumaWorkers::WorkerLoop(int node) {
+  // The whole node rather than one CPU, the scheduler still balances the
+  // threads of a node.
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int cpu : NumaTopology::Get().cpus(node)) CPU_SET(cpu, &set);
+  if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+    LOG(WARNING) << "Failed to pin a KvVariable worker to NUMA node " << node;
+  }
+  pinned_node = node;
+  Node& self = *nodes_[node];
+  while (true) {
+    std::function<void()> task;
+    {
+      std::unique_lock<std::mutex> l(self.mu);
+      self.cv.wait(l, [&self]() { return !self.tasks.empty(); });
+      task = std::move(self.tasks.front());
+      self.tasks.pop_front();
+    }
+    task();
+  }
+}
+
+void NumaWorkers::ParallelFor(
+    const std::vector<int64_t>& group_begin, int64_t cost_per_unit,
+    const std::function<void(int64_t, int64_t)>& work) {
+  if (pinned_node >= 0) {
+    // Nested in the work of a worker, queueing it could wait on itself.
+    work(group_begin.front(), group_begin.back());
+    return;
+  }
+  struct Pending {
+    std::mutex mu;
+    std::condition_variable cv;
+    int64_t count = 0;
+  } pending;
+  auto run = [&pending, &work](int64_t begin, int64_t end) {
+    work(begin, end);
+    std::lock_guard<std::mutex> l(pending.mu);
+    if (--pending.count == 0) pending.cv.notify_all();
+  };
+  std::vector<std::vector<std::pair<int64_t, int64_t>>> blocks(num_nodes());
+  for (int node = 0; node < num_nodes(); ++node) {
+    const int64_t begin = group_begin[node];
+    const int64_t end = group_begin[node + 1];
+    if (begin == end) continue;
+    int64_t num_blocks = std::min<int64_t>(
+        num_threads(node),
+        std::max<int64_t>(1, (end - begin) * cost_per_unit / kMinCostPerBlock));
+    int64_t block = (end - begin + num_blocks - 1) / num_blocks;
+    for (int64_t b = begin; b < end; b += block) {
+      blocks[node].emplace_back(b, std::min(end, b + block));
+    }
+    pending.count += blocks[node].size();
+  }
+  if (pending.count == 0) return;
+  for (int node = 0; node < num_nodes(); ++node) {
+    if (blocks[node].empty()) continue;
+    Node& target = *nodes_[node];
+    {
+      std::lock_guard<std::mutex> l(target.mu);
+      for (const auto& range : blocks[node]) {
+        target.tasks.emplace_back(
+            [run, range]() { run(range.first, range.second); });
+      }
+    }
+    target.cv.notify_all();
+  }
+  std::unique_lock<std::mutex> l(pending.mu);
+  pending.cv.wait(l, [&pending]() { return pending.count == 0; });
+}
+
+std::string NumaWorkers::DebugString() const {
+  const NumaTopology& topology = NumaTopology::Get();
+  std::string out = "KvVariable NUMA workers:";
+  for (int node = 0; node < num_nodes(); ++node) {
+    out += " node " + std::to_string(topology.node_id(node)) + ": " +
+           std::to_string(num_threads(node)) + " threads on cpus " +
+           FormatCpuList(topology.cpus(node)) + ";";
+  }
+  return out;
+}
+
+}  // namespace tfplus
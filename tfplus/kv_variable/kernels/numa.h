@@ -0,0 +1,115 @@
+// Copyright 2023 The TFPlus Authors. All rights reserved.
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TFPLUS_KV_VARIABLE_KERNELS_NUMA_H_
+#define TFPLUS_KV_VARIABLE_KERNELS_NUMA_H_
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace tfplus {
+
+// NUMA nodes of the host that have CPUs, numbered densely from 0, read from
+// /sys/devices/system/node. A host without that information has a single
+// node with every CPU.
+class NumaTopology {
+ public:
+  static const NumaTopology& Get();
+
+  int num_nodes() const { return static_cast<int>(cpus_.size()); }
+
+  // Kernel id of node, the one the memory policy calls expect.
+  int node_id(int node) const { return node_ids_[node]; }
+
+  const std::vector<int>& cpus(int node) const { return cpus_[node]; }
+
+  // Node of cpu, 0 for CPUs the topology does not know.
+  int NodeOfCpu(int cpu) const;
+
+ private:
+  NumaTopology();
+
+  std::vector<int> node_ids_;
+  std::vector<std::vector<int>> cpus_;
+  std::vector<int> node_of_cpu_;
+};
+
+// Node whose memory the calling thread should use: the node a NumaWorkers
+// thread is pinned to, otherwise the node of the CPU it runs on.
+int CurrentNumaNode();
+
+// Asks the kernel to place the pages of [addr, addr + bytes), which must be
+// page aligned and not touched yet, on node. The policy is preferred rather
+// than strict, a full node spills over instead of failing. Returns false if
+// the kernel refused it.
+bool BindMemoryToNode(void* addr, size_t bytes, int node);
+
+// Node holding the page of addr, or -1 if it is unknown, e.g. not touched
+// yet.
+int NumaNodeOfAddress(const void* addr);
+
+// Threads pinned to the CPUs of each NUMA node. Sparse ops hand them the
+// keys whose segments belong to that node, see IndexOrder, so that the rows
+// of a node are allocated and updated by threads of the same node.
+//
+// There is one instance per process, started by the first Get() when
+// TFPLUS_KV_NUMA is set on a host with more than one node.
+// TFPLUS_KV_NUMA_THREADS_PER_NODE limits the threads of each node, by
+// default there is one per CPU of the node.
+class NumaWorkers {
+ public:
+  // nullptr unless NUMA mode is on.
+  static NumaWorkers* Get();
+
+  int num_nodes() const { return static_cast<int>(nodes_.size()); }
+
+  int num_threads(int node) const {
+    return static_cast<int>(nodes_[node]->threads.size());
+  }
+
+  // Runs work(begin, end) over [group_begin[g], group_begin[g + 1]) on the
+  // threads of node g for every node, and returns once all of it is done.
+  // Each range is split in blocks like Shard() does, cost_per_unit is the
+  // estimated cost of one position. Called from a worker it runs inline.
+  void ParallelFor(const std::vector<int64_t>& group_begin,
+                   int64_t cost_per_unit,
+                   const std::function<void(int64_t, int64_t)>& work);
+
+  // Nodes, their threads and the CPUs they are pinned to.
+  std::string DebugString() const;
+
+ private:
+  struct Node {
+    std::mutex mu;
+    std::condition_variable cv;
+    std::deque<std::function<void()>> tasks;
+    std::vector<std::thread> threads;
+  };
+
+  explicit NumaWorkers(int threads_per_node);
+
+  void WorkerLoop(int node);
+
+  std::vector<std::unique_ptr<Node>> nodes_;
+};
+
+}  // namespace tfplus
+#endif  // TFPLUS_KV_VARIABLE_KERNELS_NUMA_H_
@@ -0,0 +1,592 @@
+// Copyright 2023 The TFPlus Authors. All rights reserved.
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tfplus/kv_variable/kernels/row_kernels.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include <cmath>
+#include <string>
+
+#include "tensorflow/core/platform/logging.h"
+#include "tfplus/kv_variable/kernels/utility.h"
+
+namespace tfplus {
+namespace {
+
+// The library is built without -mavx2, each kernel is compiled for its
+// instruction set with a target attribute and picked once at run time.
+struct FloatKernels {
+  const char* isa;
+  float (*sum_squares)(const float* x, int64_t n);
+  float (*shrink_sum_squares)(const float* linear, float l1, int64_t n);
+  void (*adam_moments)(float* m, float* v, const float* grad,
+                       const float* v_grad, float beta1, float beta2,
+                       int64_t n);
+  void (*adabelief_moments)(float* m, float* v, const float* grad,
+                            float beta1, float beta2, int64_t n);
+  void (*adagrad)(float* var, float* accum, const float* grad, float lr,
+                  bool update_accum, int64_t n);
+  void (*ftrl_linear)(float* linear, float* accum, const float* var,
+                      const float* grad, float lr, int64_t n);
+  void (*adaptive_linear)(float* linear, float* accum, const float* var,
+                          const float* m, const float* v, float m_correction,
+                          float v_correction, float lr, bool amsgrad,
+                          int64_t n);
+  void (*proximal_step)(float* var, const float* linear, const float* accum,
+                        float lr, float l1, float l2, float epsilon,
+                        float scale, int64_t n);
+};
+
+float SumSquaresScalar(const float* x, int64_t n) {
+  float sum = 0.0f;
+  for (int64_t i = 0; i < n; ++i) {
+    sum += x[i] * x[i];
+  }
+  return sum;
+}
+
+float ShrinkSumSquaresScalar(const float* linear, float l1, int64_t n) {
+  float sum = 0.0f;
+  for (int64_t i = 0; i < n; ++i) {
+    float d = std::fmax(std::fmin(linear[i], l1), -l1) - linear[i];
+    sum += d * d;
+  }
+  return sum;
+}
+
+void AdamMomentsScalar(float* m, float* v, const float* grad,
+                       const float* v_grad, float beta1, float beta2,
+                       int64_t n) {
+  const float one_minus_beta1 = 1.0f - beta1;
+  const float one_minus_beta2 = 1.0f - beta2;
+  for (int64_t i = 0; i < n; ++i) {
+    m[i] = beta1 * m[i] + one_minus_beta1 * grad[i];
+    v[i] = beta2 * v[i] + one_minus_beta2 * v_grad[i] * v_grad[i];
+  }
+}
+
+void AdaBeliefMomentsScalar(float* m, float* v, const float* grad,
+                            float beta1, float beta2, int64_t n) {
+  const float one_minus_beta1 = 1.0f - beta1;
+  const float one_minus_beta2 = 1.0f - beta2;
+  for (int64_t i = 0; i < n; ++i) {
+    m[i] = beta1 * m[i] + one_minus_beta1 * grad[i];
+    const float belief = grad[i] - m[i];
+    v[i] = beta2 * v[i] + one_minus_beta2 * belief * belief;
+  }
+}
+
+void AdagradScalar(float* var, float* accum, const float* grad, float lr,
+                   bool update_accum, int64_t n) {
+  for (int64_t i = 0; i < n; ++i) {
+    if (update_accum) {
+      accum[i] += grad[i] * grad[i];
+    }
+    var[i] -= lr * grad[i] / std::sqrt(accum[i]);
+  }
+}
+
+void FtrlLinearScalar(float* linear, float* accum, const float* var,
+                      const float* grad, float lr, int64_t n) {
+  for (int64_t i = 0; i < n; ++i) {
+    const float new_accum = accum[i] + grad[i] * grad[i];
+    linear[i] +=
+        grad[i] - (std::sqrt(new_accum) - std::sqrt(accum[i])) / lr * var[i];
+    accum[i] = new_accum;
+  }
+}
+
+void AdaptiveLinearScalar(float* linear, float* accum, const float* var,
+                          const float* m, const float* v, float m_correction,
+                          float v_correction, float lr, bool amsgrad,
+                          int64_t n) {
+  for (int64_t i = 0; i < n; ++i) {
+    float new_accum = v[i] / v_correction;
+    if (amsgrad) {
+      new_accum = std::fmax(accum[i], new_accum);
+    }
+    linear[i] += m[i] / m_correction -
+                 (std::sqrt(new_accum) - std::sqrt(accum[i])) / lr * var[i];
+    accum[i] = new_accum;
+  }
+}
+
+void ProximalStepScalar(float* var, const float* linear, const float* accum,
+                        float lr, float l1, float l2, float epsilon,
+                        float scale, int64_t n) {
+  const float two_l2 = 2.0f * l2;
+  for (int64_t i = 0; i < n; ++i) {
+    const float d = std::fmax(std::fmin(linear[i], l1), -l1) - linear[i];
+    var[i] = d * scale / ((std::sqrt(accum[i]) + epsilon) / lr + two_l2);
+  }
+}
+
+#if defined(__x86_64__)
+// The AVX2 kernels run their tails with the scalar loops, which are built
+// without VEX encoding. They clear the upper halves of the registers before,
+// GCC does not always do it before a tail call, and the SSE code that runs
+// with them dirty stalls on every instruction.
+__attribute__((target("avx2,fma"))) float HorizontalSum(__m256 x) {
+  __m128 sum = _mm_add_ps(_mm256_castps256_ps128(x),
+                          _mm256_extractf128_ps(x, 1));
+  sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+  sum = _mm_add_ss(sum, _mm_movehdup_ps(sum));
+  return _mm_cvtss_f32(sum);
+}
+
+__attribute__((target("avx2,fma"))) float SumSquaresAvx2(const float* x,
+                                                         int64_t n) {
+  __m256 acc0 = _mm256_setzero_ps();
+  __m256 acc1 = _mm256_setzero_ps();
+  int64_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m256 a = _mm256_loadu_ps(x + i);
+    __m256 b = _mm256_loadu_ps(x + i + 8);
+    acc0 = _mm256_fmadd_ps(a, a, acc0);
+    acc1 = _mm256_fmadd_ps(b, b, acc1);
+  }
+  for (; i + 8 <= n; i += 8) {
+    __m256 a = _mm256_loadu_ps(x + i);
+    acc0 = _mm256_fmadd_ps(a, a, acc0);
+  }
+  float sum = HorizontalSum(_mm256_add_ps(acc0, acc1));
+  _mm256_zeroupper();
+  return sum + SumSquaresScalar(x + i, n - i);
+}
+
+__attribute__((target("avx2,fma"))) float ShrinkSumSquaresAvx2(
+    const float* linear, float l1, int64_t n) {
+  const __m256 upper = _mm256_set1_ps(l1);
+  const __m256 lower = _mm256_set1_ps(-l1);
+  __m256 acc = _mm256_setzero_ps();
+  int64_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256 a = _mm256_loadu_ps(linear + i);
+    __m256 d = _mm256_sub_ps(_mm256_max_ps(_mm256_min_ps(a, upper), lower), a);
+    acc = _mm256_fmadd_ps(d, d, acc);
+  }
+  float sum = HorizontalSum(acc);
+  _mm256_zeroupper();
+  return sum + ShrinkSumSquaresScalar(linear + i, l1, n - i);
+}
+
+__attribute__((target("avx2,fma"))) void AdamMomentsAvx2(
+    float* m, float* v, const float* grad, const float* v_grad, float beta1,
+    float beta2, int64_t n) {
+  const __m256 b1 = _mm256_set1_ps(beta1);
+  const __m256 b2 = _mm256_set1_ps(beta2);
+  const __m256 c1 = _mm256_set1_ps(1.0f - beta1);
+  const __m256 c2 = _mm256_set1_ps(1.0f - beta2);
+  int64_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256 g = _mm256_loadu_ps(grad + i);
+    __m256 h = _mm256_loadu_ps(v_grad + i);
+    __m256 mi = _mm256_fmadd_ps(b1, _mm256_loadu_ps(m + i),
+                                _mm256_mul_ps(c1, g));
+    __m256 vi = _mm256_fmadd_ps(b2, _mm256_loadu_ps(v + i),
+                                _mm256_mul_ps(_mm256_mul_ps(c2, h), h));
+    _mm256_storeu_ps(m + i, mi);
+    _mm256_storeu_ps(v + i, vi);
+  }
+  _mm256_zeroupper();
+  AdamMomentsScalar(m + i, v + i, grad + i, v_grad + i, beta1, beta2, n - i);
+}
+
+__attribute__((target("avx2,fma"))) void AdaBeliefMomentsAvx2(
+    float* m, float* v, const float* grad, float beta1, float beta2,
+    int64_t n) {
+  const __m256 b1 = _mm256_set1_ps(beta1);
+  const __m256 b2 = _mm256_set1_ps(beta2);
+  const __m256 c1 = _mm256_set1_ps(1.0f - beta1);
+  const __m256 c2 = _mm256_set1_ps(1.0f - beta2);
+  int64_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256 g = _mm256_loadu_ps(grad + i);
+    __m256 mi = _mm256_fmadd_ps(b1, _mm256_loadu_ps(m + i),
+                                _mm256_mul_ps(c1, g));
+    __m256 d = _mm256_sub_ps(g, mi);
+    __m256 vi = _mm256_fmadd_ps(b2, _mm256_loadu_ps(v + i),
+                                _mm256_mul_ps(_mm256_mul_ps(c2, d), d));
+    _mm256_storeu_ps(m + i, mi);
+    _mm256_storeu_ps(v + i, vi);
+  }
+  _mm256_zeroupper();
+  AdaBeliefMomentsScalar(m + i, v + i, grad + i, beta1, beta2, n - i);
+}
+
+__attribute__((target("avx2,fma"))) void AdagradAvx2(float* var,
+                                                     float* accum,
+                                                     const float* grad,
+                                                     float lr,
+                                                     bool update_accum,
+                                                     int64_t n) {
+  const __m256 rate = _mm256_set1_ps(lr);
+  int64_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256 g = _mm256_loadu_ps(grad + i);
+    __m256 a = _mm256_loadu_ps(accum + i);
+    if (update_accum) {
+      a = _mm256_fmadd_ps(g, g, a);
+      _mm256_storeu_ps(accum + i, a);
+    }
+    __m256 step = _mm256_div_ps(_mm256_mul_ps(rate, g), _mm256_sqrt_ps(a));
+    _mm256_storeu_ps(var + i, _mm256_sub_ps(_mm256_loadu_ps(var + i), step));
+  }
+  _mm256_zeroupper();
+  AdagradScalar(var + i, accum + i, grad + i, lr, update_accum, n - i);
+}
+
+__attribute__((target("avx2,fma"))) void FtrlLinearAvx2(float* linear,
+                                                        float* accum,
+                                                        const float* var,
+                                                        const float* grad,
+                                                        float lr, int64_t n) {
+  const __m256 rate = _mm256_set1_ps(lr);
+  int64_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256 g = _mm256_loadu_ps(grad + i);
+    __m256 a = _mm256_loadu_ps(accum + i);
+    __m256 new_a = _mm256_fmadd_ps(g, g, a);
+    __m256 sigma = _mm256_div_ps(
+        _mm256_sub_ps(_mm256_sqrt_ps(new_a), _mm256_sqrt_ps(a)), rate);
+    __m256 l = _mm256_add_ps(_mm256_loadu_ps(linear + i), g);
+    l = _mm256_fnmadd_ps(sigma, _mm256_loadu_ps(var + i), l);
+    _mm256_storeu_ps(linear + i, l);
+    _mm256_storeu_ps(accum + i, new_a);
+  }
+  _mm256_zeroupper();
+  FtrlLinearScalar(linear + i, accum + i, var + i, grad + i, lr, n - i);
+}
+
+__attribute__((target("avx2,fma"))) void AdaptiveLinearAvx2(
+    float* linear, float* accum, const float* var, const float* m,
+    const float* v, float m_correction, float v_correction, float lr,
+    bool amsgrad, int64_t n) {
+  const __m256 rate = _mm256_set1_ps(lr);
+  const __m256 m_corr = _mm256_set1_ps(m_correction);
+  const __m256 v_corr = _mm256_set1_ps(v_correction);
+  int64_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256 a = _mm256_loadu_ps(accum + i);
+    __m256 new_a = _mm256_div_ps(_mm256_loadu_ps(v + i), v_corr);
+    if (amsgrad) {
+      new_a = _mm256_max_ps(a, new_a);
+    }
+    __m256 sigma = _mm256_div_ps(
+        _mm256_sub_ps(_mm256_sqrt_ps(new_a), _mm256_sqrt_ps(a)), rate);
+    __m256 l = _mm256_add_ps(_mm256_loadu_ps(linear + i),
+                             _mm256_div_ps(_mm256_loadu_ps(m + i), m_corr));
+    l = _mm256_fnmadd_ps(sigma, _mm256_loadu_ps(var + i), l);
+    _mm256_storeu_ps(linear + i, l);
+    _mm256_storeu_ps(accum + i, new_a);
+  }
+  _mm256_zeroupper();
+  AdaptiveLinearScalar(linear + i, accum + i, var + i, m + i, v + i,
+                       m_correction, v_correction, lr, amsgrad, n - i);
+}
+
+__attribute__((target("avx2,fma"))) void ProximalStepAvx2(
+    float* var, const float* linear, const float* accum, float lr, float l1,
+    float l2, float epsilon, float scale, int64_t n) {
+  const __m256 upper = _mm256_set1_ps(l1);
+  const __m256 lower = _mm256_set1_ps(-l1);
+  const __m256 rate = _mm256_set1_ps(lr);
+  const __m256 two_l2 = _mm256_set1_ps(2.0f * l2);
+  const __m256 eps = _mm256_set1_ps(epsilon);
+  const __m256 s = _mm256_set1_ps(scale);
+  int64_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256 l = _mm256_loadu_ps(linear + i);
+    __m256 d = _mm256_sub_ps(_mm256_max_ps(_mm256_min_ps(l, upper), lower), l);
+    __m256 y = _mm256_add_ps(
+        _mm256_div_ps(_mm256_add_ps(_mm256_sqrt_ps(_mm256_loadu_ps(accum + i)),
+                                    eps),
+                      rate),
+        two_l2);
+    _mm256_storeu_ps(var + i, _mm256_div_ps(_mm256_mul_ps(d, s), y));
+  }
+  _mm256_zeroupper();
+  ProximalStepScalar(var + i, linear + i, accum + i, lr, l1, l2, epsilon,
+                     scale, n - i);
+}
+
+// The tails are masked, lanes past n load as 0 and are not stored.
+__attribute__((target("avx512f"))) __mmask16 TailMask(int64_t remaining) {
+  return static_cast<__mmask16>((1u << remaining) - 1);
+}
+
+__attribute__((target("avx512f"))) float SumSquaresAvx512(const float* x,
+                                                          int64_t n) {
+  __m512 acc = _mm512_setzero_ps();
+  int64_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m512 a = _mm512_loadu_ps(x + i);
+    acc = _mm512_fmadd_ps(a, a, acc);
+  }
+  if (i < n) {
+    __m512 a = _mm512_maskz_loadu_ps(TailMask(n - i), x + i);
+    acc = _mm512_fmadd_ps(a, a, acc);
+  }
+  return _mm512_reduce_add_ps(acc);
+}
+
+__attribute__((target("avx512f"))) float ShrinkSumSquaresAvx512(
+    const float* linear, float l1, int64_t n) {
+  const __m512 upper = _mm512_set1_ps(l1);
+  const __m512 lower = _mm512_set1_ps(-l1);
+  __m512 acc = _mm512_setzero_ps();
+  for (int64_t i = 0; i < n; i += 16) {
+    __m512 a = i + 16 <= n ? _mm512_loadu_ps(linear + i)
+                           : _mm512_maskz_loadu_ps(TailMask(n - i), linear + i);
+    __m512 d = _mm512_sub_ps(_mm512_max_ps(_mm512_min_ps(a, upper), lower), a);
+    acc = _mm512_fmadd_ps(d, d, acc);
+  }
+  return _mm512_reduce_add_ps(acc);
+}
+
+__attribute__((target("avx512f"))) void AdamMomentsAvx512(
+    float* m, float* v, const float* grad, const float* v_grad, float beta1,
+    float beta2, int64_t n) {
+  const __m512 b1 = _mm512_set1_ps(beta1);
+  const __m512 b2 = _mm512_set1_ps(beta2);
+  const __m512 c1 = _mm512_set1_ps(1.0f - beta1);
+  const __m512 c2 = _mm512_set1_ps(1.0f - beta2);
+  for (int64_t i = 0; i < n; i += 16) {
+    const __mmask16 mask = i + 16 <= n ? 0xffff : TailMask(n - i);
+    __m512 g = _mm512_maskz_loadu_ps(mask, grad + i);
+    __m512 h = _mm512_maskz_loadu_ps(mask, v_grad + i);
+    __m512 mi = _mm512_fmadd_ps(b1, _mm512_maskz_loadu_ps(mask, m + i),
+                                _mm512_mul_ps(c1, g));
+    __m512 vi = _mm512_fmadd_ps(b2, _mm512_maskz_loadu_ps(mask, v + i),
+                                _mm512_mul_ps(_mm512_mul_ps(c2, h), h));
+    _mm512_mask_storeu_ps(m + i, mask, mi);
+    _mm512_mask_storeu_ps(v + i, mask, vi);
+  }
+}
+
+__attribute__((target("avx512f"))) void AdaBeliefMomentsAvx512(
+    float* m, float* v, const float* grad, float beta1, float beta2,
+    int64_t n) {
+  const __m512 b1 = _mm512_set1_ps(beta1);
+  const __m512 b2 = _mm512_set1_ps(beta2);
+  const __m512 c1 = _mm512_set1_ps(1.0f - beta1);
+  const __m512 c2 = _mm512_set1_ps(1.0f - beta2);
+  for (int64_t i = 0; i < n; i += 16) {
+    const __mmask16 mask = i + 16 <= n ? 0xffff : TailMask(n - i);
+    __m512 g = _mm512_maskz_loadu_ps(mask, grad + i);
+    __m512 mi = _mm512_fmadd_ps(b1, _mm512_maskz_loadu_ps(mask, m + i),
+                                _mm512_mul_ps(c1, g));
+    __m512 d = _mm512_sub_ps(g, mi);
+    __m512 vi = _mm512_fmadd_ps(b2, _mm512_maskz_loadu_ps(mask, v + i),
+                                _mm512_mul_ps(_mm512_mul_ps(c2, d), d));
+    _mm512_mask_storeu_ps(m + i, mask, mi);
+    _mm512_mask_storeu_ps(v + i, mask, vi);
+  }
+}
+
+// The lanes past n are loaded as 0, the divisions and square roots are
+// masked so that they raise no floating point exceptions on them.
+__attribute__((target("avx512f"))) void AdagradAvx512(float* var,
+                                                      float* accum,
+                                                      const float* grad,
+                                                      float lr,
+                                                      bool update_accum,
+                                                      int64_t n) {
+  const __m512 rate = _mm512_set1_ps(lr);
+  for (int64_t i = 0; i < n; i += 16) {
+    const __mmask16 mask = i + 16 <= n ? 0xffff : TailMask(n - i);
+    __m512 g = _mm512_maskz_loadu_ps(mask, grad + i);
+    __m512 a = _mm512_maskz_loadu_ps(mask, accum + i);
+    if (update_accum) {
+      a = _mm512_fmadd_ps(g, g, a);
+      _mm512_mask_storeu_ps(accum + i, mask, a);
+    }
+    __m512 step = _mm512_maskz_div_ps(mask, _mm512_mul_ps(rate, g),
+                                      _mm512_maskz_sqrt_ps(mask, a));
+    _mm512_mask_storeu_ps(
+        var + i, mask,
+        _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, var + i), step));
+  }
+}
+
+__attribute__((target("avx512f"))) void FtrlLinearAvx512(float* linear,
+                                                         float* accum,
+                                                         const float* var,
+                                                         const float* grad,
+                                                         float lr,
+                                                         int64_t n) {
+  const __m512 rate = _mm512_set1_ps(lr);
+  for (int64_t i = 0; i < n; i += 16) {
+    const __mmask16 mask = i + 16 <= n ? 0xffff : TailMask(n - i);
+    __m512 g = _mm512_maskz_loadu_ps(mask, grad + i);
+    __m512 a = _mm512_maskz_loadu_ps(mask, accum + i);
+    __m512 new_a = _mm512_fmadd_ps(g, g, a);
+    __m512 sigma = _mm512_maskz_div_ps(
+        mask,
+        _mm512_sub_ps(_mm512_maskz_sqrt_ps(mask, new_a),
+                      _mm512_maskz_sqrt_ps(mask, a)),
+        rate);
+    __m512 l = _mm512_add_ps(_mm512_maskz_loadu_ps(mask, linear + i), g);
+    l = _mm512_fnmadd_ps(sigma, _mm512_maskz_loadu_ps(mask, var + i), l);
+    _mm512_mask_storeu_ps(linear + i, mask, l);
+    _mm512_mask_storeu_ps(accum + i, mask, new_a);
+  }
+}
+
+__attribute__((target("avx512f"))) void AdaptiveLinearAvx512(
+    float* linear, float* accum, const float* var, const float* m,
+    const float* v, float m_correction, float v_correction, float lr,
+    bool amsgrad, int64_t n) {
+  const __m512 rate = _mm512_set1_ps(lr);
+  const __m512 m_corr = _mm512_set1_ps(m_correction);
+  const __m512 v_corr = _mm512_set1_ps(v_correction);
+  for (int64_t i = 0; i < n; i += 16) {
+    const __mmask16 mask = i + 16 <= n ? 0xffff : TailMask(n - i);
+    __m512 a = _mm512_maskz_loadu_ps(mask, accum + i);
+    __m512 new_a =
+        _mm512_maskz_div_ps(mask, _mm512_maskz_loadu_ps(mask, v + i), v_corr);
+    if (amsgrad) {
+      new_a = _mm512_max_ps(a, new_a);
+    }
+    __m512 sigma = _mm512_maskz_div_ps(
+        mask,
+        _mm512_sub_ps(_mm512_maskz_sqrt_ps(mask, new_a),
+                      _mm512_maskz_sqrt_ps(mask, a)),
+        rate);
+    __m512 l = _mm512_add_ps(
+        _mm512_maskz_loadu_ps(mask, linear + i),
+        _mm512_maskz_div_ps(mask, _mm512_maskz_loadu_ps(mask, m + i),
+                            m_corr));
+    l = _mm512_fnmadd_ps(sigma, _mm512_maskz_loadu_ps(mask, var + i), l);
+    _mm512_mask_storeu_ps(linear + i, mask, l);
+    _mm512_mask_storeu_ps(accum + i, mask, new_a);
+  }
+}
+
+__attribute__((target("avx512f"))) void ProximalStepAvx512(
+    float* var, const float* linear, const float* accum, float lr, float l1,
+    float l2, float epsilon, float scale, int64_t n) {
+  const __m512 upper = _mm512_set1_ps(l1);
+  const __m512 lower = _mm512_set1_ps(-l1);
+  const __m512 rate = _mm512_set1_ps(lr);
+  const __m512 two_l2 = _mm512_set1_ps(2.0f * l2);
+  const __m512 eps = _mm512_set1_ps(epsilon);
+  const __m512 s = _mm512_set1_ps(scale);
+  for (int64_t i = 0; i < n; i += 16) {
+    const __mmask16 mask = i + 16 <= n ? 0xffff : TailMask(n - i);
+    __m512 l = _mm512_maskz_loadu_ps(mask, linear + i);
+    __m512 d = _mm512_sub_ps(_mm512_max_ps(_mm512_min_ps(l, upper), lower), l);
+    __m512 root =
+        _mm512_maskz_sqrt_ps(mask, _mm512_maskz_loadu_ps(mask, accum + i));
+    __m512 y = _mm512_add_ps(
+        _mm512_maskz_div_ps(mask, _mm512_add_ps(root, eps), rate), two_l2);
+    _mm512_mask_storeu_ps(var + i, mask,
+                          _mm512_maskz_div_ps(mask, _mm512_mul_ps(d, s), y));
+  }
+}
+#endif  // defined(__x86_64__)
+
+// TFPLUS_ROW_KERNELS_ISA=avx2 or scalar caps the instruction set, to compare
+// the kernels or rule them out.
+FloatKernels SelectKernels() {
+  const std::string cap = GetEnvVar<std::string>("TFPLUS_ROW_KERNELS_ISA", "");
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if (cap.empty() && __builtin_cpu_supports("avx512f")) {
+    return {"avx512",          SumSquaresAvx512,
+            ShrinkSumSquaresAvx512, AdamMomentsAvx512,
+            AdaBeliefMomentsAvx512, AdagradAvx512,
+            FtrlLinearAvx512,      AdaptiveLinearAvx512,
+            ProximalStepAvx512};
+  }
+  if ((cap.empty() || cap == "avx2") && __builtin_cpu_supports("avx2") &&
+      __builtin_cpu_supports("fma")) {
+    return {"avx2",         SumSquaresAvx2,       ShrinkSumSquaresAvx2,
+            AdamMomentsAvx2, AdaBeliefMomentsAvx2, AdagradAvx2,
+            FtrlLinearAvx2,  AdaptiveLinearAvx2,   ProximalStepAvx2};
+  }
+#endif
+  return {"scalar",          SumSquaresScalar,
+          ShrinkSumSquaresScalar, AdamMomentsScalar,
+          AdaBeliefMomentsScalar, AdagradScalar,
+          FtrlLinearScalar,      AdaptiveLinearScalar,
+          ProximalStepScalar};
+}
+
+const FloatKernels& Kernels() {
+  static const FloatKernels kernels = []() {
+    FloatKernels selected = SelectKernels();
+    LOG(INFO) << "KvVariable row kernels use " << selected.isa;
+    return selected;
+  }();
+  return kernels;
+}
+}  // namespace
+
+const char* RowKernelIsa() { return Kernels().isa; }
+
+template <>
+float RowNorm<float>(const float* x, int64_t n) {
+  return std::sqrt(Kernels().sum_squares(x, n));
+}
+
+template <>
+float GroupShrinkNorm<float>(const float* linear, float l1, int64_t n) {
+  return std::sqrt(Kernels().shrink_sum_squares(linear, l1, n));
+}
+
+template <>
+void AdamMoments<float>(float* m, float* v, const float* grad,
+                        const float* v_grad, float beta1, float beta2,
+                        int64_t n) {
+  Kernels().adam_moments(m, v, grad, v_grad, beta1, beta2, n);
+}
+
+template <>
+void AdaBeliefMoments<float>(float* m, float* v, const float* grad,
+                             float beta1, float beta2, int64_t n) {
+  Kernels().adabelief_moments(m, v, grad, beta1, beta2, n);
+}
+
+template <>
+void AdagradRow<float>(float* var, float* accum, const float* grad, float lr,
+                       bool update_accum, int64_t n) {
+  Kernels().adagrad(var, accum, grad, lr, update_accum, n);
+}
+
+template <>
+void FtrlLinear<float>(float* linear, float* accum, const float* var,
+                       const float* grad, float lr, int64_t n) {
+  Kernels().ftrl_linear(linear, accum, var, grad, lr, n);
+}
+
+template <>
+void AdaptiveLinear<float>(float* linear, float* accum, const float* var,
+                           const float* m, const float* v,
+                           float m_correction, float v_correction, float lr,
+                           bool amsgrad, int64_t n) {
+  Kernels().adaptive_linear(linear, accum, var, m, v, m_correction,
+                            v_correction, lr, amsgrad, n);
+}
+
+template <>
+void ProximalStep<float>(float* var, const float* linear, const float* accum,
+                         float lr, float l1, float l2, float epsilon,
+                         float scale, int64_t n) {
+  Kernels().proximal_step(var, linear, accum, lr, l1, l2, epsilon, scale, n);
+}
+
+}  // namespace tfplus
@@ -0,0 +1,191 @@
+// Copyright 2023 The TFPlus Authors. All rights reserved.
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TFPLUS_KV_VARIABLE_KERNELS_ROW_KERNELS_H_
+#define TFPLUS_KV_VARIABLE_KERNELS_ROW_KERNELS_H_
+
+#include <cstdint>
+
+#include "tensorflow/core/framework/numeric_types.h"
+
+namespace tfplus {
+
+// Fused kernels over one embedding row that the sparse optimizers share.
+// The float kernels are vectorized with AVX2 or AVX-512, whichever the CPU
+// supports, see row_kernels.cc, the other types run the loops below. Unlike
+// an Eigen reduction into a Tensor<T, 0> they allocate nothing per key.
+//
+// Adagrad, AMSGrad and AdaBelief run their whole row update with them, Ftrl
+// and group Ftrl when lr_power is -0.5 and there is no l2 shrinkage. The
+// other Ftrl steps, the bias corrections of RectifiedAdam and the group
+// lasso step of the other Adam variants are still Eigen expressions.
+
+// Instruction set the float kernels run with, "avx512", "avx2" or "scalar".
+const char* RowKernelIsa();
+
+// sqrt(sum(x^2)).
+template <typename T>
+T RowNorm(const T* x, int64_t n) {
+  T sum = static_cast<T>(0);
+  for (int64_t i = 0; i < n; ++i) {
+    sum += x[i] * x[i];
+  }
+  return Eigen::numext::sqrt(sum);
+}
+
+// Norm of the group lasso step of linear, clamp(linear, -l1, l1) - linear,
+// without materializing it.
+template <typename T>
+T GroupShrinkNorm(const T* linear, T l1, int64_t n) {
+  T sum = static_cast<T>(0);
+  for (int64_t i = 0; i < n; ++i) {
+    T clamped = linear[i] < -l1 ? -l1 : (linear[i] > l1 ? l1 : linear[i]);
+    T d = clamped - linear[i];
+    sum += d * d;
+  }
+  return Eigen::numext::sqrt(sum);
+}
+
+// The Adam moments, m = beta1 * m + (1 - beta1) * grad and
+// v = beta2 * v + (1 - beta2) * v_grad^2. v_grad is grad for Adam and the
+// Hessian diagonal for AdaHessian.
+template <typename T>
+void AdamMoments(T* m, T* v, const T* grad, const T* v_grad, T beta1,
+                 T beta2, int64_t n) {
+  const T one_minus_beta1 = static_cast<T>(1) - beta1;
+  const T one_minus_beta2 = static_cast<T>(1) - beta2;
+  for (int64_t i = 0; i < n; ++i) {
+    m[i] = beta1 * m[i] + one_minus_beta1 * grad[i];
+    v[i] = beta2 * v[i] + one_minus_beta2 * v_grad[i] * v_grad[i];
+  }
+}
+
+// The AdaBelief moments, m = beta1 * m + (1 - beta1) * grad and
+// v = beta2 * v + (1 - beta2) * (grad - m)^2 with the new m.
+template <typename T>
+void AdaBeliefMoments(T* m, T* v, const T* grad, T beta1, T beta2,
+                      int64_t n) {
+  const T one_minus_beta1 = static_cast<T>(1) - beta1;
+  const T one_minus_beta2 = static_cast<T>(1) - beta2;
+  for (int64_t i = 0; i < n; ++i) {
+    m[i] = beta1 * m[i] + one_minus_beta1 * grad[i];
+    const T belief = grad[i] - m[i];
+    v[i] = beta2 * v[i] + one_minus_beta2 * belief * belief;
+  }
+}
+
+// The Adagrad step, accum += grad^2 when update_accum, then
+// var -= lr * grad / sqrt(accum).
+template <typename T>
+void AdagradRow(T* var, T* accum, const T* grad, T lr, bool update_accum,
+                int64_t n) {
+  for (int64_t i = 0; i < n; ++i) {
+    if (update_accum) {
+      accum[i] += grad[i] * grad[i];
+    }
+    var[i] -= lr * grad[i] / Eigen::numext::sqrt(accum[i]);
+  }
+}
+
+// The linear step of Ftrl with lr_power -0.5,
+// linear += grad - (sqrt(accum + grad^2) - sqrt(accum)) / lr * var, then
+// accum += grad^2.
+template <typename T>
+void FtrlLinear(T* linear, T* accum, const T* var, const T* grad, T lr,
+                int64_t n) {
+  for (int64_t i = 0; i < n; ++i) {
+    const T new_accum = accum[i] + grad[i] * grad[i];
+    linear[i] += grad[i] - (Eigen::numext::sqrt(new_accum) -
+                            Eigen::numext::sqrt(accum[i])) /
+                               lr * var[i];
+    accum[i] = new_accum;
+  }
+}
+
+// The linear step of the group lasso Adam optimizers on the moments.
+// accum' = v / v_correction, or max(accum, v / v_correction) for AMSGrad,
+// linear += m / m_correction - (sqrt(accum') - sqrt(accum)) / lr * var,
+// then accum = accum'.
+template <typename T>
+void AdaptiveLinear(T* linear, T* accum, const T* var, const T* m,
+                    const T* v, T m_correction, T v_correction, T lr,
+                    bool amsgrad, int64_t n) {
+  for (int64_t i = 0; i < n; ++i) {
+    T new_accum = v[i] / v_correction;
+    if (amsgrad && accum[i] > new_accum) {
+      new_accum = accum[i];
+    }
+    linear[i] += m[i] / m_correction - (Eigen::numext::sqrt(new_accum) -
+                                        Eigen::numext::sqrt(accum[i])) /
+                                           lr * var[i];
+    accum[i] = new_accum;
+  }
+}
+
+// The proximal step of Ftrl and the group lasso optimizers,
+// var = (clamp(linear, -l1, l1) - linear) * scale /
+//       ((sqrt(accum) + epsilon) / lr + 2 * l2).
+template <typename T>
+void ProximalStep(T* var, const T* linear, const T* accum, T lr, T l1, T l2,
+                  T epsilon, T scale, int64_t n) {
+  const T two_l2 = static_cast<T>(2) * l2;
+  for (int64_t i = 0; i < n; ++i) {
+    T clamped = linear[i] < -l1 ? -l1 : (linear[i] > l1 ? l1 : linear[i]);
+    var[i] = (clamped - linear[i]) * scale /
+             ((Eigen::numext::sqrt(accum[i]) + epsilon) / lr + two_l2);
+  }
+}
+
+template <>
+float RowNorm<float>(const float* x, int64_t n);
+template <>
+float GroupShrinkNorm<float>(const float* linear, float l1, int64_t n);
+template <>
+void AdamMoments<float>(float* m, float* v, const float* grad,
+                        const float* v_grad, float beta1, float beta2,
+                        int64_t n);
+template <>
+void AdaBeliefMoments<float>(float* m, float* v, const float* grad,
+                             float beta1, float beta2, int64_t n);
+template <>
+void AdagradRow<float>(float* var, float* accum, const float* grad, float lr,
+                       bool update_accum, int64_t n);
+template <>
+void FtrlLinear<float>(float* linear, float* accum, const float* var,
+                       const float* grad, float lr, int64_t n);
+template <>
+void AdaptiveLinear<float>(float* linear, float* accum, const float* var,
+                           const float* m, const float* v,
+                           float m_correction, float v_correction, float lr,
+                           bool amsgrad, int64_t n);
+template <>
+void ProximalStep<float>(float* var, const float* linear, const float* accum,
+                         float lr, float l1, float l2, float epsilon,
+                         float scale, int64_t n);
+
+// ProximalStep() scaled by 1 - l21_norm / GroupShrinkNorm(), the group lasso
+// step. Returns false and leaves var as is when the group is shrunk to zero.
+template <typename T>
+bool GroupProximalStep(T* var, const T* linear, const T* accum, T lr, T l1,
+                       T l2, T epsilon, T l21_norm, int64_t n) {
+  const T norm = GroupShrinkNorm(linear, l1, n);
+  if (norm <= l21_norm) {
+    return false;
+  }
+  ProximalStep(var, linear, accum, lr, l1, l2, epsilon,
+               static_cast<T>(1) - l21_norm / norm, n);
+  return true;
+}
+
+}  // namespace tfplus
+#endif  // TFPLUS_KV_VARIABLE_KERNELS_ROW_KERNELS_H_
@@ -0,0 +1,180 @@
+// Copyright 2023 The TFPlus Authors. All rights reserved.
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tfplus/kv_variable/kernels/shared_memory.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#include "tensorflow/core/lib/core/errors.h"
+#include "tensorflow/core/lib/hash/hash.h"
+#include "tensorflow/core/platform/logging.h"
+#include "tfplus/kv_variable/kernels/utility.h"
+
+namespace tfplus {
+namespace {
+::tensorflow::Status ErrnoError(const std::string& what,
+                                const std::string& name) {
+  const int error = errno;
+  const std::string message =
+      what + " " + name + ": " + std::strerror(error);
+  if (error == ENOENT) {
+    return ::tensorflow::errors::NotFound(message);
+  }
+  return ::tensorflow::errors::Internal(message);
+}
+
+::tensorflow::Status Map(int fd, const std::string& name, size_t size,
+                         bool writable, void** data) {
+  const int prot = writable ? PROT_READ | PROT_WRITE : PROT_READ;
+  *data = mmap(nullptr, size, prot, MAP_SHARED, fd, 0);
+  if (*data == MAP_FAILED) {
+    return ErrnoError("Failed to map shared memory", name);
+  }
+  return ::tensorflow::OkStatus();
+}
+}  // namespace
+
+::tensorflow::Status SharedMemory::Create(const std::string& name,
+                                          size_t size,
+                                          std::unique_ptr<SharedMemory>* out) {
+  shm_unlink(name.c_str());
+  const int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+  if (fd < 0) {
+    return ErrnoError("Failed to create shared memory", name);
+  }
+  void* data = nullptr;
+  ::tensorflow::Status status;
+  if (ftruncate(fd, size) != 0) {
+    status = ErrnoError("Failed to size shared memory", name);
+  } else {
+    status = Map(fd, name, size, true, &data);
+  }
+  close(fd);
+  if (!status.ok()) {
+    shm_unlink(name.c_str());
+    return status;
+  }
+  out->reset(new SharedMemory(name, data, size));
+  return ::tensorflow::OkStatus();
+}
+
+::tensorflow::Status SharedMemory::Open(const std::string& name, bool writable,
+                                        std::unique_ptr<SharedMemory>* out) {
+  const int fd = shm_open(name.c_str(), writable ? O_RDWR : O_RDONLY, 0);
+  if (fd < 0) {
+    return ErrnoError("Failed to open shared memory", name);
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    ::tensorflow::Status status = ErrnoError("Failed to stat", name);
+    close(fd);
+    return status;
+  }
+  void* data = nullptr;
+  ::tensorflow::Status status =
+      st.st_size > 0
+          ? Map(fd, name, st.st_size, writable, &data)
+          : ::tensorflow::errors::Unavailable("Shared memory ", name,
+                                              " is empty");
+  close(fd);
+  TF_RETURN_IF_ERROR(status);
+  out->reset(new SharedMemory(name, data, st.st_size));
+  return ::tensorflow::OkStatus();
+}
+
+void SharedMemory::Unlink(const std::string& name) {
+  shm_unlink(name.c_str());
+}
+
+SharedMemory::~SharedMemory() { munmap(data_, size_); }
+
+::tensorflow::Status SharedTableVersion::Open(
+    const std::string& name, bool create,
+    std::unique_ptr<SharedTableVersion>* out) {
+  std::unique_ptr<SharedMemory> memory;
+  if (create) {
+    // Keep the versions of an existing object, readers that map an older
+    // version then see the next one as new.
+    const int fd = shm_open(name.c_str(), O_CREAT | O_RDWR, 0644);
+    if (fd < 0) {
+      return ErrnoError("Failed to create shared memory", name);
+    }
+    struct stat st;
+    const bool sized = fstat(fd, &st) == 0 &&
+                       (st.st_size >= static_cast<off_t>(sizeof(Header)) ||
+                        ftruncate(fd, sizeof(Header)) == 0);
+    close(fd);
+    if (!sized) {
+      return ErrnoError("Failed to size shared memory", name);
+    }
+    TF_RETURN_IF_ERROR(SharedMemory::Open(name, true, &memory));
+    auto* header = static_cast<Header*>(memory->data());
+    if (header->magic != kMagic) {
+      header->version.store(0, std::memory_order_relaxed);
+      header->magic = kMagic;
+    }
+  } else {
+    ::tensorflow::Status status = SharedMemory::Open(name, false, &memory);
+    if (::tensorflow::errors::IsNotFound(status)) {
+      return ::tensorflow::errors::Unavailable("No table is shared as ", name,
+                                               " yet");
+    }
+    TF_RETURN_IF_ERROR(status);
+    if (memory->size() < sizeof(Header) ||
+        static_cast<const Header*>(memory->data())->magic != kMagic) {
+      return ::tensorflow::errors::Unavailable("Table ", name,
+                                               " is not shared yet");
+    }
+  }
+  out->reset(new SharedTableVersion(name, std::move(memory)));
+  return ::tensorflow::OkStatus();
+}
+
+SharedTableRole GetSharedTableRole() {
+  static const SharedTableRole role = []() {
+    const std::string value =
+        GetEnvVar<std::string>("TFPLUS_KV_SHARED_TABLE", "");
+    if (value == "loader") {
+      return SharedTableRole::kLoader;
+    }
+    if (value == "reader") {
+      return SharedTableRole::kReader;
+    }
+    if (!value.empty()) {
+      LOG(WARNING) << "Unknown TFPLUS_KV_SHARED_TABLE " << value
+                   << ", expected loader or reader";
+    }
+    return SharedTableRole::kNone;
+  }();
+  return role;
+}
+
+std::string SharedTableName(const std::string& variable_name) {
+  static const std::string prefix =
+      GetEnvVar<std::string>("TFPLUS_KV_SHARED_TABLE_PREFIX", "tfplus_kv");
+  // Variable names hold '/', which shm names can not.
+  char hash[17];
+  snprintf(hash, sizeof(hash), "%016llx",
+           static_cast<unsigned long long>(  // NOLINT(runtime/int)
+               ::tensorflow::Hash64(variable_name)));
+  return "/" + prefix + "_" + hash;
+}
+
+}  // namespace tfplus
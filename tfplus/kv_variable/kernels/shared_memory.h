@@ -0,0 +1,116 @@
+// Copyright 2023 The TFPlus Authors. All rights reserved.
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TFPLUS_KV_VARIABLE_KERNELS_SHARED_MEMORY_H_
+#define TFPLUS_KV_VARIABLE_KERNELS_SHARED_MEMORY_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "tensorflow/core/lib/core/status.h"
+
+namespace tfplus {
+
+// A POSIX shared memory object mapped into this process, see shm_open(3).
+// Names start with '/' and hold no other '/'. A mapping stays valid after
+// the object is unlinked, the memory is freed once the last process unmaps
+// it.
+class SharedMemory {
+ public:
+  // Creates the object name of size bytes mapped read-write, replacing a
+  // stale object of the same name.
+  static ::tensorflow::Status Create(const std::string& name, size_t size,
+                                     std::unique_ptr<SharedMemory>* out);
+
+  // Maps the existing object name, read-only unless writable.
+  static ::tensorflow::Status Open(const std::string& name, bool writable,
+                                   std::unique_ptr<SharedMemory>* out);
+
+  static void Unlink(const std::string& name);
+
+  SharedMemory(const SharedMemory&) = delete;
+  SharedMemory& operator=(const SharedMemory&) = delete;
+  // Unmaps the object, its owner makes sure no thread still reads it, see
+  // FrozenTableReaders.
+  ~SharedMemory();
+
+  void* data() const { return data_; }
+  size_t size() const { return size_; }
+  const std::string& name() const { return name_; }
+
+ private:
+  SharedMemory(std::string name, void* data, size_t size)
+      : name_(std::move(name)), data_(data), size_(size) {}
+
+  const std::string name_;
+  void* const data_;
+  const size_t size_;
+};
+
+// Version of a shared table that its loader published last, kept in an
+// object of its own named after the table. Version v of the rows lives in
+// SegmentName(v), the loader writes it before it publishes v and unlinks
+// the previous version after, readers that still map it are not affected.
+class SharedTableVersion {
+ public:
+  // The loader creates the object, readers fail with Unavailable until it
+  // exists.
+  static ::tensorflow::Status Open(const std::string& name, bool create,
+                                   std::unique_ptr<SharedTableVersion>* out);
+
+  // 0 before the first version is published.
+  uint64_t Load() const {
+    return header()->version.load(std::memory_order_acquire);
+  }
+
+  void Publish(uint64_t version) {
+    header()->version.store(version, std::memory_order_release);
+  }
+
+  std::string SegmentName(uint64_t version) const {
+    return name_ + "_v" + std::to_string(version);
+  }
+
+ private:
+  struct Header {
+    uint64_t magic;
+    std::atomic<uint64_t> version;
+  };
+  static constexpr uint64_t kMagic = 0x7466706c75737476ULL;
+
+  SharedTableVersion(std::string name, std::unique_ptr<SharedMemory> memory)
+      : name_(std::move(name)), memory_(std::move(memory)) {}
+
+  Header* header() const { return static_cast<Header*>(memory_->data()); }
+
+  const std::string name_;
+  std::unique_ptr<SharedMemory> memory_;
+};
+
+// Role of this process for the tables shared by the inference processes of
+// a host, set by TFPLUS_KV_SHARED_TABLE=loader or reader. The loader
+// publishes the frozen table of each variable it imports, the readers map
+// it instead of holding the rows, see KvVariable::FreezeTable().
+enum class SharedTableRole { kNone, kLoader, kReader };
+SharedTableRole GetSharedTableRole();
+
+// Name of the objects holding variable_name, under the prefix
+// TFPLUS_KV_SHARED_TABLE_PREFIX so that several models can share a host.
+std::string SharedTableName(const std::string& variable_name);
+
+}  // namespace tfplus
+#endif  // TFPLUS_KV_VARIABLE_KERNELS_SHARED_MEMORY_H_
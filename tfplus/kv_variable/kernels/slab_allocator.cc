@@ -0,0 +1,227 @@
+// Copyright 2023 The TFPlus Authors. All rights reserved.
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tfplus/kv_variable/kernels/slab_allocator.h"
+
+#include <algorithm>
+#include <cstdint>
+
+#include "tensorflow/core/framework/allocator.h"
+#include "tensorflow/core/platform/logging.h"
+#include "tensorflow/core/platform/mem.h"
+#include "tfplus/kv_variable/kernels/numa.h"
+
+namespace tfplus {
+namespace {
+constexpr size_t kSlabBytes = 2 << 20;
+constexpr size_t kRowAlignment = 16;
+constexpr size_t kMinRowsPerSlab = 64;
+// User space addresses fit in 47 bits, the registry maps each kSlabBytes
+// region of them to the allocator owning it with a two level table of
+// atomics, so a row is routed back to its allocator without a lock.
+constexpr int kAddressBits = 47;
+constexpr int kRegionBits = 21;
+constexpr int kLeafBits = 13;
+constexpr size_t kNumLeaves = size_t{1}
+                              << (kAddressBits - kRegionBits - kLeafBits);
+constexpr size_t kLeafSize = size_t{1} << kLeafBits;
+static_assert(kSlabBytes == size_t{1} << kRegionBits,
+              "registry regions must match the slab alignment");
+
+using RegistryLeaf = std::atomic<SlabAllocator*>;
+
+// Leaves are created on first use and never freed, each one covers 16GB of
+// address space.
+std::atomic<RegistryLeaf*>* Registry() {
+  static auto* leaves = new std::atomic<RegistryLeaf*>[kNumLeaves]();
+  return leaves;
+}
+
+std::atomic<size_t> num_registered_slabs{0};
+
+// Entry of the region holding base, null for an address no slab can have
+// unless create is set.
+RegistryLeaf* RegistryEntry(uintptr_t base, bool create) {
+  const uintptr_t region = base >> kRegionBits;
+  const uintptr_t leaf_index = region >> kLeafBits;
+  if (leaf_index >= kNumLeaves) {
+    return nullptr;
+  }
+  std::atomic<RegistryLeaf*>& slot = Registry()[leaf_index];
+  RegistryLeaf* leaf = slot.load(std::memory_order_acquire);
+  if (leaf == nullptr) {
+    if (!create) {
+      return nullptr;
+    }
+    auto* new_leaf = new RegistryLeaf[kLeafSize]();
+    if (slot.compare_exchange_strong(leaf, new_leaf,
+                                     std::memory_order_acq_rel)) {
+      leaf = new_leaf;
+    } else {
+      delete[] new_leaf;
+    }
+  }
+  return &leaf[region & (kLeafSize - 1)];
+}
+
+void RegisterSlab(char* slab, size_t bytes, SlabAllocator* owner) {
+  for (size_t offset = 0; offset < bytes; offset += kSlabBytes) {
+    RegistryLeaf* entry =
+        RegistryEntry(reinterpret_cast<uintptr_t>(slab + offset), true);
+    if (entry == nullptr) {
+      LOG(FATAL) << "SlabAllocator got a slab above the " << kAddressBits
+                 << " bit address space";
+    }
+    entry->store(owner, std::memory_order_release);
+  }
+  num_registered_slabs.fetch_add(1, std::memory_order_relaxed);
+}
+
+void UnregisterSlab(char* slab, size_t bytes) {
+  for (size_t offset = 0; offset < bytes; offset += kSlabBytes) {
+    RegistryEntry(reinterpret_cast<uintptr_t>(slab + offset), false)
+        ->store(nullptr, std::memory_order_release);
+  }
+  num_registered_slabs.fetch_sub(1, std::memory_order_relaxed);
+}
+
+SlabAllocator* FindOwner(void* ptr) {
+  if (num_registered_slabs.load(std::memory_order_relaxed) == 0) {
+    return nullptr;
+  }
+  RegistryLeaf* entry =
+      RegistryEntry(reinterpret_cast<uintptr_t>(ptr), false);
+  return entry == nullptr ? nullptr : entry->load(std::memory_order_acquire);
+}
+
+size_t RowStride(size_t row_bytes) {
+  size_t stride = std::max(row_bytes, sizeof(void*));
+  return (stride + kRowAlignment - 1) & ~(kRowAlignment - 1);
+}
+
+size_t SlabBytesFor(size_t stride) {
+  size_t bytes = std::max(kSlabBytes, stride * kMinRowsPerSlab);
+  return (bytes + kSlabBytes - 1) & ~(kSlabBytes - 1);
+}
+
+inline void*& NextOf(void* row) { return *reinterpret_cast<void**>(row); }
+}  // namespace
+
+SlabAllocator::SlabAllocator(size_t row_bytes, int numa_node)
+    : row_bytes_(row_bytes),
+      stride_(RowStride(row_bytes)),
+      slab_bytes_(SlabBytesFor(stride_)),
+      numa_node_(numa_node) {}
+
+SlabAllocator::~SlabAllocator() {
+  for (char* slab : slabs_) {
+    UnregisterSlab(slab, slab_bytes_);
+    ::tensorflow::port::AlignedFree(slab);
+  }
+}
+
+int SlabAllocator::ThreadFreeList() {
+  static std::atomic<int> next_thread{0};
+  thread_local int index =
+      next_thread.fetch_add(1, std::memory_order_relaxed) % kNumFreeLists;
+  return index;
+}
+
+void* SlabAllocator::PopLocked(FreeList* list) {
+  void* row = list->head;
+  if (row != nullptr) {
+    list->head = NextOf(row);
+    num_free_rows_.fetch_sub(1, std::memory_order_relaxed);
+  }
+  return row;
+}
+
+void* SlabAllocator::StealFromOtherLists(int self) {
+  for (int i = 1; i < kNumFreeLists; ++i) {
+    if (num_free_rows_.load(std::memory_order_relaxed) == 0) {
+      return nullptr;
+    }
+    FreeList& list = free_lists_[(self + i) % kNumFreeLists];
+    tfplus_spin_lock l(list.mu, true, std::try_to_lock);
+    if (!l) continue;
+    void* row = PopLocked(&list);
+    if (row != nullptr) return row;
+  }
+  return nullptr;
+}
+
+void* SlabAllocator::CarveRow() {
+  tfplus_spin_lock l(slab_mu_);
+  if (cursor_ == nullptr || cursor_ + stride_ > slab_end_) {
+    char* slab = static_cast<char*>(
+        ::tensorflow::port::AlignedMalloc(slab_bytes_, kSlabBytes));
+    if (slab == nullptr) {
+      LOG(FATAL) << "SlabAllocator failed to allocate " << slab_bytes_
+                 << " bytes";
+    }
+    if (numa_node_ >= 0 && !BindMemoryToNode(slab, slab_bytes_, numa_node_)) {
+      LOG_FIRST_N(WARNING, 1) << "Failed to bind row slabs to NUMA node "
+                              << numa_node_;
+    }
+    RegisterSlab(slab, slab_bytes_, this);
+    slabs_.push_back(slab);
+    num_slabs_.fetch_add(1, std::memory_order_relaxed);
+    cursor_ = slab;
+    slab_end_ = slab + slab_bytes_;
+  }
+  void* row = cursor_;
+  cursor_ += stride_;
+  carved_rows_.fetch_add(1, std::memory_order_relaxed);
+  return row;
+}
+
+void* SlabAllocator::Allocate() {
+  int self = ThreadFreeList();
+  if (num_free_rows_.load(std::memory_order_relaxed) > 0) {
+    {
+      FreeList& list = free_lists_[self];
+      tfplus_spin_lock l(list.mu);
+      void* row = PopLocked(&list);
+      if (row != nullptr) return row;
+    }
+    void* row = StealFromOtherLists(self);
+    if (row != nullptr) return row;
+  }
+  return CarveRow();
+}
+
+void SlabAllocator::Deallocate(void* row) {
+  FreeList& list = free_lists_[ThreadFreeList()];
+  tfplus_spin_lock l(list.mu);
+  NextOf(row) = list.head;
+  list.head = row;
+  num_free_rows_.fetch_add(1, std::memory_order_relaxed);
+}
+
+size_t SlabAllocator::InUseBytes() const {
+  size_t carved = carved_rows_.load(std::memory_order_relaxed);
+  size_t free_rows = num_free_rows_.load(std::memory_order_relaxed);
+  return carved > free_rows ? (carved - free_rows) * stride_ : 0;
+}
+
+void DeallocateEmbedding(void* ptr) {
+  if (ptr == nullptr) return;
+  SlabAllocator* owner = FindOwner(ptr);
+  if (owner != nullptr) {
+    owner->Deallocate(ptr);
+  } else {
+    ::tensorflow::cpu_allocator()->DeallocateRaw(ptr);
+  }
+}
+
+}  // namespace tfplus
@@ -0,0 +1,103 @@
+// Copyright 2023 The TFPlus Authors. All rights reserved.
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TFPLUS_KV_VARIABLE_KERNELS_SLAB_ALLOCATOR_H_
+#define TFPLUS_KV_VARIABLE_KERNELS_SLAB_ALLOCATOR_H_
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+#include "tfplus/kv_variable/kernels/mutex.h"
+
+namespace tfplus {
+
+// Fixed size allocator for embedding rows. Rows are carved from 2MB aligned
+// slabs and freed rows are kept on per-thread free lists for reuse, so the
+// steady state of insert/delete does not touch the global allocator.
+//
+// Every slab is recorded in a process wide, lock free registry, which lets
+// DeallocateEmbedding() route a row pointer back to its owner without any
+// per-row header. Slabs are only returned to the system when the allocator
+// is destroyed, all rows must be released or abandoned before that.
+//
+// With a numa_node, see NumaTopology, the pages of every slab are bound to
+// that node before any row is carved from it.
+class SlabAllocator {
+ public:
+  explicit SlabAllocator(size_t row_bytes, int numa_node = -1);
+  ~SlabAllocator();
+
+  SlabAllocator(const SlabAllocator&) = delete;
+  SlabAllocator& operator=(const SlabAllocator&) = delete;
+
+  void* Allocate();
+
+  void Deallocate(void* row);
+
+  size_t row_bytes() const { return row_bytes_; }
+
+  int numa_node() const { return numa_node_; }
+
+  // Bytes reserved for slabs, free rows included.
+  size_t AllocatedBytes() const {
+    return num_slabs_.load(std::memory_order_relaxed) * slab_bytes_;
+  }
+
+  // Bytes of the rows currently handed out.
+  size_t InUseBytes() const;
+
+  size_t NumFreeRows() const {
+    return num_free_rows_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  static constexpr int kNumFreeLists = 64;
+
+  struct alignas(64) FreeList {
+    spin_rw_mutex mu;
+    void* head = nullptr;
+  };
+
+  // Index of the free list owned by the calling thread.
+  static int ThreadFreeList();
+
+  void* PopLocked(FreeList* list);
+  void* StealFromOtherLists(int self);
+  void* CarveRow();
+
+  const size_t row_bytes_;
+  const size_t stride_;
+  const size_t slab_bytes_;
+  const int numa_node_;
+
+  FreeList free_lists_[kNumFreeLists];
+  std::atomic<size_t> num_free_rows_{0};
+
+  // Guards the slab being carved and the slab list.
+  spin_rw_mutex slab_mu_;
+  std::vector<char*> slabs_;
+  char* cursor_ = nullptr;
+  char* slab_end_ = nullptr;
+  std::atomic<size_t> num_slabs_{0};
+  std::atomic<size_t> carved_rows_{0};
+};
+
+// Releases an embedding buffer. Rows from a SlabAllocator go back to their
+// allocator, anything else was allocated by AllocateRaw() and is returned to
+// the cpu allocator.
+void DeallocateEmbedding(void* ptr);
+
+}  // namespace tfplus
+
+#endif  // TFPLUS_KV_VARIABLE_KERNELS_SLAB_ALLOCATOR_H_
@@ -24,8 +24,11 @@
 #include "tensorflow/core/lib/core/refcount.h"
 #include "tensorflow/core/util/work_sharder.h"
 #include "tensorflow/core/kernels/dense_update_functor.h"
+#include "tfplus/kv_variable/kernels/index_order.h"
 #include "tfplus/kv_variable/kernels/kv_variable.h"
 #include "tfplus/kv_variable/kernels/kv_variable_interface.h"
+#include "tfplus/kv_variable/kernels/row_kernels.h"
+#include "tfplus/kv_variable/kernels/unique_keys.h"
 #include "tfplus/kv_variable/kernels/utility.h"
 
 namespace {
@@ -143,40 +146,34 @@ VariableInputLockHolder MaybeLockVariableInputMutexesInOrder(
   }
   std::vector<ResourceBase*> vars;
   std::vector<tf_mutex*> mutexes;
-  std::vector<int> acquire_order;
   for (auto input : input_ids) {
     ResourceBase* var;
     tf_mutex* mutex = GetTrainingVariableMutex(ctx, input, sparse, &var);
     if (var) {
       vars.push_back(var);
     }
-    // Only lock each mutex once if duplicates exist (n^2 but n is 2 or 3).
-    if (std::find(mutexes.begin(), mutexes.end(), mutex) == mutexes.end()) {
-      acquire_order.push_back(mutexes.size());
+    if (mutex != nullptr) {
       mutexes.push_back(mutex);
     }
   }
-  std::sort(acquire_order.begin(), acquire_order.end(),
-            [&mutexes](int a, int b) { return mutexes[a] < mutexes[b]; });
+  // Only lock each mutex once if duplicates exist, the Batch* apply ops take
+  // hundreds of them.
+  std::sort(mutexes.begin(), mutexes.end());
+  mutexes.erase(std::unique(mutexes.begin(), mutexes.end()), mutexes.end());
 
   auto locks = absl::make_unique<std::vector<mutex_lock>>();
   auto shared_locks = absl::make_unique<std::vector<tf_shared_lock>>();
   if (!sparse || do_lock) {
-    locks->reserve(acquire_order.size());
+    locks->reserve(mutexes.size());
   } else {
-    shared_locks->reserve(acquire_order.size());
+    shared_locks->reserve(mutexes.size());
   }
 
-  for (auto input : acquire_order) {
-    ResourceBase* var;
-    tf_mutex* mu = GetTrainingVariableMutex(ctx, input, sparse, &var);
-    core::ScopedUnref scoped_unref(var);
-    if (mu != nullptr) {
-      if (!sparse || do_lock) {
-        locks->emplace_back(*static_cast<tf_mutex*>(mu));
-      } else {
-        shared_locks->emplace_back(*static_cast<tf_mutex*>(mu));
-      }
+  for (tf_mutex* mu : mutexes) {
+    if (!sparse || do_lock) {
+      locks->emplace_back(*mu);
+    } else {
+      shared_locks->emplace_back(*mu);
     }
   }
   return VariableInputLockHolder(std::move(vars), std::move(locks),
@@ -208,6 +205,126 @@ typename ::tensorflow::TTypes<T>::Tensor GetFlat(KvVariableInterface* table,
   return FlatVector<T>(var_context.Value(), num_elements);
 }
 
+// The moment decay of a key that missed steps, with TFPLUS_KV_LAZY_DECAY on
+// the variable of a sparse Adam op. A key updated at step t after its last
+// update at step t - g missed g - 1 steps, its moments are decayed in closed
+// form, m *= beta1^(g - 1) and v *= beta2^(g - 1), as if it had been updated
+// with zero gradients, before the update of step t. The rows of the keys
+// that are not updated are never touched. The step is the global_step input
+// of the op, read before the optimizer increments it, an op without one
+// does not decay.
+template <typename T, typename Tindex>
+class LazyDecay {
+ public:
+  LazyDecay(OpKernelContext* ctx, KvVariableInterface* table_var, T beta1,
+            T beta2)
+      : var_(static_cast<KvVariable<Tindex, T>*>(table_var)),
+        step_(var_->lazy_decay() ? GlobalStep(ctx) : 0),
+        beta1_(beta1),
+        beta2_(beta2) {}
+
+  // Decays the rows m and v of key, under its lock.
+  void Apply(const Tindex& key, T* m, T* v, int64_t dim) const {
+    if (step_ == 0) {
+      return;
+    }
+    const uint32_t missed = var_->TouchStepUnsafe(key, step_);
+    if (missed == 0) {
+      return;
+    }
+    const T m_decay = Eigen::numext::pow(beta1_, static_cast<T>(missed));
+    const T v_decay = Eigen::numext::pow(beta2_, static_cast<T>(missed));
+    for (int64_t d = 0; d < dim; ++d) {
+      m[d] *= m_decay;
+      v[d] *= v_decay;
+    }
+  }
+
+ private:
+  // Steps count from 1 so that 0 stands for no update, a key updated at
+  // global step 0 records step 1.
+  static uint32_t GlobalStep(OpKernelContext* ctx) {
+    OpInputList global_step;
+    if (!ctx->input_list("global_step", &global_step).ok() ||
+        global_step.size() != 1 || global_step[0].NumElements() != 1) {
+      return 0;
+    }
+    const int64 step = global_step[0].flat<int64>()(0);
+    return step < 0 ? 0
+                    : static_cast<uint32_t>(std::min<int64>(
+                          step + 1, std::numeric_limits<uint32_t>::max()));
+  }
+
+  KvVariable<Tindex, T>* var_;
+  uint32_t step_;
+  T beta1_;
+  T beta2_;
+};
+
+// With TFPLUS_KV_DEDUP_KEYS on table, replaces indices by its distinct keys
+// and each tensor of rows, e.g. grad, by the sums of the rows of every key,
+// so that a key is updated once. Inputs of mismatching shapes are left as
+// they are for the op to reject.
+template <typename T, typename Tindex>
+Status MaybeSumDuplicateRows(OpKernelContext* ctx, KvVariableInterface* table,
+                             Tensor* indices,
+                             std::initializer_list<Tensor*> rows) {
+  if (!static_cast<KvVariable<Tindex, T>*>(table)->dedup_keys() ||
+      !TensorShapeUtils::IsVector(indices->shape())) {
+    return OkStatus();
+  }
+  const int64_t n = indices->dim_size(0);
+  for (const Tensor* row : rows) {
+    if (row->dims() < 1 || row->dim_size(0) != n) {
+      return OkStatus();
+    }
+  }
+  const auto indices_flat = indices->flat<Tindex>();
+  UniqueKeys<Tindex> unique(
+      ctx, n, [&indices_flat](int64_t i) { return indices_flat(i); },
+      [](int64_t) { return false; });
+  if (!unique.has_duplicates()) {
+    return OkStatus();
+  }
+  Tensor unique_indices;
+  TF_RETURN_IF_ERROR(ctx->allocate_temp(
+      indices->dtype(), TensorShape({unique.size()}), &unique_indices));
+  auto unique_flat = unique_indices.flat<Tindex>();
+  for (int64_t u = 0; u < unique.size(); ++u) {
+    unique_flat(u) = indices_flat(unique.first(u));
+  }
+  for (Tensor* row : rows) {
+    TensorShape shape = row->shape();
+    shape.set_dim(0, unique.size());
+    Tensor summed;
+    TF_RETURN_IF_ERROR(ctx->allocate_temp(row->dtype(), shape, &summed));
+    const int64_t dim = row->NumElements() / n;
+    const T* src = row->flat<T>().data();
+    T* dst = summed.flat<T>().data();
+    unique.ForEachPosition(dim, [&unique, src, dst, dim](int64_t i,
+                                                         int64_t u) {
+      const T* from = src + i * dim;
+      T* to = dst + u * dim;
+      if (i == unique.first(u)) {
+        std::copy_n(from, dim, to);
+      } else {
+        for (int64_t d = 0; d < dim; ++d) to[d] += from[d];
+      }
+    });
+    *row = summed;
+  }
+  *indices = unique_indices;
+  return OkStatus();
+}
+
+// Keys evicted from table are erased from its optimizer slots, see
+// KvVariable::TrackSlots().
+template <typename T, typename Tindex>
+Status TrackSlots(KvVariableInterface* table,
+                  const std::vector<KvVariableInterface*>& slots) {
+  return static_cast<KvVariable<Tindex, T>*>(table)->TrackSlots(slots);
+}
+
 // Copy from tensorflow since we cannot use training_op_helpers.h
 // https://github.com/tensorflow/tensorflow/blob/r1.13/tensorflow/core/kernels/training_op_helpers.h#L195
 // This is for use with ResourceVariables to ensure *tensor has a
@@ -305,6 +422,8 @@ class KvVariableSparseApplyFtrlOp : public OpKernel {
     OP_REQUIRES_OK(ctx,
                    LookupResource(ctx, HandleFromInput(ctx, 2), &table_linear));
     core::ScopedUnref unref_me_linear(table_linear);
+    OP_REQUIRES_OK(ctx, TrackSlots<T, Tindex>(
+                            table_var, {table_accum, table_linear}));
 
     OP_REQUIRES(
         ctx, table_var->IsInitialized(),
@@ -320,8 +439,10 @@ class KvVariableSparseApplyFtrlOp : public OpKernel {
             "Attempting to use uninitialized variables: ", requested_input(2)));
 
     // get gradients and indices
-    const Tensor& grad = ctx->input(3);
-    const Tensor& indices = ctx->input(4);
+    Tensor grad = ctx->input(3);
+    Tensor indices = ctx->input(4);
+    OP_REQUIRES_OK(ctx, MaybeSumDuplicateRows<T, Tindex>(ctx, table_var,
+                                                         &indices, {&grad}));
     OP_REQUIRES(ctx, TensorShapeUtils::IsVector(indices.shape()),
                 errors::InvalidArgument("indices must be one-dimensional"));
 
@@ -404,7 +525,9 @@ class KvVariableSparseApplyFtrlOp : public OpKernel {
     }
 
     if (N > 0) {
-      auto DoWork = [this, ctx, inner_dim, &table_var, &table_accum,
+      const IndexOrder order =
+          static_cast<KvVariable<Tindex, T>*>(table_var)->ApplyOrder(indices);
+      auto DoWork = [this, ctx, &order, inner_dim, &table_var, &table_accum,
                      &table_linear, &indices, &grad, &l2_shrinkage, &lr, &l1,
                      &l2, &lr_power](int64_t start_i, int64_t limit_i) {
         const int64_t first_dim_size = indices.dim_size(0);
@@ -426,18 +549,25 @@ class KvVariableSparseApplyFtrlOp : public OpKernel {
           train_deltalist.reserve(limit_i - start_i);
         }
 
-        for (int64_t i = start_i; i < limit_i; i++) {
+        auto apply_lock =
+            static_cast<KvVariable<Tindex, T>*>(table_var)->GetApplyLock(order);
+        const auto row_handles =
+            static_cast<KvVariable<Tindex, T>*>(table_var)->GetRowHandles(
+                ctx, indices);
+        for (int64_t j = start_i; j < limit_i; ++j) {
+          const int64_t i = order(j);
           OP_REQUIRES(ctx, FastBoundsCheck(i, first_dim_size),
                       errors::InvalidArgument(strings::StrCat(
                           "Index ", i, " out of range ", first_dim_size)));
+          static_cast<KvVariable<Tindex, T>*>(table_var)->PrefetchLookup(
+              order.Reorder(indices_flat), start_i, j, limit_i);
           Tindex key = indices_flat(i);
           bool should_filter = false;
           EVContext<T> var_context;
           EVContext<T> linear_context;
           EVContext<T> accum_context;
-          auto var_lock =
-              static_cast<KvVariable<Tindex, T>*>(table_var)->GetScopedKeyLock(
-                  key, LockType::WRITE_LOCK);
+          auto var_lock = apply_lock.Lock(key);
+          row_handles.Seed(i, key, &var_context);
           static_cast<KvVariable<Tindex, T>*>(table_var)->FindOrInsertUnsafe(
               key, &var_context, &should_filter);
           if (should_filter) {
@@ -481,9 +611,21 @@ class KvVariableSparseApplyFtrlOp : public OpKernel {
             auto grad_with_shrinkage =
                 grad + static_cast<T>(2) * l2_shrinkage_scalar * var;
             COMPUTE_FTRL(grad_with_shrinkage);
+          } else if (lr_power_scalar == static_cast<T>(-0.5)) {
+            FtrlLinear(linear.data(), accum.data(), var.data(),
+                       &grad_flat(i, 0), lr_scalar, embedding_dim_size);
+            ProximalStep(var.data(), linear.data(), accum.data(), lr_scalar,
+                         l1_scalar, l2_scalar, static_cast<T>(0),
+                         static_cast<T>(1), embedding_dim_size);
           } else {
             COMPUTE_FTRL(grad);
           }
+          static_cast<KvVariable<Tindex, T>*>(table_var)->CoverUpdateUnsafe(
+              key, &var_context);
+          static_cast<KvVariable<Tindex, T>*>(table_linear)
+              ->CoverUpdateUnsafe(key, &linear_context);
+          static_cast<KvVariable<Tindex, T>*>(table_accum)
+              ->CoverUpdateUnsafe(key, &accum_context);
           if (need_delta_info) {
             train_deltalist.push_back(i);
           }
@@ -495,9 +637,7 @@ class KvVariableSparseApplyFtrlOp : public OpKernel {
       };
 
       const int64_t cost = 5000;
-      auto worker_threads = *(ctx->device()->tensorflow_cpu_worker_threads());
-      Shard(worker_threads.num_threads, worker_threads.workers, N, cost,
-            DoWork);
+      ShardIndexOrder(ctx, order, N, cost, DoWork);
     }
 
     VLOG(1) << "KvVariableSparseApplyFtrl: "
@@ -553,6 +693,8 @@ class KvVariableSparseGroupSparseApplyFtrlOp : public OpKernel {
     OP_REQUIRES_OK(ctx,
                    LookupResource(ctx, HandleFromInput(ctx, 2), &table_linear));
     core::ScopedUnref unref_me_linear(table_linear);
+    OP_REQUIRES_OK(ctx, TrackSlots<T, Tindex>(
+                            table_var, {table_accum, table_linear}));
 
     OP_REQUIRES(
         ctx, table_var->IsInitialized(),
@@ -568,8 +710,10 @@ class KvVariableSparseGroupSparseApplyFtrlOp : public OpKernel {
                                    requested_input(2)));
 
     // Get gradients and indices
-    const Tensor& grad = ctx->input(3);
-    const Tensor& indices = ctx->input(4);
+    Tensor grad = ctx->input(3);
+    Tensor indices = ctx->input(4);
+    OP_REQUIRES_OK(ctx, MaybeSumDuplicateRows<T, Tindex>(ctx, table_var,
+                                                         &indices, {&grad}));
     OP_REQUIRES(ctx, TensorShapeUtils::IsVector(indices.shape()),
                 errors::InvalidArgument("indices must be one-dimensional"));
 
@@ -659,7 +803,9 @@ class KvVariableSparseGroupSparseApplyFtrlOp : public OpKernel {
     }
 
     if (N > 0) {
-      auto DoWork = [this, ctx, inner_dim, &table_var, &table_accum,
+      const IndexOrder order =
+          static_cast<KvVariable<Tindex, T>*>(table_var)->ApplyOrder(indices);
+      auto DoWork = [this, ctx, &order, inner_dim, &table_var, &table_accum,
                      &table_linear, &indices, &grad, &l2_shrinkage, &lr, &l1,
                      &l2, &l21, &lr_power](int64_t start_i, int64_t limit_i) {
         const int64_t first_dim_size = indices.dim_size(0);
@@ -681,18 +827,25 @@ class KvVariableSparseGroupSparseApplyFtrlOp : public OpKernel {
           train_deltalist.reserve(limit_i - start_i);
         }
 
-        for (int64_t i = start_i; i < limit_i; i++) {
+        auto apply_lock =
+            static_cast<KvVariable<Tindex, T>*>(table_var)->GetApplyLock(order);
+        const auto row_handles =
+            static_cast<KvVariable<Tindex, T>*>(table_var)->GetRowHandles(
+                ctx, indices);
+        for (int64_t j = start_i; j < limit_i; ++j) {
+          const int64_t i = order(j);
           OP_REQUIRES(ctx, FastBoundsCheck(i, first_dim_size),
                       errors::InvalidArgument(strings::StrCat(
                           "Index ", i, " out of range ", first_dim_size)));
+          static_cast<KvVariable<Tindex, T>*>(table_var)->PrefetchLookup(
+              order.Reorder(indices_flat), start_i, j, limit_i);
           Tindex key = indices_flat(i);
           bool should_filter = false;
           EVContext<T> var_context;
           EVContext<T> linear_context;
           EVContext<T> accum_context;
-          auto var_lock =
-              static_cast<KvVariable<Tindex, T>*>(table_var)->GetScopedKeyLock(
-                  key, LockType::WRITE_LOCK);
+          auto var_lock = apply_lock.Lock(key);
+          row_handles.Seed(i, key, &var_context);
           static_cast<KvVariable<Tindex, T>*>(table_var)->FindOrInsertUnsafe(
               key, &var_context, &should_filter);
           if (should_filter) {
@@ -722,9 +875,8 @@ class KvVariableSparseGroupSparseApplyFtrlOp : public OpKernel {
   }                                                                            \
   auto l1_reg_adjust = linear.cwiseMin(l1_scalar).cwiseMax(-l1_scalar);        \
   auto l1_linear = l1_reg_adjust - linear;                                     \
-  using TensorScalar = Eigen::Tensor<T, 0, Eigen::RowMajor>;                   \
-  TensorScalar l1_linear_norm_t = l1_linear.square().sum().sqrt();             \
-  T l1_linear_norm = static_cast<T>(l1_linear_norm_t(0));                      \
+  T l1_linear_norm =                                                           \
+      GroupShrinkNorm(linear.data(), l1_scalar, linear.size());                \
   auto l21_norm = l21_scalar * Eigen::numext::sqrt(static_cast<T>(inner_dim)); \
   if (l1_linear_norm > l21_norm) {                                             \
     l1_linear_norm = static_cast<T>(1) - (l21_norm / l1_linear_norm);          \
@@ -754,6 +906,25 @@ class KvVariableSparseGroupSparseApplyFtrlOp : public OpKernel {
             auto grad_with_shrinkage =
                 grad + static_cast<T>(2) * l2_shrinkage_scalar * var;
             COMPUTE_FTRL(grad_with_shrinkage);
+          } else if (lr_power_scalar == static_cast<T>(-0.5)) {
+            FtrlLinear(linear.data(), accum.data(), var.data(),
+                       &grad_flat(i, 0), lr_scalar, embedding_dim_size);
+            const T l21_norm =
+                l21_scalar * Eigen::numext::sqrt(static_cast<T>(inner_dim));
+            if (GroupProximalStep(var.data(), linear.data(), accum.data(),
+                                  lr_scalar, l1_scalar, l2_scalar,
+                                  static_cast<T>(0), l21_norm,
+                                  embedding_dim_size)) {
+              static_cast<KvVariable<Tindex, T>*>(table_var)
+                  ->CoverUpdateUnsafe(key, &var_context);
+            } else {
+              static_cast<KvVariable<Tindex, T>*>(table_var)
+                  ->MarkBlacklistUnsafe(key, &var_context);
+            }
+            static_cast<KvVariable<Tindex, T>*>(table_linear)
+                ->CoverUpdateUnsafe(key, &linear_context);
+            static_cast<KvVariable<Tindex, T>*>(table_accum)
+                ->CoverUpdateUnsafe(key, &accum_context);
           } else {
             COMPUTE_FTRL(grad);
           }
@@ -768,9 +939,7 @@ class KvVariableSparseGroupSparseApplyFtrlOp : public OpKernel {
       };
 
       const int64_t cost = 5000;
-      auto worker_threads = *(ctx->device()->tensorflow_cpu_worker_threads());
-      Shard(worker_threads.num_threads, worker_threads.workers, N, cost,
-            DoWork);
+      ShardIndexOrder(ctx, order, N, cost, DoWork);
     }
 
     VLOG(1) << "KvVariableSparseGroupSparseApplyFtrl: "
@@ -825,6 +994,8 @@ class KvVariableGroupSparseApplyFtrlOp : public OpKernel {
     OP_REQUIRES_OK(ctx,
                    LookupResource(ctx, HandleFromInput(ctx, 2), &table_linear));
     core::ScopedUnref unref_me_linear(table_linear);
+    OP_REQUIRES_OK(ctx, TrackSlots<T, Tindex>(
+                            table_var, {table_accum, table_linear}));
 
     OP_REQUIRES(
         ctx, table_var->IsInitialized(),
@@ -840,8 +1011,10 @@ class KvVariableGroupSparseApplyFtrlOp : public OpKernel {
                                    requested_input(2)));
 
     // Get gradients and indices
-    const Tensor& grad = ctx->input(3);
-    const Tensor& indices = ctx->input(4);
+    Tensor grad = ctx->input(3);
+    Tensor indices = ctx->input(4);
+    OP_REQUIRES_OK(ctx, MaybeSumDuplicateRows<T, Tindex>(ctx, table_var,
+                                                         &indices, {&grad}));
     OP_REQUIRES(ctx, TensorShapeUtils::IsVector(indices.shape()),
                 errors::InvalidArgument("indices must be one-dimensional"));
 
@@ -924,7 +1097,9 @@ class KvVariableGroupSparseApplyFtrlOp : public OpKernel {
     }
 
     if (N > 0) {
-      auto DoWork = [this, ctx, inner_dim, &table_var, &table_accum,
+      const IndexOrder order =
+          static_cast<KvVariable<Tindex, T>*>(table_var)->ApplyOrder(indices);
+      auto DoWork = [this, ctx, &order, inner_dim, &table_var, &table_accum,
                      &table_linear, &indices, &grad, &l2_shrinkage, &lr, &l1,
                      &l2, &lr_power](int64_t start_i, int64_t limit_i) {
         const int64_t first_dim_size = indices.dim_size(0);
@@ -945,18 +1120,25 @@ class KvVariableGroupSparseApplyFtrlOp : public OpKernel {
           train_deltalist.reserve(limit_i - start_i);
         }
 
-        for (int64_t i = start_i; i < limit_i; i++) {
+        auto apply_lock =
+            static_cast<KvVariable<Tindex, T>*>(table_var)->GetApplyLock(order);
+        const auto row_handles =
+            static_cast<KvVariable<Tindex, T>*>(table_var)->GetRowHandles(
+                ctx, indices);
+        for (int64_t j = start_i; j < limit_i; ++j) {
+          const int64_t i = order(j);
           OP_REQUIRES(ctx, FastBoundsCheck(i, first_dim_size),
                       errors::InvalidArgument(strings::StrCat(
                           "Index ", i, " out of range ", first_dim_size)));
+          static_cast<KvVariable<Tindex, T>*>(table_var)->PrefetchLookup(
+              order.Reorder(indices_flat), start_i, j, limit_i);
           Tindex key = indices_flat(i);
           bool should_filter = false;
           EVContext<T> var_context;
           EVContext<T> linear_context;
           EVContext<T> accum_context;
-          auto var_lock =
-              static_cast<KvVariable<Tindex, T>*>(table_var)->GetScopedKeyLock(
-                  key, LockType::WRITE_LOCK);
+          auto var_lock = apply_lock.Lock(key);
+          row_handles.Seed(i, key, &var_context);
           static_cast<KvVariable<Tindex, T>*>(table_var)->FindOrInsertUnsafe(
               key, &var_context, &should_filter);
           if (should_filter) {
@@ -984,9 +1166,7 @@ class KvVariableGroupSparseApplyFtrlOp : public OpKernel {
                              accum.pow(-lr_power_scalar)) /                  \
                                 lr_scalar * var;                             \
   }                                                                          \
-  ::Eigen::Tensor<T, 0, ::Eigen::RowMajor> linear_sqrsum =                   \
-      linear.square().sum().sqrt();                                          \
-  T linear_norm = linear_sqrsum(0);                                          \
+  T linear_norm = RowNorm(linear.data(), linear.size());                     \
   if (linear_norm > l1_scalar) {                                             \
     if (lr_power_scalar == static_cast<T>(-0.5)) {                           \
       auto eta_rec = new_accum.sqrt() / new_accum.constant(lr_scalar);       \
@@ -1030,9 +1210,7 @@ class KvVariableGroupSparseApplyFtrlOp : public OpKernel {
       };
 
       const int64_t cost = 5000;
-      auto worker_threads = *(ctx->device()->tensorflow_cpu_worker_threads());
-      Shard(worker_threads.num_threads, worker_threads.workers, N, cost,
-            DoWork);
+      ShardIndexOrder(ctx, order, N, cost, DoWork);
     }
     VLOG(1) << "KvVariableSparseGroupSparseApplyFtrl: "
             << ::tensorflow::Env::Default()->NowMicros() - stime << " ms";
@@ -1071,8 +1249,6 @@ class KvVariableGroupSparseApplyAdamOp : public OpKernel {
 
   void Compute(OpKernelContext* ctx) override TF_NO_THREAD_SAFETY_ANALYSIS {
     uint64_t stime = tensorflow::Env::Default()->NowMicros();
-    auto locks = MaybeLockVariableInputMutexesInOrder(ctx, use_exclusive_lock_,
-                                                      {0, 1, 2, 3, 4});
     // Get the KvVariable handle
     KvVariableInterface *table_var = nullptr, *table_accum = nullptr,
                         *table_linear = nullptr, *table_m = nullptr,
@@ -1112,9 +1288,30 @@ class KvVariableGroupSparseApplyAdamOp : public OpKernel {
         errors::FailedPrecondition("Failed to use uninitialized variables: ",
                                    requested_input(4)));
 
+    // When var has room for the slots they are moved into its rows by the
+    // first step, every key is then resolved by a single lookup. Attaching
+    // locks the variables itself, so it runs before they are locked here.
+    auto kv_var = static_cast<KvVariable<Tindex, T>*>(table_var);
+    const std::vector<KvVariableInterface*> slots = {table_accum, table_linear,
+                                                     table_m, table_v};
+    const bool has_colocated_slots =
+        kv_var->NumColocatedSlots() >= static_cast<int>(slots.size());
+    if (has_colocated_slots) {
+      OP_REQUIRES_OK(ctx, kv_var->ColocateSlots(slots));
+    }
+    OP_REQUIRES_OK(ctx, kv_var->TrackSlots(slots));
+    // Taken before the variables, in the order ColocateSlots() takes them.
+    mutex_read_lock colocate_lock(*kv_var->colocate_mu(), has_colocated_slots);
+    auto locks = MaybeLockVariableInputMutexesInOrder(ctx, use_exclusive_lock_,
+                                                      {0, 1, 2, 3, 4});
+    const bool colocated =
+        has_colocated_slots && kv_var->SlotsColocatedUnsafe(slots);
+
     // Get gradients and indices
-    const Tensor& grad = ctx->input(5);
-    const Tensor& indices = ctx->input(6);
+    Tensor grad = ctx->input(5);
+    Tensor indices = ctx->input(6);
+    OP_REQUIRES_OK(ctx, MaybeSumDuplicateRows<T, Tindex>(ctx, table_var,
+                                                         &indices, {&grad}));
     const Tensor& lr = ctx->input(7);
     const Tensor& beta1_power = ctx->input(8);
     const Tensor& beta2_power = ctx->input(9);
@@ -1218,10 +1415,15 @@ class KvVariableGroupSparseApplyAdamOp : public OpKernel {
                     "Inner dimension should be greater than zero."));
 
     if (N > 0) {
-      auto DoWork = [this, ctx, inner_dim, &table_var, &table_accum,
-                     &table_linear, &table_m, &table_v, &indices, &grad, &lr,
-                     &beta1_power, &beta2_power, &beta1, &beta2, &epsilon, &l1,
-                     &l2, &l21](int64_t start_i, int64_t limit_i) {
+      const IndexOrder order =
+          static_cast<KvVariable<Tindex, T>*>(table_var)->ApplyOrder(indices);
+      const LazyDecay<T, Tindex> lazy_decay(
+          ctx, table_var, beta1.scalar<T>()(), beta2.scalar<T>()());
+      auto DoWork = [this, ctx, &order, &lazy_decay, inner_dim, colocated,
+                     kv_var, &table_var, &table_accum, &table_linear, &table_m,
+                     &table_v, &indices, &grad, &lr, &beta1_power, &beta2_power,
+                     &beta1, &beta2, &epsilon, &l1, &l2,
+                     &l21](int64_t start_i, int64_t limit_i) {
         const int64_t first_dim_size = indices.dim_size(0);
         const int64_t embedding_dim_size = grad.dim_size(1);
         auto grad_flat = grad.flat_outer_dims<T>();
@@ -1242,11 +1444,19 @@ class KvVariableGroupSparseApplyAdamOp : public OpKernel {
           train_deltalist.reserve(limit_i - start_i);
         }
 
-        for (int64_t i = start_i; i < limit_i; i++) {
+        auto apply_lock =
+            static_cast<KvVariable<Tindex, T>*>(table_var)->GetApplyLock(order);
+        const auto row_handles =
+            static_cast<KvVariable<Tindex, T>*>(table_var)->GetRowHandles(
+                ctx, indices);
+        for (int64_t j = start_i; j < limit_i; ++j) {
+          const int64_t i = order(j);
           OP_REQUIRES(ctx, FastBoundsCheck(i, first_dim_size),
                       errors::InvalidArgument(strings::StrCat(
                           "Index ", i, " out of range ", first_dim_size)));
 
+          static_cast<KvVariable<Tindex, T>*>(table_var)->PrefetchLookup(
+              order.Reorder(indices_flat), start_i, j, limit_i);
           Tindex key = indices_flat(i);
           bool should_filter = false;
           EVContext<T> var_context;
@@ -1254,36 +1464,48 @@ class KvVariableGroupSparseApplyAdamOp : public OpKernel {
           EVContext<T> accum_context;
           EVContext<T> m_context;
           EVContext<T> v_context;
-          auto var_lock =
-              static_cast<KvVariable<Tindex, T>*>(table_var)->GetScopedKeyLock(
-                  key, LockType::WRITE_LOCK);
+          auto var_lock = apply_lock.Lock(key);
+          row_handles.Seed(i, key, &var_context);
           static_cast<KvVariable<Tindex, T>*>(table_var)->FindOrInsertUnsafe(
               key, &var_context, &should_filter);
           if (should_filter) {
             continue;
           }
-          static_cast<KvVariable<Tindex, T>*>(table_m)
-              ->FindOrInsertUnsafe(key, &m_context, nullptr);
-          static_cast<KvVariable<Tindex, T>*>(table_v)
-              ->FindOrInsertUnsafe(key, &v_context, nullptr);
-          static_cast<KvVariable<Tindex, T>*>(table_linear)
-              ->FindOrInsertUnsafe(key, &linear_context, nullptr);
-          static_cast<KvVariable<Tindex, T>*>(table_accum)
-              ->FindOrInsertUnsafe(key, &accum_context, nullptr);
-          auto var = FlatVector<T>(var_context.Value(), embedding_dim_size);
-          auto linear =
-              FlatVector<T>(linear_context.Value(), embedding_dim_size);
-          auto accum = FlatVector<T>(accum_context.Value(), embedding_dim_size);
-          auto m = FlatVector<T>(m_context.Value(), embedding_dim_size);
-          auto v = FlatVector<T>(v_context.Value(), embedding_dim_size);
-          auto grad = grad_flat.template chip<0>(i);
+          T* var_row = var_context.Value();
+          T *accum_row, *linear_row, *m_row, *v_row;
+          if (colocated) {
+            // The slots follow var in the order of the inputs.
+            accum_row = kv_var->SlotValue(var_row, 1);
+            linear_row = kv_var->SlotValue(var_row, 2);
+            m_row = kv_var->SlotValue(var_row, 3);
+            v_row = kv_var->SlotValue(var_row, 4);
+          } else {
+            static_cast<KvVariable<Tindex, T>*>(table_m)
+                ->FindOrInsertUnsafe(key, &m_context, nullptr);
+            static_cast<KvVariable<Tindex, T>*>(table_v)
+                ->FindOrInsertUnsafe(key, &v_context, nullptr);
+            static_cast<KvVariable<Tindex, T>*>(table_linear)
+                ->FindOrInsertUnsafe(key, &linear_context, nullptr);
+            static_cast<KvVariable<Tindex, T>*>(table_accum)
+                ->FindOrInsertUnsafe(key, &accum_context, nullptr);
+            accum_row = accum_context.Value();
+            linear_row = linear_context.Value();
+            m_row = m_context.Value();
+            v_row = v_context.Value();
+          }
+          auto var = FlatVector<T>(var_row, embedding_dim_size);
+          auto linear = FlatVector<T>(linear_row, embedding_dim_size);
+          auto accum = FlatVector<T>(accum_row, embedding_dim_size);
+          auto m = FlatVector<T>(m_row, embedding_dim_size);
+          auto v = FlatVector<T>(v_row, embedding_dim_size);
+          auto grad = FlatVector<T>(&grad_flat(i, 0), embedding_dim_size);
+          lazy_decay.Apply(key, m.data(), v.data(), embedding_dim_size);
 
 // Use a macro to implement the computation here due to the templating of the
 // eigen tensor library.
 #define COMPUTE_ADAM(grad_to_use)                                              \
-  m = beta1_scalar * m + (static_cast<T>(1) - beta1_scalar) * grad_to_use;     \
-  v = beta2_scalar * v +                                                       \
-      (static_cast<T>(1) - beta2_scalar) * grad_to_use.square();               \
+  AdamMoments(m.data(), v.data(), grad_to_use.data(), grad_to_use.data(),      \
+              beta1_scalar, beta2_scalar, m.size());                           \
   auto new_accum = v / (static_cast<T>(1) - beta2_power_scalar);               \
   auto epsilon_adjust =                                                        \
       epsilon_scalar /                                                         \
@@ -1299,9 +1521,8 @@ class KvVariableGroupSparseApplyAdamOp : public OpKernel {
   }                                                                            \
   auto l1_reg_adjust = linear.cwiseMin(l1_scalar).cwiseMax(-l1_scalar);        \
   auto l1_linear = l1_reg_adjust - linear;                                     \
-  using TensorScalar = Eigen::Tensor<T, 0, Eigen::RowMajor>;                   \
-  TensorScalar l1_linear_norm_t = l1_linear.square().sum().sqrt();             \
-  T l1_linear_norm = static_cast<T>(l1_linear_norm_t(0));                      \
+  T l1_linear_norm =                                                           \
+      GroupShrinkNorm(linear.data(), l1_scalar, linear.size());                \
   auto l21_norm = l21_scalar * Eigen::numext::sqrt(static_cast<T>(inner_dim)); \
   if (l1_linear_norm > l21_norm) {                                             \
     l1_linear_norm = static_cast<T>(1) - l21_norm / l1_linear_norm;            \
@@ -1315,16 +1536,18 @@ class KvVariableGroupSparseApplyAdamOp : public OpKernel {
     static_cast<KvVariable<Tindex, T>*>(table_var)->MarkBlacklistUnsafe(       \
         key, &var_context);                                                    \
   }                                                                            \
-  accum = new_accum;                                                           \
-  static_cast<KvVariable<Tindex, T>*>(table_linear)                            \
-      ->CoverUpdateUnsafe(key, &linear_context);                               \
-  static_cast<KvVariable<Tindex, T>*>(table_m)->CoverUpdateUnsafe(key,         \
-                                                                  &m_context); \
-  static_cast<KvVariable<Tindex, T>*>(table_v)->CoverUpdateUnsafe(key,         \
-                                                                  &v_context); \
-  static_cast<KvVariable<Tindex, T>*>(table_accum)                             \
-      ->CoverUpdateUnsafe(key, &accum_context);
+  accum = new_accum;
           COMPUTE_ADAM(grad);
+          if (!colocated) {
+            static_cast<KvVariable<Tindex, T>*>(table_linear)
+                ->CoverUpdateUnsafe(key, &linear_context);
+            static_cast<KvVariable<Tindex, T>*>(table_m)->CoverUpdateUnsafe(
+                key, &m_context);
+            static_cast<KvVariable<Tindex, T>*>(table_v)->CoverUpdateUnsafe(
+                key, &v_context);
+            static_cast<KvVariable<Tindex, T>*>(table_accum)
+                ->CoverUpdateUnsafe(key, &accum_context);
+          }
           if (need_delta_info) {
             train_deltalist.push_back(i);
           }
@@ -1338,9 +1561,7 @@ class KvVariableGroupSparseApplyAdamOp : public OpKernel {
       };
 
       const int64_t cost = 5000;
-      auto worker_threads = *(ctx->device()->tensorflow_cpu_worker_threads());
-      Shard(worker_threads.num_threads, worker_threads.workers, N, cost,
-            DoWork);
+      ShardIndexOrder(ctx, order, N, cost, DoWork);
     }
 
     VLOG(1) << "KvVariableGroupSparseApplyAdamOp: "
@@ -1369,6 +1590,125 @@ TF_CALL_float(REGISTER_CPU_KERNELS);
 #undef REGISTER_CPU_KERNELS
 #undef REGISTER_KERNELS
 
+// A variable of a Batch* apply op, which takes the var handles, slot
+// handles, grads and indices of its n variables as lists.
+template <typename T, typename Tindex>
+struct BatchApplyVariable {
+  KvVariableInterface* var = nullptr;
+  KvVariableInterface* slot = nullptr;
+  Tensor grad;
+  Tensor indices;
+  IndexOrder order;
+  int64_t inner_dim = 1;
+};
+
+// Looks up variable v of a Batch* apply op of n variables, its var and slot
+// handles are inputs v and n + v, its grad and indices inputs grad_input + v
+// and indices_input + v. Checks them as the op of one variable does.
+template <typename T, typename Tindex>
+Status LookupBatchApplyVariable(
+    OpKernelContext* ctx, int n, int v, int grad_input, int indices_input,
+    BatchApplyVariable<T, Tindex>* variable,
+    std::vector<std::unique_ptr<core::ScopedUnref>>* unrefs) {
+  TF_RETURN_IF_ERROR(
+      LookupResource(ctx, HandleFromInput(ctx, v), &variable->var));
+  unrefs->emplace_back(new core::ScopedUnref(variable->var));
+  TF_RETURN_IF_ERROR(
+      LookupResource(ctx, HandleFromInput(ctx, n + v), &variable->slot));
+  unrefs->emplace_back(new core::ScopedUnref(variable->slot));
+  if (!variable->var->IsInitialized() || !variable->slot->IsInitialized()) {
+    return errors::FailedPrecondition(
+        "Attempting to use uninitialized variables: ",
+        ctx->op_kernel().requested_input(v), " ",
+        ctx->op_kernel().requested_input(n + v));
+  }
+  TF_RETURN_IF_ERROR(TrackSlots<T, Tindex>(variable->var, {variable->slot}));
+  variable->grad = ctx->input(grad_input + v);
+  variable->indices = ctx->input(indices_input + v);
+  TF_RETURN_IF_ERROR(MaybeSumDuplicateRows<T, Tindex>(
+      ctx, variable->var, &variable->indices, {&variable->grad}));
+  if (!TensorShapeUtils::IsVector(variable->indices.shape())) {
+    return errors::InvalidArgument("indices must be one-dimensional");
+  }
+  const TensorShape& var_shape = variable->var->value_shape();
+  if (variable->grad.dims() != var_shape.dims() + 1 ||
+      variable->grad.dim_size(0) != variable->indices.dim_size(0)) {
+    return errors::InvalidArgument(
+        "grad must be the same size as indices in the first dimension and "
+        "match var in the others: ",
+        variable->grad.shape().DebugString(), " ",
+        var_shape.DebugString());
+  }
+  variable->inner_dim = 1;
+  for (int d = 0; d < var_shape.dims(); d++) {
+    if (var_shape.dim_size(d) != variable->grad.dim_size(d + 1)) {
+      return errors::InvalidArgument(
+          strings::StrCat("var and grad must match in dimension ", d + 1));
+    }
+    variable->inner_dim *= var_shape.dim_size(d);
+  }
+  if (variable->inner_dim <= 0) {
+    return errors::InvalidArgument(
+        "Inner dimension should be greater than zero.");
+  }
+  if (variable->indices.dim_size(0) > 0) {
+    variable->order = static_cast<KvVariable<Tindex, T>*>(variable->var)
+                          ->ApplyOrder(variable->indices);
+  }
+  return OkStatus();
+}
+
+// Applies KvVariableSparseApplyAdagrad to positions order[start_i, limit_i)
+// of indices, BatchKvVariableSparseApplyAdagrad calls it for each variable.
+template <typename T, typename Tindex>
+void SparseApplyAdagradRange(
+    OpKernelContext* ctx, KvVariableInterface* table_var,
+    KvVariableInterface* table_accum, const Tensor& indices,
+    const Tensor& grad, const IndexOrder& order,
+    const typename KvVariable<Tindex, T>::RowHandles& row_handles,
+    T lr_scalar, bool update_slots, int64_t start_i, int64_t limit_i) {
+  auto grad_flat = grad.flat_outer_dims<T>();
+  auto indices_flat = indices.flat<Tindex>();
+  const int64_t embedding_dim_size = grad.dim_size(1);
+  std::vector<int64> train_deltalist;
+  auto need_delta_info = table_var->NeedDeltaInfo();
+  if (need_delta_info) {
+    train_deltalist.reserve(limit_i - start_i);
+  }
+
+  auto apply_lock =
+      static_cast<KvVariable<Tindex, T>*>(table_var)->GetApplyLock(order);
+  for (int64_t j = start_i; j < limit_i; ++j) {
+    const int64_t i = order(j);
+    static_cast<KvVariable<Tindex, T>*>(table_var)->PrefetchLookup(
+        order.Reorder(indices_flat), start_i, j, limit_i);
+    Tindex key = indices_flat(i);
+    bool should_filter = false;
+    EVContext<T> var_context;
+    EVContext<T> accum_context;
+    auto var_lock = apply_lock.Lock(key);
+    row_handles.Seed(i, key, &var_context);
+    static_cast<KvVariable<Tindex, T>*>(table_var)->FindOrInsertUnsafe(
+        key, &var_context, &should_filter);
+    if (should_filter) {
+      continue;
+    }
+    static_cast<KvVariable<Tindex, T>*>(table_accum)
+        ->FindOrInsertUnsafe(key, &accum_context, nullptr);
+    AdagradRow(var_context.Value(), accum_context.Value(), &grad_flat(i, 0),
+               lr_scalar, update_slots, embedding_dim_size);
+    static_cast<KvVariable<Tindex, T>*>(table_var)->CoverUpdateUnsafe(
+        key, &var_context);
+    static_cast<KvVariable<Tindex, T>*>(table_accum)
+        ->CoverUpdateUnsafe(key, &accum_context);
+    if (need_delta_info) {
+      train_deltalist.push_back(i);
+    }
+  }
+  table_var->MarkAsDeltaListElements(ctx, indices, train_deltalist);
+  table_accum->MarkAsDeltaListElements(ctx, indices, train_deltalist);
+}
+
 template <typename T, typename Tindex>
 class KvVariableSparseApplyAdagradOp : public OpKernel {
  public:
@@ -1390,6 +1730,7 @@ class KvVariableSparseApplyAdagradOp : public OpKernel {
                    LookupResource(ctx, HandleFromInput(ctx, 1), &table_accum));
     core::ScopedUnref unref_me_var(table_var);
     core::ScopedUnref unref_me_accum(table_accum);
+    OP_REQUIRES_OK(ctx, TrackSlots<T, Tindex>(table_var, {table_accum}));
 
     OP_REQUIRES(
         ctx, table_var->IsInitialized(),
@@ -1403,8 +1744,10 @@ class KvVariableSparseApplyAdagradOp : public OpKernel {
     OP_REQUIRES(ctx, IsLegacyScalar(lr.shape()),
                 errors::InvalidArgument("lr is not a scalar: ",
                                         lr.shape().DebugString()));
-    const Tensor& grad = ctx->input(3);
-    const Tensor& indices = ctx->input(4);
+    Tensor grad = ctx->input(3);
+    Tensor indices = ctx->input(4);
+    OP_REQUIRES_OK(ctx, MaybeSumDuplicateRows<T, Tindex>(ctx, table_var,
+                                                         &indices, {&grad}));
     OP_REQUIRES(ctx, TensorShapeUtils::IsVector(indices.shape()),
                 errors::InvalidArgument("indices must be one-dimensional"));
     const int64_t N = indices.dim_size(0);
@@ -1439,59 +1782,22 @@ class KvVariableSparseApplyAdagradOp : public OpKernel {
                 errors::InvalidArgument(
                     "Inner dimension should be greater than zero."));
     if (N > 0) {
-      auto DoWork = [this, ctx, &table_var, &table_accum, inner_dim,
-                     &indices, &grad,
-                     &lr](int64_t start_i, int64_t limit_i) {
-        auto grad_flat = grad.flat_outer_dims<T>();
-        auto indices_flat = indices.flat<Tindex>();
-        T lr_scalar = lr.scalar<T>()();
-        const int64_t embedding_dim_size = grad.dim_size(1);
-        std::vector<int64> train_deltalist;
-        auto need_delta_info = table_var->NeedDeltaInfo();
-        if (need_delta_info) {
-          train_deltalist.reserve(limit_i - start_i);
-        }
-
-        for (int64_t i = start_i; i < limit_i; i++) {
-          Tindex key = indices_flat(i);
-          bool should_filter = false;
-          EVContext<T> var_context;
-          EVContext<T> accum_context;
-          auto var_lock =
-              static_cast<KvVariable<Tindex, T>*>(table_var)->GetScopedKeyLock(
-                  key, LockType::WRITE_LOCK);
-          static_cast<KvVariable<Tindex, T>*>(table_var)->FindOrInsertUnsafe(
-              key, &var_context, &should_filter);
-          if (should_filter) {
-            continue;
-          }
-          static_cast<KvVariable<Tindex, T>*>(table_accum)
-              ->FindOrInsertUnsafe(key, &accum_context, nullptr);
-          auto v = FlatVector<T>(var_context.Value(), embedding_dim_size);
-          auto a = FlatVector<T>(accum_context.Value(), embedding_dim_size);
-
-          auto g = grad_flat.template chip<0>(i);
-          if (update_slots_) {
-            a += g.square();
-          }
-
-          if (inner_dim > 1) {
-            v -= g.constant(lr_scalar) * g * a.rsqrt();
-          } else {
-            v -= g.constant(lr_scalar) * g / a.sqrt();
-          }
-          if (need_delta_info) {
-            train_deltalist.push_back(i);
-          }
-        }
-        table_var->MarkAsDeltaListElements(ctx, indices, train_deltalist);
-        table_accum->MarkAsDeltaListElements(ctx, indices, train_deltalist);
+      const IndexOrder order =
+          static_cast<KvVariable<Tindex, T>*>(table_var)->ApplyOrder(indices);
+      const auto row_handles =
+          static_cast<KvVariable<Tindex, T>*>(table_var)->GetRowHandles(
+              ctx, indices);
+      const T lr_scalar = lr.scalar<T>()();
+      auto DoWork = [this, ctx, &order, &table_var, &table_accum, &indices,
+                     &grad, &row_handles,
+                     lr_scalar](int64_t start_i, int64_t limit_i) {
+        SparseApplyAdagradRange<T, Tindex>(
+            ctx, table_var, table_accum, indices, grad, order, row_handles,
+            lr_scalar, update_slots_, start_i, limit_i);
       };
 
       const int64_t cost = 5000;
-      auto worker_threads = *(ctx->device()->tensorflow_cpu_worker_threads());
-      Shard(worker_threads.num_threads, worker_threads.workers, N, cost,
-            DoWork);
+      ShardIndexOrder(ctx, order, N, cost, DoWork);
     }
     VLOG(1) << "KvVariableSparseApplyAdagradOp: "
             << ::tensorflow::Env::Default()->NowMicros() - stime << " ms";
@@ -1519,6 +1825,90 @@ TF_CALL_float(REGISTER_CPU_KERNELS);
 #undef REGISTER_CPU_KERNELS
 #undef REGISTER_KERNELS
 
+// KvVariableSparseApplyAdagrad of N variables in one kernel. The resources
+// are looked up and locked once and the keys of all the variables are
+// sharded together, see ShardTables(), a model with hundreds of small tables
+// does not pay an op of its own for each of them.
+template <typename T, typename Tindex>
+class BatchKvVariableSparseApplyAdagradOp : public OpKernel {
+ public:
+  explicit BatchKvVariableSparseApplyAdagradOp(OpKernelConstruction* ctx)
+      : OpKernel(ctx) {
+    OP_REQUIRES_OK(ctx, ctx->GetAttr("N", &N_));
+    OP_REQUIRES_OK(ctx, ctx->GetAttr("use_locking", &use_exclusive_lock_));
+    OP_REQUIRES_OK(ctx, ctx->GetAttr("update_slots", &update_slots_));
+  }
+
+  void Compute(OpKernelContext* ctx) override TF_NO_THREAD_SAFETY_ANALYSIS {
+    uint64_t stime = tensorflow::Env::Default()->NowMicros();
+    std::vector<int> resource_inputs(2 * N_);
+    for (int i = 0; i < 2 * N_; ++i) {
+      resource_inputs[i] = i;
+    }
+    auto locks = MaybeLockVariableInputMutexesInOrder(ctx, use_exclusive_lock_,
+                                                      resource_inputs);
+    const Tensor& lr = ctx->input(2 * N_);
+    OP_REQUIRES(ctx, IsLegacyScalar(lr.shape()),
+                errors::InvalidArgument("lr is not a scalar: ",
+                                        lr.shape().DebugString()));
+    const T lr_scalar = lr.scalar<T>()();
+
+    std::vector<BatchApplyVariable<T, Tindex>> variables(N_);
+    std::vector<std::unique_ptr<core::ScopedUnref>> unrefs;
+    std::vector<int64_t> sizes(N_, 0);
+    for (int v = 0; v < N_; ++v) {
+      auto* variable = &variables[v];
+      OP_REQUIRES_OK(ctx, LookupBatchApplyVariable<T, Tindex>(
+                              ctx, N_, v, 2 * N_ + 1, 3 * N_ + 1, variable,
+                              &unrefs));
+      OP_REQUIRES(
+          ctx,
+          variable->var->value_shape().IsSameSize(
+              variable->slot->value_shape()),
+          errors::InvalidArgument(
+              "var and accum do not have the same shape",
+              variable->var->value_shape().DebugString(), " ",
+              variable->slot->value_shape().DebugString()));
+      sizes[v] = variable->indices.dim_size(0);
+    }
+
+    const typename KvVariable<Tindex, T>::RowHandles no_handles;
+    auto worker_threads = *(ctx->device()->tensorflow_cpu_worker_threads());
+    ShardTables(worker_threads.num_threads, worker_threads.workers, sizes,
+                5000, [&](int v, int64_t begin, int64_t end) {
+                  const auto& variable = variables[v];
+                  SparseApplyAdagradRange<T, Tindex>(
+                      ctx, variable.var, variable.slot, variable.indices,
+                      variable.grad, variable.order, no_handles, lr_scalar,
+                      update_slots_, begin, end);
+                });
+    VLOG(1) << "BatchKvVariableSparseApplyAdagradOp: "
+            << ::tensorflow::Env::Default()->NowMicros() - stime << " ms";
+  }
+
+ private:
+  int N_;
+  bool use_exclusive_lock_;
+  bool update_slots_;
+};
+#define REGISTER_KERNELS(T, Tindices)                                \
+  REGISTER_KERNEL_BUILDER(Name("BatchKvVariableSparseApplyAdagrad")  \
+                              .Device(DEVICE_CPU)                    \
+                              .TypeConstraint<T>("T")                \
+                              .TypeConstraint<Tindices>("Tindices"), \
+                          BatchKvVariableSparseApplyAdagradOp<T, Tindices>);
+
+#define REGISTER_CPU_KERNELS(T) \
+  REGISTER_KERNELS(T, int32);   \
+  REGISTER_KERNELS(T, int64);   \
+  REGISTER_KERNELS(T, uint64);  \
+//  REGISTER_KERNELS(T, string);
+
+TF_CALL_float(REGISTER_CPU_KERNELS);
+
+#undef REGISTER_CPU_KERNELS
+#undef REGISTER_KERNELS
+
 template <typename Device, typename T, typename Tindex>
 class KvVariableGroupSparseApplyAMSGradOp : public OpKernel {
  public:
@@ -1548,6 +1938,9 @@ class KvVariableGroupSparseApplyAMSGradOp : public OpKernel {
     core::ScopedUnref unref_me_m(table_m);
     OP_REQUIRES_OK(ctx, LookupResource(ctx, HandleFromInput(ctx, 4), &table_v));
     core::ScopedUnref unref_me_v(table_v);
+    OP_REQUIRES_OK(ctx,
+                   TrackSlots<T, Tindex>(table_var, {table_vhat, table_linear,
+                                                     table_m, table_v}));
 
     OP_REQUIRES(
         ctx, table_var->IsInitialized(),
@@ -1571,8 +1964,10 @@ class KvVariableGroupSparseApplyAMSGradOp : public OpKernel {
                                    requested_input(4)));
 
     // Get gradients, indices and other parameters
-    const Tensor& grad = ctx->input(5);
-    const Tensor& indices = ctx->input(6);
+    Tensor grad = ctx->input(5);
+    Tensor indices = ctx->input(6);
+    OP_REQUIRES_OK(ctx, MaybeSumDuplicateRows<T, Tindex>(ctx, table_var,
+                                                         &indices, {&grad}));
     const Tensor& lr = ctx->input(7);
     const Tensor& beta1_power = ctx->input(8);
     const Tensor& beta2_power = ctx->input(9);
@@ -1678,10 +2073,15 @@ class KvVariableGroupSparseApplyAMSGradOp : public OpKernel {
                                         "greater than zero."));
 
     if (N > 0) {
-      auto DoWork = [this, ctx, inner_dim, &table_var, &table_vhat,
-                     &table_linear, &table_m, &table_v, &indices, &grad, &lr,
-                     &beta1_power, &beta2_power, &beta1, &beta2, &epsilon, &l1,
-                     &l2, &l21](int64_t start_i, int64_t limit_i) {
+      const IndexOrder order =
+          static_cast<KvVariable<Tindex, T>*>(table_var)->ApplyOrder(indices);
+      const LazyDecay<T, Tindex> lazy_decay(
+          ctx, table_var, beta1.scalar<T>()(), beta2.scalar<T>()());
+      auto DoWork = [this, ctx, &order, &lazy_decay, inner_dim, &table_var,
+                     &table_vhat, &table_linear, &table_m, &table_v, &indices,
+                     &grad, &lr, &beta1_power, &beta2_power, &beta1, &beta2,
+                     &epsilon, &l1, &l2,
+                     &l21](int64_t start_i, int64_t limit_i) {
         const int64_t first_dim_size = indices.dim_size(0);
         const int64_t embedding_dim_size = grad.dim_size(1);
         auto indices_flat = indices.flat<Tindex>();
@@ -1702,10 +2102,18 @@ class KvVariableGroupSparseApplyAMSGradOp : public OpKernel {
           train_deltalist.reserve(limit_i - start_i);
         }
 
-        for (int64_t i = start_i; i < limit_i; ++i) {
+        auto apply_lock =
+            static_cast<KvVariable<Tindex, T>*>(table_var)->GetApplyLock(order);
+        const auto row_handles =
+            static_cast<KvVariable<Tindex, T>*>(table_var)->GetRowHandles(
+                ctx, indices);
+        for (int64_t j = start_i; j < limit_i; ++j) {
+          const int64_t i = order(j);
           OP_REQUIRES(ctx, FastBoundsCheck(i, first_dim_size),
                       errors::InvalidArgument(strings::StrCat(
                           "Index ", i, " out of range ", first_dim_size)));
+          static_cast<KvVariable<Tindex, T>*>(table_var)->PrefetchLookup(
+              order.Reorder(indices_flat), start_i, j, limit_i);
           Tindex key = indices_flat(i);
           bool should_filter = false;
           EVContext<T> var_context;
@@ -1713,9 +2121,8 @@ class KvVariableGroupSparseApplyAMSGradOp : public OpKernel {
           EVContext<T> m_context;
           EVContext<T> v_context;
           EVContext<T> linear_context;
-          auto var_lock =
-              static_cast<KvVariable<Tindex, T>*>(table_var)->GetScopedKeyLock(
-                  key, LockType::WRITE_LOCK);
+          auto var_lock = apply_lock.Lock(key);
+          row_handles.Seed(i, key, &var_context);
           static_cast<KvVariable<Tindex, T>*>(table_var)->FindOrInsertUnsafe(
               key, &var_context, &should_filter);
           if (should_filter) {
@@ -1735,36 +2142,28 @@ class KvVariableGroupSparseApplyAMSGradOp : public OpKernel {
           auto v = FlatVector<T>(v_context.Value(), embedding_dim_size);
           auto linear =
               FlatVector<T>(linear_context.Value(), embedding_dim_size);
-          auto grad = grad_flat.template chip<0>(i);
+          auto grad = FlatVector<T>(&grad_flat(i, 0), embedding_dim_size);
+          lazy_decay.Apply(key, m.data(), v.data(), embedding_dim_size);
 
 // Use a macro to implement the computation here due to the templating of the
 // eigen tensor library.
 #define COMPUTE_AMSGrad(grad_to_use)                                           \
-  m = beta1_scalar * m + (static_cast<T>(1) - beta1_scalar) * grad_to_use;     \
-  v = beta2_scalar * v +                                                       \
-      (static_cast<T>(1) - beta2_scalar) * grad_to_use.square();               \
-  auto new_vhat = vhat.cwiseMax(v / (static_cast<T>(1) - beta2_power_scalar)); \
-  linear += m / (static_cast<T>(1) - beta1_power_scalar) -                     \
-            (new_vhat.sqrt() - vhat.sqrt()) / lr_scalar * var;                 \
-  auto l1_reg_adjust = linear.cwiseMin(l1_scalar).cwiseMax(-l1_scalar);        \
-  auto l1_linear = l1_reg_adjust - linear;                                     \
-  using TensorScalar = Eigen::Tensor<T, 0, Eigen::RowMajor>;                   \
-  TensorScalar l1_linear_norm_t = l1_linear.square().sum().sqrt();             \
-  T l1_linear_norm = static_cast<T>(l1_linear_norm_t(0));                      \
+  AdamMoments(m.data(), v.data(), grad_to_use.data(), grad_to_use.data(),      \
+              beta1_scalar, beta2_scalar, m.size());                           \
+  AdaptiveLinear(linear.data(), vhat.data(), var.data(), m.data(), v.data(),   \
+                 static_cast<T>(1) - beta1_power_scalar,                       \
+                 static_cast<T>(1) - beta2_power_scalar, lr_scalar, true,      \
+                 m.size());                                                    \
   auto l21_norm = l21_scalar * Eigen::numext::sqrt(static_cast<T>(inner_dim)); \
-  if (l1_linear_norm > l21_norm) {                                             \
-    l1_linear_norm = static_cast<T>(1) - l21_norm / l1_linear_norm;            \
-    auto y =                                                                   \
-        (new_vhat.sqrt() + new_vhat.constant(epsilon_scalar)) / lr_scalar +    \
-        linear.constant(static_cast<T>(2) * l2_scalar);                        \
-    var = l1_linear * l1_linear_norm / y;                                      \
+  if (GroupProximalStep(var.data(), linear.data(), vhat.data(), lr_scalar,     \
+                        l1_scalar, l2_scalar, epsilon_scalar, l21_norm,        \
+                        var.size())) {                                         \
     static_cast<KvVariable<Tindex, T>*>(table_var)->CoverUpdateUnsafe(         \
         key, &var_context);                                                    \
   } else {                                                                     \
     static_cast<KvVariable<Tindex, T>*>(table_var)->MarkBlacklistUnsafe(       \
         key, &var_context);                                                    \
   }                                                                            \
-  vhat = new_vhat;                                                             \
   static_cast<KvVariable<Tindex, T>*>(table_linear)                            \
       ->CoverUpdateUnsafe(key, &linear_context);                               \
   static_cast<KvVariable<Tindex, T>*>(table_m)->CoverUpdateUnsafe(key,         \
@@ -1787,9 +2186,7 @@ class KvVariableGroupSparseApplyAMSGradOp : public OpKernel {
       };
 
       const int64_t cost = 5000;
-      auto worker_threads = *(ctx->device()->tensorflow_cpu_worker_threads());
-      Shard(worker_threads.num_threads, worker_threads.workers, N, cost,
-            DoWork);
+      ShardIndexOrder(ctx, order, N, cost, DoWork);
     }
 
     VLOG(1) << "KvVariableGroupSparseApplyAMSGradOp: "
@@ -1843,6 +2240,8 @@ class KvVariableSparseApplyAdadeltaOp : public OpKernel {
     core::ScopedUnref unref_me_var(table_var);
     core::ScopedUnref unref_me_accum(table_accum_grad);
     core::ScopedUnref unref_me_accum_update(table_accum_update);
+    OP_REQUIRES_OK(ctx, TrackSlots<T, Tindex>(
+                            table_var, {table_accum_grad, table_accum_update}));
 
     OP_REQUIRES(
         ctx, table_var->IsInitialized(),
@@ -1869,8 +2268,10 @@ class KvVariableSparseApplyAdadeltaOp : public OpKernel {
     OP_REQUIRES(ctx, TensorShapeUtils::IsScalar(epsilon.shape()),
                 errors::InvalidArgument("epsilon is not a scalar: ",
                                         epsilon.shape().DebugString()));
-    const Tensor& grad = ctx->input(6);
-    const Tensor& indices = ctx->input(7);
+    Tensor grad = ctx->input(6);
+    Tensor indices = ctx->input(7);
+    OP_REQUIRES_OK(ctx, MaybeSumDuplicateRows<T, Tindex>(ctx, table_var,
+                                                         &indices, {&grad}));
     OP_REQUIRES(ctx, TensorShapeUtils::IsVector(indices.shape()),
                 errors::InvalidArgument("indices must be one-dimensional"));
 
@@ -1910,7 +2311,9 @@ class KvVariableSparseApplyAdadeltaOp : public OpKernel {
     }
 
     if (N > 0) {
-      auto DoWork = [this, ctx, &table_var, &table_accum_grad,
+      const IndexOrder order =
+          static_cast<KvVariable<Tindex, T>*>(table_var)->ApplyOrder(indices);
+      auto DoWork = [this, ctx, &order, &table_var, &table_accum_grad,
                      &table_accum_update, &indices, &grad, &lr, &rho,
                      &epsilon](int64_t start_i, int64_t limit_i) {
         auto grad_flat = grad.flat_outer_dims<T>();
@@ -1926,15 +2329,22 @@ class KvVariableSparseApplyAdadeltaOp : public OpKernel {
           train_deltalist.reserve(limit_i - start_i);
         }
 
-        for (int64_t i = start_i; i < limit_i; ++i) {
+        auto apply_lock =
+            static_cast<KvVariable<Tindex, T>*>(table_var)->GetApplyLock(order);
+        const auto row_handles =
+            static_cast<KvVariable<Tindex, T>*>(table_var)->GetRowHandles(
+                ctx, indices);
+        for (int64_t j = start_i; j < limit_i; ++j) {
+          const int64_t i = order(j);
+          static_cast<KvVariable<Tindex, T>*>(table_var)->PrefetchLookup(
+              order.Reorder(indices_flat), start_i, j, limit_i);
           Tindex key = indices_flat(i);
           bool should_filter = false;
           EVContext<T> var_context;
           EVContext<T> accum_grad_context;
           EVContext<T> accum_update_context;
-          auto var_lock =
-              static_cast<KvVariable<Tindex, T>*>(table_var)->GetScopedKeyLock(
-                  key, LockType::WRITE_LOCK);
+          auto var_lock = apply_lock.Lock(key);
+          row_handles.Seed(i, key, &var_context);
           static_cast<KvVariable<Tindex, T>*>(table_var)->FindOrInsertUnsafe(
               key, &var_context, &should_filter);
           if (should_filter) {
@@ -1960,6 +2370,12 @@ class KvVariableSparseApplyAdadeltaOp : public OpKernel {
           accum_update_ =
               accum_update_ * accum_update_.constant(rho_scalar) +
               update.square() * update.constant(static_cast<T>(1) - rho_scalar);
+          static_cast<KvVariable<Tindex, T>*>(table_var)->CoverUpdateUnsafe(
+              key, &var_context);
+          static_cast<KvVariable<Tindex, T>*>(table_accum_grad)
+              ->CoverUpdateUnsafe(key, &accum_grad_context);
+          static_cast<KvVariable<Tindex, T>*>(table_accum_update)
+              ->CoverUpdateUnsafe(key, &accum_update_context);
           if (need_delta_info) {
             train_deltalist.push_back(i);
           }
@@ -1972,9 +2388,7 @@ class KvVariableSparseApplyAdadeltaOp : public OpKernel {
       };
 
       const int64_t cost = 5000;
-      auto worker_threads = *(ctx->device()->tensorflow_cpu_worker_threads());
-      Shard(worker_threads.num_threads, worker_threads.workers, N, cost,
-            DoWork);
+      ShardIndexOrder(ctx, order, N, cost, DoWork);
     }
     VLOG(1) << "KvVariableSparseApplyAdadeltaOp: "
             << ::tensorflow::Env::Default()->NowMicros() - stime << " ms";
@@ -2028,6 +2442,10 @@ class KvVariableGroupSparseApplyAdadeltaOp : public OpKernel {
     core::ScopedUnref unref_me_accum(table_accum_grad);
     core::ScopedUnref unref_me_accum_update(table_accum_update);
     core::ScopedUnref unref_me_linear(table_linear);
+    OP_REQUIRES_OK(ctx,
+                   TrackSlots<T, Tindex>(table_var, {table_accum_grad,
+                                                     table_accum_update,
+                                                     table_linear}));
 
     OP_REQUIRES(
         ctx, table_var->IsInitialized(),
@@ -2058,8 +2476,10 @@ class KvVariableGroupSparseApplyAdadeltaOp : public OpKernel {
     OP_REQUIRES(ctx, TensorShapeUtils::IsScalar(epsilon.shape()),
                 errors::InvalidArgument("epsilon is not a scalar: ",
                                         epsilon.shape().DebugString()));
-    const Tensor& grad = ctx->input(7);
-    const Tensor& indices = ctx->input(8);
+    Tensor grad = ctx->input(7);
+    Tensor indices = ctx->input(8);
+    OP_REQUIRES_OK(ctx, MaybeSumDuplicateRows<T, Tindex>(ctx, table_var,
+                                                         &indices, {&grad}));
     OP_REQUIRES(ctx, TensorShapeUtils::IsVector(indices.shape()),
                 errors::InvalidArgument("indices must be one-dimensional"));
     const Tensor& l1 = ctx->input(9);
@@ -2132,9 +2552,11 @@ class KvVariableGroupSparseApplyAdadeltaOp : public OpKernel {
                     "Inner dimension should be greater than zero."));
 
     if (N > 0) {
-      auto DoWork = [this, ctx, inner_dim, &table_var, &table_accum_grad,
-                     &table_accum_update, &table_linear, &lr, &rho, &epsilon,
-                     &grad, &indices, &l1, &l2,
+      const IndexOrder order =
+          static_cast<KvVariable<Tindex, T>*>(table_var)->ApplyOrder(indices);
+      auto DoWork = [this, ctx, &order, inner_dim, &table_var,
+                     &table_accum_grad, &table_accum_update, &table_linear, &lr,
+                     &rho, &epsilon, &grad, &indices, &l1, &l2,
                      &l21](int64_t start_i, int64_t limit_i) {
         const int64_t first_dim_size = indices.dim_size(0);
         const int64_t embedding_dim_size = grad.dim_size(1);
@@ -2153,19 +2575,26 @@ class KvVariableGroupSparseApplyAdadeltaOp : public OpKernel {
           train_deltalist.reserve(limit_i - start_i);
         }
 
-        for (int64_t i = start_i; i < limit_i; i++) {
+        auto apply_lock =
+            static_cast<KvVariable<Tindex, T>*>(table_var)->GetApplyLock(order);
+        const auto row_handles =
+            static_cast<KvVariable<Tindex, T>*>(table_var)->GetRowHandles(
+                ctx, indices);
+        for (int64_t j = start_i; j < limit_i; ++j) {
+          const int64_t i = order(j);
           OP_REQUIRES(ctx, FastBoundsCheck(i, first_dim_size),
                       errors::InvalidArgument(strings::StrCat(
                           "Index ", i, " out of range ", first_dim_size)));
+          static_cast<KvVariable<Tindex, T>*>(table_var)->PrefetchLookup(
+              order.Reorder(indices_flat), start_i, j, limit_i);
           Tindex key = indices_flat(i);
           bool should_filter = false;
           EVContext<T> var_context;
           EVContext<T> accum_grad_context;
           EVContext<T> accum_update_context;
           EVContext<T> linear_context;
-          auto var_lock =
-              static_cast<KvVariable<Tindex, T>*>(table_var)->GetScopedKeyLock(
-                  key, LockType::WRITE_LOCK);
+          auto var_lock = apply_lock.Lock(key);
+          row_handles.Seed(i, key, &var_context);
           static_cast<KvVariable<Tindex, T>*>(table_var)->FindOrInsertUnsafe(
               key, &var_context, &should_filter);
           if (should_filter) {
@@ -2198,9 +2627,8 @@ class KvVariableGroupSparseApplyAdadeltaOp : public OpKernel {
   linear += m - (new_accum.sqrt() - accum.sqrt()) / lr_scalar * var;           \
   auto l1_reg_adjust = linear.cwiseMin(l1_scalar).cwiseMax(-l1_scalar);        \
   auto l1_linear = l1_reg_adjust - linear;                                     \
-  using TensorScalar = Eigen::Tensor<T, 0, Eigen::RowMajor>;                   \
-  TensorScalar l1_linear_norm_t = l1_linear.square().sum().sqrt();             \
-  T l1_linear_norm = static_cast<T>(l1_linear_norm_t(0));                      \
+  T l1_linear_norm =                                                           \
+      GroupShrinkNorm(linear.data(), l1_scalar, linear.size());                \
   auto l21_norm = l21_scalar * Eigen::numext::sqrt(static_cast<T>(inner_dim)); \
   if (l1_linear_norm > l21_norm) {                                             \
     l1_linear_norm = static_cast<T>(1) - l21_norm / l1_linear_norm;            \
@@ -2239,9 +2667,7 @@ class KvVariableGroupSparseApplyAdadeltaOp : public OpKernel {
       };
 
       const int64_t cost = 5000;
-      auto worker_threads = *(ctx->device()->tensorflow_cpu_worker_threads());
-      Shard(worker_threads.num_threads, worker_threads.workers, N, cost,
-            DoWork);
+      ShardIndexOrder(ctx, order, N, cost, DoWork);
     }
 
     VLOG(1) << "KvVariableGroupSparseApplyAdadeltaOp: "
@@ -2297,6 +2723,8 @@ class KvVariableGroupSparseApplyMomentumOp : public OpKernel {
     core::ScopedUnref unref_me_accum(table_accum);
     core::ScopedUnref unref_me_linear(table_linear);
     core::ScopedUnref unref_me_m(table_m);
+    OP_REQUIRES_OK(ctx, TrackSlots<T, Tindex>(
+                            table_var, {table_accum, table_linear, table_m}));
 
     OP_REQUIRES(
         ctx, table_var->IsInitialized(),
@@ -2319,8 +2747,10 @@ class KvVariableGroupSparseApplyMomentumOp : public OpKernel {
     OP_REQUIRES(ctx, IsLegacyScalar(lr.shape()),
                 errors::InvalidArgument("lr is not a scalar: ",
                                         lr.shape().DebugString()));
-    const Tensor& grad = ctx->input(5);
-    const Tensor& indices = ctx->input(6);
+    Tensor grad = ctx->input(5);
+    Tensor indices = ctx->input(6);
+    OP_REQUIRES_OK(ctx, MaybeSumDuplicateRows<T, Tindex>(ctx, table_var,
+                                                         &indices, {&grad}));
     OP_REQUIRES(ctx, TensorShapeUtils::IsVector(indices.shape()),
                 errors::InvalidArgument("indices must be one-dimensional"));
     const Tensor& momentum = ctx->input(7);
@@ -2395,7 +2825,9 @@ class KvVariableGroupSparseApplyMomentumOp : public OpKernel {
                     "Inner dimension should be greater than zero."));
 
     if (N > 0) {
-      auto DoWork = [this, ctx, inner_dim, &table_var, &table_accum,
+      const IndexOrder order =
+          static_cast<KvVariable<Tindex, T>*>(table_var)->ApplyOrder(indices);
+      auto DoWork = [this, ctx, &order, inner_dim, &table_var, &table_accum,
                      &table_linear, &table_m, &lr, &grad, &indices, &momentum,
                      &l1, &l2, &l21](int64_t start_i, int64_t limit_i) {
         const int64_t first_dim_size = indices.dim_size(0);
@@ -2415,19 +2847,26 @@ class KvVariableGroupSparseApplyMomentumOp : public OpKernel {
           train_deltalist.reserve(limit_i - start_i);
         }
 
-        for (int64_t i = start_i; i < limit_i; i++) {
+        auto apply_lock =
+            static_cast<KvVariable<Tindex, T>*>(table_var)->GetApplyLock(order);
+        const auto row_handles =
+            static_cast<KvVariable<Tindex, T>*>(table_var)->GetRowHandles(
+                ctx, indices);
+        for (int64_t j = start_i; j < limit_i; ++j) {
+          const int64_t i = order(j);
           OP_REQUIRES(ctx, FastBoundsCheck(i, first_dim_size),
                       errors::InvalidArgument(strings::StrCat(
                           "Index ", i, " out of range ", first_dim_size)));
+          static_cast<KvVariable<Tindex, T>*>(table_var)->PrefetchLookup(
+              order.Reorder(indices_flat), start_i, j, limit_i);
           Tindex key = indices_flat(i);
           bool should_filter = false;
           EVContext<T> var_context;
           EVContext<T> linear_context;
           EVContext<T> m_context;
           EVContext<T> accum_context;
-          auto var_lock =
-              static_cast<KvVariable<Tindex, T>*>(table_var)->GetScopedKeyLock(
-                  key, LockType::WRITE_LOCK);
+          auto var_lock = apply_lock.Lock(key);
+          row_handles.Seed(i, key, &var_context);
           static_cast<KvVariable<Tindex, T>*>(table_var)->FindOrInsertUnsafe(
               key, &var_context, &should_filter);
           if (should_filter) {
@@ -2458,9 +2897,8 @@ class KvVariableGroupSparseApplyMomentumOp : public OpKernel {
   linear += new_m - (new_accum.sqrt() - accum.sqrt()) / lr_scalar * var;       \
   auto l1_reg_adjust = linear.cwiseMin(l1_scalar).cwiseMax(-l1_scalar);        \
   auto l1_linear = l1_reg_adjust - linear;                                     \
-  using TensorScalar = Eigen::Tensor<T, 0, Eigen::RowMajor>;                   \
-  TensorScalar l1_linear_norm_t = l1_linear.square().sum().sqrt();             \
-  T l1_linear_norm = static_cast<T>(l1_linear_norm_t(0));                      \
+  T l1_linear_norm =                                                           \
+      GroupShrinkNorm(linear.data(), l1_scalar, linear.size());                \
   auto l21_norm = l21_scalar * Eigen::numext::sqrt(static_cast<T>(inner_dim)); \
   if (l1_linear_norm > l21_norm) {                                             \
     l1_linear_norm = static_cast<T>(1) - l21_norm / l1_linear_norm;            \
@@ -2493,9 +2931,7 @@ class KvVariableGroupSparseApplyMomentumOp : public OpKernel {
       };
 
       const int64_t cost = 5000;
-      auto worker_threads = *(ctx->device()->tensorflow_cpu_worker_threads());
-      Shard(worker_threads.num_threads, worker_threads.workers, N, cost,
-            DoWork);
+      ShardIndexOrder(ctx, order, N, cost, DoWork);
     }
 
     VLOG(1) << "KvVariableGroupSparseApplyMomentumOp: "
@@ -2554,6 +2990,9 @@ class KvVariableGroupSparseApplyAdaHessianOp : public OpKernel {
     core::ScopedUnref unref_me_m(table_m);
     OP_REQUIRES_OK(ctx, LookupResource(ctx, HandleFromInput(ctx, 4), &table_v));
     core::ScopedUnref unref_me_v(table_v);
+    OP_REQUIRES_OK(ctx,
+                   TrackSlots<T, Tindex>(table_var, {table_accum, table_linear,
+                                                     table_m, table_v}));
 
     OP_REQUIRES(
         ctx, table_var->IsInitialized(),
@@ -2577,9 +3016,11 @@ class KvVariableGroupSparseApplyAdaHessianOp : public OpKernel {
                                    requested_input(4)));
 
     // Get gradients and indices
-    const Tensor& grad = ctx->input(5);
-    const Tensor& indices = ctx->input(6);
-    const Tensor& hessian = ctx->input(7);
+    Tensor grad = ctx->input(5);
+    Tensor indices = ctx->input(6);
+    Tensor hessian = ctx->input(7);
+    OP_REQUIRES_OK(ctx, MaybeSumDuplicateRows<T, Tindex>(
+                            ctx, table_var, &indices, {&grad, &hessian}));
     const Tensor& lr = ctx->input(8);
     const Tensor& beta1_power = ctx->input(9);
     const Tensor& beta2_power = ctx->input(10);
@@ -2686,11 +3127,13 @@ class KvVariableGroupSparseApplyAdaHessianOp : public OpKernel {
                     "Inner dimension should be greater than zero."));
 
     if (N > 0) {
-      auto DoWork = [this, ctx, inner_dim, &table_var, &table_accum,
+      const IndexOrder order =
+          static_cast<KvVariable<Tindex, T>*>(table_var)->ApplyOrder(indices);
+      auto DoWork = [this, ctx, &order, inner_dim, &table_var, &table_accum,
                      &table_linear, &table_m, &table_v, &indices, &grad,
                      &hessian, &lr, &beta1_power, &beta2_power, &beta1, &beta2,
-                     &epsilon, &l1, &l2, &l21]
-                     (int64_t start_i, int64_t limit_i) {
+                     &epsilon, &l1, &l2,
+                     &l21](int64_t start_i, int64_t limit_i) {
         const int64_t first_dim_size = indices.dim_size(0);
         const int64_t embedding_dim_size = grad.dim_size(1);
         auto grad_flat = grad.flat_outer_dims<T>();
@@ -2712,10 +3155,18 @@ class KvVariableGroupSparseApplyAdaHessianOp : public OpKernel {
           train_deltalist.reserve(limit_i - start_i);
         }
 
-        for (int64_t i = start_i; i < limit_i; i++) {
+        auto apply_lock =
+            static_cast<KvVariable<Tindex, T>*>(table_var)->GetApplyLock(order);
+        const auto row_handles =
+            static_cast<KvVariable<Tindex, T>*>(table_var)->GetRowHandles(
+                ctx, indices);
+        for (int64_t j = start_i; j < limit_i; ++j) {
+          const int64_t i = order(j);
           OP_REQUIRES(ctx, FastBoundsCheck(i, first_dim_size),
                       errors::InvalidArgument(strings::StrCat(
                           "Index ", i, " out of range ", first_dim_size)));
+          static_cast<KvVariable<Tindex, T>*>(table_var)->PrefetchLookup(
+              order.Reorder(indices_flat), start_i, j, limit_i);
           Tindex key = indices_flat(i);
           bool should_filter = false;
           EVContext<T> var_context;
@@ -2723,9 +3174,8 @@ class KvVariableGroupSparseApplyAdaHessianOp : public OpKernel {
           EVContext<T> m_context;
           EVContext<T> v_context;
           EVContext<T> linear_context;
-          auto var_lock =
-              static_cast<KvVariable<Tindex, T>*>(table_var)->GetScopedKeyLock(
-                  key, LockType::WRITE_LOCK);
+          auto var_lock = apply_lock.Lock(key);
+          row_handles.Seed(i, key, &var_context);
           static_cast<KvVariable<Tindex, T>*>(table_var)->FindOrInsertUnsafe(
               key, &var_context, &should_filter);
           if (should_filter) {
@@ -2746,23 +3196,22 @@ class KvVariableGroupSparseApplyAdaHessianOp : public OpKernel {
           auto linear =
               FlatVector<T>(linear_context.Value(), embedding_dim_size);
 
-          auto grad = grad_flat.template chip<0>(i);
-          auto hessian = hessian_flat.template chip<0>(i);
+          auto grad = FlatVector<T>(&grad_flat(i, 0), embedding_dim_size);
+          auto hessian =
+              FlatVector<T>(&hessian_flat(i, 0), embedding_dim_size);
 
 // Use a macro to implement the computation here due to the templating of the
 // eigen tensor library.
 #define COMPUTE_ADAHESSIAN(grad_to_use, hessian)                               \
-  m = beta1_scalar * m + (static_cast<T>(1) - beta1_scalar) * grad_to_use;     \
-  v = beta2_scalar * v +                                                       \
-      (static_cast<T>(1) - beta2_scalar) * hessian.square();                   \
+  AdamMoments(m.data(), v.data(), grad_to_use.data(), hessian.data(),          \
+              beta1_scalar, beta2_scalar, m.size());                           \
   auto new_accum = v / (static_cast<T>(1) - beta2_power_scalar);               \
   linear += m / (static_cast<T>(1) - beta1_power_scalar) -                     \
             (new_accum.sqrt() - accum.sqrt()) / lr_scalar * var;               \
   auto l1_reg_adjust = linear.cwiseMin(l1_scalar).cwiseMax(-l1_scalar);        \
   auto l1_linear = l1_reg_adjust - linear;                                     \
-  using TensorScalar = Eigen::Tensor<T, 0, Eigen::RowMajor>;                   \
-  TensorScalar l1_linear_norm_t = l1_linear.square().sum().sqrt();             \
-  T l1_linear_norm = static_cast<T>(l1_linear_norm_t(0));                      \
+  T l1_linear_norm =                                                           \
+      GroupShrinkNorm(linear.data(), l1_scalar, linear.size());                \
   auto l21_norm = l21_scalar * Eigen::numext::sqrt(static_cast<T>(inner_dim)); \
   if (l1_linear_norm > l21_norm) {                                             \
     l1_linear_norm = static_cast<T>(1) - l21_norm / l1_linear_norm;            \
@@ -2801,9 +3250,7 @@ class KvVariableGroupSparseApplyAdaHessianOp : public OpKernel {
       };
 
       const int64_t cost = 5000;
-      auto worker_threads = *(ctx->device()->tensorflow_cpu_worker_threads());
-      Shard(worker_threads.num_threads, worker_threads.workers, N, cost,
-            DoWork);
+      ShardIndexOrder(ctx, order, N, cost, DoWork);
     }
 
     VLOG(1) << "KvVariableGroupSparseApplyAdaHessianOp: "
@@ -3007,6 +3454,9 @@ class KvVariableGroupSparseApplyAdaBeliefOp : public OpKernel {
     core::ScopedUnref unref_me_m(table_m);
     OP_REQUIRES_OK(ctx, LookupResource(ctx, HandleFromInput(ctx, 4), &table_v));
     core::ScopedUnref unref_me_v(table_v);
+    OP_REQUIRES_OK(ctx,
+                   TrackSlots<T, Tindex>(table_var, {table_accum, table_linear,
+                                                     table_m, table_v}));
     OP_REQUIRES(
         ctx, table_var->IsInitialized(),
         errors::FailedPrecondition("Failed to use uninitialized variables: ",
@@ -3029,8 +3479,10 @@ class KvVariableGroupSparseApplyAdaBeliefOp : public OpKernel {
                                    requested_input(4)));
 
     // Get gradients and indices
-    const Tensor& grad = ctx->input(5);
-    const Tensor& indices = ctx->input(6);
+    Tensor grad = ctx->input(5);
+    Tensor indices = ctx->input(6);
+    OP_REQUIRES_OK(ctx, MaybeSumDuplicateRows<T, Tindex>(ctx, table_var,
+                                                         &indices, {&grad}));
     const Tensor& lr = ctx->input(7);
     const Tensor& beta1_power = ctx->input(8);
     const Tensor& beta2_power = ctx->input(9);
@@ -3126,10 +3578,15 @@ class KvVariableGroupSparseApplyAdaBeliefOp : public OpKernel {
                 errors::InvalidArgument(
                     "Inner dimension should be greater than zero."));
     if (N > 0) {
-      auto DoWork = [this, ctx, inner_dim, &table_var, &table_accum,
-                     &table_linear, &table_m, &table_v, &indices, &grad, &lr,
-                     &beta1_power, &beta2_power, &beta1, &beta2, &epsilon, &l1,
-                     &l2, &l21](int64_t start_i, int64_t limit_i) {
+      const IndexOrder order =
+          static_cast<KvVariable<Tindex, T>*>(table_var)->ApplyOrder(indices);
+      const LazyDecay<T, Tindex> lazy_decay(
+          ctx, table_var, beta1.scalar<T>()(), beta2.scalar<T>()());
+      auto DoWork = [this, ctx, &order, &lazy_decay, inner_dim, &table_var,
+                     &table_accum, &table_linear, &table_m, &table_v, &indices,
+                     &grad, &lr, &beta1_power, &beta2_power, &beta1, &beta2,
+                     &epsilon, &l1, &l2,
+                     &l21](int64_t start_i, int64_t limit_i) {
         const int64_t first_dim_size = indices.dim_size(0);
         const int64_t embedding_dim_size = grad.dim_size(1);
         auto grad_flat = grad.flat_outer_dims<T>();
@@ -3149,10 +3606,18 @@ class KvVariableGroupSparseApplyAdaBeliefOp : public OpKernel {
           train_deltalist.reserve(limit_i - start_i);
         }
 
-        for (int64_t i = start_i; i < limit_i; i++) {
+        auto apply_lock =
+            static_cast<KvVariable<Tindex, T>*>(table_var)->GetApplyLock(order);
+        const auto row_handles =
+            static_cast<KvVariable<Tindex, T>*>(table_var)->GetRowHandles(
+                ctx, indices);
+        for (int64_t j = start_i; j < limit_i; ++j) {
+          const int64_t i = order(j);
           OP_REQUIRES(ctx, FastBoundsCheck(i, first_dim_size),
                       errors::InvalidArgument(strings::StrCat(
                           "Index ", i, " out of range ", first_dim_size)));
+          static_cast<KvVariable<Tindex, T>*>(table_var)->PrefetchLookup(
+              order.Reorder(indices_flat), start_i, j, limit_i);
           Tindex key = indices_flat(i);
           bool should_filter = false;
           EVContext<T> var_context;
@@ -3160,9 +3625,8 @@ class KvVariableGroupSparseApplyAdaBeliefOp : public OpKernel {
           EVContext<T> m_context;
           EVContext<T> v_context;
           EVContext<T> linear_context;
-          auto var_lock =
-              static_cast<KvVariable<Tindex, T>*>(table_var)->GetScopedKeyLock(
-                  key, LockType::WRITE_LOCK);
+          auto var_lock = apply_lock.Lock(key);
+          row_handles.Seed(i, key, &var_context);
           static_cast<KvVariable<Tindex, T>*>(table_var)->FindOrInsertUnsafe(
               key, &var_context, &should_filter);
           if (should_filter) {
@@ -3182,36 +3646,28 @@ class KvVariableGroupSparseApplyAdaBeliefOp : public OpKernel {
           auto v = FlatVector<T>(v_context.Value(), embedding_dim_size);
           auto linear =
               FlatVector<T>(linear_context.Value(), embedding_dim_size);
-          auto grad = grad_flat.template chip<0>(i);
+          auto grad = FlatVector<T>(&grad_flat(i, 0), embedding_dim_size);
+          lazy_decay.Apply(key, m.data(), v.data(), embedding_dim_size);
 
 // Use a macro to implement the computation here due to the templating of the
 // eigen tensor library.
 #define COMPUTE_ADABELIEF(grad_to_use)                                         \
-  m = beta1_scalar * m + (static_cast<T>(1) - beta1_scalar) * grad_to_use;     \
-  v = beta2_scalar * v +                                                       \
-      (static_cast<T>(1) - beta2_scalar) * (grad_to_use - m).square();         \
-  auto new_accum = v / (static_cast<T>(1) - beta2_power_scalar);               \
-  linear += m / (static_cast<T>(1) - beta1_power_scalar) -                     \
-            (new_accum.sqrt() - accum.sqrt()) / lr_scalar * var;               \
-  auto l1_reg_adjust = linear.cwiseMin(l1_scalar).cwiseMax(-l1_scalar);        \
-  auto l1_linear = l1_reg_adjust - linear;                                     \
-  using TensorScalar = Eigen::Tensor<T, 0, Eigen::RowMajor>;                   \
-  TensorScalar l1_linear_norm_t = l1_linear.square().sum().sqrt();             \
-  T l1_linear_norm = static_cast<T>(l1_linear_norm_t(0));                      \
+  AdaBeliefMoments(m.data(), v.data(), grad_to_use.data(), beta1_scalar,       \
+                   beta2_scalar, m.size());                                    \
+  AdaptiveLinear(linear.data(), accum.data(), var.data(), m.data(), v.data(),  \
+                 static_cast<T>(1) - beta1_power_scalar,                       \
+                 static_cast<T>(1) - beta2_power_scalar, lr_scalar, false,     \
+                 m.size());                                                    \
   auto l21_norm = l21_scalar * Eigen::numext::sqrt(static_cast<T>(inner_dim)); \
-  if (l1_linear_norm > l21_norm) {                                             \
-    l1_linear_norm = static_cast<T>(1) - l21_norm / l1_linear_norm;            \
-    auto y =                                                                   \
-        (new_accum.sqrt() + new_accum.constant(epsilon_scalar)) / lr_scalar +  \
-        linear.constant(static_cast<T>(2) * l2_scalar);                        \
-    var = l1_linear * l1_linear_norm / y;                                      \
+  if (GroupProximalStep(var.data(), linear.data(), accum.data(), lr_scalar,    \
+                        l1_scalar, l2_scalar, epsilon_scalar, l21_norm,        \
+                        var.size())) {                                         \
     static_cast<KvVariable<Tindex, T>*>(table_var)->CoverUpdateUnsafe(         \
         key, &var_context);                                                    \
   } else {                                                                     \
     static_cast<KvVariable<Tindex, T>*>(table_var)->MarkBlacklistUnsafe(       \
         key, &var_context);                                                    \
   }                                                                            \
-  accum = new_accum;                                                           \
   static_cast<KvVariable<Tindex, T>*>(table_linear)                            \
       ->CoverUpdateUnsafe(key, &linear_context);                               \
   static_cast<KvVariable<Tindex, T>*>(table_accum)                             \
@@ -3234,9 +3690,7 @@ class KvVariableGroupSparseApplyAdaBeliefOp : public OpKernel {
       };
 
       const int64_t cost = 5000;
-      auto worker_threads = *(ctx->device()->tensorflow_cpu_worker_threads());
-      Shard(worker_threads.num_threads, worker_threads.workers, N, cost,
-            DoWork);
+      ShardIndexOrder(ctx, order, N, cost, DoWork);
     }
 
     VLOG(1) << "KvVariableGroupSparseApplyAdaBeliefOp: "
@@ -3425,6 +3879,9 @@ class KvVariableGroupSparseApplyLambOp : public OpKernel {
     core::ScopedUnref unref_me_m(table_m);
     OP_REQUIRES_OK(ctx, LookupResource(ctx, HandleFromInput(ctx, 4), &table_v));
     core::ScopedUnref unref_me_v(table_v);
+    OP_REQUIRES_OK(ctx,
+                   TrackSlots<T, Tindex>(table_var, {table_accum, table_linear,
+                                                     table_m, table_v}));
 
     OP_REQUIRES(
         ctx, table_var->IsInitialized(),
@@ -3448,8 +3905,10 @@ class KvVariableGroupSparseApplyLambOp : public OpKernel {
                                    requested_input(4)));
 
     // Get gradients and indices
-    const Tensor& grad = ctx->input(5);
-    const Tensor& indices = ctx->input(6);
+    Tensor grad = ctx->input(5);
+    Tensor indices = ctx->input(6);
+    OP_REQUIRES_OK(ctx, MaybeSumDuplicateRows<T, Tindex>(ctx, table_var,
+                                                         &indices, {&grad}));
     const Tensor& lr = ctx->input(7);
     const Tensor& beta1_power = ctx->input(8);
     const Tensor& beta2_power = ctx->input(9);
@@ -3553,7 +4012,9 @@ class KvVariableGroupSparseApplyLambOp : public OpKernel {
                     "Inner dimension should be greater than zero."));
 
     if (N > 0) {
-      auto DoWork = [this, ctx, inner_dim, &table_var, &table_accum,
+      const IndexOrder order =
+          static_cast<KvVariable<Tindex, T>*>(table_var)->ApplyOrder(indices);
+      auto DoWork = [this, ctx, &order, inner_dim, &table_var, &table_accum,
                      &table_linear, &table_m, &table_v, &indices, &grad, &lr,
                      &beta1_power, &beta2_power, &beta1, &beta2, &epsilon, &l1,
                      &l2, &l21](int64_t start_i, int64_t limit_i) {
@@ -3577,11 +4038,19 @@ class KvVariableGroupSparseApplyLambOp : public OpKernel {
           train_deltalist.reserve(limit_i - start_i);
         }
 
-        for (int64_t i = start_i; i < limit_i; i++) {
+        auto apply_lock =
+            static_cast<KvVariable<Tindex, T>*>(table_var)->GetApplyLock(order);
+        const auto row_handles =
+            static_cast<KvVariable<Tindex, T>*>(table_var)->GetRowHandles(
+                ctx, indices);
+        for (int64_t j = start_i; j < limit_i; ++j) {
+          const int64_t i = order(j);
           OP_REQUIRES(ctx, FastBoundsCheck(i, first_dim_size),
                       errors::InvalidArgument(strings::StrCat(
                           "Index ", i, " out of range ", first_dim_size)));
 
+          static_cast<KvVariable<Tindex, T>*>(table_var)->PrefetchLookup(
+              order.Reorder(indices_flat), start_i, j, limit_i);
           Tindex key = indices_flat(i);
           bool should_filter = false;
           EVContext<T> var_context;
@@ -3589,9 +4058,8 @@ class KvVariableGroupSparseApplyLambOp : public OpKernel {
           EVContext<T> m_context;
           EVContext<T> v_context;
           EVContext<T> linear_context;
-          auto var_lock =
-              static_cast<KvVariable<Tindex, T>*>(table_var)->GetScopedKeyLock(
-                  key, LockType::WRITE_LOCK);
+          auto var_lock = apply_lock.Lock(key);
+          row_handles.Seed(i, key, &var_context);
           static_cast<KvVariable<Tindex, T>*>(table_var)->FindOrInsertUnsafe(
               key, &var_context, &should_filter);
           if (should_filter) {
@@ -3611,22 +4079,20 @@ class KvVariableGroupSparseApplyLambOp : public OpKernel {
           auto v = FlatVector<T>(v_context.Value(), embedding_dim_size);
           auto linear =
               FlatVector<T>(linear_context.Value(), embedding_dim_size);
-          auto grad = grad_flat.template chip<0>(i);
+          auto grad = FlatVector<T>(&grad_flat(i, 0), embedding_dim_size);
 
 // Use a macro to implement the computation here due to the templating of the
 // eigen tensor library.
 #define COMPUTE_LAMB(grad_to_use)                                              \
-  m = beta1_scalar * m + (static_cast<T>(1) - beta1_scalar) * grad_to_use;     \
-  v = beta2_scalar * v +                                                       \
-      (static_cast<T>(1) - beta2_scalar) * grad_to_use.square();               \
+  AdamMoments(m.data(), v.data(), grad_to_use.data(), grad_to_use.data(),      \
+              beta1_scalar, beta2_scalar, m.size());                           \
   auto new_m = m / (static_cast<T>(1) - beta1_power_scalar);                   \
   auto new_accum = v / (static_cast<T>(1) - beta2_power_scalar);               \
   auto r = new_m / (new_accum.sqrt() + new_accum.constant(epsilon_scalar));    \
   using TensorScalar = Eigen::Tensor<T, 0, Eigen::RowMajor>;                   \
   TensorScalar r_norm_t = r.square().sum().sqrt();                             \
-  TensorScalar var_norm_t = var.square().sum().sqrt();                         \
   T r_norm = static_cast<T>(r_norm_t(0));                                      \
-  T var_norm = static_cast<T>(var_norm_t(0));                                  \
+  T var_norm = RowNorm(var.data(), var.size());                                \
   T ratio = static_cast<T>(1);                                                 \
   if (r_norm > static_cast<T>(0) && var_norm > static_cast<T>(0)) {            \
     ratio = var_norm / (r_norm + static_cast<T>(1e-8));                        \
@@ -3635,8 +4101,8 @@ class KvVariableGroupSparseApplyLambOp : public OpKernel {
             (new_accum.sqrt() - accum.sqrt()) / lr_scalar * var;               \
   auto l1_reg_adjust = linear.cwiseMin(l1_scalar).cwiseMax(-l1_scalar);        \
   auto l1_linear = l1_reg_adjust - linear;                                     \
-  TensorScalar l1_linear_norm_t = l1_linear.square().sum().sqrt();             \
-  T l1_linear_norm = static_cast<T>(l1_linear_norm_t(0));                      \
+  T l1_linear_norm =                                                           \
+      GroupShrinkNorm(linear.data(), l1_scalar, linear.size());                \
   auto l21_norm = l21_scalar * Eigen::numext::sqrt(static_cast<T>(inner_dim)); \
   if (l1_linear_norm > l21_norm) {                                             \
     l1_linear_norm = static_cast<T>(1) - l21_norm / l1_linear_norm;            \
@@ -3673,9 +4139,7 @@ class KvVariableGroupSparseApplyLambOp : public OpKernel {
       };
 
       const int64_t cost = 5000;
-      auto worker_threads = *(ctx->device()->tensorflow_cpu_worker_threads());
-      Shard(worker_threads.num_threads, worker_threads.workers, N, cost,
-            DoWork);
+      ShardIndexOrder(ctx, order, N, cost, DoWork);
     }
 
     VLOG(1) << "KvVariableGroupSparseApplyLambOp: "
@@ -3891,6 +4355,9 @@ class KvVariableGroupSparseApplyLambHessianOp : public OpKernel {
     core::ScopedUnref unref_me_m(table_m);
     OP_REQUIRES_OK(ctx, LookupResource(ctx, HandleFromInput(ctx, 4), &table_v));
     core::ScopedUnref unref_me_v(table_v);
+    OP_REQUIRES_OK(ctx,
+                   TrackSlots<T, Tindex>(table_var, {table_accum, table_linear,
+                                                     table_m, table_v}));
 
     OP_REQUIRES(
         ctx, table_var->IsInitialized(),
@@ -3914,9 +4381,11 @@ class KvVariableGroupSparseApplyLambHessianOp : public OpKernel {
                                    requested_input(4)));
 
     // Get gradients and indices
-    const Tensor& grad = ctx->input(5);
-    const Tensor& indices = ctx->input(6);
-    const Tensor& hessian = ctx->input(7);
+    Tensor grad = ctx->input(5);
+    Tensor indices = ctx->input(6);
+    Tensor hessian = ctx->input(7);
+    OP_REQUIRES_OK(ctx, MaybeSumDuplicateRows<T, Tindex>(
+                            ctx, table_var, &indices, {&grad, &hessian}));
     const Tensor& lr = ctx->input(8);
     const Tensor& beta1_power = ctx->input(9);
     const Tensor& beta2_power = ctx->input(10);
@@ -4024,11 +4493,13 @@ class KvVariableGroupSparseApplyLambHessianOp : public OpKernel {
                     "Inner dimension should be greater than zero."));
 
     if (N > 0) {
-      auto DoWork = [this, ctx, inner_dim, &table_var, &table_accum,
+      const IndexOrder order =
+          static_cast<KvVariable<Tindex, T>*>(table_var)->ApplyOrder(indices);
+      auto DoWork = [this, ctx, &order, inner_dim, &table_var, &table_accum,
                      &table_linear, &table_m, &table_v, &indices, &grad,
                      &hessian, &lr, &beta1_power, &beta2_power, &beta1, &beta2,
-                     &epsilon, &l1, &l2, &l21]
-                     (int64_t start_i, int64_t limit_i) {
+                     &epsilon, &l1, &l2,
+                     &l21](int64_t start_i, int64_t limit_i) {
         const int64_t first_dim_size = indices.dim_size(0);
         const int64_t embedding_dim_size = grad.dim_size(1);
         auto grad_flat = grad.flat_outer_dims<T>();
@@ -4050,11 +4521,19 @@ class KvVariableGroupSparseApplyLambHessianOp : public OpKernel {
           train_deltalist.reserve(limit_i - start_i);
         }
 
-        for (int64_t i = start_i; i < limit_i; i++) {
+        auto apply_lock =
+            static_cast<KvVariable<Tindex, T>*>(table_var)->GetApplyLock(order);
+        const auto row_handles =
+            static_cast<KvVariable<Tindex, T>*>(table_var)->GetRowHandles(
+                ctx, indices);
+        for (int64_t j = start_i; j < limit_i; ++j) {
+          const int64_t i = order(j);
           OP_REQUIRES(ctx, FastBoundsCheck(i, first_dim_size),
                       errors::InvalidArgument(strings::StrCat(
                           "Index ", i, " out of range ", first_dim_size)));
 
+          static_cast<KvVariable<Tindex, T>*>(table_var)->PrefetchLookup(
+              order.Reorder(indices_flat), start_i, j, limit_i);
           Tindex key = indices_flat(i);
           bool should_filter = false;
           EVContext<T> var_context;
@@ -4062,9 +4541,8 @@ class KvVariableGroupSparseApplyLambHessianOp : public OpKernel {
           EVContext<T> m_context;
           EVContext<T> v_context;
           EVContext<T> linear_context;
-          auto var_lock =
-              static_cast<KvVariable<Tindex, T>*>(table_var)->GetScopedKeyLock(
-                  key, LockType::WRITE_LOCK);
+          auto var_lock = apply_lock.Lock(key);
+          row_handles.Seed(i, key, &var_context);
           static_cast<KvVariable<Tindex, T>*>(table_var)->FindOrInsertUnsafe(
               key, &var_context, &should_filter);
           if (should_filter) {
@@ -4084,23 +4562,22 @@ class KvVariableGroupSparseApplyLambHessianOp : public OpKernel {
           auto v = FlatVector<T>(v_context.Value(), embedding_dim_size);
           auto linear =
               FlatVector<T>(linear_context.Value(), embedding_dim_size);
-          auto grad = grad_flat.template chip<0>(i);
-          auto hessian = hessian_flat.template chip<0>(i);
+          auto grad = FlatVector<T>(&grad_flat(i, 0), embedding_dim_size);
+          auto hessian =
+              FlatVector<T>(&hessian_flat(i, 0), embedding_dim_size);
 
 // Use a macro to implement the computation here due to the templating of the
 // eigen tensor library.
 #define COMPUTE_LAMBHESSIAN(grad_to_use, hessian)                              \
-  m = beta1_scalar * m + (static_cast<T>(1) - beta1_scalar) * grad_to_use;     \
-  v = beta2_scalar * v +                                                       \
-      (static_cast<T>(1) - beta2_scalar) * hessian.square();                   \
+  AdamMoments(m.data(), v.data(), grad_to_use.data(), hessian.data(),          \
+              beta1_scalar, beta2_scalar, m.size());                           \
   auto new_m = m / (static_cast<T>(1) - beta1_power_scalar);                   \
   auto new_accum = v / (static_cast<T>(1) - beta2_power_scalar);               \
   auto r = new_m / (new_accum.sqrt() + new_accum.constant(epsilon_scalar));    \
   using TensorScalar = Eigen::Tensor<T, 0, Eigen::RowMajor>;                   \
   TensorScalar r_norm_t = r.square().sum().sqrt();                             \
-  TensorScalar var_norm_t = var.square().sum().sqrt();                         \
   T r_norm = static_cast<T>(r_norm_t(0));                                      \
-  T var_norm = static_cast<T>(var_norm_t(0));                                  \
+  T var_norm = RowNorm(var.data(), var.size());                                \
   T ratio = static_cast<T>(1);                                                 \
   if (r_norm > static_cast<T>(0) && var_norm > static_cast<T>(0)) {            \
     ratio = var_norm / (r_norm + static_cast<T>(1e-8));                        \
@@ -4109,8 +4586,8 @@ class KvVariableGroupSparseApplyLambHessianOp : public OpKernel {
             (new_accum.sqrt() - accum.sqrt()) / lr_scalar * var;               \
   auto l1_reg_adjust = linear.cwiseMin(l1_scalar).cwiseMax(-l1_scalar);        \
   auto l1_linear = l1_reg_adjust - linear;                                     \
-  TensorScalar l1_linear_norm_t = l1_linear.square().sum().sqrt();             \
-  T l1_linear_norm = static_cast<T>(l1_linear_norm_t(0));                      \
+  T l1_linear_norm =                                                           \
+      GroupShrinkNorm(linear.data(), l1_scalar, linear.size());                \
   auto l21_norm = l21_scalar * Eigen::numext::sqrt(static_cast<T>(inner_dim)); \
   if (l1_linear_norm > l21_norm) {                                             \
     l1_linear_norm = static_cast<T>(1) - l21_norm / l1_linear_norm;            \
@@ -4147,9 +4624,7 @@ class KvVariableGroupSparseApplyLambHessianOp : public OpKernel {
       };
 
       const int64_t cost = 5000;
-      auto worker_threads = *(ctx->device()->tensorflow_cpu_worker_threads());
-      Shard(worker_threads.num_threads, worker_threads.workers, N, cost,
-            DoWork);
+      ShardIndexOrder(ctx, order, N, cost, DoWork);
     }
 
     VLOG(1) << "KvVariableGroupSparseApplyLambHessianOp: "
@@ -4482,6 +4957,7 @@ class KvVariableSparseApplyAdaDQHOp : public OpKernel {
     core::ScopedUnref unref_me_m(table_m);
     OP_REQUIRES_OK(ctx, LookupResource(ctx, HandleFromInput(ctx, 2), &table_v));
     core::ScopedUnref unref_me_v(table_v);
+    OP_REQUIRES_OK(ctx, TrackSlots<T, Tindex>(table_var, {table_m, table_v}));
     OP_REQUIRES(
         ctx, table_var->IsInitialized(),
         errors::FailedPrecondition("Failed to use uninitialized variables: ",
@@ -4496,8 +4972,10 @@ class KvVariableSparseApplyAdaDQHOp : public OpKernel {
                                    requested_input(2)));
 
     // Get gradients and indices
-    const Tensor& grad = ctx->input(3);
-    const Tensor& indices = ctx->input(4);
+    Tensor grad = ctx->input(3);
+    Tensor indices = ctx->input(4);
+    OP_REQUIRES_OK(ctx, MaybeSumDuplicateRows<T, Tindex>(ctx, table_var,
+                                                         &indices, {&grad}));
     const Tensor& lr = ctx->input(5);
     const Tensor& beta1_power = ctx->input(6);
     const Tensor& beta2_power = ctx->input(7);
@@ -4561,9 +5039,11 @@ class KvVariableSparseApplyAdaDQHOp : public OpKernel {
                     "Inner dimension should be greater than zero."));
 
     if (N > 0) {
-      auto DoWork = [this, ctx, inner_dim, &table_var, &table_m,
-                     &table_v, &indices, &grad, &lr,
-                     &beta1_power, &beta2_power, &beta1, &beta2,
+      const IndexOrder order =
+          static_cast<KvVariable<Tindex, T>*>(table_var)->ApplyOrder(indices);
+      auto DoWork = [this, ctx, &order, inner_dim, &table_var, &table_m,
+                     &table_v, &indices, &grad, &lr, &beta1_power, &beta2_power,
+                     &beta1, &beta2,
                      &epsilon](int64_t start_i, int64_t limit_i) {
         const int64_t first_dim_size = indices.dim_size(0);
         const int64_t embedding_dim_size = grad.dim_size(1);
@@ -4581,18 +5061,25 @@ class KvVariableSparseApplyAdaDQHOp : public OpKernel {
           train_deltalist.reserve(limit_i - start_i);
         }
 
-        for (int64_t i = start_i; i < limit_i; i++) {
+        auto apply_lock =
+            static_cast<KvVariable<Tindex, T>*>(table_var)->GetApplyLock(order);
+        const auto row_handles =
+            static_cast<KvVariable<Tindex, T>*>(table_var)->GetRowHandles(
+                ctx, indices);
+        for (int64_t j = start_i; j < limit_i; ++j) {
+          const int64_t i = order(j);
           OP_REQUIRES(ctx, FastBoundsCheck(i, first_dim_size),
                       errors::InvalidArgument(strings::StrCat(
                           "Index ", i, " out of range ", first_dim_size)));
+          static_cast<KvVariable<Tindex, T>*>(table_var)->PrefetchLookup(
+              order.Reorder(indices_flat), start_i, j, limit_i);
           Tindex key = indices_flat(i);
           bool should_filter = false;
           EVContext<T> var_context;
           EVContext<T> m_context;
           EVContext<T> v_context;
-          auto var_lock =
-              static_cast<KvVariable<Tindex, T>*>(table_var)->GetScopedKeyLock(
-                  key, LockType::WRITE_LOCK);
+          auto var_lock = apply_lock.Lock(key);
+          row_handles.Seed(i, key, &var_context);
           static_cast<KvVariable<Tindex, T>*>(table_var)->FindOrInsertUnsafe(
               key, &var_context, &should_filter);
           if (should_filter) {
@@ -4628,6 +5115,12 @@ class KvVariableSparseApplyAdaDQHOp : public OpKernel {
               Eigen::numext::sqrt(static_cast<T>(1) - beta2_power_scalar));    \
   m = beta1_scalar * m + (static_cast<T>(1) - beta1_scalar) * grad_to_use;
           COMPUTE_ADADQH(grad);
+          static_cast<KvVariable<Tindex, T>*>(table_var)->CoverUpdateUnsafe(
+              key, &var_context);
+          static_cast<KvVariable<Tindex, T>*>(table_m)
+              ->CoverUpdateUnsafe(key, &m_context);
+          static_cast<KvVariable<Tindex, T>*>(table_v)
+              ->CoverUpdateUnsafe(key, &v_context);
           if (need_delta_info) {
             train_deltalist.push_back(i);
           }
@@ -4639,9 +5132,7 @@ class KvVariableSparseApplyAdaDQHOp : public OpKernel {
       };
 
       const int64_t cost = 5000;
-      auto worker_threads = *(ctx->device()->tensorflow_cpu_worker_threads());
-      Shard(worker_threads.num_threads, worker_threads.workers, N, cost,
-            DoWork);
+      ShardIndexOrder(ctx, order, N, cost, DoWork);
     }
 
     VLOG(1) << "KvVariableSparseApplyAdaDQHOp: "
@@ -4876,6 +5367,8 @@ class KvVariableGroupSparseApplyAdaDQHOp : public OpKernel {
     OP_REQUIRES_OK(ctx,
                    LookupResource(ctx, HandleFromInput(ctx, 3), &table_linear));
     core::ScopedUnref unref_me_linear(table_linear);
+    OP_REQUIRES_OK(ctx, TrackSlots<T, Tindex>(
+                            table_var, {table_m, table_v, table_linear}));
     OP_REQUIRES(
         ctx, table_var->IsInitialized(),
         errors::FailedPrecondition("Failed to use uninitialized variables: ",
@@ -4894,8 +5387,10 @@ class KvVariableGroupSparseApplyAdaDQHOp : public OpKernel {
                                    requested_input(3)));
 
     // Get gradients and indices
-    const Tensor& grad = ctx->input(4);
-    const Tensor& indices = ctx->input(5);
+    Tensor grad = ctx->input(4);
+    Tensor indices = ctx->input(5);
+    OP_REQUIRES_OK(ctx, MaybeSumDuplicateRows<T, Tindex>(ctx, table_var,
+                                                         &indices, {&grad}));
     const Tensor& lr = ctx->input(6);
     const Tensor& beta1_power = ctx->input(7);
     const Tensor& beta2_power = ctx->input(8);
@@ -4987,10 +5482,12 @@ class KvVariableGroupSparseApplyAdaDQHOp : public OpKernel {
                     "Inner dimension should be greater than zero."));
 
     if (N > 0) {
-      auto DoWork = [this, ctx, inner_dim, &table_var, &table_m, &table_v,
-                     &table_linear, &indices, &grad, &lr, &beta1_power,
-                     &beta2_power, &beta1, &beta2, &epsilon, &l1, &l2,
-                     &l21](int64_t start_i, int64_t limit_i) {
+      const IndexOrder order =
+          static_cast<KvVariable<Tindex, T>*>(table_var)->ApplyOrder(indices);
+      auto DoWork = [this, ctx, &order, inner_dim, &table_var, &table_m,
+                     &table_v, &table_linear, &indices, &grad, &lr,
+                     &beta1_power, &beta2_power, &beta1, &beta2, &epsilon, &l1,
+                     &l2, &l21](int64_t start_i, int64_t limit_i) {
         const int64_t first_dim_size = indices.dim_size(0);
         const int64_t embedding_dim_size = grad.dim_size(1);
         auto grad_flat = grad.flat_outer_dims<T>();
@@ -5010,19 +5507,26 @@ class KvVariableGroupSparseApplyAdaDQHOp : public OpKernel {
           train_deltalist.reserve(limit_i - start_i);
         }
 
-        for (int64_t i = start_i; i < limit_i; i++) {
+        auto apply_lock =
+            static_cast<KvVariable<Tindex, T>*>(table_var)->GetApplyLock(order);
+        const auto row_handles =
+            static_cast<KvVariable<Tindex, T>*>(table_var)->GetRowHandles(
+                ctx, indices);
+        for (int64_t j = start_i; j < limit_i; ++j) {
+          const int64_t i = order(j);
           OP_REQUIRES(ctx, FastBoundsCheck(i, first_dim_size),
                       errors::InvalidArgument(strings::StrCat(
                           "Index ", i, " out of range ", first_dim_size)));
+          static_cast<KvVariable<Tindex, T>*>(table_var)->PrefetchLookup(
+              order.Reorder(indices_flat), start_i, j, limit_i);
           Tindex key = indices_flat(i);
           bool should_filter = false;
           EVContext<T> var_context;
           EVContext<T> linear_context;
           EVContext<T> m_context;
           EVContext<T> v_context;
-          auto var_lock =
-              static_cast<KvVariable<Tindex, T>*>(table_var)->GetScopedKeyLock(
-                  key, LockType::WRITE_LOCK);
+          auto var_lock = apply_lock.Lock(key);
+          row_handles.Seed(i, key, &var_context);
           static_cast<KvVariable<Tindex, T>*>(table_var)->FindOrInsertUnsafe(
               key, &var_context, &should_filter);
           if (should_filter) {
@@ -5069,9 +5573,8 @@ class KvVariableGroupSparseApplyAdaDQHOp : public OpKernel {
                                 lr_scalar * var;                               \
   auto l1_reg_adjust = linear.cwiseMin(l1_scalar).cwiseMax(-l1_scalar);        \
   auto l1_linear = l1_reg_adjust - linear;                                     \
-  using TensorScalar = Eigen::Tensor<T, 0, Eigen::RowMajor>;                   \
-  TensorScalar l1_linear_norm_t = l1_linear.square().sum().sqrt();             \
-  T l1_linear_norm = static_cast<T>(l1_linear_norm_t(0));                      \
+  T l1_linear_norm =                                                           \
+      GroupShrinkNorm(linear.data(), l1_scalar, linear.size());                \
   auto l21_norm = l21_scalar * Eigen::numext::sqrt(static_cast<T>(inner_dim)); \
   if (l1_linear_norm > l21_norm) {                                             \
     l1_linear_norm = static_cast<T>(1) - l21_norm / l1_linear_norm;            \
@@ -5105,9 +5608,7 @@ class KvVariableGroupSparseApplyAdaDQHOp : public OpKernel {
       };
 
       const int64_t cost = 5000;
-      auto worker_threads = *(ctx->device()->tensorflow_cpu_worker_threads());
-      Shard(worker_threads.num_threads, worker_threads.workers, N, cost,
-            DoWork);
+      ShardIndexOrder(ctx, order, N, cost, DoWork);
     }
 
     VLOG(1) << "KvVariableGroupSparseApplyAdaDQHOp: "
@@ -5161,6 +5662,8 @@ class KvVariableGroupSparseApplyAdaDQHV2Op : public OpKernel {
     OP_REQUIRES_OK(ctx,
                    LookupResource(ctx, HandleFromInput(ctx, 3), &table_linear));
     core::ScopedUnref unref_me_linear(table_linear);
+    OP_REQUIRES_OK(ctx, TrackSlots<T, Tindex>(
+                            table_var, {table_m, table_v, table_linear}));
     OP_REQUIRES(
         ctx, table_var->IsInitialized(),
         errors::FailedPrecondition("Failed to use uninitialized variables: ",
@@ -5179,8 +5682,10 @@ class KvVariableGroupSparseApplyAdaDQHV2Op : public OpKernel {
                                    requested_input(3)));
 
     // Get gradients and indices
-    const Tensor& grad = ctx->input(4);
-    const Tensor& indices = ctx->input(5);
+    Tensor grad = ctx->input(4);
+    Tensor indices = ctx->input(5);
+    OP_REQUIRES_OK(ctx, MaybeSumDuplicateRows<T, Tindex>(ctx, table_var,
+                                                         &indices, {&grad}));
     const Tensor& lr = ctx->input(6);
     const Tensor& beta1_power = ctx->input(7);
     const Tensor& beta2_power = ctx->input(8);
@@ -5294,8 +5799,10 @@ class KvVariableGroupSparseApplyAdaDQHV2Op : public OpKernel {
       Eigen::numext::sqrt(static_cast<T>(inner_dim));
 
     if (N > 0) {
-      auto DoWork = [this, ctx, &table_var, &table_m, &table_v, &table_linear,
-                     &indices, &grad, &beta1_power_scalar,
+      const IndexOrder order =
+          static_cast<KvVariable<Tindex, T>*>(table_var)->ApplyOrder(indices);
+      auto DoWork = [this, ctx, &order, &table_var, &table_m, &table_v,
+                     &table_linear, &indices, &grad, &beta1_power_scalar,
                      &beta2_power_scalar, &beta1_scalar, &beta2_scalar,
                      &epsilon_adjust, &last_epsilon_adjust, &l1_scalar,
                      &l2_scalar, &l21_norm, &alpha, first_dim_size,
@@ -5308,19 +5815,26 @@ class KvVariableGroupSparseApplyAdaDQHV2Op : public OpKernel {
           train_deltalist.reserve(limit_i - start_i);
         }
 
-        for (int64_t i = start_i; i < limit_i; i++) {
+        auto apply_lock =
+            static_cast<KvVariable<Tindex, T>*>(table_var)->GetApplyLock(order);
+        const auto row_handles =
+            static_cast<KvVariable<Tindex, T>*>(table_var)->GetRowHandles(
+                ctx, indices);
+        for (int64_t j = start_i; j < limit_i; ++j) {
+          const int64_t i = order(j);
           OP_REQUIRES(ctx, FastBoundsCheck(i, first_dim_size),
                       errors::InvalidArgument(strings::StrCat(
                           "Index ", i, " out of range ", first_dim_size)));
+          static_cast<KvVariable<Tindex, T>*>(table_var)->PrefetchLookup(
+              order.Reorder(indices_flat), start_i, j, limit_i);
           Tindex key = indices_flat(i);
           bool should_filter = false;
           EVContext<T> var_context;
           EVContext<T> linear_context;
           EVContext<T> m_context;
           EVContext<T> v_context;
-          auto var_lock =
-              static_cast<KvVariable<Tindex, T>*>(table_var)->GetScopedKeyLock(
-                  key, LockType::WRITE_LOCK);
+          auto var_lock = apply_lock.Lock(key);
+          row_handles.Seed(i, key, &var_context);
           static_cast<KvVariable<Tindex, T>*>(table_var)->FindOrInsertUnsafe(
               key, &var_context, &should_filter);
           if (should_filter) {
@@ -5359,9 +5873,8 @@ class KvVariableGroupSparseApplyAdaDQHV2Op : public OpKernel {
   linear += m_new * alpha - (accum_new - accum) * var;                         \
   auto l1_reg_adjust = linear.cwiseMin(l1_scalar).cwiseMax(-l1_scalar);        \
   auto l1_linear = l1_reg_adjust - linear;                                     \
-  using TensorScalar = Eigen::Tensor<T, 0, Eigen::RowMajor>;                   \
-  TensorScalar l1_linear_norm_t = l1_linear.square().sum().sqrt();             \
-  T l1_linear_norm = static_cast<T>(l1_linear_norm_t(0));                      \
+  T l1_linear_norm =                                                           \
+      GroupShrinkNorm(linear.data(), l1_scalar, linear.size());                \
   if (l1_linear_norm > l21_norm) {                                             \
     l1_linear_norm = static_cast<T>(1) - l21_norm / l1_linear_norm;            \
     auto y = v_new.sqrt().cwiseMax(epsilon_adjust) +                           \
@@ -5394,9 +5907,7 @@ class KvVariableGroupSparseApplyAdaDQHV2Op : public OpKernel {
         table_v->MarkAsDeltaListElements(ctx, indices, train_deltalist);
       };
       const int64_t cost = 5000;
-      auto worker_threads = *(ctx->device()->tensorflow_cpu_worker_threads());
-      Shard(worker_threads.num_threads, worker_threads.workers, N, cost,
-            DoWork);
+      ShardIndexOrder(ctx, order, N, cost, DoWork);
     }
 
     VLOG(1) << "KvVariableGroupSparseApplyAdaDQHV2Op: "
@@ -5449,6 +5960,8 @@ class KvVariableGroupSparseApplyAdamV2Op : public OpKernel {
     core::ScopedUnref unref_me_m(table_m);
     OP_REQUIRES_OK(ctx, LookupResource(ctx, HandleFromInput(ctx, 3), &table_v));
     core::ScopedUnref unref_me_v(table_v);
+    OP_REQUIRES_OK(ctx, TrackSlots<T, Tindex>(
+                            table_var, {table_linear, table_m, table_v}));
 
     OP_REQUIRES(
         ctx, table_var->IsInitialized(),
@@ -5468,8 +5981,10 @@ class KvVariableGroupSparseApplyAdamV2Op : public OpKernel {
                                    requested_input(3)));
 
     // Get gradients and indices
-    const Tensor& grad = ctx->input(4);
-    const Tensor& indices = ctx->input(5);
+    Tensor grad = ctx->input(4);
+    Tensor indices = ctx->input(5);
+    OP_REQUIRES_OK(ctx, MaybeSumDuplicateRows<T, Tindex>(ctx, table_var,
+                                                         &indices, {&grad}));
     const Tensor& lr = ctx->input(6);
     const Tensor& beta1_power = ctx->input(7);
     const Tensor& beta2_power = ctx->input(8);
@@ -5566,10 +6081,14 @@ class KvVariableGroupSparseApplyAdamV2Op : public OpKernel {
                     "Inner dimension should be greater than zero."));
 
     if (N > 0) {
-      auto DoWork = [this, ctx, inner_dim, &table_var, &table_linear, &table_m,
-                     &table_v, &indices, &grad, &lr, &beta1_power, &beta2_power,
-                     &beta1, &beta2, &epsilon, &l1, &l2,
-                     &l21](int64_t start_i, int64_t limit_i) {
+      const IndexOrder order =
+          static_cast<KvVariable<Tindex, T>*>(table_var)->ApplyOrder(indices);
+      const LazyDecay<T, Tindex> lazy_decay(
+          ctx, table_var, beta1.scalar<T>()(), beta2.scalar<T>()());
+      auto DoWork = [this, ctx, &order, &lazy_decay, inner_dim, &table_var,
+                     &table_linear, &table_m, &table_v, &indices, &grad, &lr,
+                     &beta1_power, &beta2_power, &beta1, &beta2, &epsilon, &l1,
+                     &l2, &l21](int64_t start_i, int64_t limit_i) {
         const int64_t first_dim_size = indices.dim_size(0);
         const int64_t embedding_dim_size = grad.dim_size(1);
         auto grad_flat = grad.flat_outer_dims<T>();
@@ -5590,20 +6109,27 @@ class KvVariableGroupSparseApplyAdamV2Op : public OpKernel {
           train_deltalist.reserve(limit_i - start_i);
         }
 
-        for (int64_t i = start_i; i < limit_i; i++) {
+        auto apply_lock =
+            static_cast<KvVariable<Tindex, T>*>(table_var)->GetApplyLock(order);
+        const auto row_handles =
+            static_cast<KvVariable<Tindex, T>*>(table_var)->GetRowHandles(
+                ctx, indices);
+        for (int64_t j = start_i; j < limit_i; ++j) {
+          const int64_t i = order(j);
           OP_REQUIRES(ctx, FastBoundsCheck(i, first_dim_size),
                       errors::InvalidArgument(strings::StrCat(
                           "Index ", i, " out of range ", first_dim_size)));
 
+          static_cast<KvVariable<Tindex, T>*>(table_var)->PrefetchLookup(
+              order.Reorder(indices_flat), start_i, j, limit_i);
           Tindex key = indices_flat(i);
           bool should_filter = false;
           EVContext<T> var_context;
           EVContext<T> linear_context;
           EVContext<T> m_context;
           EVContext<T> v_context;
-          auto var_lock =
-              static_cast<KvVariable<Tindex, T>*>(table_var)->GetScopedKeyLock(
-                  key, LockType::WRITE_LOCK);
+          auto var_lock = apply_lock.Lock(key);
+          row_handles.Seed(i, key, &var_context);
           static_cast<KvVariable<Tindex, T>*>(table_var)->FindOrInsertUnsafe(
               key, &var_context, &should_filter);
           if (should_filter) {
@@ -5621,6 +6147,7 @@ class KvVariableGroupSparseApplyAdamV2Op : public OpKernel {
           auto m = FlatVector<T>(m_context.Value(), embedding_dim_size);
           auto v = FlatVector<T>(v_context.Value(), embedding_dim_size);
           auto grad = grad_flat.template chip<0>(i);
+          lazy_decay.Apply(key, m.data(), v.data(), embedding_dim_size);
 
 // Use a macro to implement the computation here due to the templating of the
 // eigen tensor library.
@@ -5640,9 +6167,8 @@ class KvVariableGroupSparseApplyAdamV2Op : public OpKernel {
   }                                                                            \
   auto l1_reg_adjust = linear.cwiseMin(l1_scalar).cwiseMax(-l1_scalar);        \
   auto l1_linear = l1_reg_adjust - linear;                                     \
-  using TensorScalar = Eigen::Tensor<T, 0, Eigen::RowMajor>;                   \
-  TensorScalar l1_linear_norm_t = l1_linear.square().sum().sqrt();             \
-  T l1_linear_norm = static_cast<T>(l1_linear_norm_t(0));                      \
+  T l1_linear_norm =                                                           \
+      GroupShrinkNorm(linear.data(), l1_scalar, linear.size());                \
   auto l21_norm = l21_scalar * Eigen::numext::sqrt(static_cast<T>(inner_dim)); \
   if (l1_linear_norm > l21_norm) {                                             \
     l1_linear_norm = static_cast<T>(1) - l21_norm / l1_linear_norm;            \
@@ -5675,9 +6201,7 @@ class KvVariableGroupSparseApplyAdamV2Op : public OpKernel {
       };
 
       const int64_t cost = 5000;
-      auto worker_threads = *(ctx->device()->tensorflow_cpu_worker_threads());
-      Shard(worker_threads.num_threads, worker_threads.workers, N, cost,
-            DoWork);
+      ShardIndexOrder(ctx, order, N, cost, DoWork);
     }
 
     VLOG(1) << "KvVariableGroupSparseApplyAdamV2Op: "
@@ -5706,6 +6230,124 @@ TF_CALL_float(REGISTER_CPU_KERNELS);
 #undef REGISTER_CPU_KERNELS
 #undef REGISTER_KERNELS
 
+// The scalars of a KvVariableGroupSparseApplyAdamV3, alpha is the bias
+// correction of lr and l21_norm the l21 strength scaled to a row.
+template <typename T>
+struct GroupAdamV3Scalars {
+  T lr;
+  T beta1_power;
+  T beta1;
+  T beta2;
+  T epsilon;
+  T l1;
+  T l2;
+  T alpha;
+  T l21_norm;
+};
+
+// Applies KvVariableGroupSparseApplyAdamV3 to positions
+// order[start_i, limit_i) of indices, BatchKvVariableGroupSparseApplyAdamV3
+// calls it for each variable.
+template <typename T, typename Tindex>
+void GroupSparseApplyAdamV3Range(
+    OpKernelContext* ctx, KvVariableInterface* table_var,
+    KvVariableInterface* table_m_v_linear, const Tensor& indices,
+    const Tensor& grad, const IndexOrder& order,
+    const typename KvVariable<Tindex, T>::RowHandles& row_handles,
+    const LazyDecay<T, Tindex>& lazy_decay,
+    const GroupAdamV3Scalars<T>& scalars, int64_t start_i, int64_t limit_i) {
+  const T lr_scalar = scalars.lr;
+  const T beta1_power_scalar = scalars.beta1_power;
+  const T beta1_scalar = scalars.beta1;
+  const T beta2_scalar = scalars.beta2;
+  const T epsilon_scalar = scalars.epsilon;
+  const T l1_scalar = scalars.l1;
+  const T l2_scalar = scalars.l2;
+  const T alpha = scalars.alpha;
+  const T l21_norm = scalars.l21_norm;
+  const int64_t first_dim_size = indices.dim_size(0);
+  const int64_t embedding_dim_size = grad.dim_size(1);
+  const size_t value_bytes = embedding_dim_size * sizeof(T);
+  auto grad_flat = grad.flat_outer_dims<T>();
+  auto indices_flat = indices.flat<Tindex>();
+  // prepare phstore variables
+  std::vector<int64> train_deltalist;
+  train_deltalist.reserve(limit_i - start_i);
+  std::unique_ptr<T, void (*)(T*)> buf_var(
+      static_cast<T*>(AllocateRaw(value_bytes)), DeallocateRaw<T>);
+  std::unique_ptr<T, void (*)(T*)> buf_opt(
+      static_cast<T*>(AllocateRaw(value_bytes * 3)), DeallocateRaw<T>);
+  auto apply_lock =
+      static_cast<KvVariable<Tindex, T>*>(table_var)->GetApplyLock(order);
+  for (int64_t j = start_i; j < limit_i; ++j) {
+    const int64_t i = order(j);
+    OP_REQUIRES(ctx, FastBoundsCheck(i, first_dim_size),
+                errors::InvalidArgument(strings::StrCat(
+                    "Index ", i, " out of range ", first_dim_size)));
+    static_cast<KvVariable<Tindex, T>*>(table_var)->PrefetchLookup(
+        order.Reorder(indices_flat), start_i, j, limit_i);
+    Tindex key = indices_flat(i);
+    bool should_filter = false;
+    EVContext<T> var_context(buf_var.get(), false);
+    auto var_lock = apply_lock.Lock(key);
+    row_handles.Seed(i, key, &var_context);
+    static_cast<KvVariable<Tindex, T>*>(table_var)->FindOrInsertUnsafe(
+        key, &var_context, &should_filter);
+    if (should_filter) {
+      continue;
+    }
+    auto var = FlatVector<T>(var_context.Value(), embedding_dim_size);
+    EVContext<T> opt_value_context(buf_opt.get(), false);
+    static_cast<KvVariable<Tindex, T>*>(table_m_v_linear)
+        ->FindOrInsertUnsafe(key, &opt_value_context, nullptr);
+    auto m = FlatVector<T>(opt_value_context.Value(), embedding_dim_size);
+    auto v = FlatVector<T>(opt_value_context.Value() + embedding_dim_size,
+                           embedding_dim_size);
+    auto linear =
+        FlatVector<T>(opt_value_context.Value() + 2 * embedding_dim_size,
+                      embedding_dim_size);
+    auto grad_value = grad_flat.template chip<0>(i);
+    lazy_decay.Apply(key, m.data(), v.data(), embedding_dim_size);
+// Use a macro to implement the computation here due to the templating of the
+// eigen tensor library.
+#define COMPUTE_ADAM(grad_to_use)                                          \
+  m = beta1_scalar * m + (static_cast<T>(1) - beta1_scalar) * grad_to_use; \
+  auto new_v = beta2_scalar * v +                                          \
+               (static_cast<T>(1) - beta2_scalar) * grad_to_use.square();  \
+  auto new_v_sqrt = new_v.sqrt();                                          \
+  if (beta1_scalar > beta1_power_scalar) {                                 \
+    linear += alpha * m - (new_v_sqrt - v.sqrt()) / lr_scalar * var;       \
+  } else {                                                                 \
+    linear +=                                                              \
+        alpha * m - (new_v_sqrt - v.sqrt() + v.constant(epsilon_scalar)) / \
+                        lr_scalar * var;                                   \
+  }                                                                        \
+  auto l1_reg_adjust = linear.cwiseMin(l1_scalar).cwiseMax(-l1_scalar);    \
+  auto l1_linear = l1_reg_adjust - linear;                                 \
+  T l1_linear_norm =                                                       \
+      GroupShrinkNorm(linear.data(), l1_scalar, linear.size());            \
+  if (l1_linear_norm > l21_norm) {                                         \
+    l1_linear_norm = static_cast<T>(1) - l21_norm / l1_linear_norm;        \
+    auto y = (new_v_sqrt + new_v.constant(epsilon_scalar)) / lr_scalar +   \
+             linear.constant(static_cast<T>(2) * l2_scalar);               \
+    var = l1_linear * l1_linear_norm / y;                                  \
+    static_cast<KvVariable<Tindex, T>*>(table_var)->CoverUpdateUnsafe(     \
+        key, &var_context);                                                \
+  } else {                                                                 \
+    static_cast<KvVariable<Tindex, T>*>(table_var)->MarkBlacklistUnsafe(   \
+        key, &var_context);                                                \
+  }                                                                        \
+  v = new_v;                                                               \
+  static_cast<KvVariable<Tindex, T>*>(table_m_v_linear)                    \
+      ->CoverUpdateUnsafe(key, &opt_value_context);
+    COMPUTE_ADAM(grad_value);
+    train_deltalist.push_back(i);
+  }
+#undef COMPUTE_ADAM
+  table_var->MarkAsDeltaListElements(ctx, indices, train_deltalist);
+  table_m_v_linear->MarkAsDeltaListElements(ctx, indices, train_deltalist);
+}
+
 template <typename Device, typename T, typename Tindex>
 class KvVariableGroupSparseApplyAdamV3Op : public OpKernel {
  public:
@@ -5726,6 +6368,7 @@ class KvVariableGroupSparseApplyAdamV3Op : public OpKernel {
     OP_REQUIRES_OK(
         ctx, LookupResource(ctx, HandleFromInput(ctx, 1), &table_m_v_linear));
     core::ScopedUnref unref_me_linear(table_m_v_linear);
+    OP_REQUIRES_OK(ctx, TrackSlots<T, Tindex>(table_var, {table_m_v_linear}));
 
     OP_REQUIRES(
         ctx, table_var->IsInitialized(),
@@ -5737,8 +6380,10 @@ class KvVariableGroupSparseApplyAdamV3Op : public OpKernel {
                                    requested_input(1)));
 
     // Get gradients and indices
-    const Tensor& grad = ctx->input(2);
-    const Tensor& indices = ctx->input(3);
+    Tensor grad = ctx->input(2);
+    Tensor indices = ctx->input(3);
+    OP_REQUIRES_OK(ctx, MaybeSumDuplicateRows<T, Tindex>(ctx, table_var,
+                                                         &indices, {&grad}));
     const Tensor& lr = ctx->input(4);
     const Tensor& beta1_power = ctx->input(5);
     const Tensor& beta2_power = ctx->input(6);
@@ -5840,102 +6485,32 @@ class KvVariableGroupSparseApplyAdamV3Op : public OpKernel {
     T l1_scalar = l1.scalar<T>()();
     T l2_scalar = l2.scalar<T>()();
     T l21_scalar = l21.scalar<T>()();
-    const int64_t first_dim_size = indices.dim_size(0);
-    const int64_t embedding_dim_size = grad.dim_size(1);
-    size_t value_bytes = embedding_dim_size * sizeof(T);
     const T alpha =
         Eigen::numext::sqrt(static_cast<T>(1) - beta2_power_scalar) /
         (static_cast<T>(1) - beta1_power_scalar);
     auto l21_norm = l21_scalar * Eigen::numext::sqrt(static_cast<T>(inner_dim));
 
     if (N > 0) {
-      auto DoWork = [this, ctx, &table_var, &table_m_v_linear, &indices, &grad,
-                     &lr_scalar, &beta1_power_scalar, &beta2_power_scalar,
-                     &beta1_scalar, &beta2_scalar, &epsilon_scalar, &l1_scalar,
-                     &l2_scalar, &alpha, &l21_norm, value_bytes,
-                     embedding_dim_size,
-                     first_dim_size](int64_t start_i, int64_t limit_i) {
-        auto grad_flat = grad.flat_outer_dims<T>();
-        auto indices_flat = indices.flat<Tindex>();
-        // prepare phstore variables
-        std::vector<int64> train_deltalist;
-        train_deltalist.reserve(limit_i - start_i);
-        std::unique_ptr<T, void (*)(T*)> buf_var(
-            static_cast<T*>(AllocateRaw(value_bytes)), DeallocateRaw<T>);
-        std::unique_ptr<T, void (*)(T*)> buf_opt(
-            static_cast<T*>(AllocateRaw(value_bytes * 3)), DeallocateRaw<T>);
-        for (int64_t i = start_i; i < limit_i; i++) {
-          OP_REQUIRES(ctx, FastBoundsCheck(i, first_dim_size),
-                      errors::InvalidArgument(strings::StrCat(
-                          "Index ", i, " out of range ", first_dim_size)));
-          Tindex key = indices_flat(i);
-          bool should_filter = false;
-          EVContext<T> var_context(buf_var.get(), false);
-          auto var_lock =
-              static_cast<KvVariable<Tindex, T>*>(table_var)->GetScopedKeyLock(
-                  key, LockType::WRITE_LOCK);
-          static_cast<KvVariable<Tindex, T>*>(table_var)->FindOrInsertUnsafe(
-              key, &var_context, &should_filter);
-          if (should_filter) {
-            continue;
-          }
-          auto var = FlatVector<T>(var_context.Value(), embedding_dim_size);
-          EVContext<T> opt_value_context(buf_opt.get(), false);
-          static_cast<KvVariable<Tindex, T>*>(table_m_v_linear)
-              ->FindOrInsertUnsafe(key, &opt_value_context, nullptr);
-          auto m = FlatVector<T>(opt_value_context.Value(), embedding_dim_size);
-          auto v = FlatVector<T>(opt_value_context.Value() + embedding_dim_size,
-                                 embedding_dim_size);
-          auto linear =
-              FlatVector<T>(opt_value_context.Value() + 2 * embedding_dim_size,
-                            embedding_dim_size);
-          auto grad_value = grad_flat.template chip<0>(i);
-// Use a macro to implement the computation here due to the templating of the
-// eigen tensor library.
-#define COMPUTE_ADAM(grad_to_use)                                          \
-  m = beta1_scalar * m + (static_cast<T>(1) - beta1_scalar) * grad_to_use; \
-  auto new_v = beta2_scalar * v +                                          \
-               (static_cast<T>(1) - beta2_scalar) * grad_to_use.square();  \
-  auto new_v_sqrt = new_v.sqrt();                                          \
-  if (beta1_scalar > beta1_power_scalar) {                                 \
-    linear += alpha * m - (new_v_sqrt - v.sqrt()) / lr_scalar * var;       \
-  } else {                                                                 \
-    linear +=                                                              \
-        alpha * m - (new_v_sqrt - v.sqrt() + v.constant(epsilon_scalar)) / \
-                        lr_scalar * var;                                   \
-  }                                                                        \
-  auto l1_reg_adjust = linear.cwiseMin(l1_scalar).cwiseMax(-l1_scalar);    \
-  auto l1_linear = l1_reg_adjust - linear;                                 \
-  using TensorScalar = Eigen::Tensor<T, 0, Eigen::RowMajor>;               \
-  TensorScalar l1_linear_norm_t = l1_linear.square().sum().sqrt();         \
-  T l1_linear_norm = static_cast<T>(l1_linear_norm_t(0));                  \
-  if (l1_linear_norm > l21_norm) {                                         \
-    l1_linear_norm = static_cast<T>(1) - l21_norm / l1_linear_norm;        \
-    auto y = (new_v_sqrt + new_v.constant(epsilon_scalar)) / lr_scalar +   \
-             linear.constant(static_cast<T>(2) * l2_scalar);               \
-    var = l1_linear * l1_linear_norm / y;                                  \
-    static_cast<KvVariable<Tindex, T>*>(table_var)->CoverUpdateUnsafe(     \
-        key, &var_context);                                                \
-  } else {                                                                 \
-    static_cast<KvVariable<Tindex, T>*>(table_var)->MarkBlacklistUnsafe(   \
-        key, &var_context);                                                \
-  }                                                                        \
-  v = new_v;                                                               \
-  static_cast<KvVariable<Tindex, T>*>(table_m_v_linear)                    \
-      ->CoverUpdateUnsafe(key, &opt_value_context);
-          COMPUTE_ADAM(grad_value);
-          train_deltalist.push_back(i);
-        }
-#undef COMPUTE_ADAM
-        table_var->MarkAsDeltaListElements(ctx, indices, train_deltalist);
-        table_m_v_linear->MarkAsDeltaListElements(ctx, indices,
-                                                  train_deltalist);
+      const IndexOrder order =
+          static_cast<KvVariable<Tindex, T>*>(table_var)->ApplyOrder(indices);
+      const auto row_handles =
+          static_cast<KvVariable<Tindex, T>*>(table_var)->GetRowHandles(
+              ctx, indices);
+      const GroupAdamV3Scalars<T> scalars = {
+          lr_scalar, beta1_power_scalar, beta1_scalar, beta2_scalar,
+          epsilon_scalar, l1_scalar, l2_scalar, alpha, l21_norm};
+      const LazyDecay<T, Tindex> lazy_decay(ctx, table_var, beta1_scalar,
+                                            beta2_scalar);
+      auto DoWork = [ctx, &order, &table_var, &table_m_v_linear, &indices,
+                     &grad, &row_handles, &lazy_decay,
+                     &scalars](int64_t start_i, int64_t limit_i) {
+        GroupSparseApplyAdamV3Range<T, Tindex>(
+            ctx, table_var, table_m_v_linear, indices, grad, order,
+            row_handles, lazy_decay, scalars, start_i, limit_i);
       };
 
       const int64_t cost = 5000;
-      auto worker_threads = *(ctx->device()->tensorflow_cpu_worker_threads());
-      Shard(worker_threads.num_threads, worker_threads.workers, N, cost,
-            DoWork);
+      ShardIndexOrder(ctx, order, N, cost, DoWork);
     }
 
     VLOG(1) << "KvVariableGroupSparseApplyAdamV3Op: "
@@ -5964,6 +6539,130 @@ TF_CALL_float(REGISTER_CPU_KERNELS);
 #undef REGISTER_CPU_KERNELS
 #undef REGISTER_KERNELS
 
+// KvVariableGroupSparseApplyAdamV3 of N variables that share the scalars,
+// see BatchKvVariableSparseApplyAdagradOp.
+template <typename T, typename Tindex>
+class BatchKvVariableGroupSparseApplyAdamV3Op : public OpKernel {
+ public:
+  explicit BatchKvVariableGroupSparseApplyAdamV3Op(OpKernelConstruction* ctx)
+      : OpKernel(ctx) {
+    OP_REQUIRES_OK(ctx, ctx->GetAttr("N", &N_));
+    OP_REQUIRES_OK(ctx, ctx->GetAttr("use_locking", &use_exclusive_lock_));
+  }
+
+  void Compute(OpKernelContext* ctx) override TF_NO_THREAD_SAFETY_ANALYSIS {
+    uint64_t stime = tensorflow::Env::Default()->NowMicros();
+    std::vector<int> resource_inputs(2 * N_);
+    for (int i = 0; i < 2 * N_; ++i) {
+      resource_inputs[i] = i;
+    }
+    auto locks = MaybeLockVariableInputMutexesInOrder(ctx, use_exclusive_lock_,
+                                                      resource_inputs);
+    // lr, beta1_power, beta2_power, beta1, beta2, epsilon, l1, l2 and l21
+    // follow the indices.
+    const int scalars_input = 4 * N_;
+    static const char* const kScalarNames[] = {
+        "lr",      "beta1_power", "beta2_power", "beta1", "beta2",
+        "epsilon", "l1",          "l2",          "l21"};
+    T scalar_values[9];
+    for (int i = 0; i < 9; ++i) {
+      const Tensor& scalar = ctx->input(scalars_input + i);
+      OP_REQUIRES(ctx, TensorShapeUtils::IsScalar(scalar.shape()),
+                  errors::InvalidArgument(kScalarNames[i], " is not a scalar: ",
+                                          scalar.shape().DebugString()));
+      scalar_values[i] = scalar.scalar<T>()();
+    }
+    const T lr_scalar = scalar_values[0];
+    const T beta1_power_scalar = scalar_values[1];
+    const T beta2_power_scalar = scalar_values[2];
+    const T l1_scalar = scalar_values[6];
+    const T l2_scalar = scalar_values[7];
+    const T l21_scalar = scalar_values[8];
+    OP_REQUIRES(ctx, lr_scalar > static_cast<T>(0),
+                errors::InvalidArgument("lr is not a positive scalar"));
+    OP_REQUIRES(ctx,
+                l1_scalar >= static_cast<T>(0) &&
+                    l2_scalar >= static_cast<T>(0) &&
+                    l21_scalar >= static_cast<T>(0),
+                errors::InvalidArgument(
+                    "regularization strengths must be non-negative"));
+    const T alpha =
+        Eigen::numext::sqrt(static_cast<T>(1) - beta2_power_scalar) /
+        (static_cast<T>(1) - beta1_power_scalar);
+
+    std::vector<BatchApplyVariable<T, Tindex>> variables(N_);
+    std::vector<GroupAdamV3Scalars<T>> scalars(N_);
+    std::vector<LazyDecay<T, Tindex>> lazy_decays;
+    lazy_decays.reserve(N_);
+    std::vector<std::unique_ptr<core::ScopedUnref>> unrefs;
+    std::vector<int64_t> sizes(N_, 0);
+    for (int v = 0; v < N_; ++v) {
+      auto* variable = &variables[v];
+      OP_REQUIRES_OK(ctx, LookupBatchApplyVariable<T, Tindex>(
+                              ctx, N_, v, 2 * N_, 3 * N_, variable, &unrefs));
+      // m, v and linear are stored in one row of the slot.
+      const TensorShape& var_shape = variable->var->value_shape();
+      const TensorShape& slot_shape = variable->slot->value_shape();
+      bool same_shape = var_shape.dims() == slot_shape.dims();
+      for (int d = 0; same_shape && d < var_shape.dims(); d++) {
+        same_shape = slot_shape.dim_size(d) == var_shape.dim_size(d) ||
+                     slot_shape.dim_size(d) == 3 * var_shape.dim_size(d);
+      }
+      OP_REQUIRES(ctx, same_shape,
+                  errors::InvalidArgument(
+                      "kv_variable and linear do not have the same shape",
+                      var_shape.DebugString(), " ", slot_shape.DebugString()));
+      scalars[v] = {lr_scalar,
+                    beta1_power_scalar,
+                    scalar_values[3],
+                    scalar_values[4],
+                    scalar_values[5],
+                    l1_scalar,
+                    l2_scalar,
+                    alpha,
+                    l21_scalar * Eigen::numext::sqrt(
+                                     static_cast<T>(variable->inner_dim))};
+      lazy_decays.emplace_back(ctx, variable->var, scalar_values[3],
+                               scalar_values[4]);
+      sizes[v] = variable->indices.dim_size(0);
+    }
+
+    const typename KvVariable<Tindex, T>::RowHandles no_handles;
+    auto worker_threads = *(ctx->device()->tensorflow_cpu_worker_threads());
+    ShardTables(worker_threads.num_threads, worker_threads.workers, sizes,
+                5000, [&](int v, int64_t begin, int64_t end) {
+                  const auto& variable = variables[v];
+                  GroupSparseApplyAdamV3Range<T, Tindex>(
+                      ctx, variable.var, variable.slot, variable.indices,
+                      variable.grad, variable.order, no_handles,
+                      lazy_decays[v], scalars[v], begin, end);
+                });
+    VLOG(1) << "BatchKvVariableGroupSparseApplyAdamV3Op: "
+            << ::tensorflow::Env::Default()->NowMicros() - stime << " ms";
+  }
+
+ private:
+  int N_;
+  bool use_exclusive_lock_;
+};
+#define REGISTER_KERNELS(T, Tindices)                                   \
+  REGISTER_KERNEL_BUILDER(Name("BatchKvVariableGroupSparseApplyAdamV3") \
+                              .Device(DEVICE_CPU)                       \
+                              .TypeConstraint<T>("T")                   \
+                              .TypeConstraint<Tindices>("Tindices"),    \
+                          BatchKvVariableGroupSparseApplyAdamV3Op<T, Tindices>);
+
+#define REGISTER_CPU_KERNELS(T) \
+  REGISTER_KERNELS(T, int32);   \
+  REGISTER_KERNELS(T, int64);   \
+  REGISTER_KERNELS(T, uint64);  \
+//  REGISTER_KERNELS(T, string);
+
+TF_CALL_float(REGISTER_CPU_KERNELS);
+
+#undef REGISTER_CPU_KERNELS
+#undef REGISTER_KERNELS
+
 template <typename Device, typename T, typename Tindex>
 class SparseApplyAdaBeliefOp : public OpKernel {
  public:
@@ -6340,6 +7039,8 @@ class KvVariableComputeGroupAdaDQHHPOp : public OpKernel {
     OP_REQUIRES_OK(ctx,
                    LookupResource(ctx, HandleFromInput(ctx, 3), &table_linear));
     core::ScopedUnref unref_me_linear(table_linear);
+    OP_REQUIRES_OK(ctx, TrackSlots<T, Tindex>(
+                            table_var, {table_m, table_v, table_linear}));
     OP_REQUIRES(
         ctx, table_var->IsInitialized(),
         errors::FailedPrecondition("Failed to use uninitialized variables: ",
@@ -6436,11 +7137,13 @@ class KvVariableComputeGroupAdaDQHHPOp : public OpKernel {
     OP_REQUIRES_OK(ctx, ctx->allocate_output(1, grad.shape(), &eps_hg));
 
     if (N > 0) {
-      auto DoWork = [this, ctx, inner_dim, &table_var, &table_m,
+      const IndexOrder order =
+          static_cast<KvVariable<Tindex, T>*>(table_var)->ApplyOrder(indices);
+      auto DoWork = [this, ctx, &order, inner_dim, &table_var, &table_m,
                      &table_v, &table_linear, &indices, &grad, &lr,
-                     &beta1_power, &beta2_power, &beta1, &beta2, &epsilon,
-                     &l1, &l2, &l21,
-                     &lr_hg, &eps_hg](int64_t start_i, int64_t limit_i) {
+                     &beta1_power, &beta2_power, &beta1, &beta2, &epsilon, &l1,
+                     &l2, &l21, &lr_hg,
+                     &eps_hg](int64_t start_i, int64_t limit_i) {
         const int64_t first_dim_size = indices.dim_size(0);
         const int64_t embedding_dim_size = grad.dim_size(1);
         auto grad_flat = grad.flat_outer_dims<T>();
@@ -6457,19 +7160,26 @@ class KvVariableComputeGroupAdaDQHHPOp : public OpKernel {
         T l2_scalar = l2.scalar<T>()();
         T l21_scalar = l21.scalar<T>()();
 
-        for (int64_t i = start_i; i < limit_i; ++i) {
+        auto apply_lock =
+            static_cast<KvVariable<Tindex, T>*>(table_var)->GetApplyLock(order);
+        const auto row_handles =
+            static_cast<KvVariable<Tindex, T>*>(table_var)->GetRowHandles(
+                ctx, indices);
+        for (int64_t j = start_i; j < limit_i; ++j) {
+          const int64_t i = order(j);
           OP_REQUIRES(ctx, FastBoundsCheck(i, first_dim_size),
                       errors::InvalidArgument(strings::StrCat(
                           "Index ", i, " out of range ", first_dim_size)));
+          static_cast<KvVariable<Tindex, T>*>(table_var)->PrefetchLookup(
+              order.Reorder(indices_flat), start_i, j, limit_i);
           Tindex key = indices_flat(i);
           bool should_filter = false;
           EVContext<T> var_context;
           EVContext<T> m_context;
           EVContext<T> v_context;
           EVContext<T> linear_context;
-          auto var_lock =
-              static_cast<KvVariable<Tindex, T>*>(table_var)->GetScopedKeyLock(
-                  key, LockType::WRITE_LOCK);
+          auto var_lock = apply_lock.Lock(key);
+          row_handles.Seed(i, key, &var_context);
           static_cast<KvVariable<Tindex, T>*>(table_var)->FindOrInsertUnsafe(
               key, &var_context, &should_filter);
           if (should_filter) {
@@ -6497,9 +7207,8 @@ class KvVariableComputeGroupAdaDQHHPOp : public OpKernel {
     Eigen::numext::sqrt(static_cast<T>(1) - beta2_power_scalar / beta2_scalar);\
   auto l1_reg_adjust = linear.cwiseMin(l1_scalar).cwiseMax(-l1_scalar);        \
   auto l1_linear = l1_reg_adjust - linear;                                     \
-  using TensorScalar = Eigen::Tensor<T, 0, Eigen::RowMajor>;                   \
-  TensorScalar l1_linear_norm_t = l1_linear.square().sum().sqrt();             \
-  T l1_linear_norm = static_cast<T>(l1_linear_norm_t(0));                      \
+  T l1_linear_norm =                                                           \
+      GroupShrinkNorm(linear.data(), l1_scalar, linear.size());                \
   auto l21_norm = l21_scalar * Eigen::numext::sqrt(static_cast<T>(inner_dim)); \
   auto y = v.sqrt().cwiseMax(epsilon_adjust);                                  \
   auto deno = (y + y.constant(static_cast<T>(2) * l2_scalar *                  \
@@ -6522,9 +7231,7 @@ class KvVariableComputeGroupAdaDQHHPOp : public OpKernel {
       };
 
       const int64_t cost = 5000;
-      auto worker_threads = *(ctx->device()->tensorflow_cpu_worker_threads());
-      Shard(worker_threads.num_threads, worker_threads.workers, N, cost,
-            DoWork);
+      ShardIndexOrder(ctx, order, N, cost, DoWork);
     }
 
     VLOG(1) << "KvVariableComputeGroupAdaDQHHPOp: "
@@ -6710,6 +7417,7 @@ class KvVariableGroupSparseApplyRectifiedAdamOp : public OpKernel {
     OP_REQUIRES_OK(ctx,
                    LookupResource(ctx, HandleFromInput(ctx, 1), &table_opt));
     core::ScopedUnref unref_me_linear(table_opt);
+    OP_REQUIRES_OK(ctx, TrackSlots<T, Tindex>(table_var, {table_opt}));
 
     OP_REQUIRES(
         ctx, table_var->IsInitialized(),
@@ -6721,8 +7429,10 @@ class KvVariableGroupSparseApplyRectifiedAdamOp : public OpKernel {
                                    requested_input(1)));
 
     // Get gradients and indices
-    const Tensor& grad = ctx->input(2);
-    const Tensor& indices = ctx->input(3);
+    Tensor grad = ctx->input(2);
+    Tensor indices = ctx->input(3);
+    OP_REQUIRES_OK(ctx, MaybeSumDuplicateRows<T, Tindex>(ctx, table_var,
+                                                         &indices, {&grad}));
     const Tensor& lr = ctx->input(4);
     const Tensor& beta1_power = ctx->input(5);
     const Tensor& beta2_power = ctx->input(6);
@@ -6820,9 +7530,14 @@ class KvVariableGroupSparseApplyRectifiedAdamOp : public OpKernel {
                     "Inner dimension should be greater than zero."));
 
     if (N > 0) {
-      auto DoWork = [this, ctx, inner_dim, &table_var, &table_opt, &indices,
-                     &grad, &lr, &beta1_power, &beta2_power, &beta1, &beta2,
-                     &epsilon, &l1, &l2, &l21, &r_t, &tractable, &amsgrad,
+      const IndexOrder order =
+          static_cast<KvVariable<Tindex, T>*>(table_var)->ApplyOrder(indices);
+      const LazyDecay<T, Tindex> lazy_decay(
+          ctx, table_var, beta1.scalar<T>()(), beta2.scalar<T>()());
+      auto DoWork = [this, ctx, &order, &lazy_decay, inner_dim, &table_var,
+                     &table_opt, &indices, &grad, &lr, &beta1_power,
+                     &beta2_power, &beta1, &beta2, &epsilon, &l1, &l2, &l21,
+                     &r_t, &tractable, &amsgrad,
                      &use_nesterov](int64_t start_i, int64_t limit_i) {
         const int64_t first_dim_size = indices.dim_size(0);
         const int64_t embedding_dim_size = grad.dim_size(1);
@@ -6847,18 +7562,25 @@ class KvVariableGroupSparseApplyRectifiedAdamOp : public OpKernel {
         if (need_delta_info) {
           train_deltalist.reserve(limit_i - start_i);
         }
-        for (int64_t i = start_i; i < limit_i; i++) {
+        auto apply_lock =
+            static_cast<KvVariable<Tindex, T>*>(table_var)->GetApplyLock(order);
+        const auto row_handles =
+            static_cast<KvVariable<Tindex, T>*>(table_var)->GetRowHandles(
+                ctx, indices);
+        for (int64_t j = start_i; j < limit_i; ++j) {
+          const int64_t i = order(j);
           OP_REQUIRES(ctx, FastBoundsCheck(i, first_dim_size),
                       errors::InvalidArgument(strings::StrCat(
                           "Index ", i, " out of range ", first_dim_size)));
 
+          static_cast<KvVariable<Tindex, T>*>(table_var)->PrefetchLookup(
+              order.Reorder(indices_flat), start_i, j, limit_i);
           Tindex key = indices_flat(i);
           bool should_filter = false;
           EVContext<T> var_context;
           EVContext<T> opt_context;
-          auto var_lock =
-              static_cast<KvVariable<Tindex, T>*>(table_var)->GetScopedKeyLock(
-                  key, LockType::WRITE_LOCK);
+          auto var_lock = apply_lock.Lock(key);
+          row_handles.Seed(i, key, &var_context);
           static_cast<KvVariable<Tindex, T>*>(table_var)->FindOrInsertUnsafe(
               key, &var_context, &should_filter);
           if (should_filter) {
@@ -6876,15 +7598,15 @@ class KvVariableGroupSparseApplyRectifiedAdamOp : public OpKernel {
               opt_context.Value() + embedding_dim_size * 3, embedding_dim_size);
           auto vamsgrad = FlatVector<T>(
               opt_context.Value() + embedding_dim_size * 4, embedding_dim_size);
-          auto grad = grad_flat.template chip<0>(i);
+          auto grad = FlatVector<T>(&grad_flat(i, 0), embedding_dim_size);
+          lazy_decay.Apply(key, m.data(), v.data(), embedding_dim_size);
 
 // Use a macro to implement the computation here due to the templating of the
 // eigen tensor library.
 #define COMPUTE_RECTFIED_ADAM(grad_to_use)                                     \
   const T alpha = Eigen::numext::sqrt(static_cast<T>(1) - beta2_power_scalar); \
-  m = beta1_scalar * m + (static_cast<T>(1) - beta1_scalar) * grad_to_use;     \
-  auto new_v = beta2_scalar * v +                                              \
-               (static_cast<T>(1) - beta2_scalar) * grad_to_use.square();      \
+  AdamMoments(m.data(), v.data(), grad_to_use.data(), grad_to_use.data(),      \
+              beta1_scalar, beta2_scalar, m.size());                           \
   auto m_corr = m;                                                             \
   if (use_nesterov_flag) {                                                     \
     m_corr =                                                                   \
@@ -6898,7 +7620,7 @@ class KvVariableGroupSparseApplyRectifiedAdamOp : public OpKernel {
     APPLY_RECTIFIED_ADAM(radam_m, radam_v, radam_v_old);                       \
   } else if (amsgrad_flag) {                                                   \
     auto radam_m = r_t_scalar * m / (static_cast<T>(1) - beta1_power_scalar);  \
-    vamsgrad = new_v.cwiseMax(vamsgrad);                                       \
+    vamsgrad = v.cwiseMax(vamsgrad);                                           \
                                                                                \
     auto radam_v =                                                             \
         (vamsgrad.sqrt() / alpha + v.constant(epsilon_scalar)) / lr_scalar;    \
@@ -6907,7 +7629,7 @@ class KvVariableGroupSparseApplyRectifiedAdamOp : public OpKernel {
   } else {                                                                     \
     auto radam_m = r_t_scalar * m / (static_cast<T>(1) - beta1_power_scalar);  \
     auto radam_v =                                                             \
-        (new_v.sqrt() / alpha + v.constant(epsilon_scalar)) / lr_scalar;       \
+        (v.sqrt() / alpha + v.constant(epsilon_scalar)) / lr_scalar;           \
     auto radam_v_old = vhat;                                                   \
     APPLY_RECTIFIED_ADAM(radam_m, radam_v, radam_v_old);                       \
   }
@@ -6916,9 +7638,8 @@ class KvVariableGroupSparseApplyRectifiedAdamOp : public OpKernel {
   linear += radam_m - (radam_v - radam_v_old) * var;                           \
   auto l1_reg_adjust = linear.cwiseMin(l1_scalar).cwiseMax(-l1_scalar);        \
   auto l1_linear = l1_reg_adjust - linear;                                     \
-  using TensorScalar = Eigen::Tensor<T, 0, Eigen::RowMajor>;                   \
-  TensorScalar l1_linear_norm_t = l1_linear.square().sum().sqrt();             \
-  T l1_linear_norm = static_cast<T>(l1_linear_norm_t(0));                      \
+  T l1_linear_norm =                                                           \
+      GroupShrinkNorm(linear.data(), l1_scalar, linear.size());                \
   auto l21_norm = l21_scalar * Eigen::numext::sqrt(static_cast<T>(inner_dim)); \
   if (l1_linear_norm > l21_norm) {                                             \
     l1_linear_norm = static_cast<T>(1) - l21_norm / l1_linear_norm;            \
@@ -6931,7 +7652,6 @@ class KvVariableGroupSparseApplyRectifiedAdamOp : public OpKernel {
         key, &var_context);                                                    \
   }                                                                            \
   vhat = radam_v;                                                              \
-  v = new_v;                                                                   \
   static_cast<KvVariable<Tindex, T>*>(table_opt)->CoverUpdateUnsafe(           \
       key, &opt_context);
           COMPUTE_RECTFIED_ADAM(grad);
@@ -6946,9 +7666,7 @@ class KvVariableGroupSparseApplyRectifiedAdamOp : public OpKernel {
       };
 
       const int64_t cost = 5000;
-      auto worker_threads = *(ctx->device()->tensorflow_cpu_worker_threads());
-      Shard(worker_threads.num_threads, worker_threads.workers, N, cost,
-            DoWork);
+      ShardIndexOrder(ctx, order, N, cost, DoWork);
     }
 
     VLOG(1) << "KvVariableGroupSparseApplyRectifiedAdamOp: "
@@ -6997,6 +7715,7 @@ class KvVariableGroupSparseApplyAdamV4Op : public OpKernel {
     OP_REQUIRES_OK(
         ctx, LookupResource(ctx, HandleFromInput(ctx, 1), &table_m_v_linear));
     core::ScopedUnref unref_me_linear(table_m_v_linear);
+    OP_REQUIRES_OK(ctx, TrackSlots<T, Tindex>(table_var, {table_m_v_linear}));
 
     OP_REQUIRES(
         ctx, table_var->IsInitialized(),
@@ -7008,8 +7727,10 @@ class KvVariableGroupSparseApplyAdamV4Op : public OpKernel {
                                    requested_input(1)));
 
     // Get gradients and indices
-    const Tensor& grad = ctx->input(2);
-    const Tensor& indices = ctx->input(3);
+    Tensor grad = ctx->input(2);
+    Tensor indices = ctx->input(3);
+    OP_REQUIRES_OK(ctx, MaybeSumDuplicateRows<T, Tindex>(ctx, table_var,
+                                                         &indices, {&grad}));
     const Tensor& lr = ctx->input(4);
     const Tensor& beta1_power = ctx->input(5);
     const Tensor& beta2_power = ctx->input(6);
@@ -7120,10 +7841,14 @@ class KvVariableGroupSparseApplyAdamV4Op : public OpKernel {
     auto l21_norm = l21_scalar * Eigen::numext::sqrt(static_cast<T>(inner_dim));
 
     if (N > 0) {
-      auto DoWork = [this, ctx, &table_var, &table_m_v_linear, &indices, &grad,
-                     &beta1_power_scalar, &beta2_power_scalar,
-                     &beta1_scalar, &beta2_scalar, &epsilon_scalar, &l1_scalar,
-                     &l2_scalar, &alpha, &l21_norm,
+      const IndexOrder order =
+          static_cast<KvVariable<Tindex, T>*>(table_var)->ApplyOrder(indices);
+      const LazyDecay<T, Tindex> lazy_decay(
+          ctx, table_var, beta1.scalar<T>()(), beta2.scalar<T>()());
+      auto DoWork = [this, ctx, &order, &lazy_decay, &table_var,
+                     &table_m_v_linear, &indices, &grad, &beta1_power_scalar,
+                     &beta2_power_scalar, &beta1_scalar, &beta2_scalar,
+                     &epsilon_scalar, &l1_scalar, &l2_scalar, &alpha, &l21_norm,
                      value_bytes, embedding_dim_size,
                      first_dim_size](int64_t start_i, int64_t limit_i) {
         auto grad_flat = grad.flat_outer_dims<T>();
@@ -7135,16 +7860,23 @@ class KvVariableGroupSparseApplyAdamV4Op : public OpKernel {
             static_cast<T*>(AllocateRaw(value_bytes)), DeallocateRaw<T>);
         std::unique_ptr<T, void (*)(T*)> buf_opt(
             static_cast<T*>(AllocateRaw(value_bytes * 3)), DeallocateRaw<T>);
-        for (int64_t i = start_i; i < limit_i; i++) {
+        auto apply_lock =
+            static_cast<KvVariable<Tindex, T>*>(table_var)->GetApplyLock(order);
+        const auto row_handles =
+            static_cast<KvVariable<Tindex, T>*>(table_var)->GetRowHandles(
+                ctx, indices);
+        for (int64_t j = start_i; j < limit_i; ++j) {
+          const int64_t i = order(j);
           OP_REQUIRES(ctx, FastBoundsCheck(i, first_dim_size),
                       errors::InvalidArgument(strings::StrCat(
                           "Index ", i, " out of range ", first_dim_size)));
+          static_cast<KvVariable<Tindex, T>*>(table_var)->PrefetchLookup(
+              order.Reorder(indices_flat), start_i, j, limit_i);
           Tindex key = indices_flat(i);
           bool should_filter = false;
           EVContext<T> var_context(buf_var.get(), false);
-          auto var_lock =
-              static_cast<KvVariable<Tindex, T>*>(table_var)->GetScopedKeyLock(
-                  key, LockType::WRITE_LOCK);
+          auto var_lock = apply_lock.Lock(key);
+          row_handles.Seed(i, key, &var_context);
           static_cast<KvVariable<Tindex, T>*>(table_var)->FindOrInsertUnsafe(
               key, &var_context, &should_filter);
           if (should_filter) {
@@ -7161,6 +7893,7 @@ class KvVariableGroupSparseApplyAdamV4Op : public OpKernel {
               FlatVector<T>(opt_value_context.Value() + 2 * embedding_dim_size,
                             embedding_dim_size);
           auto grad_value = grad_flat.template chip<0>(i);
+          lazy_decay.Apply(key, m.data(), v.data(), embedding_dim_size);
 // Use a macro to implement the computation here due to the templating of the
 // eigen tensor library.
 #define COMPUTE_ADAM(grad_to_use)                                          \
@@ -7176,9 +7909,8 @@ class KvVariableGroupSparseApplyAdamV4Op : public OpKernel {
   }                                                                        \
   auto l1_reg_adjust = linear.cwiseMin(l1_scalar).cwiseMax(-l1_scalar);    \
   auto l1_linear = l1_reg_adjust - linear;                                 \
-  using TensorScalar = Eigen::Tensor<T, 0, Eigen::RowMajor>;               \
-  TensorScalar l1_linear_norm_t = l1_linear.square().sum().sqrt();         \
-  T l1_linear_norm = static_cast<T>(l1_linear_norm_t(0));                  \
+  T l1_linear_norm =                                                       \
+      GroupShrinkNorm(linear.data(), l1_scalar, linear.size());            \
   if (l1_linear_norm > l21_norm) {                                         \
     l1_linear_norm = static_cast<T>(1) - l21_norm / l1_linear_norm;        \
     auto y = new_v_sqrt + new_v.constant(epsilon_scalar) +                 \
@@ -7203,9 +7935,7 @@ class KvVariableGroupSparseApplyAdamV4Op : public OpKernel {
       };
 
       const int64_t cost = 5000;
-      auto worker_threads = *(ctx->device()->tensorflow_cpu_worker_threads());
-      Shard(worker_threads.num_threads, worker_threads.workers, N, cost,
-            DoWork);
+      ShardIndexOrder(ctx, order, N, cost, DoWork);
     }
 
     VLOG(1) << "KvVariableGroupSparseApplyAdamV4Op: "
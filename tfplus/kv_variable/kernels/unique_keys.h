@@ -0,0 +1,138 @@
+// Copyright 2023 The TFPlus Authors. All rights reserved.
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TFPLUS_KV_VARIABLE_KERNELS_UNIQUE_KEYS_H_
+#define TFPLUS_KV_VARIABLE_KERNELS_UNIQUE_KEYS_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "tensorflow/core/framework/op_kernel.h"
+#include "tensorflow/core/util/work_sharder.h"
+#include "tfplus/kv_variable/kernels/index_order.h"
+
+namespace tfplus {
+
+// Distinct keys of a batch. The positions are hash partitioned by key and
+// each partition is deduplicated with its own map, so the partitions run in
+// parallel without sharing anything. The first position of a key represents
+// it, unique key u is at position first(u) and position i holds unique key
+// index(i).
+template <typename K>
+class UniqueKeys {
+ public:
+  // keys(i) for i in [0, n), the positions with skip(i) are left out and
+  // their index() is -1.
+  template <typename Keys, typename Skip>
+  UniqueKeys(::tensorflow::OpKernelContext* ctx, int64_t n, const Keys& keys,
+             const Skip& skip)
+      : ctx_(ctx), index_(n, -1) {
+    int num_parts = 1;
+    if (ctx != nullptr) {
+      const auto* workers = ctx->device()->tensorflow_cpu_worker_threads();
+      num_parts = static_cast<int>(std::max<int64_t>(
+          1, std::min<int64_t>(workers->num_threads,
+                               n / kMinKeysPerPartition)));
+    }
+    // The last group holds the skipped positions.
+    parts_ = IndexOrder::GroupBy(n, num_parts + 1, [&](int64_t i) {
+      return skip(i) ? num_parts : Partition(keys(i), num_parts);
+    });
+    std::vector<std::vector<int64_t>> firsts(num_parts);
+    ForEachPartition(kCostPerKey, [&](int p) {
+      const int64_t begin = parts_.group_begin()[p];
+      const int64_t end = parts_.group_begin()[p + 1];
+      std::unordered_map<K, int64_t> local;
+      local.reserve(end - begin);
+      for (int64_t j = begin; j < end; ++j) {
+        const int64_t i = parts_(j);
+        auto inserted = local.emplace(keys(i), firsts[p].size());
+        if (inserted.second) firsts[p].push_back(i);
+        index_[i] = inserted.first->second;
+      }
+    });
+    std::vector<int64_t> offset(num_parts + 1, 0);
+    for (int p = 0; p < num_parts; ++p) {
+      offset[p + 1] = offset[p] + firsts[p].size();
+    }
+    firsts_.reserve(offset[num_parts]);
+    for (int p = 0; p < num_parts; ++p) {
+      firsts_.insert(firsts_.end(), firsts[p].begin(), firsts[p].end());
+    }
+    num_kept_ = parts_.group_begin()[num_parts];
+    if (num_parts > 1) {
+      ForEachPartition(1, [&](int p) {
+        for (int64_t j = parts_.group_begin()[p];
+             j < parts_.group_begin()[p + 1]; ++j) {
+          index_[parts_(j)] += offset[p];
+        }
+      });
+    }
+  }
+
+  int64_t size() const { return firsts_.size(); }
+  int64_t first(int64_t u) const { return firsts_[u]; }
+  int64_t index(int64_t i) const { return index_[i]; }
+  bool has_duplicates() const { return size() < num_kept_; }
+
+  // Runs fn(i, index(i)) for the positions that were not skipped. All the
+  // positions of a key are visited in increasing order by the same thread,
+  // so fn may accumulate into the row of the key without a lock.
+  template <typename Fn>
+  void ForEachPosition(int64_t cost_per_key, Fn&& fn) const {
+    ForEachPartition(cost_per_key, [this, &fn](int p) {
+      for (int64_t j = parts_.group_begin()[p];
+           j < parts_.group_begin()[p + 1]; ++j) {
+        const int64_t i = parts_(j);
+        fn(i, index_[i]);
+      }
+    });
+  }
+
+ private:
+  static constexpr int64_t kMinKeysPerPartition = 4096;
+  static constexpr int64_t kCostPerKey = 200;
+
+  static int Partition(const K& key, int num_parts) {
+    return static_cast<int>(
+        ((static_cast<uint64_t>(key) * 0x9e3779b97f4a7c15ULL) >> 32) %
+        num_parts);
+  }
+
+  template <typename Fn>
+  void ForEachPartition(int64_t cost_per_key, Fn&& fn) const {
+    const int num_parts = static_cast<int>(parts_.group_begin().size()) - 2;
+    if (ctx_ == nullptr || num_parts == 1) {
+      for (int p = 0; p < num_parts; ++p) fn(p);
+      return;
+    }
+    const int64_t cost = cost_per_key * (parts_.group_begin()[num_parts] /
+                                         num_parts + 1);
+    auto worker_threads = *(ctx_->device()->tensorflow_cpu_worker_threads());
+    ::tensorflow::Shard(worker_threads.num_threads, worker_threads.workers,
+                        num_parts, cost, [&fn](int64_t begin, int64_t end) {
+                          for (int64_t p = begin; p < end; ++p) fn(p);
+                        });
+  }
+
+  ::tensorflow::OpKernelContext* ctx_;
+  IndexOrder parts_;
+  std::vector<int64_t> firsts_;
+  std::vector<int64_t> index_;
+  int64_t num_kept_ = 0;
+};
+
+}  // namespace tfplus
+#endif  // TFPLUS_KV_VARIABLE_KERNELS_UNIQUE_KEYS_H_
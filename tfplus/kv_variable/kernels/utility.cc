@@ -24,6 +24,8 @@
 #include "tfplus/kv_variable/kernels/utility.h"
 #include "tensorflow/core/framework/tensor_shape.h"
 #include "tensorflow/core/lib/io/path.h"
+#include "tensorflow/core/lib/random/philox_random.h"
+#include "tensorflow/core/lib/random/random.h"
 
 namespace tfplus {
 using ::tensorflow::uint16;
@@ -129,4 +131,21 @@ void* AllocateRaw(size_t size) {
       ::tensorflow::Allocator::kAllocatorAlignment, size);
 }
 
+uint32_t ThreadLocalRandom32() {
+  using ::tensorflow::random::PhiloxRandom;
+  struct ThreadRandom {
+    ThreadRandom()
+        : gen(::tensorflow::random::New64(), ::tensorflow::random::New64()) {}
+    PhiloxRandom gen;
+    PhiloxRandom::ResultType samples;
+    int next = PhiloxRandom::kResultElementCount;
+  };
+  thread_local ThreadRandom random;
+  if (random.next == PhiloxRandom::kResultElementCount) {
+    random.samples = random.gen();
+    random.next = 0;
+  }
+  return random.samples[random.next++];
+}
+
 }  // namespace tfplus
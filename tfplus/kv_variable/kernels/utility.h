@@ -127,6 +127,10 @@ Status Unlink(const std::string& path);
 
 void* AllocateRaw(size_t size);
 
+// Random value from a Philox generator owned by the calling thread and
+// seeded once per thread, it takes no lock unlike std::rand().
+uint32_t ThreadLocalRandom32();
+
 template <typename T>
 void DeallocateRaw(T* ptr) {
   ::tensorflow::cpu_allocator()->DeallocateRaw(reinterpret_cast<void*>(ptr));
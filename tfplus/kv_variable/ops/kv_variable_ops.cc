@@ -237,6 +237,25 @@ REGISTER_OP("KvVariableSizeV3")
     .Output("sizes: T")
     .Attr("T: {int32, int64} = DT_INT64");
 
+REGISTER_OP("KvVariableExportAdmissionSketch")
+    .Input("table_handle: resource")
+    .Output("sketch: uint16")
+    .SetShapeFn([](InferenceContext* c) {
+      ShapeHandle handle;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(0), 0, &handle));
+      c->set_output(0, c->UnknownShape());
+      return ::tensorflow::OkStatus();
+    });
+
+REGISTER_OP("KvVariableImportAdmissionSketch")
+    .Input("table_handle: resource")
+    .Input("sketch: uint16")
+    .SetShapeFn([](InferenceContext* c) {
+      ShapeHandle handle;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(0), 0, &handle));
+      return ::tensorflow::OkStatus();
+    });
+
 REGISTER_OP("KvVariableFrequency")
     .Input("table_handle: resource")
     .Output("size: T")
@@ -319,6 +338,24 @@ REGISTER_OP("KvVariableGatherOrInsertV2")
       return ::tensorflow::OkStatus();
     });
 
+// KvVariableGatherOrInsertV2 that also outputs the handles of the rows of
+// indices, an int64 [num_indices, 3] tensor of the rows it resolved in the
+// step, their positions and keys. Passed to the handles input of a KvVariable
+// optimizer op of the same step with the same indices, it spares that op the
+// lookup of the keys.
+REGISTER_OP("KvVariableGatherOrInsertWithHandles")
+    .Input("table_handle: resource")
+    .Input("indices: Tindices")
+    .Output("output: dtype")
+    .Output("handles: int64")
+    .Attr("dtype: type")
+    .Attr("Tindices: {int32, int64, uint64, string}")
+    .SetShapeFn([](InferenceContext* c) {
+      c->set_output(0, c->UnknownShape());
+      c->set_output(1, c->Matrix(InferenceContext::kUnknownDim, 3));
+      return ::tensorflow::OkStatus();
+    });
+
 REGISTER_OP("KvVariableGatherOrInsertWithCounts")
     .Input("table_handle: resource")
     .Input("indices: Tindices")
@@ -331,6 +368,30 @@ REGISTER_OP("KvVariableGatherOrInsertWithCounts")
       return ::tensorflow::OkStatus();
     });
 
+// KvVariableGatherOrInsertV2 of N tables in one kernel, with the counts of
+// KvVariableGatherOrInsertWithCounts when num_counts is N. With
+// num_filter_out N it also outputs the low frequency keys of each table.
+REGISTER_OP("BatchKvVariableGatherOrInsert")
+    .Input("table_handles: N * resource")
+    .Input("indices: N * Tindices")
+    .Input("counts: num_counts * int32")
+    .Output("output: N * dtype")
+    .Output("filter_out: num_filter_out * bool")
+    .Attr("N: int >= 1")
+    .Attr("num_counts: int >= 0")
+    .Attr("num_filter_out: int >= 0 = 0")
+    .Attr("dtype: type")
+    .Attr("Tindices: {int32, int64, uint64, string}")
+    .SetShapeFn([](InferenceContext* c) {
+      int n;
+      TF_RETURN_IF_ERROR(c->GetAttr("N", &n));
+      for (int i = 0; i < c->num_outputs(); ++i) {
+        // filter_out i - n has the shape of indices i - n, input i.
+        c->set_output(i, i < n ? c->UnknownShape() : c->input(i));
+      }
+      return ::tensorflow::OkStatus();
+    });
+
 REGISTER_OP("KvVariableInsertV2")
     .Input("table_handle: resource")
     .Input("indices: Tindices")
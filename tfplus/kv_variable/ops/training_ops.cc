@@ -111,9 +111,11 @@ REGISTER_OP("KvVariableSparseApplyFtrlV2")
     .Input("l2: T")
     .Input("l2_shrinkage: T")
     .Input("lr_power: T")
+    .Input("handles: num_handles * int64")
     .Attr("T: numbertype")
     .Attr("Tindices: {int32, int64, uint64, string}")
     .Attr("use_locking: bool = false")
+    .Attr("num_handles: int >= 0 = 0")
     .SetShapeFn([](InferenceContext* c) { return ApplyFtrlShapeFn(c, false); });
 
 REGISTER_OP("KvVariableGroupSparseApplyFtrlV2")
@@ -127,9 +129,11 @@ REGISTER_OP("KvVariableGroupSparseApplyFtrlV2")
     .Input("l2: T")
     .Input("l2_shrinkage: T")
     .Input("lr_power: T")
+    .Input("handles: num_handles * int64")
     .Attr("T: numbertype")
     .Attr("Tindices: {int32, int64, uint64, string}")
     .Attr("use_locking: bool = false")
+    .Attr("num_handles: int >= 0 = 0")
     .SetShapeFn([](InferenceContext* c) { return ApplyFtrlShapeFn(c, false); });
 
 REGISTER_OP("KvVariableSparseGroupSparseApplyFtrlV2")
@@ -144,9 +148,11 @@ REGISTER_OP("KvVariableSparseGroupSparseApplyFtrlV2")
     .Input("l21: T")
     .Input("l2_shrinkage: T")
     .Input("lr_power: T")
+    .Input("handles: num_handles * int64")
     .Attr("T: numbertype")
     .Attr("Tindices: {int32, int64, uint64, string}")
     .Attr("use_locking: bool = false")
+    .Attr("num_handles: int >= 0 = 0")
     .SetShapeFn([](InferenceContext* c) { return ApplyFtrlShapeFn(c, true); });
 
 static Status GroupApplyAdamShapeFn(InferenceContext* c) {
@@ -174,6 +180,8 @@ static Status GroupApplyAdamShapeFn(InferenceContext* c) {
   return ::tensorflow::OkStatus();
 }
 
+// The sparse Adam ops take the optional global_step that numbers the steps
+// of the variables with TFPLUS_KV_LAZY_DECAY, without it they do not decay.
 REGISTER_OP("KvVariableGroupSparseApplyAdamV2")
     .Input("var: resource")
     .Input("accum: resource")
@@ -191,9 +199,13 @@ REGISTER_OP("KvVariableGroupSparseApplyAdamV2")
     .Input("l1: T")
     .Input("l2: T")
     .Input("l21: T")
+    .Input("handles: num_handles * int64")
+    .Input("global_step: num_global_step * int64")
     .Attr("T: numbertype")
     .Attr("Tindices: {int32, int64, uint64, string}")
     .Attr("use_locking: bool = false")
+    .Attr("num_handles: int >= 0 = 0")
+    .Attr("num_global_step: int >= 0 = 0")
     .SetShapeFn([](InferenceContext* c) {
       return GroupApplyAdamShapeFn(c);
     });
@@ -217,14 +229,41 @@ REGISTER_OP("KvVariableSparseApplyAdagrad")
     .Input("lr: T")
     .Input("grad: T")
     .Input("indices: Tindices")
+    .Input("handles: num_handles * int64")
     .Attr("T: numbertype")
     .Attr("Tindices: {int32, int64, uint64, string}")
     .Attr("use_locking: bool = false")
     .Attr("update_slots: bool = true")
+    .Attr("num_handles: int >= 0 = 0")
     .SetShapeFn([](InferenceContext* c) {
       return ApplyAdagradShapeFn(c);
     });
 
+// KvVariableSparseApplyAdagrad of N variables in one op, the keys of all the
+// variables are updated with one parallel schedule.
+REGISTER_OP("BatchKvVariableSparseApplyAdagrad")
+    .Input("var: N * resource")
+    .Input("accum: N * resource")
+    .Input("lr: T")
+    .Input("grad: N * T")
+    .Input("indices: N * Tindices")
+    .Attr("N: int >= 1")
+    .Attr("T: numbertype")
+    .Attr("Tindices: {int32, int64, uint64, string}")
+    .Attr("use_locking: bool = false")
+    .Attr("update_slots: bool = true")
+    .SetShapeFn([](InferenceContext* c) {
+      int n;
+      TF_RETURN_IF_ERROR(c->GetAttr("N", &n));
+      ShapeHandle unused;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(2 * n), 0, &unused));  // lr
+      for (int i = 0; i < n; ++i) {
+        TF_RETURN_IF_ERROR(
+            c->WithRank(c->input(3 * n + 1 + i), 1, &unused));  // indices
+      }
+      return ::tensorflow::OkStatus();
+    });
+
 static Status GroupApplyAMSGradShapeFn(InferenceContext* c) {
   ShapeHandle unused;
   ShapeHandle s = ShapeOrHandleShape(c, 0);                       // var
@@ -267,9 +306,13 @@ REGISTER_OP("KvVariableGroupSparseApplyAMSGrad")
     .Input("l1: T")
     .Input("l2: T")
     .Input("l21: T")
+    .Input("handles: num_handles * int64")
+    .Input("global_step: num_global_step * int64")
     .Attr("T: numbertype")
     .Attr("Tindices: {int32, int64, uint64, string}")
     .Attr("use_locking: bool = false")
+    .Attr("num_handles: int >= 0 = 0")
+    .Attr("num_global_step: int >= 0 = 0")
     .SetShapeFn([](InferenceContext* c) {
       return GroupApplyAMSGradShapeFn(c);
     });
@@ -300,9 +343,11 @@ REGISTER_OP("KvVariableSparseApplyAdadelta")
     .Input("epsilon: T")
     .Input("grad: T")
     .Input("indices: Tindices")
+    .Input("handles: num_handles * int64")
     .Attr("T: numbertype")
     .Attr("Tindices: {int32, int64, uint64, string}")
     .Attr("use_locking: bool = false")
+    .Attr("num_handles: int >= 0 = 0")
     .SetShapeFn([](InferenceContext* c) {
       return ApplyAdadeltaShapeFn(c);
     });
@@ -342,9 +387,11 @@ REGISTER_OP("KvVariableGroupSparseApplyAdadelta")
     .Input("l1: T")
     .Input("l2: T")
     .Input("l21: T")
+    .Input("handles: num_handles * int64")
     .Attr("T: numbertype")
     .Attr("Tindices: {int32, int64, uint64, string}")
     .Attr("use_locking: bool = false")
+    .Attr("num_handles: int >= 0 = 0")
     .SetShapeFn([](InferenceContext* c) {
       return GroupApplyAdadeltaShapeFn(c);
     });
@@ -381,10 +428,12 @@ REGISTER_OP("KvVariableGroupSparseApplyMomentum")
     .Input("l1: T")
     .Input("l2: T")
     .Input("l21: T")
+    .Input("handles: num_handles * int64")
     .Attr("T: numbertype")
     .Attr("Tindices: {int32, int64, uint64, string}")
     .Attr("use_locking: bool = false")
     .Attr("use_nesterov: bool = false")
+    .Attr("num_handles: int >= 0 = 0")
     .SetShapeFn([](InferenceContext* c) {
       return GroupApplyMomentumShapeFn(c);
     });
@@ -435,9 +484,11 @@ REGISTER_OP("KvVariableGroupSparseApplyAdaHessian")
     .Input("l1: T")
     .Input("l2: T")
     .Input("l21: T")
+    .Input("handles: num_handles * int64")
     .Attr("T: numbertype")
     .Attr("Tindices: {int32, int64, uint64, string}")
     .Attr("use_locking: bool = false")
+    .Attr("num_handles: int >= 0 = 0")
     .SetShapeFn([](InferenceContext* c) {
       return GroupApplyAdaHessianShapeFn(c, true);
     });
@@ -585,9 +636,13 @@ REGISTER_OP("KvVariableGroupSparseApplyAdaBelief")
     .Input("l1: T")
     .Input("l2: T")
     .Input("l21: T")
+    .Input("handles: num_handles * int64")
+    .Input("global_step: num_global_step * int64")
     .Attr("T: numbertype")
     .Attr("Tindices: {int32, int64, uint64, string}")
     .Attr("use_locking: bool = false")
+    .Attr("num_handles: int >= 0 = 0")
+    .Attr("num_global_step: int >= 0 = 0")
     .SetShapeFn([](InferenceContext* c) {
       return GroupApplyAdaBeliefShapeFn(c);
     });
@@ -728,9 +783,11 @@ REGISTER_OP("KvVariableGroupSparseApplyLamb")
     .Input("l1: T")
     .Input("l2: T")
     .Input("l21: T")
+    .Input("handles: num_handles * int64")
     .Attr("T: numbertype")
     .Attr("Tindices: {int32, int64, uint64, string}")
     .Attr("use_locking: bool = false")
+    .Attr("num_handles: int >= 0 = 0")
     .SetShapeFn([](InferenceContext* c) {
       return GroupApplyLambShapeFn(c);
     });
@@ -808,9 +865,11 @@ REGISTER_OP("KvVariableGroupSparseApplyLambHessian")
     .Input("l1: T")
     .Input("l2: T")
     .Input("l21: T")
+    .Input("handles: num_handles * int64")
     .Attr("T: numbertype")
     .Attr("Tindices: {int32, int64, uint64, string}")
     .Attr("use_locking: bool = false")
+    .Attr("num_handles: int >= 0 = 0")
     .SetShapeFn([](InferenceContext* c) {
       return GroupApplyAdaHessianShapeFn(c, true);
     });
@@ -919,9 +978,11 @@ REGISTER_OP("KvVariableSparseApplyAdaDQH")
     .Input("beat1: T")
     .Input("beta2: T")
     .Input("epsilon: T")
+    .Input("handles: num_handles * int64")
     .Attr("T: numbertype")
     .Attr("Tindices: {int32, int64, uint64, string}")
     .Attr("use_locking: bool = false")
+    .Attr("num_handles: int >= 0 = 0")
     .SetShapeFn([](InferenceContext* c) {
       return ApplyAdaDQHShapeFn(c, true);
     });
@@ -1005,9 +1066,11 @@ REGISTER_OP("KvVariableGroupSparseApplyAdaDQH")
     .Input("l1: T")
     .Input("l2: T")
     .Input("l21: T")
+    .Input("handles: num_handles * int64")
     .Attr("T: numbertype")
     .Attr("Tindices: {int32, int64, uint64, string}")
     .Attr("use_locking: bool = false")
+    .Attr("num_handles: int >= 0 = 0")
     .SetShapeFn([](InferenceContext* c) {
       return GroupApplyAdaDQHShapeFn(c);
     });
@@ -1052,9 +1115,13 @@ REGISTER_OP("KvVariableGroupSparseApplyAdamNewV2")
     .Input("l1: T")
     .Input("l2: T")
     .Input("l21: T")
+    .Input("handles: num_handles * int64")
+    .Input("global_step: num_global_step * int64")
     .Attr("T: numbertype")
     .Attr("Tindices: {int32, int64, uint64, string}")
     .Attr("use_locking: bool = false")
+    .Attr("num_handles: int >= 0 = 0")
+    .Attr("num_global_step: int >= 0 = 0")
     .SetShapeFn([](InferenceContext* c) {
       return GroupApplyAdamV2ShapeFn(c);
     });
@@ -1097,13 +1164,53 @@ REGISTER_OP("KvVariableGroupSparseApplyAdamV3")
     .Input("l1: T")
     .Input("l2: T")
     .Input("l21: T")
+    .Input("handles: num_handles * int64")
+    .Input("global_step: num_global_step * int64")
     .Attr("T: numbertype")
     .Attr("Tindices: {int32, int64, uint64, string}")
     .Attr("use_locking: bool = false")
+    .Attr("num_handles: int >= 0 = 0")
+    .Attr("num_global_step: int >= 0 = 0")
     .SetShapeFn([](InferenceContext* c) {
       return GroupApplyAdamV3ShapeFn(c);
     });
 
+// KvVariableGroupSparseApplyAdamV3 of N variables that share the scalars,
+// see BatchKvVariableSparseApplyAdagrad.
+REGISTER_OP("BatchKvVariableGroupSparseApplyAdamV3")
+    .Input("var: N * resource")
+    .Input("m_v_linear: N * resource")
+    .Input("grad: N * T")
+    .Input("indices: N * Tindices")
+    .Input("lr: T")
+    .Input("beta1_power: T")
+    .Input("beta2_power: T")
+    .Input("beta1: T")
+    .Input("beta2: T")
+    .Input("epsilon: T")
+    .Input("l1: T")
+    .Input("l2: T")
+    .Input("l21: T")
+    .Input("global_step: num_global_step * int64")
+    .Attr("N: int >= 1")
+    .Attr("T: numbertype")
+    .Attr("Tindices: {int32, int64, uint64, string}")
+    .Attr("use_locking: bool = false")
+    .Attr("num_global_step: int >= 0 = 0")
+    .SetShapeFn([](InferenceContext* c) {
+      int n;
+      TF_RETURN_IF_ERROR(c->GetAttr("N", &n));
+      ShapeHandle unused;
+      for (int i = 0; i < n; ++i) {
+        TF_RETURN_IF_ERROR(
+            c->WithRank(c->input(3 * n + i), 1, &unused));  // indices
+      }
+      for (int i = 4 * n; i < c->num_inputs(); ++i) {
+        TF_RETURN_IF_ERROR(c->WithRank(c->input(i), 0, &unused));  // scalars
+      }
+      return ::tensorflow::OkStatus();
+    });
+
 REGISTER_OP("KvVariableComputeAdaDQHHG")
     .Input("var: resource")
     .Input("m: resource")
@@ -1120,11 +1227,13 @@ REGISTER_OP("KvVariableComputeAdaDQHHG")
     .Input("l1: T")
     .Input("l2: T")
     .Input("l21: T")
+    .Input("handles: num_handles * int64")
     .Output("lr_hg: T")
     .Output("eps_hg: T")
     .Attr("T: numbertype")
     .Attr("Tindices: {int32, int64, uint64, string}")
-    .Attr("use_locking: bool = false");
+    .Attr("use_locking: bool = false")
+    .Attr("num_handles: int >= 0 = 0");
 
 REGISTER_OP("ComputeAdaDQHHG")
     .Input("var: Ref(T)")
@@ -1209,9 +1318,13 @@ REGISTER_OP("KvVariableGroupSparseApplyRectifiedAdam")
     .Input("tractable: bool")
     .Input("amsgrad: bool")
     .Input("use_nesterov: bool")
+    .Input("handles: num_handles * int64")
+    .Input("global_step: num_global_step * int64")
     .Attr("T: numbertype")
     .Attr("Tindices: {int32, int64, uint64, string}")
     .Attr("use_locking: bool = false")
+    .Attr("num_handles: int >= 0 = 0")
+    .Attr("num_global_step: int >= 0 = 0")
     .SetShapeFn([](InferenceContext* c) {
       return GroupApplyRectifiedAdamShapeFn(c);
     });
@@ -1256,9 +1369,11 @@ REGISTER_OP("KvVariableGroupSparseApplyAdaDQHV2")
     .Input("l1: T")
     .Input("l2: T")
     .Input("l21: T")
+    .Input("handles: num_handles * int64")
     .Attr("T: numbertype")
     .Attr("Tindices: {int32, int64, uint64, string}")
     .Attr("use_locking: bool = false")
+    .Attr("num_handles: int >= 0 = 0")
     .SetShapeFn([](InferenceContext* c) {
       return GroupApplyAdaDQHV2ShapeFn(c);
     });
@@ -1277,9 +1392,13 @@ REGISTER_OP("KvVariableGroupSparseApplyAdamV4")
     .Input("l1: T")
     .Input("l2: T")
     .Input("l21: T")
+    .Input("handles: num_handles * int64")
+    .Input("global_step: num_global_step * int64")
     .Attr("T: numbertype")
     .Attr("Tindices: {int32, int64, uint64, string}")
     .Attr("use_locking: bool = false")
+    .Attr("num_handles: int >= 0 = 0")
+    .Attr("num_global_step: int >= 0 = 0")
     .SetShapeFn([](InferenceContext* c) {
       return GroupApplyAdamV3ShapeFn(c);
     });
@@ -453,7 +453,7 @@ def _eager_safe_variable_handle(
     raise ValueError("variable object with name '%s' already created. Use "
                      "get_kv_variable() if reuse is desired." % shared_name)
   with context.graph_mode(), ops.Graph().as_default() as graph:
-    if kv_options.has_path():
+    if kv_options.needs_storage_option():
       h = gen_kv_variable_ops.kv_variable_v4(
           value_shape=shape,
           key_dtype=key_dtype,
@@ -964,6 +964,9 @@ class KvVariable(resource_variable_ops.ResourceVariable): # pylint: disable=abst
   def has_remote_storage(self):
     return self._kv_options.has_remote_storage()
 
+  def has_admission_sketch(self):
+    return self._kv_options.storage_option.admission_sketch_width > 0
+
   @property
   def storage_size_count(self):
     return gen_kv_variable_ops.kv_variable_size_v3(self._handle,
@@ -1112,6 +1115,24 @@ class KvVariable(resource_variable_ops.ResourceVariable): # pylint: disable=abst
 
       return train_fn() if IS_TRAINING else predict_fn()
 
+  def sparse_read_with_handles(self, indices, name=None):
+    """Like `sparse_read`, also returns the handles of the rows of indices.
+
+    Passing the handles to the `handles` input of a KvVariable optimizer op
+    with the same indices spares that op the lookup of the keys. They are
+    only valid for the step that produced them.
+    """
+
+    with ops.name_scope(name or "Gather") as gather_name:
+      if self._trainable:
+        tape.variable_accessed(self)
+      return gen_kv_variable_ops.kv_variable_gather_or_insert_with_handles(
+          self._handle,
+          indices,
+          dtype=self._value_dtype,
+          name=gather_name + "train_with_handles",
+      )
+
   def increase_counting(self, indices, counts, name=None):
     """Increase counting for indices"""
 
@@ -1750,6 +1771,26 @@ class KvVariableSaveableV3(KvVariableSaveable):
     self._specs = value
 
 
+class KvAdmissionSketchSaveable(BaseSaverBuilder.SaveableObject):
+  """SaveableObject implementation that handles the admission sketch of a
+    KvVariable, the counts of the keys that are not admitted yet"""
+
+  def __init__(self, var, name):
+    self._handle = var._handle  # pylint: disable=protected-access
+    name = name + "-admission_sketch"
+    with ops.colocate_with(self._handle):
+      sketch = gen_kv_variable_ops.kv_variable_export_admission_sketch(
+          self._handle)
+    specs = [BaseSaverBuilder.SaveSpec(sketch, "", name)]
+    super(KvAdmissionSketchSaveable, self).__init__(var, specs, name)
+
+  # pylint: disable=unused-argument, missing-docstring
+  def restore(self, restored_tensors, restored_shapes):
+    with ops.colocate_with(self._handle):
+      return gen_kv_variable_ops.kv_variable_import_admission_sketch(
+          self._handle, restored_tensors[0])
+
+
 # Register a conversion function which reads the value of the variable,
 # allowing instances of the class to be used as tensors.
 class _UnreadVariable(KvVariable):
@@ -1829,10 +1870,26 @@ def _GatherWithCountGrad(op, grad):  # pylint: disable=invalid-name
 @ops.RegisterGradient("KvVariableGatherOrInsertV2")
 def _GatherGrad(op, grad):  # pylint: disable=invalid-name
   """Gradient for gather op."""
-  # Build appropriately shaped IndexedSlices
-  handle = op.inputs[0]
-  indices = op.inputs[1]
+  return [_GatherSlices(op.inputs[0], op.inputs[1], grad), None]
 
+
+@ops.RegisterGradient("KvVariableGatherOrInsertWithHandles")
+def _GatherWithHandlesGrad(op, grad, _):  # pylint: disable=invalid-name
+  return _GatherGrad(op, grad)
+
+
+@ops.RegisterGradient("BatchKvVariableGatherOrInsert")
+def _BatchGatherGrad(op, *grads):  # pylint: disable=invalid-name
+  """Gradient for batch gather op, filter_out has none."""
+  n = op.get_attr("N")
+  return [
+      _GatherSlices(op.inputs[i], op.inputs[n + i], grads[i])
+      for i in range(n)
+  ] + [None] * (len(op.inputs) - n)
+
+
+def _GatherSlices(handle, indices, grad):  # pylint: disable=invalid-name
+  """Builds appropriately shaped IndexedSlices of grad for handle."""
   if utils.is_kv_variable_op_type(handle.op.type):
     # No tf.cond in forward pass, just KvVariableV2 -> KvVariableGatherOrInsertV2
     kv_op = handle.op
@@ -1849,11 +1906,8 @@ def _GatherGrad(op, grad):  # pylint: disable=invalid-name
   values = array_ops.reshape(grad, values_shape)
   indices = array_ops.reshape(indices, size)
 
-  # return [ops.IndexedSlices(values, indices, params_shape), None]
-  return [
-      tf.IndexedSlices(values, indices, params_shape),
-      None,
-  ]  # tf2.13 change
+  # return ops.IndexedSlices(values, indices, params_shape)
+  return tf.IndexedSlices(values, indices, params_shape)  # tf2.13 change
 
 
 ops.NotDifferentiable("KvVariableGatherOrZerosV2")
@@ -1922,6 +1976,50 @@ def scatter_sub(ref, indices, updates, use_locking=True, name=None):
                              name=name)
 
 
+def batch_sparse_read(variables, indices, counts=None, with_filter_out=False,
+                      name=None):
+  """Reads the rows of several KvVariables with one op.
+
+  Same as `[v.sparse_read_with_counts(i, c) for v, i, c in zip(...)]`, but
+  the keys of all the variables are looked up by one kernel that schedules
+  them together, which matters for models with hundreds of features.
+
+  Args:
+    variables: list of KvVariable of the same dtype.
+    indices: list of indices tensors of the same dtype, one per variable.
+    counts: optional list of int32 counts tensors, one per variable.
+    with_filter_out: whether to also return the low frequency keys.
+    name: name of the op.
+
+  Returns:
+    The list of values, and the list of bool filter_out tensors too when
+    with_filter_out is set. No key is filtered out when predicting.
+  """
+  with ops.name_scope(name or "BatchGather") as gather_name:
+    for variable in variables:
+      if variable._trainable:  # pylint: disable=protected-access
+        tape.variable_accessed(variable)
+    handles = [variable.handle for variable in variables]
+    dtype = variables[0]._value_dtype  # pylint: disable=protected-access
+    if not IS_TRAINING:
+      values = gen_kv_variable_ops.batch_kv_variable_gather_or_zeros_v2(
+          handles, indices, dtype=dtype, name=gather_name + "predict")
+      if with_filter_out:
+        return values, [array_ops.zeros_like(i, dtype=tf.bool) for i in indices]
+      return values
+    outputs = gen_kv_variable_ops.batch_kv_variable_gather_or_insert(
+        handles,
+        indices,
+        counts or [],
+        dtype=dtype,
+        num_filter_out=len(variables) if with_filter_out else 0,
+        name=gather_name + "train",
+    )
+    if with_filter_out:
+      return outputs.output, outputs.filter_out
+    return outputs.output
+
+
 def is_variable_initialized(ref, name=None):
   if utils.is_kv_variable_op_type(ref.op.type):
     return ref.is_initialized(name=name)
@@ -1962,6 +2060,9 @@ def op_list_to_dict(op_list, convert_variable_to_tensor=True):
       else:
         saved = KvVariableSaveable(var, var.name)
       names_to_saveables[var.name] = saved
+      if var.has_admission_sketch():
+        sketch = KvAdmissionSketchSaveable(var, var.name)
+        names_to_saveables[sketch.name] = sketch
     else:
       orignal_tf_op_list.append(var)
   names_to_saveables.update(
@@ -1979,6 +2080,8 @@ def saveable_objects_for_op(op, name):
       yield KvVariableSaveableV3(op, name)
     else:
       yield KvVariableSaveable(op, name)
+    if op.has_admission_sketch():
+      yield KvAdmissionSketchSaveable(op, name)
   else:
     yield from original_saveable_objects_for_op(op, name)
 
@@ -19,6 +19,8 @@ from tfplus.kv_variable.kernels.hybrid_embedding.storage_config_pb2 import *  #
 
 COMBINATION_MAPPING = {
     StorageCombination.MEM: [StorageType.MEM_STORAGE],
+    StorageCombination.MEM_SSD:
+    [StorageType.MEM_STORAGE, StorageType.SSD_STORAGE],
 }
 
 
@@ -44,12 +46,38 @@ def get_remote_option(storage_path):
 class KvOptions:
   """KvVariable options"""
 
-  def __init__(self, combination=StorageCombination.MEM, configs=None):
+  def __init__(self,
+               combination=StorageCombination.MEM,
+               configs=None,
+               colocated_slots=0,
+               admission_sketch_width=0,
+               num_segments=0,
+               row_dtype=RowDtype.ROW_FLOAT,
+               stochastic_rounding=False,
+               expected_size=0):
     """
         Args:
         combination: pb enum, combination of storage.
           supported combinations are MEM, REMOTE, MEM_SSD, MEM_SSD_REMOTE.
         configs: a dict mapping storage type to a KvStorageConfig instance.
+        colocated_slots: number of optimizer slots stored in the rows of the
+          variable, 4 lets the group Adam optimizer update a key with a
+          single lookup.
+        admission_sketch_width: counters per row of the count-min sketch that
+          keeps new keys out of the table until they are seen enter_threshold
+          times, 0 inserts every key.
+        num_segments: independently locked segments of the in-memory table,
+          rounded up to a power of two. More segments lower lock contention
+          on many cores, fewer save memory for small tables, 0 uses the
+          default of 1024.
+        row_dtype: pb enum, element type of the stored rows. ROW_BFLOAT16
+          and ROW_HALF halve the memory of a float MEM variable without
+          colocated slots, values are still computed in float.
+        stochastic_rounding: round bfloat16 rows stochastically, which keeps
+          updates below the rounding step on average.
+        expected_size: number of keys the variable is expected to hold, the
+          in-memory table is sized for them up front so that it does not
+          rehash while it fills up. 0 grows the table from empty.
         """
     if configs is None:
       configs = {StorageType.MEM_STORAGE: KvStorageConfig()}
@@ -66,9 +94,28 @@ class KvOptions:
       config.trans_to_pb(storage_opt.configs[storage_type])
 
     storage_opt.combination = combination
+    storage_opt.colocated_slots = colocated_slots
+    storage_opt.admission_sketch_width = admission_sketch_width
+    storage_opt.num_segments = num_segments
+    storage_opt.row_dtype = row_dtype
+    storage_opt.stochastic_rounding = stochastic_rounding
+    storage_opt.expected_size = expected_size
     self.storage_option = storage_opt
     self.storage_option_string = storage_opt.SerializeToString()
 
+  def slot_options(self):
+    """Options of the optimizer slots of a variable with these options.
+
+    Slots are stored like the variable, but never hold colocated slots
+    themselves, the variable takes them into its own rows.
+    """
+    if self.storage_option.colocated_slots == 0:
+      return self
+    storage_opt = storage_config_pb2.StorageOption()
+    storage_opt.CopyFrom(self.storage_option)
+    storage_opt.colocated_slots = 0
+    return parse_from_string(storage_opt.SerializeToString())
+
   def has_storage(self, storage_type):
     return (storage_type
             in COMBINATION_MAPPING[self.storage_option.combination])
@@ -79,7 +126,19 @@ class KvOptions:
     return None
 
   def has_path(self):
-    return False
+    config = self.get_storage_config(StorageType.SSD_STORAGE)
+    return (self.has_storage(StorageType.SSD_STORAGE) and config is not None
+            and bool(config.storage_path))
+
+  def needs_storage_option(self):
+    """Whether the variable must be created with its storage option."""
+    return (self.has_path() or self.storage_option.colocated_slots > 0
+            or self.storage_option.admission_sketch_width > 0
+            or self.storage_option.num_segments > 0
+            or self.storage_option.expected_size > 0
+            or self.storage_option.row_dtype != RowDtype.ROW_FLOAT or any(
+                config.training_storage_size > 0
+                for config in self.storage_option.configs.values()))
 
   def has_remote_storage(self):
     return False
@@ -107,7 +166,9 @@ class KvStorageConfig:
     Args:
     storage_path: storage path
     training_storage_size: num of features in this storage during training,
-      if not provided, then the auto size is used.
+      if not provided, then the auto size is used. The coldest features are
+      evicted from the memory storage, or moved to the ssd storage of a
+      MEM_SSD combination, once it holds more.
     inference_storage_size: num of features in this storage during inferencing,
       if not provided, then the auto size is used.
     """
@@ -1054,7 +1054,7 @@ def create_slot_wrapper(func):
               key_dtype=primary.key_dtype,
               value_dtype=primary.dtype,
               trainable=False,
-              kv_options=primary.kv_options,
+              kv_options=primary.kv_options.slot_options(),
           )
           primary.copy_multi_level_hash_config(slot)
       else:
@@ -1070,7 +1070,7 @@ def create_slot_wrapper(func):
               key_dtype=primary.key_dtype,
               value_dtype=primary.dtype,
               trainable=False,
-              kv_options=primary.kv_options,
+              kv_options=primary.kv_options.slot_options(),
           )
       get_kv_variable_scope_store().current_scope.set_partitioner(
           current_partitioner)
@@ -13,7 +13,8 @@
 """adgrad for tfplus and tensorflow"""
 from __future__ import absolute_import, division, print_function
 
-from tensorflow.python.ops import math_ops
+from tensorflow.python.framework import ops
+from tensorflow.python.ops import control_flow_ops, math_ops
 from tensorflow.python.training.adagrad import \
     AdagradOptimizer as TFAdagradOptimizer
 
@@ -21,6 +22,7 @@ from tfplus.kv_variable.python.ops.kv_variable_ops import (
     KvVariable,
     gen_kv_variable_ops,
 )
+from tfplus.kv_variable.python.training.utils import group_batch_updates
 
 
 class AdagradOptimizer(TFAdagradOptimizer):
@@ -30,16 +32,68 @@ class AdagradOptimizer(TFAdagradOptimizer):
     Variable and our KvVariable
     """
 
+  def __init__(
+      self,
+      learning_rate,
+      initial_accumulator_value=0.1,
+      use_locking=False,
+      name="Adagrad",
+      batch_apply=False,
+  ):
+    """Construct a new Adagrad optimizer.
+
+    Args:
+      learning_rate: A `Tensor` or a floating point value.
+      initial_accumulator_value: A floating point value.
+        Starting value for the accumulators, must be positive.
+      use_locking: If `True` use locks for update operations.
+      name: Optional name prefix for the operations created when applying
+        gradients.  Defaults to "Adagrad".
+      batch_apply: If `True`, the sparse updates of all KvVariables on one
+        device are applied by a single BatchKvVariableSparseApplyAdagrad op
+        instead of one op per variable.
+    """
+    super(AdagradOptimizer, self).__init__(
+        learning_rate,
+        initial_accumulator_value=initial_accumulator_value,
+        use_locking=use_locking,
+        name=name,
+    )
+    self._batch_apply = batch_apply
+    self._batch_updates = []
+
   def _resource_apply_sparse(self, grad, var, indices):
     if not isinstance(var, KvVariable):
       return super(AdagradOptimizer,
                    self)._resource_apply_sparse(grad, var, indices)
     acc = self.get_slot(var, "accumulator")
+    if self._batch_apply:
+      # Applied by _finish together with the other KvVariables.
+      self._batch_updates.append((var, acc, grad, indices))
+      return control_flow_ops.no_op()
     return gen_kv_variable_ops.kv_variable_sparse_apply_adagrad(
         var.handle,
         acc.handle,
         math_ops.cast(self._learning_rate_tensor, grad.dtype),
         grad,
         indices,
+        handles=[],
         use_locking=True,
     )  # TODO (tongsuo): We should revolve dead-lock when use_locking set True
+
+  def _finish(self, update_ops, name_scope):
+    update_ops = list(update_ops)
+    updates, self._batch_updates = self._batch_updates, []
+    for group in group_batch_updates(updates):
+      var_list, acc_list, grads, indices = zip(*group)
+      with ops.colocate_with(var_list[0]):
+        update_ops.append(
+            gen_kv_variable_ops.batch_kv_variable_sparse_apply_adagrad(
+                [var.handle for var in var_list],
+                [acc.handle for acc in acc_list],
+                math_ops.cast(self._learning_rate_tensor, grads[0].dtype),
+                list(grads),
+                list(indices),
+                use_locking=True,
+            ))
+    return super(AdagradOptimizer, self)._finish(update_ops, name_scope)
@@ -13,16 +13,18 @@
 """Adam + Group Lasso for TensorFlow and TFPlus"""
 from __future__ import absolute_import, division, print_function
 
-from tensorflow.python.framework import constant_op, ops
-from tensorflow.python.ops import math_ops
+from tensorflow.python.framework import constant_op, dtypes, ops
+from tensorflow.python.ops import control_flow_ops, math_ops
 from tensorflow.python.platform import tf_logging as logging
 from tensorflow.python.training import adam as tf_adam
+from tensorflow.python.training import training_util
 
 from tfplus.kv_variable.python.ops import variable_scope
 from tfplus.kv_variable.python.ops.kv_variable_ops import (
     KvVariable,
     gen_kv_variable_ops,
 )
+from tfplus.kv_variable.python.training.utils import group_batch_updates
 
 
 class GroupAdamOptimizer(tf_adam.AdamOptimizer):
@@ -45,6 +47,7 @@ class GroupAdamOptimizer(tf_adam.AdamOptimizer):
       accum_name=None,
       linear_name=None,
       version=4,
+      batch_apply=False,
   ):
     """Construct a new Group Adam optimizer.
 
@@ -73,6 +76,9 @@ class GroupAdamOptimizer(tf_adam.AdamOptimizer):
       linear_name: The suffix for the variable that keeps the linear gradient
         accumulator.  If not present, defaults to name + "_1".
       version: the specific version of GroupAdam.
+      batch_apply: If `True`, the sparse updates of all KvVariables on one
+        device are applied by a single BatchKvVariableGroupSparseApplyAdamV3
+        op instead of one op per variable. Needs `version=3`.
 
     Raises:
       ValueError: If one of the arguments is invalid.
@@ -101,6 +107,9 @@ class GroupAdamOptimizer(tf_adam.AdamOptimizer):
     if l21_regularization_strength < 0.0:
       raise ValueError("l21_regularization_strength %f needs to be positive"
                        " or zero" % l21_regularization_strength)
+    if batch_apply and version != 3:
+      raise ValueError("batch_apply needs version 3, got version %d" %
+                       version)
 
     self._initial_accumulator_value = initial_accumulator_value
     self._l1_regularization_strength = l1_regularization_strength
@@ -114,6 +123,18 @@ class GroupAdamOptimizer(tf_adam.AdamOptimizer):
     self._accum_name = accum_name
     self._linear_name = linear_name
     self._version = version
+    self._batch_apply = batch_apply
+    self._batch_updates = []
+    self._global_step = None
+    self._global_step_t = []
+
+  def apply_gradients(self, grads_and_vars, global_step=None, name=None):
+    # The sparse ops decay the moments of the keys that missed steps by the
+    # global step, see TFPLUS_KV_LAZY_DECAY.
+    self._global_step = (global_step if global_step is not None else
+                         training_util.get_global_step())
+    return super(GroupAdamOptimizer, self).apply_gradients(
+        grads_and_vars, global_step=global_step, name=name)
 
   # pylint: disable=missing-docstring
   def _create_slots(self, var_list):
@@ -182,6 +203,9 @@ class GroupAdamOptimizer(tf_adam.AdamOptimizer):
         self._l21_regularization_strength,
         name="l21_regularization_strength",
     )
+    # Read before apply_gradients increments it.
+    self._global_step_t = ([] if self._global_step is None else
+                           [math_ops.cast(self._global_step, dtypes.int64)])
 
   def _resource_apply_sparse(self, grad, var, indices):
     if not isinstance(var, KvVariable):
@@ -211,10 +235,16 @@ class GroupAdamOptimizer(tf_adam.AdamOptimizer):
           math_ops.cast(self._l1_regularization_strength_tensor, grad.dtype),
           math_ops.cast(self._l2_regularization_strength_tensor, grad.dtype),
           math_ops.cast(self._l21_regularization_strength_tensor, grad.dtype),
+          handles=[],
+          global_step=self._global_step_t,
           use_locking=False,
       )
     if (self._version == 3 or var.has_path()
         or var.kv_options is variable_scope.default_kv_option()):
+      if self._batch_apply:
+        # Applied by _finish together with the other KvVariables.
+        self._batch_updates.append((var, m_v_linear, grad, indices))
+        return control_flow_ops.no_op()
       return gen_kv_variable_ops.kv_variable_group_sparse_apply_adam_v3(
           var.handle,
           m_v_linear.handle,
@@ -229,6 +259,8 @@ class GroupAdamOptimizer(tf_adam.AdamOptimizer):
           math_ops.cast(self._l1_regularization_strength_tensor, grad.dtype),
           math_ops.cast(self._l2_regularization_strength_tensor, grad.dtype),
           math_ops.cast(self._l21_regularization_strength_tensor, grad.dtype),
+          handles=[],
+          global_step=self._global_step_t,
           use_locking=False,
       )
     if self._version == 2:
@@ -248,6 +280,8 @@ class GroupAdamOptimizer(tf_adam.AdamOptimizer):
           math_ops.cast(self._l1_regularization_strength_tensor, grad.dtype),
           math_ops.cast(self._l2_regularization_strength_tensor, grad.dtype),
           math_ops.cast(self._l21_regularization_strength_tensor, grad.dtype),
+          handles=[],
+          global_step=self._global_step_t,
           use_locking=True,
       ))
     accum = self.get_slot(var, "accum")
@@ -268,5 +302,38 @@ class GroupAdamOptimizer(tf_adam.AdamOptimizer):
         math_ops.cast(self._l1_regularization_strength_tensor, grad.dtype),
         math_ops.cast(self._l2_regularization_strength_tensor, grad.dtype),
         math_ops.cast(self._l21_regularization_strength_tensor, grad.dtype),
+        handles=[],
+        global_step=self._global_step_t,
         use_locking=True,
     )
+
+  def _finish(self, update_ops, name_scope):
+    # The batch ops are added to update_ops so that Adam's _finish updates
+    # beta1_power and beta2_power only after they ran.
+    update_ops = list(update_ops)
+    updates, self._batch_updates = self._batch_updates, []
+    beta1_power, beta2_power = self._get_beta_accumulators()
+    for group in group_batch_updates(updates):
+      var_list, slot_list, grads, indices = zip(*group)
+      dtype = grads[0].dtype
+      with ops.colocate_with(var_list[0]):
+        update_ops.append(
+            gen_kv_variable_ops.batch_kv_variable_group_sparse_apply_adam_v3(
+                [var.handle for var in var_list],
+                [slot.handle for slot in slot_list],
+                list(grads),
+                list(indices),
+                math_ops.cast(self._lr_t, dtype),
+                math_ops.cast(beta1_power, dtype),
+                math_ops.cast(beta2_power, dtype),
+                math_ops.cast(self._beta1_t, dtype),
+                math_ops.cast(self._beta2_t, dtype),
+                math_ops.cast(self._epsilon_t, dtype),
+                math_ops.cast(self._l1_regularization_strength_tensor, dtype),
+                math_ops.cast(self._l2_regularization_strength_tensor, dtype),
+                math_ops.cast(self._l21_regularization_strength_tensor,
+                              dtype),
+                global_step=self._global_step_t,
+                use_locking=False,
+            ))
+    return super(GroupAdamOptimizer, self)._finish(update_ops, name_scope)
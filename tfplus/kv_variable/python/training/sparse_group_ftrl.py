@@ -92,5 +92,6 @@ class SparseGroupFtrlOptimizer(TFFtrlOptimizer):
         math_ops.cast(self._l2_shrinkage_regularization_strength_tensor,
                       grad.dtype),
         math_ops.cast(self._learning_rate_power_tensor, grad.dtype),
+        handles=[],
         use_locking=True,
     )  # TODO (tongsuo): We should revolve dead-lock when use_locking set True
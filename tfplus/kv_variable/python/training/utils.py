@@ -5,6 +5,8 @@ from __future__ import absolute_import
 from __future__ import division
 from __future__ import print_function
 
+import collections
+
 
 def get_kv_variable_op_types():
   return ("KvVariable", "KvVariableV3")
@@ -12,3 +14,23 @@ def get_kv_variable_op_types():
 
 def is_kv_variable_op_type(op_type):
   return op_type in get_kv_variable_op_types()
+
+
+def group_batch_updates(updates):
+  """Splits the pending updates of a batch apply op into the groups that one
+  op can apply: the variables of one group live on one device and share the
+  value and index dtypes.
+
+  Args:
+    updates: A list of tuples `(var, slot..., grad, indices)`.
+
+  Returns:
+    A list of groups, each a list of update tuples, in the order in which the
+    first update of every group was added.
+  """
+  groups = collections.OrderedDict()
+  for update in updates:
+    var, grad, indices = update[0], update[-2], update[-1]
+    key = (var.device, grad.dtype, indices.dtype)
+    groups.setdefault(key, []).append(update)
+  return list(groups.values())
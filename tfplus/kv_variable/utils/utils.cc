@@ -21,7 +21,20 @@
 #include "tfplus/kv_variable/kernels/utility.h"
 namespace tfplus {
 
-GlobalConfigs gConf;
+namespace {
+GlobalConfigs InitGlobalConfigs() {
+  GlobalConfigs conf;
+  // Selects the MapType used by new KvVariables, e.g. 5 for FLAT_SIMD_MAP.
+  conf.map_type = GetEnvVar<int>("TFPLUS_KV_MAP_TYPE", conf.map_type);
+  // Serving processes set it so that imported variables are frozen for lock
+  // free lookups, see KvVariable::FreezeTable().
+  conf.inference_only =
+      GetEnvVar<bool>("TFPLUS_KV_INFERENCE_ONLY", conf.inference_only);
+  return conf;
+}
+}  // namespace
+
+GlobalConfigs gConf = InitGlobalConfigs();
 
 bool InferenceMode() { return gConf.inference_only; }
 